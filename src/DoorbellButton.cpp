@@ -0,0 +1,86 @@
+#include "DoorbellButton.h"
+
+DoorbellButton::~DoorbellButton() {
+  if (edgeSignal != NULL)
+    vSemaphoreDelete(edgeSignal);
+}
+
+bool DoorbellButton::begin(uint8_t pin) {
+  this->pin = pin;
+  if (edgeSignal == NULL)
+    edgeSignal = xSemaphoreCreateBinary();
+  if (edgeSignal == NULL)
+    return false;
+  pinMode(pin, INPUT_PULLUP);
+  pressed = (digitalRead(pin) == LOW);
+  attachInterruptArg(digitalPinToInterrupt(pin), onEdge, this, CHANGE);
+  return true;
+}
+
+void IRAM_ATTR DoorbellButton::onEdge(void *arg) {
+  DoorbellButton *button = (DoorbellButton*)arg;
+  uint32_t position = button->head.load(std::memory_order_relaxed);
+  if (position - button->tail.load(std::memory_order_acquire) >= doorbellEdgeQueueLength) {
+    button->dropped.fetch_add(1, std::memory_order_relaxed); // bounce storm, the pin is checked after the debounce time anyway
+  } else {
+    Edge &edge = button->edges[position % doorbellEdgeQueueLength];
+    edge.micros = micros();
+    edge.level = digitalRead(button->pin);
+    button->head.store(position + 1, std::memory_order_release);
+  }
+  BaseType_t higherPriorityTaskWoken = pdFALSE;
+  xSemaphoreGiveFromISR(button->edgeSignal, &higherPriorityTaskWoken);
+  if (higherPriorityTaskWoken)
+    portYIELD_FROM_ISR();
+}
+
+bool DoorbellButton::wait(TickType_t ticksToWait) {
+  if (edgeSignal == NULL)
+    return false;
+  if (settling) {
+    // wake up when the debounce time is over to check the pin
+    unsigned long elapsed = micros() - changeMicros;
+    TickType_t remaining = elapsed >= doorbellDebounceMicros ? 0 : pdMS_TO_TICKS((doorbellDebounceMicros - elapsed) / 1000 + 1);
+    ticksToWait = min(ticksToWait, remaining);
+  }
+  return xSemaphoreTake(edgeSignal, ticksToWait) == pdTRUE;
+}
+
+bool DoorbellButton::read(DoorbellEvent &event) {
+  uint32_t droppedNow = dropped.load(std::memory_order_relaxed);
+  if (droppedNow != droppedSeen) {
+    droppedSeen = droppedNow;
+    settling = true; // the last edges are unknown, only the pin can tell
+  }
+  uint32_t position = tail.load(std::memory_order_relaxed);
+  while (position != head.load(std::memory_order_acquire)) {
+    Edge edge = edges[position % doorbellEdgeQueueLength];
+    tail.store(++position, std::memory_order_release);
+    lastEdgeMicros = edge.micros;
+    bool edgePressed = (edge.level == LOW);
+    if (edgePressed == pressed)
+      continue;
+    if (edge.micros - changeMicros < doorbellDebounceMicros) {
+      settling = true; // contact bounce, or a press shorter than the debounce time
+      continue;
+    }
+    pressed = edgePressed;
+    changeMicros = edge.micros;
+    event.pressed = pressed;
+    event.edgeMicros = edge.micros;
+    return true;
+  }
+
+  // after the debounce time the pin tells where the ignored edges ended
+  if (settling && micros() - changeMicros >= doorbellDebounceMicros) {
+    settling = false;
+    if ((digitalRead(pin) == LOW) != pressed) {
+      pressed = !pressed;
+      changeMicros = lastEdgeMicros;
+      event.pressed = pressed;
+      event.edgeMicros = lastEdgeMicros;
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,53 @@
+#ifndef DOORBELLBUTTON_H
+#define DOORBELLBUTTON_H
+
+#include <Arduino.h>
+#include <atomic>
+
+/*
+  Doorbell button read by interrupt instead of sampling the pin: the interrupt handler records every edge with its
+  time in a small queue and wakes up the consumer (loop()), which debounces them. The first edge of a bounce burst
+  counts right away, the pin is checked again once the debounce time is over, so a press shorter than the poll interval
+  is not lost and the time of a press is the time of its edge, not of the next pass of loop().
+*/
+
+const uint8_t doorbellEdgeQueueLength = 16;           // raw edges, a bounce burst longer than this is only counted as dropped
+const uint32_t doorbellDebounceMicros = 30000;
+
+struct DoorbellEvent {
+  bool pressed;
+  unsigned long edgeMicros;  // micros() of the edge that changed the state
+};
+
+class DoorbellButton {
+  public:
+    ~DoorbellButton();
+    bool begin(uint8_t pin);           // INPUT_PULLUP, LOW = pressed
+    bool wait(TickType_t ticksToWait); // consumer: sleeps until an edge or the timeout
+    bool read(DoorbellEvent &event);   // consumer: next debounced press or release, false if there is none
+    bool isPressed() const { return pressed; }
+    uint32_t getDropped() const { return dropped.load(std::memory_order_relaxed); }
+
+  private:
+    struct Edge {
+      unsigned long micros;
+      uint8_t level;
+    };
+    uint8_t pin = 0;
+    Edge edges[doorbellEdgeQueueLength];
+    std::atomic<uint32_t> head{0};     // written by the interrupt handler
+    std::atomic<uint32_t> tail{0};     // written by the consumer
+    std::atomic<uint32_t> dropped{0};
+    SemaphoreHandle_t edgeSignal = NULL;
+
+    // debouncer, consumer only
+    bool pressed = false;
+    unsigned long changeMicros = 0;    // edge of the last state change
+    unsigned long lastEdgeMicros = 0;  // last raw edge, ignored ones included
+    bool settling = false;             // edges were ignored during the debounce time, check the pin afterwards
+    uint32_t droppedSeen = 0;
+
+    static void onEdge(void *arg);
+};
+
+#endif
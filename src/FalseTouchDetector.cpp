@@ -0,0 +1,39 @@
+#include "FalseTouchDetector.h"
+
+bool FalseTouchDetector::record(TouchOutcome outcome, unsigned long nowMillis) {
+  if (outcome == TouchOutcome::falseTouch) {
+    falseTouchMillis[nextFalseTouch] = nowMillis;
+    nextFalseTouch = (nextFalseTouch + 1) % falseTouchEnterCount;
+    if (storedFalseTouches < falseTouchEnterCount)
+      storedFalseTouches++;
+    if (!suppressed && getRecentFalseTouches(nowMillis) >= falseTouchEnterCount) {
+      suppressed = true;
+      suppressedSince = nowMillis;
+      return true;
+    }
+  }
+  return update(nowMillis);
+}
+
+bool FalseTouchDetector::update(unsigned long nowMillis) {
+  if (suppressed && nowMillis - suppressedSince >= falseTouchMinSuppressedMillis && getRecentFalseTouches(nowMillis) < falseTouchExitCount) {
+    suppressed = false;
+    return true;
+  }
+  return false;
+}
+
+void FalseTouchDetector::reset() {
+  nextFalseTouch = 0;
+  storedFalseTouches = 0;
+  suppressed = false;
+}
+
+uint8_t FalseTouchDetector::getRecentFalseTouches(unsigned long nowMillis) const {
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < storedFalseTouches; i++) {
+    if (nowMillis - falseTouchMillis[i] < falseTouchWindowMillis)
+      count++;
+  }
+  return count;
+}
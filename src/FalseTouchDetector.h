@@ -0,0 +1,39 @@
+#ifndef FALSETOUCHDETECTOR_H
+#define FALSETOUCHDETECTOR_H
+
+#include <Arduino.h>
+
+/*
+  Rain on the touch ring: every edge of the ring is either followed by a finger on the sensor or it is a false touch
+  (no image at all, or only images that are too messy or without features). Once falseTouchEnterCount false touches
+  fall within falseTouchWindowMillis the ring is suppressed: the scan loop polls the sensor as with ignoreTouchRing,
+  drops no longer start imaging passes or flash the LED ring, and fingers are still found by getImage. The edges are
+  still classified while suppressed, the ring is used again once fewer than falseTouchExitCount false touches are
+  left in the window and it was suppressed for at least falseTouchMinSuppressedMillis.
+*/
+
+const uint8_t falseTouchEnterCount = 6;
+const uint8_t falseTouchExitCount = 2;
+const unsigned long falseTouchWindowMillis = 120000;
+const unsigned long falseTouchMinSuppressedMillis = 300000;
+const unsigned long falseTouchFingerGraceMillis = 1000; // suppressed: a finger found this long after an edge belongs to it
+
+enum class TouchOutcome { finger, falseTouch };
+
+class FalseTouchDetector {
+  public:
+    bool record(TouchOutcome outcome, unsigned long nowMillis); // true if the ring was suppressed or enabled again
+    bool update(unsigned long nowMillis);                        // recovery without further edges, same return value
+    void reset();                                                // forget the window, the ring is used again
+    bool isSuppressed() const { return suppressed; }
+    uint8_t getRecentFalseTouches(unsigned long nowMillis) const; // within the window
+
+  private:
+    unsigned long falseTouchMillis[falseTouchEnterCount] = {0}; // the latest false touches, oldest is overwritten
+    uint8_t nextFalseTouch = 0;
+    uint8_t storedFalseTouches = 0;
+    bool suppressed = false;
+    unsigned long suppressedSince = 0;
+};
+
+#endif
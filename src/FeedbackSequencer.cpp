@@ -0,0 +1,42 @@
+#include "FeedbackSequencer.h"
+
+void FeedbackSequencer::begin(FeedbackOutput output, void *arg) {
+  this->output = output;
+  outputArg = arg;
+}
+
+void FeedbackSequencer::play(const FeedbackStep *pattern) {
+  active.store(true, std::memory_order_relaxed); // playing() right away, not only after the next update()
+  pending.store(pattern, std::memory_order_release);
+}
+
+bool FeedbackSequencer::playing() const {
+  return active.load(std::memory_order_relaxed);
+}
+
+uint32_t FeedbackSequencer::update() {
+  unsigned long now = millis();
+  const FeedbackStep *next = pending.exchange(nullptr, std::memory_order_acquire);
+  if (next != nullptr) {
+    active.store(true, std::memory_order_relaxed);
+    stepStart = now;
+  } else if (step != nullptr && now - stepStart >= step->durationMillis) {
+    stepStart += step->durationMillis; // no drift if update() is late, a melody keeps its rhythm
+    next = step + 1;
+  }
+
+  if (next != nullptr) {
+    step = next;
+    if (output)
+      output(*step, outputArg);
+    if (step->durationMillis == 0) {
+      step = nullptr; // last step, its output stays
+      if (pending.load(std::memory_order_relaxed) == nullptr)
+        active.store(false, std::memory_order_relaxed);
+    }
+  }
+  if (step == nullptr)
+    return feedbackIdle;
+  unsigned long elapsed = now - stepStart;
+  return elapsed >= step->durationMillis ? 0 : step->durationMillis - elapsed;
+}
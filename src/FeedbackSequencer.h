@@ -0,0 +1,41 @@
+#ifndef FEEDBACKSEQUENCER_H
+#define FEEDBACKSEQUENCER_H
+
+#include <Arduino.h>
+#include <atomic>
+
+/*
+  Plays feedback patterns (LED ring colors, buzzer melodies) step by step on the clock instead of with delay() or
+  blocking tone() calls. play() may be called from any task and replaces the pattern that is playing. update() runs on
+  the task that owns the output (the sensor task for the LED ring, which is driven through the sensor's UART, loop()
+  for the buzzer), sends the steps that are due and tells that task how long it may sleep until the next one.
+*/
+
+struct FeedbackStep {
+  uint8_t control;          // LED ring: FINGERPRINT_LED_* control code, 0 = leave the ring as it is
+  uint8_t speed;            // LED ring: speed of flashing/breathing
+  uint16_t value;           // LED ring: color, buzzer: frequency in Hz (0 = silent)
+  uint16_t durationMillis;  // 0 = last step of the pattern, its output stays
+};
+
+typedef void (*FeedbackOutput)(const FeedbackStep &step, void *arg);
+
+const uint32_t feedbackIdle = UINT32_MAX; // update(): nothing is playing
+
+class FeedbackSequencer {
+  public:
+    void begin(FeedbackOutput output, void *arg = nullptr); // arg is passed to the output, e.g. the reader of the LED ring
+    void play(const FeedbackStep *pattern);  // any task, the pattern must stay valid (static const or a member of the owner)
+    uint32_t update();                       // owner task: millis until the next step is due, or feedbackIdle
+    bool playing() const;
+
+  private:
+    FeedbackOutput output = nullptr;
+    void *outputArg = nullptr;
+    std::atomic<const FeedbackStep*> pending{nullptr};
+    std::atomic<bool> active{false};
+    const FeedbackStep *step = nullptr;      // step that is playing, owner task only
+    unsigned long stepStart = 0;
+};
+
+#endif
@@ -0,0 +1,125 @@
+#include "FingerListHtml.h"
+
+FingerListHtml::~FingerListHtml() {
+  free(html);
+  free(offsets);
+  if (mutex != NULL)
+    vSemaphoreDelete(mutex);
+}
+
+void FingerListHtml::lock() {
+  if (mutex == NULL)
+    mutex = xSemaphoreCreateMutex();
+  xSemaphoreTake(mutex, portMAX_DELAY);
+}
+
+void FingerListHtml::unlock() {
+  xSemaphoreGive(mutex);
+}
+
+void FingerListHtml::rebuild(const FingerRegistry &fingers) {
+  lock();
+  htmlLength = 0;
+  optionCount = 0;
+  for (uint16_t index=0; index<fingers.getCount(); index++) {
+    if (!reserveOptions(optionCount + 1))
+      break;
+    offsets[optionCount] = htmlLength;
+    offsets[optionCount + 1] = htmlLength;
+    optionCount++;
+    if (!renderOption(fingers, index)) {
+      optionCount--;
+      break;
+    }
+  }
+  unlock();
+}
+
+void FingerListHtml::insert(const FingerRegistry &fingers, uint16_t index) {
+  lock();
+  if (!reserveOptions(optionCount + 1)) {
+    unlock();
+    return;
+  }
+  if (optionCount == 0)
+    offsets[0] = 0;
+  // empty option at the index, then render it
+  memmove(&offsets[index + 1], &offsets[index], (optionCount + 1 - index) * sizeof(uint32_t));
+  optionCount++;
+  renderOption(fingers, index);
+  if (index == 0 && optionCount > 1)
+    renderOption(fingers, 1); // the former first option is not preselected anymore
+  unlock();
+}
+
+void FingerListHtml::replace(const FingerRegistry &fingers, uint16_t index) {
+  lock();
+  if (index < optionCount)
+    renderOption(fingers, index);
+  unlock();
+}
+
+void FingerListHtml::erase(const FingerRegistry &fingers, uint16_t index) {
+  lock();
+  if (index < optionCount) {
+    splice(index, "", 0);
+    memmove(&offsets[index], &offsets[index + 1], (optionCount - index) * sizeof(uint32_t));
+    optionCount--;
+    if (index == 0 && optionCount > 0)
+      renderOption(fingers, 0); // new first option becomes the preselected one
+  }
+  unlock();
+}
+
+String FingerListHtml::toString() {
+  lock();
+  String copy;
+  if (copy.reserve(htmlLength) && htmlLength > 0)
+    copy.concat(html);
+  unlock();
+  return copy;
+}
+
+bool FingerListHtml::reserveOptions(uint16_t count) {
+  if (count + 1 <= offsetsAllocated)
+    return true;
+  uint16_t size = max((uint16_t)16, offsetsAllocated);
+  while (size < count + 1)
+    size *= 2;
+  uint32_t *grown = (uint32_t*)realloc(offsets, size * sizeof(uint32_t));
+  if (grown == nullptr)
+    return false;
+  offsets = grown;
+  offsetsAllocated = size;
+  return true;
+}
+
+// replaces the text of one option, moving all options behind it
+bool FingerListHtml::splice(uint16_t index, const char *text, size_t textLength) {
+  size_t start = offsets[index];
+  size_t oldLength = offsets[index + 1] - start;
+  if (htmlLength - oldLength + textLength + 1 > htmlAllocated) {
+    size_t size = max((size_t)256, htmlAllocated);
+    while (size < htmlLength - oldLength + textLength + 1)
+      size *= 2;
+    char *grown = (char*)realloc(html, size);
+    if (grown == nullptr)
+      return false;
+    html = grown;
+    htmlAllocated = size;
+  }
+  memmove(&html[start + textLength], &html[start + oldLength], htmlLength - start - oldLength);
+  memcpy(&html[start], text, textLength);
+  htmlLength = htmlLength - oldLength + textLength;
+  html[htmlLength] = '\0';
+  for (uint16_t i=index+1; i<=optionCount; i++)
+    offsets[i] = offsets[i] - oldLength + textLength;
+  return true;
+}
+
+bool FingerListHtml::renderOption(const FingerRegistry &fingers, uint16_t index) {
+  char option[48 + 256];
+  uint16_t id = fingers.idAt(index);
+  int length = snprintf(option, sizeof(option), "<option value=\"%u\"%s>%u - %s</option>", id, (index == 0) ? " selected" : "", id, fingers.nameAt(index));
+  return splice(index, option, min((size_t)length, sizeof(option) - 1));
+}
@@ -0,0 +1,38 @@
+#ifndef FINGERLISTHTML_H
+#define FINGERLISTHTML_H
+
+#include <Arduino.h>
+#include "FingerRegistry.h"
+
+/*
+  The <option> list of the enrolled fingers for the web UI (%FINGERLIST% and the "fingerlist" event). It is rendered
+  once at connect, afterwards only the option of the changed slot is patched, the offset of every option is kept in
+  registry order. The sensor task changes the list while the web server reads it, both sides take the mutex.
+*/
+class FingerListHtml {
+  public:
+    ~FingerListHtml();
+    void rebuild(const FingerRegistry &fingers);
+    void insert(const FingerRegistry &fingers, uint16_t index);  // slot was added to the registry at this index
+    void replace(const FingerRegistry &fingers, uint16_t index); // slot at this index was renamed
+    void erase(const FingerRegistry &fingers, uint16_t index);   // slot was removed from this index
+    String toString();                                           // copy of the whole list, a single allocation
+    size_t length() const { return htmlLength; }
+
+  private:
+    SemaphoreHandle_t mutex = NULL;
+    char *html = nullptr;
+    size_t htmlLength = 0;
+    size_t htmlAllocated = 0;
+    uint32_t *offsets = nullptr;  // start of each option, offsets[optionCount] = htmlLength
+    uint16_t optionCount = 0;
+    uint16_t offsetsAllocated = 0;
+
+    void lock();
+    void unlock();
+    bool reserveOptions(uint16_t count);
+    bool splice(uint16_t index, const char *text, size_t textLength);
+    bool renderOption(const FingerRegistry &fingers, uint16_t index);
+};
+
+#endif
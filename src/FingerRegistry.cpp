@@ -0,0 +1,256 @@
+#include "FingerRegistry.h"
+
+FingerRegistry::~FingerRegistry() {
+  free(bitmap);
+  free(entries);
+  free(arena);
+}
+
+bool FingerRegistry::begin(uint16_t capacity) {
+  clear();
+  free(bitmap);
+  bitmap = (uint32_t*)calloc((capacity + 31) / 32, sizeof(uint32_t));
+  this->capacity = bitmap ? capacity : 0;
+  return bitmap != nullptr;
+}
+
+void FingerRegistry::clear() {
+  if (bitmap)
+    memset(bitmap, 0, ((capacity + 31) / 32) * sizeof(uint32_t));
+  free(entries);
+  free(arena);
+  entries = nullptr;
+  arena = nullptr;
+  count = 0;
+  entriesAllocated = 0;
+  arenaUsed = 0;
+  arenaAllocated = 0;
+}
+
+bool FingerRegistry::contains(int id) const {
+  if (id < 0 || id >= capacity)
+    return false;
+  return bitmap[id / 32] & (1UL << (id % 32));
+}
+
+int FingerRegistry::indexOf(int id) const {
+  if (!contains(id))
+    return -1;
+  return lowerBound(id);
+}
+
+const char* FingerRegistry::getName(int id) const {
+  int index = indexOf(id);
+  return (index < 0) ? nullptr : nameAt(index);
+}
+
+// index of the first entry with an id >= the given one (binary search)
+uint16_t FingerRegistry::lowerBound(uint16_t id) const {
+  uint16_t low = 0;
+  uint16_t high = count;
+  while (low < high) {
+    uint16_t mid = (low + high) / 2;
+    if (entries[mid].id < id)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
+
+bool FingerRegistry::setName(uint16_t id, const char *name) {
+  if (!isValidId(id))
+    return false;
+  uint32_t size = strlen(name) + 1;
+
+  int index = indexOf(id);
+  if (index >= 0) {
+    uint32_t oldSize = strlen(nameAt(index)) + 1;
+    if ((size > oldSize) && !reserveArena(arenaUsed + size - oldSize))
+      return false;
+    resizeName(index, oldSize, size);
+    memcpy(&arena[entries[index].nameOffset], name, size);
+    return true;
+  }
+
+  if (!reserveEntries(count + 1) || !reserveArena(arenaUsed + size))
+    return false;
+  uint16_t pos = lowerBound(id);
+  uint32_t offset = (pos < count) ? entries[pos].nameOffset : arenaUsed;
+  memmove(&arena[offset + size], &arena[offset], arenaUsed - offset);
+  memcpy(&arena[offset], name, size);
+  arenaUsed += size;
+  memmove(&entries[pos + 1], &entries[pos], (count - pos) * sizeof(FingerEntry));
+  for (uint16_t i=pos+1; i<=count; i++)
+    entries[i].nameOffset += size;
+  entries[pos].id = id;
+  entries[pos].matchCount = 0;
+  entries[pos].nameOffset = offset;
+  count++;
+  bitmap[id / 32] |= (1UL << (id % 32));
+  return true;
+}
+
+bool FingerRegistry::remove(uint16_t id) {
+  int index = indexOf(id);
+  if (index < 0)
+    return false;
+  resizeName(index, strlen(nameAt(index)) + 1, 0);
+  memmove(&entries[index], &entries[index + 1], (count - index - 1) * sizeof(FingerEntry));
+  count--;
+  bitmap[id / 32] &= ~(1UL << (id % 32));
+  return true;
+}
+
+// moves all names behind the entry, so that the arena stays packed
+void FingerRegistry::resizeName(uint16_t index, uint32_t oldSize, uint32_t newSize) {
+  if (oldSize == newSize)
+    return;
+  uint32_t tail = entries[index].nameOffset + oldSize;
+  memmove(&arena[tail + newSize - oldSize], &arena[tail], arenaUsed - tail);
+  arenaUsed = arenaUsed + newSize - oldSize;
+  for (uint16_t i=index+1; i<count; i++)
+    entries[i].nameOffset = entries[i].nameOffset + newSize - oldSize;
+}
+
+bool FingerRegistry::reserveEntries(uint16_t needed) {
+  if (needed <= entriesAllocated)
+    return true;
+  uint16_t size = max((uint16_t)8, entriesAllocated);
+  while (size < needed)
+    size *= 2;
+  size = min(size, capacity);
+  FingerEntry *grown = (FingerEntry*)realloc(entries, size * sizeof(FingerEntry));
+  if (grown == nullptr)
+    return false;
+  entries = grown;
+  entriesAllocated = size;
+  return true;
+}
+
+bool FingerRegistry::reserveArena(uint32_t needed) {
+  if (needed <= arenaAllocated)
+    return true;
+  uint32_t size = max((uint32_t)128, arenaAllocated);
+  while (size < needed)
+    size *= 2;
+  char *grown = (char*)realloc(arena, size);
+  if (grown == nullptr)
+    return false;
+  arena = grown;
+  arenaAllocated = size;
+  return true;
+}
+
+size_t FingerRegistry::getMemoryUsage() const {
+  return ((capacity + 31) / 32) * sizeof(uint32_t) + entriesAllocated * sizeof(FingerEntry) + arenaAllocated;
+}
+
+
+static uint16_t crc16(const uint8_t *data, size_t length) {
+  uint16_t crc = 0xFFFF; // CRC-16/CCITT-FALSE
+  for (size_t i=0; i<length; i++) {
+    crc ^= (uint16_t)data[i] << 8;
+    for (int bit=0; bit<8; bit++)
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+  }
+  return crc;
+}
+
+size_t FingerRegistry::getSerializedSize() const {
+  size_t size = fingerRegistryHeaderSize;
+  for (uint16_t i=0; i<count; i++)
+    size += 3 + min(strlen(nameAt(i)), (size_t)255);
+  return size;
+}
+
+size_t FingerRegistry::serialize(uint8_t *buffer, size_t size) const {
+  if (size < getSerializedSize())
+    return 0;
+  size_t pos = fingerRegistryHeaderSize;
+  for (uint16_t i=0; i<count; i++) {
+    uint8_t nameLength = min(strlen(nameAt(i)), (size_t)255);
+    buffer[pos++] = (uint8_t)(entries[i].id >> 8);
+    buffer[pos++] = (uint8_t)(entries[i].id & 0xFF);
+    buffer[pos++] = nameLength;
+    memcpy(&buffer[pos], nameAt(i), nameLength);
+    pos += nameLength;
+  }
+  uint16_t crc = crc16(&buffer[fingerRegistryHeaderSize], pos - fingerRegistryHeaderSize);
+  buffer[0] = fingerRegistryVersion;
+  buffer[1] = 0;
+  buffer[2] = (uint8_t)(count >> 8);
+  buffer[3] = (uint8_t)(count & 0xFF);
+  buffer[4] = (uint8_t)(crc >> 8);
+  buffer[5] = (uint8_t)(crc & 0xFF);
+  return pos;
+}
+
+bool FingerRegistry::deserialize(const uint8_t *buffer, size_t length) {
+  clear();
+  if (length < fingerRegistryHeaderSize || buffer[0] != fingerRegistryVersion)
+    return false;
+  uint16_t storedCount = ((uint16_t)buffer[2] << 8) | buffer[3];
+  uint16_t crc = ((uint16_t)buffer[4] << 8) | buffer[5];
+  if (crc != crc16(&buffer[fingerRegistryHeaderSize], length - fingerRegistryHeaderSize))
+    return false;
+
+  char name[256];
+  size_t pos = fingerRegistryHeaderSize;
+  for (uint16_t i=0; i<storedCount; i++) {
+    if (pos + 3 > length || pos + 3 + buffer[pos + 2] > length)
+      break;
+    uint16_t id = ((uint16_t)buffer[pos] << 8) | buffer[pos + 1];
+    uint8_t nameLength = buffer[pos + 2];
+    memcpy(name, &buffer[pos + 3], nameLength);
+    name[nameLength] = '\0';
+    pos += 3 + nameLength;
+    if (!setName(id, name))
+      break; // slot beyond the capacity of this sensor or out of memory
+  }
+  if (count != storedCount || pos != length) {
+    clear();
+    return false;
+  }
+  return true;
+}
+
+
+void printJsonString(Print &out, const char *text) {
+  out.print('"');
+  for (const char *c = text; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      out.print('\\');
+      out.print(*c);
+    } else if ((uint8_t)*c < 0x20) {
+      out.printf("\\u%04x", (uint8_t)*c);
+    } else {
+      out.print(*c);
+    }
+  }
+  out.print('"');
+}
+
+static void printJsonEntry(Print &out, uint16_t id, const char *name, uint16_t matchCount) {
+  out.printf("{\"id\":%u,\"name\":", id);
+  printJsonString(out, name);
+  out.printf(",\"matches\":%u}", matchCount);
+}
+
+void FingerRegistry::printJson(Print &out, uint16_t offset, uint16_t limit) const {
+  out.printf("{\"capacity\":%u,\"count\":%u,\"offset\":%u,\"limit\":%u,\"fingers\":[", capacity, count, offset, limit);
+  for (uint32_t index=offset; index<count && index<(uint32_t)offset + limit; index++) {
+    if (index > offset)
+      out.print(',');
+    printJsonEntry(out, entries[index].id, nameAt(index), entries[index].matchCount);
+  }
+  out.print("]}");
+}
+
+bool FingerRegistry::printJson(Print &out, int id) const {
+  int index = indexOf(id);
+  if (index < 0)
+    return false;
+  printJsonEntry(out, id, nameAt(index), entries[index].matchCount);
+  return true;
+}
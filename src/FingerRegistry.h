@@ -0,0 +1,76 @@
+#ifndef FINGERREGISTRY_H
+#define FINGERREGISTRY_H
+
+#include <Arduino.h>
+
+/*
+  Names (and match counters) of the enrolled fingers. Sized from the capacity reported by the sensor: a bitmap of the
+  occupied slots plus one entry per enrolled finger, the names are packed into a single arena in slot order. Memory
+  grows with the number of enrolled fingers, not with the capacity of the sensor (200, 1000 or 3000 templates).
+  Slot 0 is never used, valid ids are 1..capacity-1.
+*/
+
+const uint8_t fingerRegistryVersion = 1;
+const uint8_t fingerNameMaxLength = 63; // names entered in the web UI, longer ones (from old preferences) are cut in a Match
+const size_t fingerRegistryHeaderSize = 6;
+
+struct FingerEntry {
+  uint16_t id;
+  uint16_t matchCount;
+  uint32_t nameOffset;  // into the name arena, names are null terminated
+};
+
+class FingerRegistry {
+  public:
+    ~FingerRegistry();
+    bool begin(uint16_t capacity); // drops all entries
+    void clear();
+
+    uint16_t getCapacity() const { return capacity; }
+    uint16_t getCount() const { return count; }
+    bool isValidId(int id) const { return (id > 0) && (id < capacity); }
+    bool contains(int id) const;
+    int indexOf(int id) const;          // -1 if the slot is empty
+    const char* getName(int id) const;  // nullptr if the slot is empty
+
+    bool setName(uint16_t id, const char *name); // adds or renames, false if the id is invalid or out of memory
+    bool remove(uint16_t id);
+
+    // enrolled fingers ordered by slot id, index 0..getCount()-1
+    uint16_t idAt(uint16_t index) const { return entries[index].id; }
+    const char* nameAt(uint16_t index) const { return &arena[entries[index].nameOffset]; }
+    uint16_t matchCountAt(uint16_t index) const { return entries[index].matchCount; }
+    void setMatchCountAt(uint16_t index, uint16_t matchCount) { entries[index].matchCount = matchCount; }
+
+    size_t getMemoryUsage() const;
+
+    // compact storage format (one NVS blob): uint8 version, uint8 reserved, uint16 count, uint16 CRC-16 of the
+    // entries, then per finger uint16 id, uint8 name length, name (all numbers big endian)
+    size_t getSerializedSize() const;
+    size_t serialize(uint8_t *buffer, size_t size) const;  // 0 if the buffer is too small
+    bool deserialize(const uint8_t *buffer, size_t length); // false (and empty) if version, checksum or ids don't fit
+
+    // JSON for the REST API: one page of the enrolled fingers (offset/limit count enrolled fingers, not slots) or a
+    // single slot. Printed piece by piece, the document is never built in memory.
+    void printJson(Print &out, uint16_t offset, uint16_t limit) const;
+    bool printJson(Print &out, int id) const; // false if the slot is empty
+
+  private:
+    uint16_t capacity = 0;
+    uint32_t *bitmap = nullptr;     // capacity bits
+    FingerEntry *entries = nullptr; // sorted by id
+    uint16_t count = 0;
+    uint16_t entriesAllocated = 0;
+    char *arena = nullptr;
+    uint32_t arenaUsed = 0;
+    uint32_t arenaAllocated = 0;
+
+    uint16_t lowerBound(uint16_t id) const;
+    bool reserveEntries(uint16_t needed);
+    bool reserveArena(uint32_t needed);
+    void resizeName(uint16_t index, uint32_t oldSize, uint32_t newSize);
+};
+
+void printJsonString(Print &out, const char *text); // quoted and escaped
+
+#endif
@@ -3,17 +3,33 @@
 
 #include <Adafruit_Fingerprint.h>
 
-bool FingerprintManager::connect() {
+FingerprintManager::FingerprintManager(uint8_t readerId, HardwareSerial &serial, int touchPin, int8_t rxPin, int8_t txPin)
+  : readerId(readerId), serialPort(serial), touchPin(touchPin), rxPin(rxPin), txPin(txPin), trace(serial, readerId), finger(&trace) {
+  if (readerId == 0) {
+    strcpy(namesNamespace, "fingerList");
+    strcpy(statsNamespace, "fingerStats");
+  } else {
+    snprintf(namesNamespace, sizeof(namesNamespace), "fingerList%u", readerId);
+    snprintf(statsNamespace, sizeof(statsNamespace), "fingerStats%u", readerId);
+  }
+}
+
+FingerprintManager::~FingerprintManager() {
+  free(matchCountPairs);
+  if (fingersMutex != NULL)
+    vSemaphoreDelete(fingersMutex);
+}
+
+bool FingerprintManager::connect(uint32_t baudRate) {
   
-    // initialize input pins
-    pinMode(touchRingPin, INPUT_PULLDOWN);
-    Serial.print("TouchRing pin: ");
-    Serial.println(touchRingPin);
+    beginTouchInput();
 
     Serial.println("\n\nAdafruit finger detect test");
 
     // set the data rate for the sensor serial port
-    finger.begin(57600);
+    this->baudRate = baudRate;
+    finger.begin(baudRate); // only waits for the sensor to boot, finger talks to the UART through the trace
+    serialPort.begin(baudRate, SERIAL_8N1, rxPin, txPin); // rxPin/txPin < 0 = default pins of the UART
     delay(50);
     if (finger.verifyPassword()) {
         Serial.println("Found fingerprint sensor!");
@@ -21,6 +37,9 @@ bool FingerprintManager::connect() {
         delay(5000); // wait a bit longer for sensor to start before 2nd try (usually after a OTA-Update the esp32 is faster with startup than the fingerprint sensor)
         if (finger.verifyPassword()) { 
           Serial.println("Found fingerprint sensor!");
+        } else if (probeBaudRate()) {
+          // sensor is alive but uses another baud rate than expected (e.g. settings were reset after changing the rate)
+          notifyClients(String("Found fingerprint sensor at ") + this->baudRate + " baud instead of " + baudRate + " baud.");
         } else {
           Serial.println("Did not find fingerprint sensor :(");
           connected = false;
@@ -37,52 +56,141 @@ bool FingerprintManager::connect() {
     Serial.print(F("Security level: ")); Serial.println(finger.security_level);
     Serial.print(F("Device address: ")); Serial.println(finger.device_addr, HEX);
     Serial.print(F("Packet len: ")); Serial.println(finger.packet_len);
-    Serial.print(F("Baud rate: ")); Serial.println(finger.baud_rate);
+    Serial.print(F("Baud rate: ")); Serial.println(this->baudRate); // finger.baud_rate is only 16 bit wide and overflows above 57600
 
     finger.getTemplateCount();
     Serial.print("Sensor contains "); Serial.print(finger.templateCount); Serial.println(" templates");
 
+    autoIdentifySupported = probeAutoIdentify();
+    scanEngine = autoIdentifySupported ? ScanEngine::autoIdentify : ScanEngine::threeStep;
+    autoIdentifyErrors = 0;
+    Serial.print(F("Scan engine: ")); Serial.println(autoIdentifySupported ? "AutoIdentify" : "getImage/image2Tz/search");
+
     loadFingerListFromPrefs();
+    loadMatchCounts();
 
+    linkGeneration++;
     connected = true;
     return connected;
 }
 
+void FingerprintManager::beginTouchInput() {
+    // initialize input pins
+    pinMode(touchPin, INPUT_PULLDOWN);
+    Serial.print("TouchRing pin: ");
+    Serial.println(touchPin);
+    if (touchSemaphore == NULL)
+      touchSemaphore = xSemaphoreCreateBinary();
+    attachInterruptArg(digitalPinToInterrupt(touchPin), onTouchRingEdge, this, FALLING); // LOW = touched
+}
+
 void FingerprintManager::updateTouchState(bool touched)
 {
-  if ((touched != lastTouchState) || (ignoreTouchRing != lastIgnoreTouchRing)) {
+  if ((touched != lastTouchState) || (isTouchRingIgnored() != lastIgnoreTouchRing)) {
       // check if sensor or ring is touched
       if (touched) {
         // turn touch indicator on:
-        finger.LEDcontrol(FINGERPRINT_LED_FLASHING, 25, FINGERPRINT_LED_RED, 0);
+        ledControl(FINGERPRINT_LED_FLASHING, 25, FINGERPRINT_LED_RED);
       } else {
         // turn touch indicator off:
         setLedRingReady();
      }
   }
   lastTouchState = touched;
-  lastIgnoreTouchRing = ignoreTouchRing;
+  lastIgnoreTouchRing = isTouchRingIgnored();
   
 }
 
 
+uint8_t FingerprintManager::ledControl(uint8_t control, uint8_t speed, uint8_t coloridx) {
+  unsigned long start = micros();
+  uint8_t returnCode = finger.LEDcontrol(control, speed, coloridx, 0);
+  if (returnCode != FINGERPRINT_OK) // the ring is the only feedback at the door, try once more
+    returnCode = finger.LEDcontrol(control, speed, coloridx, 0);
+  metrics.ledControl.record(micros() - start);
+  return returnCode;
+}
+
+
 Match FingerprintManager::scanFingerprint() {
+  Match match = scanPasses();
+  match.readerId = readerId;
+  if (traceScanOpen)
+    traceDecision(match);
+  classifyTouch(match);
+
+  if (scanAfterMatch && match.scanResult != ScanResult::error) {
+    // a finger was imaged again (a touch of the ring alone ends with noFinger or a no finger code)
+    scanAfterMatch = false;
+    scanPolicy.recordAfterMatch(match.scanResult == ScanResult::matchFound || match.returnCode == FINGERPRINT_NOTFOUND);
+  }
+  if (match.scanResult == ScanResult::matchFound) {
+    scanAfterMatch = true;
+    // a finger still resting on the sensor when the cooldown ends is matched again, it is neither published nor
+    // counted again (counting it twice would favour the ones who rest their finger in the hot set)
+    if (match.matchId != lastMatchedId)
+      countMatch(match.matchId);
+  }
+  lastMatchedId = (match.scanResult == ScanResult::matchFound) ? match.matchId : 0;
+
+  metrics.scanResults[(int)match.scanResult]++;
+  metrics.returnCodes[match.returnCode]++;
+  if (match.returnCode == FINGERPRINT_PACKETRECIEVEERR || match.returnCode == FINGERPRINT_TIMEOUT)
+    linkGeneration++; // the sensor did not answer properly, it may have been unplugged
+  if (match.scanResult == ScanResult::matchFound || match.scanResult == ScanResult::noMatchFound) {
+    if (decisionStartMicros != 0)
+      metrics.touchToDecision.record(micros() - decisionStartMicros);
+    decisionStartMicros = 0;
+  } else if (match.scanResult == ScanResult::noFinger && !lastTouchState) {
+    decisionStartMicros = 0;
+  }
+  return match;
+}
+
+
+void FingerprintManager::recordTouchLatency() {
+  if (!touchLatencyPending)
+    return;
+  touchLatencyPending = false;
+  unsigned long latency = micros() - pendingEdgeMicros;
+  metrics.touchToImage.record(latency);
+  touchLatency.count++;
+  touchLatency.lastMicros = latency;
+  touchLatency.totalMicros += latency;
+  if (latency > touchLatency.maxMicros)
+    touchLatency.maxMicros = latency;
+  Serial.printf("Touch to first image: %luus\n", latency);
+}
+
+
+Match FingerprintManager::scanPasses() {
   
   Match match;
   match.scanResult = ScanResult::error;
+  scanSawFinger = false;
 
   if (!connected) {
       return match;
   }
+  discardInput();
 
 
   // finger detection by capacitive touchRing state (increased sensitivy but error prone due to rain)
   bool ringTouched = false;
-  if (!ignoreTouchRing)
+  ringEdgePass = false;
+  if (!isTouchRingIgnored())
   {
-    if (isRingTouched())
+    bool edgeLatched = touchEdgeDetected;
+    if (isRingTouched()) {
       ringTouched = true;
+      ringEdgePass = true;
+      if (decisionStartMicros == 0)
+        decisionStartMicros = touchLatencyPending ? pendingEdgeMicros : micros();
+    }
     if (ringTouched || lastTouchState) { 
+        scanLimits = scanPolicy.beginScan();
+        if (trace.isActive())
+          traceScanStart(ringTouched ? (edgeLatched ? TraceTouch::edge : TraceTouch::level) : TraceTouch::none);
         updateTouchState(true);
         //Serial.println("touched");
     } else {
@@ -91,11 +199,37 @@ Match FingerprintManager::scanFingerprint() {
         return match;
     }
 
+  } else {
+    if (touchEdgeDetected && !ignoreTouchRing) {
+      // suppressed: the edge starts no imaging passes, the next polls tell if a finger follows
+      touchEdgeDetected = false;
+      ringEdgePending = true;
+      ringEdgeMillis = millis();
+    }
+    scanLimits = scanPolicy.beginScan();
+    if (trace.isActive())
+      traceScanStart(TraceTouch::none);
+  }
+
+  // AutoIdentify waits for the finger on its own, so it is only started after a touch. Without touch ring the
+  // classic path is used, its getImage returns immediately if there is no finger. Further passes after a failed
+  // match use the classic path too, it notices a released finger without waiting. AutoIdentify always searches
+  // from page 0, if the hot set lies further up the narrowed search of the classic path is faster.
+  int scanPass = 0;
+  int linkErrors = 0;
+  if (ringTouched && (scanEngine == ScanEngine::autoIdentify) && (hotSetEnd <= autoIdentifyMaxHotPage)) {
+    bool anotherScan = false;
+    match = autoIdentifyScan(anotherScan);
+    if (!anotherScan)
+      return match;
+    if (match.returnCode == FINGERPRINT_PACKETRECIEVEERR)
+      linkErrors++;
+    if (match.scanResult == ScanResult::noMatchFound)
+      scanPass = 1;
   }
   
 
   bool doAnotherScan = true;
-  int scanPass = 0;
   while (doAnotherScan)
   {
     doAnotherScan = false;
@@ -111,9 +245,21 @@ Match FingerprintManager::scanFingerprint() {
       doImaging = false;
       imagingPass++;
       //Serial.println(String("Get Image try ") + imagingPass);
-      match.returnCode = finger.getImage();
+      recordTouchLatency();
+      unsigned long stageStart = micros();
+      match.returnCode = getImage();
+      metrics.getImage.record(micros() - stageStart);
+      if (match.returnCode == FINGERPRINT_PACKETRECIEVEERR && ++linkErrors >= scanMaxLinkErrors) {
+        Serial.println("Communication error");
+        match.scanResult = ScanResult::error;
+        return match; // back to the sensor task instead of waiting for further timeouts, the next pass tries again
+      }
+      if (ringTouched && (match.returnCode == FINGERPRINT_OK || match.returnCode == FINGERPRINT_NOFINGER || match.returnCode == FINGERPRINT_PACKETRECIEVEERR))
+        scanPolicy.recordImagingPass(imagingPass, match.returnCode == FINGERPRINT_OK);
       switch (match.returnCode) {
         case FINGERPRINT_OK:
+          if (decisionStartMicros == 0)
+            decisionStartMicros = stageStart; // touch ring is ignored, the finger was noticed by this image
           // Important: do net set touch state to true yet! Reason:
           // - if touchRing is NOT ignored, updateTouchState(true) was already called a few lines up, ring is already flashing red
           // - if touchRing IS ignored, wait for next step because image still can be "too messy" (=raindrop on sensor), and we don't want to flash red in this case
@@ -126,18 +272,18 @@ Match FingerprintManager::scanFingerprint() {
             // no finger on sensor but ring was touched -> ring event
             //Serial.println("ring touched");
             updateTouchState(true);
-            if (imagingPass < 15) // up to x image passes in a row are taken after touch ring was touched until noFinger will raise a noMatchFound event
+            if (imagingPass < scanLimits.imagingPasses) // image passes in a row after the touch ring was touched until noFinger will raise a noMatchFound event
             {
               doImaging = true; // scan another image
               //delay(50);
               break;
             } else {
-              //Serial.println("15 times no image after touching ring");
+              //Serial.println("no image after touching ring");
               match.scanResult = ScanResult::noMatchFound;
               return match;
             }
           } else  {
-            if (ignoreTouchRing && scanPass > 1) {
+            if (isTouchRingIgnored() && scanPass > 1) {
               // the scan(s) in last iteration(s) have not found any match, now the finger was released (=no finger) -> return "no match" as result
               match.scanResult = ScanResult::noMatchFound;
             } else {
@@ -160,10 +306,13 @@ Match FingerprintManager::scanFingerprint() {
     ///////////////////////////////////////////////////////////
     // STEP 2: Convert Image to feature map
     ///////////////////////////////////////////////////////////
-    match.returnCode = finger.image2Tz();
+    unsigned long stageStart = micros();
+    match.returnCode = image2Tz();
+    metrics.image2Tz.record(micros() - stageStart);
     switch (match.returnCode) {
       case FINGERPRINT_OK:
         //Serial.println("Image converted");
+        scanSawFinger = true;
         updateTouchState(true);
         break;
       case FINGERPRINT_IMAGEMESS:
@@ -186,23 +335,28 @@ Match FingerprintManager::scanFingerprint() {
     ///////////////////////////////////////////////////////////
     // STEP 3: Search DB for matching features
     ///////////////////////////////////////////////////////////
-    match.returnCode = finger.fingerSearch();
+    stageStart = micros();
+    match.returnCode = searchDatabase();
+    metrics.fingerSearch.record(micros() - stageStart);
+    if (match.returnCode == FINGERPRINT_OK || match.returnCode == FINGERPRINT_NOTFOUND)
+      scanPolicy.recordSearchPass(scanPass, match.returnCode == FINGERPRINT_OK);
     if (match.returnCode == FINGERPRINT_OK) {
         // found a match!
-        finger.LEDcontrol(FINGERPRINT_LED_ON, 0, FINGERPRINT_LED_PURPLE);
+        ledControl(FINGERPRINT_LED_ON, 0, FINGERPRINT_LED_PURPLE);
         
         match.scanResult = ScanResult::matchFound;
         match.matchId = finger.fingerID;
         match.matchConfidence = finger.confidence;
-        match.matchName = fingerList[finger.fingerID];
+        if (fingers.contains(finger.fingerID))
+          strlcpy(match.matchName, fingers.getName(finger.fingerID), sizeof(match.matchName));
       
     } else if (match.returnCode == FINGERPRINT_PACKETRECIEVEERR) {
         Serial.println("Communication error");
 
     } else if (match.returnCode == FINGERPRINT_NOTFOUND) {
-        Serial.println(String("Did not find a match. (Scan #") + scanPass + String(" of 5)"));
+        Serial.printf("Did not find a match. (Scan #%d of %u)\n", scanPass, scanLimits.searchPasses);
         match.scanResult = ScanResult::noMatchFound;
-        if (scanPass < 5) // max 5 Scans until no match found is given back as result
+        if (scanPass < scanLimits.searchPasses) // scans until no match found is given back as result
           doAnotherScan = true;
 
     } else {
@@ -216,205 +370,551 @@ Match FingerprintManager::scanFingerprint() {
 }
 
 
+/* First scan pass of a touch with a single AutoIdentify command. Sets anotherScan if the touch should be scanned
+   again with the classic path: after a failed match (next pass) or if AutoIdentify failed (fallback). */
+Match FingerprintManager::autoIdentifyScan(bool &anotherScan) {
+  Match match;
+  match.scanResult = ScanResult::error;
+
+  recordTouchLatency();
+  uint16_t id = 0;
+  uint16_t score = 0;
+  unsigned long stageStart = micros();
+  match.returnCode = autoIdentify(id, score);
+  metrics.autoIdentify.record(micros() - stageStart);
+  if (match.returnCode != FINGERPRINT_PACKETRECIEVEERR)
+    autoIdentifyErrors = 0;
+  if (match.returnCode == FINGERPRINT_OK || match.returnCode == FINGERPRINT_NOTFOUND) {
+    scanSawFinger = true;
+    scanPolicy.recordSearchPass(1, match.returnCode == FINGERPRINT_OK);
+  }
+
+  switch (match.returnCode) {
+    case FINGERPRINT_OK:
+      ledControl(FINGERPRINT_LED_ON, 0, FINGERPRINT_LED_PURPLE);
+      match.scanResult = ScanResult::matchFound;
+      match.matchId = id;
+      match.matchConfidence = score;
+      if (fingers.contains(id))
+        strlcpy(match.matchName, fingers.getName(id), sizeof(match.matchName));
+      break;
+    case FINGERPRINT_NOTFOUND:
+      Serial.printf("Did not find a match. (Scan #1 of %u)\n", scanLimits.searchPasses);
+      match.scanResult = ScanResult::noMatchFound;
+      anotherScan = scanLimits.searchPasses > 1;
+      break;
+    case FINGERPRINT_AUTOTIMEOUT:
+    case FINGERPRINT_NOFINGER:
+      // ring was touched but no finger was placed -> ring event
+      match.scanResult = ScanResult::noMatchFound;
+      break;
+    case FINGERPRINT_PACKETRECIEVEERR:
+      // communication error or the command is not understood (e.g. sensor was replaced), scan this touch the classic way
+      Serial.println("AutoIdentify failed, using getImage/image2Tz/search");
+      if (++autoIdentifyErrors >= 3) {
+        scanEngine = ScanEngine::threeStep;
+        notifyClients("AutoIdentify failed repeatedly, switched to getImage/image2Tz/search scans.");
+      }
+      anotherScan = true;
+      break;
+    case FINGERPRINT_IMAGEMESS:
+      Serial.println("Image too messy");
+      break;
+    case FINGERPRINT_FEATUREFAIL:
+    case FINGERPRINT_INVALIDIMAGE:
+      Serial.println("Could not find fingerprint features");
+      break;
+    default:
+      Serial.println("Unknown error");
+      break;
+  }
+
+  return match;
+}
+
+
+/* R503 AutoIdentify. Only the final result is requested (no acknowledge per step), it carries the step code, the
+   matched page and the score. */
+uint8_t FingerprintManager::autoIdentify(uint16_t &id, uint16_t &score) {
+  uint8_t data[6];
+
+  data[0] = FINGERPRINT_AUTOIDENTIFY;
+  data[1] = (uint8_t)finger.security_level;
+  data[2] = 0xFF; // page 0xFFFF = search the whole library
+  data[3] = 0xFF;
+  data[4] = 0x00;
+  data[5] = 0x05; // bit 0: LED stays under host control, bit 2: return the final result only
+
+  Adafruit_Fingerprint_Packet packet(FINGERPRINT_COMMANDPACKET, sizeof(data), data);
+  finger.writeStructuredPacket(packet);
+  if (receiveAck(packet, autoIdentifyTimeoutMillis) != FINGERPRINT_OK)
+    return FINGERPRINT_PACKETRECIEVEERR;
+
+  if (packet.length >= 8) {
+    id = ((uint16_t)packet.data[2] << 8) | packet.data[3];
+    score = ((uint16_t)packet.data[4] << 8) | packet.data[5];
+    finger.fingerID = id;
+    finger.confidence = score;
+  }
+  if ((packet.data[0] == FINGERPRINT_OK) && (id >= finger.capacity))
+    return FINGERPRINT_PACKETRECIEVEERR;
+  return packet.data[0];
+}
+
+
+/* Sends AutoIdentify with an invalid page number. A sensor knowing the command rejects the parameter right away
+   without waiting for a finger, older sensors report an unknown command or don't answer at all. */
+bool FingerprintManager::probeAutoIdentify() {
+  uint8_t data[6];
+
+  data[0] = FINGERPRINT_AUTOIDENTIFY;
+  data[1] = (uint8_t)finger.security_level;
+  data[2] = (uint8_t)(finger.capacity >> 8);
+  data[3] = (uint8_t)(finger.capacity & 0xFF);
+  data[4] = 0x00;
+  data[5] = 0x05;
+
+  Adafruit_Fingerprint_Packet packet(FINGERPRINT_COMMANDPACKET, sizeof(data), data);
+  finger.writeStructuredPacket(packet);
+  if (finger.getStructuredPacket(&packet) != FINGERPRINT_OK)
+    return false;
+  return (packet.type == FINGERPRINT_ACKPACKET) && (packet.data[0] != FINGERPRINT_PACKETRECIEVEERR);
+}
+
+
+ScanEngine FingerprintManager::getScanEngine() {
+  return scanEngine;
+}
+
+
+bool FingerprintManager::setScanEngine(ScanEngine engine) {
+  if ((engine == ScanEngine::autoIdentify) && !autoIdentifySupported)
+    return false;
+  scanEngine = engine;
+  autoIdentifyErrors = 0;
+  return true;
+}
+
+
 
 // Preferences
+/* All names are stored in a single blob (see FingerRegistry::serialize), read with one getBytes. Older firmware
+   stored one string per slot, these keys are read once and replaced by the blob. */
 void FingerprintManager::loadFingerListFromPrefs() {
+  lockFingers();
+  if (!fingers.begin(finger.capacity))
+    notifyClients(String("Error: not enough memory for the finger list of ") + finger.capacity + " slots.");
+  fingerListDirty = false;
   Preferences preferences;
-  preferences.begin("fingerList", true); 
-  int counter = 0;
-  for (int i=1; i<=200; i++) {
-    String key = String(i);
-    if (preferences.isKey(key.c_str())) {
-      fingerList[i] = preferences.getString(key.c_str(), String("@empty"));
-      counter++;
+  if (preferences.begin(namesNamespace, true)) {
+    size_t length = preferences.getBytesLength("names");
+    if (length > 0) {
+      uint8_t *blob = (uint8_t*)malloc(length);
+      if (!blob || (preferences.getBytes("names", blob, length) != length) || !fingers.deserialize(blob, length))
+        notifyClients("Warning: the stored finger names are corrupt or don't fit this sensor, all names were dropped.");
+      free(blob);
+    } else {
+      for (int i=1; i<fingers.getCapacity(); i++) {
+        String key = String(i);
+        if (preferences.isKey(key.c_str()))
+          fingerListDirty |= fingers.setName(i, preferences.getString(key.c_str()).c_str());
+      }
     }
+    preferences.end();
+  }
+  fingerListHtml.rebuild(fingers);
+  unlockFingers();
+  if (fingerListDirty) {
+    Serial.println("Converting the finger list to a single preferences entry");
+    saveFingerList(true);
+  }
+  Serial.println(String(fingers.getCount()) + " fingers loaded from preferences.");
+  if (fingers.getCount() != finger.templateCount)
+    notifyClients(String("Warning: Fingerprint count mismatch! ") + finger.templateCount + " fingerprints stored on sensor, but we are aware of " + fingers.getCount() + " fingerprints.");
+}
+
+
+// registry changes go through these two, they keep the HTML option list in sync, mark the names for saving and push
+// the change to the web clients
+void FingerprintManager::setFingerName(uint16_t id, const char *name, bool notify) {
+  lockFingers();
+  bool added = !fingers.contains(id);
+  bool changed = fingers.setName(id, name);
+  if (changed) {
+    if (added)
+      fingerListHtml.insert(fingers, fingers.indexOf(id));
     else
-      fingerList[i] = String("@empty");
+      fingerListHtml.replace(fingers, fingers.indexOf(id));
+    fingerListDirty = true;
   }
-  Serial.println(String(counter) + " fingers loaded from preferences.");
-  if (counter != finger.templateCount)
-    notifyClients(String("Warning: Fingerprint count mismatch! ") + finger.templateCount + " fingerprints stored on sensor, but we are aware of " + counter + " fingerprints.");
-  preferences.end();
+  unlockFingers();
+  if (changed && notify)
+    notifyFingerChanged(readerId, added ? FingerChange::added : FingerChange::renamed, id, name);
 }
 
+void FingerprintManager::removeFingerName(uint16_t id) {
+  lockFingers();
+  int index = fingers.indexOf(id);
+  bool removed = (index >= 0) && fingers.remove(id);
+  if (removed) {
+    fingerListHtml.erase(fingers, index);
+    fingerListDirty = true;
+  }
+  unlockFingers();
+  if (removed)
+    notifyFingerChanged(readerId, FingerChange::deleted, id, "");
+}
 
-// Add/Enroll fingerprint
-NewFinger FingerprintManager::enrollFinger(int id, String name) {
+void FingerprintManager::lockFingers() {
+  if (fingersMutex == NULL)
+    fingersMutex = xSemaphoreCreateMutex(); // first use is connect() during setup, before the web server runs
+  xSemaphoreTake(fingersMutex, portMAX_DELAY);
+}
 
-  NewFinger newFinger;
-  newFinger.enrollResult = EnrollResult::error;
+void FingerprintManager::unlockFingers() {
+  xSemaphoreGive(fingersMutex);
+}
+
+void FingerprintManager::printFingerListJson(Print &out, uint16_t offset, uint16_t limit) {
+  lockFingers();
+  fingers.printJson(out, offset, limit);
+  unlockFingers();
+}
+
+bool FingerprintManager::printFingerJson(Print &out, int id) {
+  lockFingers();
+  bool found = fingers.printJson(out, id);
+  unlockFingers();
+  return found;
+}
 
+
+/* Writes the names if they changed since the last save. Changes are only collected in RAM by enroll, rename etc.,
+   the caller saves once a batch of changes is done. removeOtherKeys drops the per slot keys of older firmware, one by
+   one and only once the blob is written: a failed write or a power loss in between keeps the old names. */
+bool FingerprintManager::saveFingerList(bool removeOtherKeys) {
+  if (!fingerListDirty)
+    return true;
+  size_t length = fingers.getSerializedSize();
+  uint8_t *blob = (uint8_t*)malloc(length);
+  if (blob == nullptr)
+    return false;
+  fingers.serialize(blob, length);
+
+  bool saved = false;
+  Preferences preferences;
+  if (preferences.begin(namesNamespace, false)) {
+    saved = (preferences.putBytes("names", blob, length) == length);
+    for (int i=1; saved && removeOtherKeys && i<fingers.getCapacity(); i++) {
+      String key = String(i);
+      if (preferences.isKey(key.c_str()))
+        preferences.remove(key.c_str());
+    }
+    preferences.end();
+  }
+  free(blob);
+  if (saved)
+    fingerListDirty = false;
+  else
+    notifyClients("Error: the finger names could not be saved.");
+  return saved;
+}
+
+
+// Add/Enroll fingerprint, the steps are run by continueEnroll()
+bool FingerprintManager::beginEnroll(int id, const char *name) {
+  if (enrolling)
+    return false;
+
+  enrolling = true;
+  enrollCancelRequested = false;
+  enrollId = id;
+  strlcpy(enrollName, name, sizeof(enrollName));
+  enrollSample = 1;
   lastTouchState = true; // after enrollment, scan mode kicks in again. Force update of the ring light back to normal on first iteration of scan mode.
 
-  
-  notifyClients(String("Enrollment for id #") + id + " started. We need to scan your finger 5 times until enrollment is completed.");
+  notifyClients(String("Enrollment for id #") + id + " started. We need to scan your finger " + enrollSamples + " times until enrollment is completed.");
+  startEnrollSample();
+  return true;
+}
 
-  
-  // Repeat n times to get better resulting templates (as stated in R503 documentation up to 6 combined image samples possible, but I got an communication error when trying more than 5 samples, so dont go >5)
-  for (int nTimes=1; nTimes<=5; nTimes++)
-  {
-      notifyClients(String("Take #" + String(nTimes))+ " (place your finger on the sensor until led ring stops flashing, then remove it).");
-
-      if (nTimes != 1) // not on first run
-      {
-        //delay(2000);
-        newFinger.returnCode = 0xFF;
-        while (newFinger.returnCode != FINGERPRINT_NOFINGER) {
-          newFinger.returnCode = finger.getImage();
-        }
-      }
-      
-      Serial.print("Taking image sample "); Serial.print(nTimes); Serial.print(": ");
-      finger.LEDcontrol(FINGERPRINT_LED_FLASHING, 25, FINGERPRINT_LED_PURPLE, 0);
-      newFinger.returnCode = 0xFF;
-      while (newFinger.returnCode != FINGERPRINT_OK) {
-        newFinger.returnCode = finger.getImage();
-        switch (newFinger.returnCode) {
-        case FINGERPRINT_OK:
-          Serial.print("taken, ");
-          break;
-        case FINGERPRINT_NOFINGER:
-          break;
-        case FINGERPRINT_PACKETRECIEVEERR:
-          Serial.print("Communication error, ");
-          break;
-        case FINGERPRINT_IMAGEFAIL:
-          Serial.print("Imaging error, ");
-          break;
-        default:
-          Serial.print("Unknown error, ");
-          break;
-        }
-      }
-    
-      // OK success!
-    
-      newFinger.returnCode = finger.image2Tz(nTimes);
+
+void FingerprintManager::startEnrollSample() {
+  notifyClients(String("Take #" + String(enrollSample))+ " (place your finger on the sensor until led ring stops flashing, then remove it).");
+  Serial.print("Taking image sample "); Serial.print(enrollSample); Serial.print(": ");
+  ledControl(FINGERPRINT_LED_FLASHING, 25, FINGERPRINT_LED_PURPLE);
+  enrollState = EnrollState::waitForFinger;
+  enrollStepStart = millis();
+  notifyEnrollProgress(readerId, enrollState, enrollId, enrollSample);
+}
+
+
+NewFinger FingerprintManager::continueEnroll() {
+
+  NewFinger newFinger;
+  if (!enrolling)
+    return newFinger;
+  newFinger.enrollResult = EnrollResult::running;
+
+  if (enrollCancelRequested) {
+    Serial.println("cancelled");
+    return finishEnroll(EnrollResult::cancelled, 0);
+  }
+
+  unsigned long waited = millis() - enrollStepStart;
+  discardInput();
+  newFinger.returnCode = getImage();
+
+  if (enrollState == EnrollState::waitForLift) {
+    if (newFinger.returnCode == FINGERPRINT_NOFINGER) {
+      startEnrollSample();
+      return newFinger;
+    }
+    if (waited >= enrollLiftTimeoutMillis) {
+      Serial.println("finger not lifted");
+      return finishEnroll(EnrollResult::timeout, newFinger.returnCode);
+    }
+
+  } else {
+    switch (newFinger.returnCode) {
+    case FINGERPRINT_OK:
+      Serial.print("taken, ");
+      break;
+    case FINGERPRINT_NOFINGER:
+      break;
+    case FINGERPRINT_PACKETRECIEVEERR:
+      Serial.print("Communication error, ");
+      break;
+    case FINGERPRINT_IMAGEFAIL:
+      Serial.print("Imaging error, ");
+      break;
+    default:
+      Serial.print("Unknown error, ");
+      break;
+    }
+
+    if (newFinger.returnCode == FINGERPRINT_OK) {
+      newFinger.returnCode = image2Tz(enrollSample);
+      // a bad image or a garbled reply only costs this sample another image, the finger timeout still applies
       switch (newFinger.returnCode) {
         case FINGERPRINT_OK:
-          Serial.print("converted");
+          Serial.println("converted");
           break;
         case FINGERPRINT_IMAGEMESS:
-          Serial.print("too messy");
-          return newFinger;
+          Serial.println("too messy, again");
+          break;
         case FINGERPRINT_PACKETRECIEVEERR:
-          Serial.print("Communication error");
-          return newFinger;
+          Serial.println("Communication error, again");
+          break;
         case FINGERPRINT_FEATUREFAIL:
-          Serial.print("Could not find fingerprint features");
-          return newFinger;
         case FINGERPRINT_INVALIDIMAGE:
-          Serial.print("Could not find fingerprint features");
-          return newFinger;
+          Serial.println("Could not find fingerprint features, again");
+          break;
         default:
-          Serial.print("Unknown error");
-          return newFinger;
+          Serial.println("Unknown error, again");
+          break;
       }
-      finger.LEDcontrol(FINGERPRINT_LED_ON, 0, FINGERPRINT_LED_PURPLE);
-
+    }
+    if (newFinger.returnCode == FINGERPRINT_OK) {
+      ledControl(FINGERPRINT_LED_ON, 0, FINGERPRINT_LED_PURPLE);
+
+      if (enrollSample == enrollSamples)
+        return storeEnrolledModel();
+      enrollSample++;
+      enrollState = EnrollState::waitForLift;
+      enrollStepStart = millis();
+      notifyEnrollProgress(readerId, enrollState, enrollId, enrollSample);
+      return newFinger;
+    }
+    if (waited >= enrollFingerTimeoutMillis) {
+      Serial.println("no finger");
+      return finishEnroll(EnrollResult::timeout, newFinger.returnCode);
+    }
   }
 
-  
+  // nothing changed yet: poll again later, the touch ring interrupt, a new command or cancelEnroll() wake us up earlier
+  xSemaphoreTake(touchSemaphore, pdMS_TO_TICKS(enrollPollMillis));
+  return newFinger;
+}
+
+
+NewFinger FingerprintManager::storeEnrolledModel() {
+
+  NewFinger newFinger;
 
   // OK converted!
-  Serial.println();
-  Serial.print("Creating model for #");  Serial.println(id);
+  Serial.print("Creating model for #");  Serial.println(enrollId);
 
   newFinger.returnCode = finger.createModel();
   if (newFinger.returnCode == FINGERPRINT_OK) {
     Serial.println("Prints matched!");
   } else if (newFinger.returnCode == FINGERPRINT_PACKETRECIEVEERR) {
     Serial.println("Communication error");
-    return newFinger;
+    return finishEnroll(EnrollResult::error, newFinger.returnCode);
   } else if (newFinger.returnCode == FINGERPRINT_ENROLLMISMATCH) {
     Serial.println("Fingerprints did not match");
-    return newFinger;
+    return finishEnroll(EnrollResult::error, newFinger.returnCode);
   } else {
     Serial.println("Unknown error");
-    return newFinger;
+    return finishEnroll(EnrollResult::error, newFinger.returnCode);
   }
 
-  Serial.print("ID "); Serial.println(id);
-  newFinger.returnCode = finger.storeModel(id);
+  Serial.print("ID "); Serial.println(enrollId);
+  newFinger.returnCode = finger.storeModel(enrollId);
   if (newFinger.returnCode == FINGERPRINT_OK) {
     Serial.println("Stored!");
-    newFinger.enrollResult = EnrollResult::ok;
     // save to prefs
-    fingerList[id] = name;
-    Preferences preferences;
-    preferences.begin("fingerList", false); 
-    preferences.putString(String(id).c_str(), name);
-    preferences.end();
+    setFingerName(enrollId, enrollName);
+    return finishEnroll(EnrollResult::ok, newFinger.returnCode);
 
   } else if (newFinger.returnCode == FINGERPRINT_PACKETRECIEVEERR) {
     Serial.println("Communication error");
-    return newFinger;
   } else if (newFinger.returnCode == FINGERPRINT_BADLOCATION) {
     Serial.println("Could not store in that location");
-    return newFinger;
   } else if (newFinger.returnCode == FINGERPRINT_FLASHERR) {
     Serial.println("Error writing to flash");
-    return newFinger;
   } else {
     Serial.println("Unknown error");
-    return newFinger;
   }
+  return finishEnroll(EnrollResult::error, newFinger.returnCode);
+}
+
 
-  //finger.LEDcontrol(FINGERPRINT_LED_OFF, 0, FINGERPRINT_LED_RED);
+NewFinger FingerprintManager::finishEnroll(EnrollResult result, uint8_t returnCode) {
+  static const EnrollState finalStates[] = { EnrollState::ok, EnrollState::error, EnrollState::error, EnrollState::cancelled, EnrollState::timeout }; // same order as EnrollResult
+  enrolling = false;
+  enrollCancelRequested = false;
+  touchEdgeDetected = false; // the touches of the enrollment are no doorbell rings
+  notifyEnrollProgress(readerId, finalStates[(int)result], enrollId, enrollSample);
 
+  NewFinger newFinger;
+  newFinger.enrollResult = result;
+  newFinger.returnCode = returnCode;
   return newFinger;
+}
+
 
+void FingerprintManager::cancelEnroll() {
+  enrollCancelRequested = true;
+  wakeUp();
 }
 
 
-void FingerprintManager::deleteFinger(int id) {
+bool FingerprintManager::isEnrolling() {
+  return enrolling;
+}
+
+
+bool FingerprintManager::deleteFinger(int id) {
           
-  if ((id > 0) && (id <= 200)) {
+  if (fingers.isValidId(id)) {
     int8_t result = finger.deleteModel(id);
     if (result != FINGERPRINT_OK) {
       notifyClients(String("Delete of finger template #") + id + " from sensor failed with code " + result);
-      return;
+      return false;
 
     } else {
-      fingerList[id] = "@empty";
-      Preferences preferences;
-      preferences.begin("fingerList", false); 
-      preferences.remove (String(id).c_str());
-      preferences.end();
+      int index = fingers.indexOf(id);
+      bool wasHot = (index >= 0) && (fingers.matchCountAt(index) != 0);
+      removeFingerName(id);
+      if (wasHot) {
+        updateHotRanges();
+        saveMatchCounts();
+      }
       Serial.println(String("Finger template #") + id + " deleted from sensor and prefs.");
+      return true;
 
     }
   }
+  return false;
 
 }
 
 
 void FingerprintManager::renameFinger(int id, String newName) {
-  if ((id > 0) && (id <= 200)) {
-    Preferences preferences;
-    preferences.begin("fingerList", false); 
-    preferences.putString(String(id).c_str(), newName);
-    preferences.end();
-    Serial.println(String("Finger template #") + id + " renamed from " + fingerList[id] + " to " + newName);
-    fingerList[id] = newName;
+  if (fingers.isValidId(id)) {
+    Serial.println(String("Finger template #") + id + " renamed from " + (fingers.contains(id) ? fingers.getName(id) : "@empty") + " to " + newName);
+    setFingerName(id, newName.c_str());
   }
 }
 
 String FingerprintManager::getFingerListAsHtmlOptionList() {
-  String htmlOptions = "";
-  int counter = 0;
-  for (int i=1; i<=200; i++) {
-    if (fingerList[i].compareTo("@empty") != 0) {
-      String option;
-      if (counter == 0)
-        option = "<option value=\"" + String(i) + "\" selected>" + String(i) + " - " + fingerList[i] + "</option>";
-      else 
-        option = "<option value=\"" + String(i) + "\">" + String(i) + " - " + fingerList[i] + "</option>";
-      htmlOptions += option;
-      counter++;
+  return fingerListHtml.toString();
+}
+
+const FingerRegistry& FingerprintManager::getFingers() {
+  return fingers;
+}
+
+uint16_t FingerprintManager::getCapacity() {
+  return fingers.getCapacity();
+}
+
+bool FingerprintManager::isValidFingerId(int id) {
+  return fingers.isValidId(id);
+}
+
+/* Outcome of a touch of the ring for the false touch detection: a pass of the scan saw a finger (converted or
+   searched an image, e.g. an unknown finger that was lifted before the last pass), or the scan found no image or only
+   a messy one or one without features. */
+void FingerprintManager::classifyTouch(const Match &match) {
+  if (!falseTouchDetection || ignoreTouchRing)
+    return;
+  bool finger = scanSawFinger;
+  bool unusableImage = match.scanResult == ScanResult::error && (match.returnCode == FINGERPRINT_IMAGEMESS
+    || match.returnCode == FINGERPRINT_FEATUREFAIL || match.returnCode == FINGERPRINT_INVALIDIMAGE);
+  bool noImage = match.scanResult == ScanResult::noMatchFound && !finger; // the imaging passes after the touch ran out
+
+  bool classified = false;
+  TouchOutcome outcome = TouchOutcome::finger;
+  if (ringEdgePass) {
+    classified = finger || unusableImage || noImage;
+    outcome = finger ? TouchOutcome::finger : TouchOutcome::falseTouch;
+  } else if (ringEdgePending) {
+    classified = finger || unusableImage || millis() - ringEdgeMillis >= falseTouchFingerGraceMillis;
+    outcome = finger ? TouchOutcome::finger : TouchOutcome::falseTouch;
+    ringEdgePending = !classified;
+  }
+  if (classified) {
+    if (outcome == TouchOutcome::finger)
+      metrics.fingerTouches++;
+    else
+      metrics.falseTouches++;
+  }
+
+  bool changed = classified ? falseTouches.record(outcome, millis()) : falseTouches.update(millis());
+  if (changed) {
+    metrics.ringSuppressed = falseTouches.isSuppressed();
+    ringEdgePending = false;
+    char message[96];
+    if (metrics.ringSuppressed) {
+      metrics.ringSuppressions++;
+      snprintf(message, sizeof(message), "Touch ring suppressed: %u touches without a finger within %lu s (rain?)",
+        falseTouchEnterCount, falseTouchWindowMillis / 1000);
+    } else {
+      strlcpy(message, "Touch ring is used again", sizeof(message));
     }
+    notifyClients(message);
+    notifyTouchRingSuppressed(readerId, metrics.ringSuppressed);
+  }
+}
+
+bool FingerprintManager::isTouchRingIgnored() {
+  return ignoreTouchRing || falseTouches.isSuppressed();
+}
+
+bool FingerprintManager::isTouchRingSuppressed() {
+  return falseTouches.isSuppressed();
+}
+
+void FingerprintManager::setFalseTouchDetection(bool enabled) {
+  falseTouchDetection = enabled;
+  if (!enabled && falseTouches.isSuppressed()) {
+    falseTouches.reset();
+    metrics.ringSuppressed = false;
+    notifyTouchRingSuppressed(readerId, false);
   }
-  return htmlOptions;
+  ringEdgePending = false;
 }
 
 void FingerprintManager::setIgnoreTouchRing(bool state) {
@@ -428,19 +928,57 @@ void FingerprintManager::setIgnoreTouchRing(bool state) {
 }
 
 
+void IRAM_ATTR FingerprintManager::onTouchRingEdge(void *arg) {
+  FingerprintManager *manager = (FingerprintManager*)arg;
+  manager->touchEdgeMicros = micros();
+  manager->touchEdgeDetected = true;
+  BaseType_t higherPriorityTaskWoken = pdFALSE;
+  xSemaphoreGiveFromISR(manager->touchSemaphore, &higherPriorityTaskWoken);
+  if (higherPriorityTaskWoken)
+    portYIELD_FROM_ISR();
+}
+
 bool FingerprintManager::isRingTouched() {
-  if (digitalRead(touchRingPin) == LOW) // LOW = touched. Caution: touchSignal on this pin occour only once (at beginning of touching the ring, not every iteration if you keep your finger on the ring)
+  if (touchEdgeDetected) { // edge was latched by interrupt, even if the pin is already HIGH again
+      touchEdgeDetected = false;
+      pendingEdgeMicros = touchEdgeMicros;
+      touchLatencyPending = true;
+      return true;
+  }
+  if (digitalRead(touchPin) == LOW) // LOW = touched. Caution: touchSignal on this pin occour only once (at beginning of touching the ring, not every iteration if you keep your finger on the ring)
       return true;
   else 
       return false;
 }
 
+/* Blocks until the touch ring was touched or the timeout elapsed. Returns immediately if the next scan has to run anyway
+   (touch ring ignored, finger still on the sensor or touch already latched). */
+bool FingerprintManager::waitForTouch(uint32_t timeoutMillis) {
+  if (!connected || isTouchRingIgnored() || lastTouchState || touchEdgeDetected)
+    return true;
+  return xSemaphoreTake(touchSemaphore, pdMS_TO_TICKS(timeoutMillis)) == pdTRUE;
+}
+
+/* Ends a pending waitForTouch() early, e.g. because there is other work for the sensor */
+void FingerprintManager::wakeUp() {
+  if (touchSemaphore != NULL)
+    xSemaphoreGive(touchSemaphore);
+}
+
+TouchLatencyStats FingerprintManager::getTouchLatencyStats() {
+  return touchLatency;
+}
+
+const ScanMetrics& FingerprintManager::getMetrics() {
+  return metrics;
+}
+
 bool FingerprintManager::isFingerOnSensor() {
   // get an image
-  uint8_t returnCode = finger.getImage();
+  uint8_t returnCode = getImage();
   if (returnCode == FINGERPRINT_OK) {
     // try to find fingerprint features in image, because image taken does not already means finger on sensor, could also be a raindrop
-    returnCode = finger.image2Tz();
+    returnCode = image2Tz();
     if (returnCode == FINGERPRINT_OK)
       return true;
   }
@@ -448,12 +986,16 @@ bool FingerprintManager::isFingerOnSensor() {
 }
   
 void FingerprintManager::setLedRingError() {
-  finger.LEDcontrol(FINGERPRINT_LED_ON, 0, FINGERPRINT_LED_RED);
+  ledControl(FINGERPRINT_LED_ON, 0, FINGERPRINT_LED_RED);
+}
+
+void FingerprintManager::setLedRing(uint8_t control, uint8_t speed, uint8_t coloridx) {
+  ledControl(control, speed, coloridx);
 }
 
 void FingerprintManager::setLedRingReady() {
   Serial.println("turning LED off");
-  finger.LEDcontrol(FINGERPRINT_LED_OFF, 0, FINGERPRINT_LED_BLUE);
+  ledControl(FINGERPRINT_LED_OFF, 0, FINGERPRINT_LED_BLUE);
   /*
   if (!ignoreTouchRing)
     finger.LEDcontrol(FINGERPRINT_LED_BREATHING, 250, FINGERPRINT_LED_BLUE);
@@ -467,14 +1009,19 @@ bool FingerprintManager::deleteAll() {
   {
     bool rc;
     Preferences preferences;
-    rc = preferences.begin("fingerList", false); 
+    rc = preferences.begin(namesNamespace, false); 
     if (rc)
         rc = preferences.clear();
     preferences.end();
 
-    for (int i=1; i<=200; i++) {
-        fingerList[i] = String("@empty");
-    };
+    lockFingers();
+    fingers.clear();
+    fingerListHtml.rebuild(fingers);
+    fingerListDirty = false;
+    unlockFingers();
+    updateHotRanges();
+    saveMatchCounts();
+    notifyFingerChanged(readerId, FingerChange::reload, 0, "");
     
     return rc;
   }
@@ -531,13 +1078,117 @@ uint8_t FingerprintManager::readNotepad(uint8_t pageNumber, char *text, uint8_t
 }
 
 
-String FingerprintManager::getPairingCode() {
-  char buffer[33];
-  buffer[32] = 0; // null termination needed for convertion to string at the end
-  if (readNotepad(0, (char*)buffer, 32) == FINGERPRINT_OK)
-    return String((char*)buffer);
-  else
-    return "";
+bool FingerprintManager::getPairingCode(char *code) {
+  code[pairingCodeLength] = 0;
+  if (readNotepad(0, code, pairingCodeLength) == FINGERPRINT_OK)
+    return true;
+  code[0] = 0;
+  return false;
+}
+
+
+uint32_t FingerprintManager::getLinkGeneration() {
+  return linkGeneration;
+}
+
+
+ScanPolicy& FingerprintManager::getScanPolicy() {
+  return scanPolicy;
+}
+
+
+bool FingerprintManager::startTrace(size_t size) {
+  traceStatePending = true; // written by the sensor task before the next scan pass
+  traceScanOpen = false;
+  return trace.start(size);
+}
+
+void FingerprintManager::stopTrace() {
+  trace.stop();
+}
+
+UartTrace& FingerprintManager::getTrace() {
+  return trace;
+}
+
+size_t FingerprintManager::getTraceState(uint8_t *state) {
+  uint16_t packetLength = finger.packet_len;
+  state[0] = baudRate >> 24;
+  state[1] = baudRate >> 16;
+  state[2] = baudRate >> 8;
+  state[3] = baudRate;
+  state[4] = finger.capacity >> 8;
+  state[5] = finger.capacity;
+  state[6] = packetLength >> 8;
+  state[7] = packetLength;
+  state[8] = finger.security_level;
+  state[9] = (uint8_t)scanEngine;
+  state[10] = (isTouchRingIgnored() ? traceFlagIgnoreTouchRing : 0) | (autoIdentifySupported ? traceFlagAutoIdentifySupported : 0)
+    | (lastTouchState ? traceFlagFingerOnSensor : 0);
+  state[11] = min(autoIdentifyErrors, 255);
+  state[12] = hotRangeCount;
+  for (int i=0; i<hotSetSize; i++) {
+    PageRange range = (i < hotRangeCount) ? hotRanges[i] : PageRange();
+    state[13 + i*4] = range.start >> 8;
+    state[14 + i*4] = range.start;
+    state[15 + i*4] = range.count >> 8;
+    state[16 + i*4] = range.count;
+  }
+  return traceStateLength;
+}
+
+/* Replay of a UART trace: the manager is set up from a recorded state instead of asking the sensor (connect()), the
+   recorded replies are fed through the UART. */
+bool FingerprintManager::restoreTraceState(const uint8_t *state, size_t length) {
+  if (length < traceStateLength || state[12] > hotSetSize)
+    return false;
+  if (!connected)
+    beginTouchInput();
+  baudRate = ((uint32_t)state[0] << 24) | ((uint32_t)state[1] << 16) | ((uint32_t)state[2] << 8) | state[3];
+  serialPort.begin(baudRate, SERIAL_8N1, rxPin, txPin);
+  finger.capacity = ((uint16_t)state[4] << 8) | state[5];
+  finger.packet_len = ((uint16_t)state[6] << 8) | state[7];
+  finger.security_level = state[8];
+  scanEngine = (ScanEngine)state[9];
+  ignoreTouchRing = lastIgnoreTouchRing = (state[10] & traceFlagIgnoreTouchRing) != 0; // a suppression is recorded as ignored ring
+  falseTouchDetection = false;
+  falseTouches.reset();
+  autoIdentifySupported = (state[10] & traceFlagAutoIdentifySupported) != 0;
+  lastTouchState = (state[10] & traceFlagFingerOnSensor) != 0;
+  autoIdentifyErrors = state[11];
+  hotRangeCount = state[12];
+  hotSetEnd = 0;
+  for (int i=0; i<hotRangeCount; i++) {
+    hotRanges[i].start = ((uint16_t)state[13 + i*4] << 8) | state[14 + i*4];
+    hotRanges[i].count = ((uint16_t)state[15 + i*4] << 8) | state[16 + i*4];
+    hotSetEnd = max(hotSetEnd, (uint16_t)(hotRanges[i].start + hotRanges[i].count));
+  }
+  connected = true;
+  return true;
+}
+
+/* The scan pass is about to talk to the sensor: the manager state first if it changed since it was last recorded
+   (the finger flag changes with every touch, it is part of this record anyway), then how the pass was started. */
+void FingerprintManager::traceScanStart(TraceTouch touch) {
+  uint8_t state[traceStateLength];
+  getTraceState(state);
+  state[10] &= ~traceFlagFingerOnSensor;
+  if (traceStatePending || memcmp(state, tracedState, traceStateLength) != 0 || millis() - tracedStateMillis >= traceStateIntervalMillis) {
+    memcpy(tracedState, state, traceStateLength);
+    tracedStateMillis = millis();
+    traceStatePending = false;
+    getTraceState(state);
+    trace.record(TraceRecord::state, state, traceStateLength);
+  }
+  uint8_t data[4] = { (uint8_t)touch, lastTouchState, scanLimits.imagingPasses, scanLimits.searchPasses };
+  trace.record(TraceRecord::scanStart, data, sizeof(data));
+  traceScanOpen = true;
+}
+
+void FingerprintManager::traceDecision(const Match &match) {
+  uint8_t data[4] = { (uint8_t)match.scanResult, match.returnCode, (uint8_t)(match.matchId >> 8), (uint8_t)match.matchId };
+  trace.record(TraceRecord::decision, data, sizeof(data));
+  traceScanOpen = false;
 }
 
 
@@ -549,12 +1200,625 @@ bool FingerprintManager::setPairingCode(String pairingCode) {
 }
 
 
-// ToDo: support sensor replacement by enable transferring of sensor DB to another sensor
-void FingerprintManager::exportSensorDB() {
+bool FingerprintManager::probeBaudRate() {
+  const uint32_t commonRates[] = { 57600, 115200, 9600, 19200, 38400, 76800, 96000 };
+  for (uint32_t rate : commonRates) {
+    if (rate == baudRate)
+      continue;
+    serialPort.updateBaudRate(rate);
+    delay(50);
+    if (finger.verifyPassword()) {
+      baudRate = rate;
+      return true;
+    }
+  }
+  serialPort.updateBaudRate(baudRate);
+  return false;
+}
+
+
+SensorLinkSettings FingerprintManager::getLinkSettings() {
+  SensorLinkSettings settings;
+  settings.baudRate = baudRate;
+  settings.packetLength = finger.packet_len;
+  settings.securityLevel = finger.security_level;
+  return settings;
+}
+
 
+LinkTimings FingerprintManager::measureLinkTimings(int samples) {
+  LinkTimings timings;
+  if (!connected || samples < 1)
+    return timings;
+
+  unsigned long start;
+  for (int i=0; i<samples; i++) {
+    start = micros();
+    finger.getImage();
+    timings.getImage += micros() - start;
+
+    start = micros();
+    finger.image2Tz(); // without a fresh image this fails fast, but still costs a full round trip
+    timings.image2Tz += micros() - start;
+
+    start = micros();
+    finger.fingerSearch();
+    timings.fingerSearch += micros() - start;
+
+    start = micros();
+    finger.LEDcontrol(FINGERPRINT_LED_OFF, 0, FINGERPRINT_LED_BLUE);
+    timings.ledControl += micros() - start;
+  }
+  timings.getImage /= samples;
+  timings.image2Tz /= samples;
+  timings.fingerSearch /= samples;
+  timings.ledControl /= samples;
+  lastTouchState = true; // force the touch indicator to be restored on the next scan
+  return timings;
+}
+
+
+static String formatMillis(unsigned long durationMicros) {
+  return String(durationMicros / 1000.0, 1) + "ms";
+}
+
+
+bool FingerprintManager::applyLinkSettings(SensorLinkSettings settings) {
+  if (!connected)
+    return false;
+
+  uint8_t packetSizeCode;
+  switch (settings.packetLength) {
+    case 32: packetSizeCode = FINGERPRINT_PACKET_SIZE_32; break;
+    case 64: packetSizeCode = FINGERPRINT_PACKET_SIZE_64; break;
+    case 128: packetSizeCode = FINGERPRINT_PACKET_SIZE_128; break;
+    case 256: packetSizeCode = FINGERPRINT_PACKET_SIZE_256; break;
+    default:
+      notifyClients(String("Invalid sensor packet length ") + settings.packetLength);
+      return false;
+  }
+  if ((settings.baudRate % 9600 != 0) || (settings.baudRate < 9600) || (settings.baudRate > 115200)) {
+    notifyClients(String("Invalid sensor baud rate ") + settings.baudRate);
+    return false;
+  }
+  if ((settings.securityLevel < 1) || (settings.securityLevel > 5)) {
+    notifyClients(String("Invalid sensor security level ") + settings.securityLevel);
+    return false;
+  }
+
+  LinkTimings before = measureLinkTimings();
+
+  bool success = true;
+  if (settings.securityLevel != finger.security_level)
+    success &= (finger.setSecurityLevel(settings.securityLevel) == FINGERPRINT_OK);
+  if (settings.packetLength != finger.packet_len)
+    success &= (finger.setPacketSize(packetSizeCode) == FINGERPRINT_OK);
+
+  if (success && (settings.baudRate != baudRate)) {
+    if (finger.setBaudRate(settings.baudRate / 9600) == FINGERPRINT_OK) {
+      // sensor switches to the new rate right after its acknowledge, reconnect with the new rate
+      uint32_t oldBaudRate = baudRate;
+      serialPort.updateBaudRate(settings.baudRate);
+      delay(50);
+      if (finger.verifyPassword()) {
+        baudRate = settings.baudRate;
+      } else {
+        serialPort.updateBaudRate(oldBaudRate);
+        if (!finger.verifyPassword())
+          connected = probeBaudRate();
+        success = false;
+      }
+    } else {
+      success = false;
+    }
+  }
+  finger.getParameters();
+  linkGeneration++;
+
+  if (!connected) {
+    notifyClients("Lost connection to fingerprint sensor while changing the link settings!");
+    return false;
+  }
+
+  LinkTimings after = measureLinkTimings();
+  notifyClients(String("Sensor link now ") + baudRate + " baud, packet length " + finger.packet_len + ", security level " + finger.security_level
+    + ". Round trips before/after: getImage " + formatMillis(before.getImage) + "/" + formatMillis(after.getImage)
+    + ", image2Tz " + formatMillis(before.image2Tz) + "/" + formatMillis(after.image2Tz)
+    + ", search " + formatMillis(before.fingerSearch) + "/" + formatMillis(after.fingerSearch)
+    + ", LED " + formatMillis(before.ledControl) + "/" + formatMillis(after.ledControl));
+
+  if (!success)
+    notifyClients("Not all sensor link settings could be applied.");
+  return success;
+}
+
+
+/* Search the hot set first, the whole library only if none of the hot slots matches. Sets finger.fingerID and
+   finger.confidence like finger.fingerSearch(), but with a checked reply */
+uint8_t FingerprintManager::searchDatabase() {
+  for (int i=0; i<hotRangeCount; i++) {
+    uint8_t returnCode = searchRange(hotRanges[i].start, hotRanges[i].count);
+    if (returnCode != FINGERPRINT_NOTFOUND) {
+      if (returnCode == FINGERPRINT_OK)
+        metrics.hotSetHits++;
+      return returnCode;
+    }
+  }
+  if (hotRangeCount > 0)
+    metrics.hotSetMisses++;
+  return searchRange(0, finger.capacity);
+}
+
+
+uint8_t FingerprintManager::searchRange(uint16_t startPage, uint16_t pageCount) {
+  uint8_t data[6];
+
+  data[0] = FINGERPRINT_SEARCH;
+  data[1] = 1; // char buffer
+  data[2] = (uint8_t)(startPage >> 8);
+  data[3] = (uint8_t)(startPage & 0xFF);
+  data[4] = (uint8_t)(pageCount >> 8);
+  data[5] = (uint8_t)(pageCount & 0xFF);
+
+  Adafruit_Fingerprint_Packet packet(FINGERPRINT_COMMANDPACKET, sizeof(data), data);
+  finger.writeStructuredPacket(packet);
+  if (receiveAck(packet) != FINGERPRINT_OK || packet.length < 7)
+    return FINGERPRINT_PACKETRECIEVEERR;
+
+  finger.fingerID = ((uint16_t)packet.data[1] << 8) | packet.data[2];
+  finger.confidence = ((uint16_t)packet.data[3] << 8) | packet.data[4];
+  return packet.data[0];
+}
+
+
+/* Acknowledge packet with a valid checksum. Adafruit_Fingerprint does not check it, so a byte changed on the wire
+   could turn "not found" into a match or name another slot. The replies that decide a match are read with this. */
+uint8_t FingerprintManager::receiveAck(Adafruit_Fingerprint_Packet &packet, uint16_t timeout) {
+  if (finger.getStructuredPacket(&packet, timeout) != FINGERPRINT_OK || packet.type != FINGERPRINT_ACKPACKET)
+    return FINGERPRINT_PACKETRECIEVEERR;
+  // packet.length is the length field of the packet, the received data ends with the two checksum bytes
+  if (packet.length < 3 || packet.length > sizeof(packet.data))
+    return FINGERPRINT_PACKETRECIEVEERR;
+  uint16_t sum = packet.type + (packet.length >> 8) + (packet.length & 0xFF);
+  for (uint16_t i=0; i<packet.length - 2; i++)
+    sum += packet.data[i];
+  if (sum != (((uint16_t)packet.data[packet.length - 2] << 8) | packet.data[packet.length - 1])) {
+    Serial.println("Checksum error");
+    return FINGERPRINT_PACKETRECIEVEERR;
+  }
+  return FINGERPRINT_OK;
+}
+
+
+/* GetImage and Img2Tz with a checked reply: a corrupted "no finger" read as "ok" would let the search run on the
+   image or features of the previous finger. */
+uint8_t FingerprintManager::getImage() {
+  uint8_t data[1] = { FINGERPRINT_GETIMAGE };
+  Adafruit_Fingerprint_Packet packet(FINGERPRINT_COMMANDPACKET, sizeof(data), data);
+  finger.writeStructuredPacket(packet);
+  if (receiveAck(packet) != FINGERPRINT_OK)
+    return FINGERPRINT_PACKETRECIEVEERR;
+  return packet.data[0];
 }
-    
-void FingerprintManager::importSensorDB() {
 
+uint8_t FingerprintManager::image2Tz(uint8_t slot) {
+  uint8_t data[2] = { FINGERPRINT_IMAGE2TZ, slot };
+  Adafruit_Fingerprint_Packet packet(FINGERPRINT_COMMANDPACKET, sizeof(data), data);
+  finger.writeStructuredPacket(packet);
+  if (receiveAck(packet) != FINGERPRINT_OK)
+    return FINGERPRINT_PACKETRECIEVEERR;
+  return packet.data[0];
+}
+
+
+/* Drops bytes still waiting in the UART before the next command: the rest of a reply cut short by a transmission
+   error, or a reply that came after its timeout. Read as the answer to the next command they would shift every
+   following reply by one. A single 0x55 is the handshake of a sensor that restarted (e.g. supply dip). */
+void FingerprintManager::discardInput() {
+  bool restarted = false;
+  while (trace.available()) {
+    int c = trace.read();
+    restarted = restarted || (c == 0x55);
+  }
+  if (restarted) {
+    Serial.println("Fingerprint sensor restarted");
+    linkGeneration++; // verify the pairing again, the sensor could have been exchanged
+  }
+}
+
+
+void FingerprintManager::countMatch(uint16_t id) {
+  int index = fingers.indexOf(id);
+  if (index < 0)
+    return;
+  lockFingers(); // the counters are part of the entries the web server reads
+  if (fingers.matchCountAt(index) == 0xFFFF) {
+    // age all counters, so that the hot set follows changes in who is using the door
+    for (uint16_t i=0; i<fingers.getCount(); i++)
+      fingers.setMatchCountAt(i, fingers.matchCountAt(i) / 2);
+  }
+  fingers.setMatchCountAt(index, fingers.matchCountAt(index) + 1);
+  unlockFingers();
+  updateHotRanges();
+  if (++matchesSinceSave >= matchCountSaveInterval)
+    saveMatchCounts();
+}
+
+
+void FingerprintManager::updateHotRanges() {
+  // pick the slots with the most matches (insertion into a small sorted list)
+  uint16_t hotIds[hotSetSize];
+  uint16_t hotCounts[hotSetSize];
+  int hotCount = 0;
+  for (uint16_t i=0; i<fingers.getCount(); i++) {
+    uint16_t matchCount = fingers.matchCountAt(i);
+    if (matchCount == 0)
+      continue;
+    int pos = hotCount;
+    while (pos > 0 && hotCounts[pos-1] < matchCount)
+      pos--;
+    if (pos >= hotSetSize)
+      continue;
+    if (hotCount < hotSetSize)
+      hotCount++;
+    for (int j=hotCount-1; j>pos; j--) {
+      hotIds[j] = hotIds[j-1];
+      hotCounts[j] = hotCounts[j-1];
+    }
+    hotIds[pos] = fingers.idAt(i);
+    hotCounts[pos] = matchCount;
+  }
+
+  // merge slots lying close to each other into one range, ranges stay ordered by their most frequent slot
+  hotRangeCount = 0;
+  for (int i=0; i<hotCount; i++) {
+    bool merged = false;
+    for (int r=0; r<hotRangeCount && !merged; r++) {
+      uint16_t start = hotRanges[r].start;
+      uint16_t end = start + hotRanges[r].count - 1;
+      if ((hotIds[i] + hotSetMaxGap >= start) && (hotIds[i] <= end + hotSetMaxGap)) {
+        uint16_t newStart = min(start, hotIds[i]);
+        uint16_t newEnd = max(end, hotIds[i]);
+        hotRanges[r].start = newStart;
+        hotRanges[r].count = newEnd - newStart + 1;
+        merged = true;
+      }
+    }
+    if (!merged) {
+      hotRanges[hotRangeCount].start = hotIds[i];
+      hotRanges[hotRangeCount].count = 1;
+      hotRangeCount++;
+    }
+  }
+
+  hotSetEnd = 0;
+  for (int r=0; r<hotRangeCount; r++)
+    hotSetEnd = max(hotSetEnd, (uint16_t)(hotRanges[r].start + hotRanges[r].count));
+}
+
+
+/* The counters are stored as (slot id, count) pairs of the slots matched at least once. Older firmware stored
+   a plain array for the slots 0..200 ("matchCounts"), it is converted on first load. */
+void FingerprintManager::loadMatchCounts() {
+  Preferences preferences;
+  if (!preferences.begin(statsNamespace, true)) {
+    updateHotRanges();
+    return;
+  }
+  bool migrate = false;
+  size_t length = preferences.getBytesLength("slotCounts");
+  if (length == 0) {
+    length = preferences.getBytesLength("matchCounts");
+    migrate = (length == 201 * sizeof(uint16_t));
+  }
+  uint16_t *values = (length >= 2 * sizeof(uint16_t)) ? (uint16_t*)malloc(length) : nullptr;
+  if (values != nullptr) {
+    lockFingers();
+    if (migrate) {
+      preferences.getBytes("matchCounts", values, length);
+      for (uint16_t id=1; id<201; id++) {
+        int index = fingers.indexOf(id);
+        if (index >= 0)
+          fingers.setMatchCountAt(index, values[id]);
+      }
+    } else {
+      preferences.getBytes("slotCounts", values, length);
+      for (size_t i=0; i+1 < length / sizeof(uint16_t); i += 2) {
+        int index = fingers.indexOf(values[i]); // slot could have been deleted while the counters were not saved
+        if (index >= 0)
+          fingers.setMatchCountAt(index, values[i+1]);
+      }
+    }
+    unlockFingers();
+    free(values);
+  }
+  preferences.end();
+  updateHotRanges();
+  if (migrate) {
+    saveMatchCounts();
+    if (preferences.begin(statsNamespace, false)) {
+      preferences.remove("matchCounts");
+      preferences.end();
+    }
+  }
+}
+
+
+void FingerprintManager::saveMatchCounts() {
+  uint16_t used = 0;
+  for (uint16_t i=0; i<fingers.getCount(); i++) {
+    if (fingers.matchCountAt(i) != 0)
+      used++;
+  }
+  if (used > matchCountPairsAllocated) {
+    uint16_t size = max((uint16_t)8, matchCountPairsAllocated);
+    while (size < used)
+      size *= 2;
+    uint16_t *grown = (uint16_t*)realloc(matchCountPairs, size * 2 * sizeof(uint16_t));
+    if (grown != nullptr) {
+      matchCountPairs = grown;
+      matchCountPairsAllocated = size;
+    }
+  }
+  Preferences preferences;
+  preferences.begin(statsNamespace, false);
+  if (used > 0 && used <= matchCountPairsAllocated) {
+    size_t pos = 0;
+    for (uint16_t i=0; i<fingers.getCount(); i++) {
+      if (fingers.matchCountAt(i) == 0)
+        continue;
+      matchCountPairs[pos++] = fingers.idAt(i);
+      matchCountPairs[pos++] = fingers.matchCountAt(i);
+    }
+    preferences.putBytes("slotCounts", matchCountPairs, pos * sizeof(uint16_t));
+  } else if (used == 0) {
+    preferences.remove("slotCounts");
+  }
+  preferences.end();
+  matchesSinceSave = 0;
+}
+
+
+/* Streams all templates of the sensor (LoadChar + UpChar per slot) together with their names into the pipe. Blocks
+   while the pipe is full, i.e. until the HTTP client has downloaded the previous templates. */
+bool FingerprintManager::exportSensorDB(TemplatePipe &pipe) {
+  // a bit per slot, all index pages up to the capacity (e.g. 12 of them for 3000 slots): a slot left out would be
+  // missing on the replacement sensor without notice
+  uint16_t pages = finger.capacity;
+  uint8_t *bitmap = (uint8_t*)calloc((pages + 7) / 8, 1);
+  if (bitmap == nullptr) {
+    notifyClients("Export failed, not enough memory for the template index.");
+    pipe.cancel();
+    return false;
+  }
+  if (!connected || readIndexTable(bitmap, (pages + 7) / 8) != FINGERPRINT_OK) {
+    free(bitmap);
+    notifyClients(String("Export failed, could not read the template index of the sensor (") + pages + " slots).");
+    pipe.cancel();
+    return false;
+  }
+  uint16_t count = 0;
+  for (uint16_t id=0; id<pages; id++) {
+    if (bitmap[id / 8] & (1 << (id % 8)))
+      count++;
+  }
+  pipe.setRecordCount(count);
+
+  unsigned long start = millis();
+  uint16_t exported = 0;
+  uint8_t returnCode = FINGERPRINT_OK;
+  for (uint16_t id=0; id<pages && returnCode == FINGERPRINT_OK; id++) {
+    if (!(bitmap[id / 8] & (1 << (id % 8))))
+      continue;
+    TemplateRecord *record = pipe.acquireFree(pdMS_TO_TICKS(templatePipeTimeoutMillis));
+    if (record == nullptr) {
+      returnCode = FINGERPRINT_TIMEOUT; // download was aborted
+      break;
+    }
+    record->id = id;
+    const char *name = fingers.getName(id);
+    strlcpy(record->name, name ? name : "", sizeof(record->name));
+    returnCode = uploadTemplate(id, record->data, templateMaxSize, record->length);
+    if (returnCode == FINGERPRINT_OK) {
+      pipe.commit(record);
+      exported++;
+    } else {
+      pipe.release(record);
+    }
+  }
+  free(bitmap);
+  pipe.finish();
+  lastTouchState = true; // restore the ring LED on the next scan
+
+  float seconds = (millis() - start) / 1000.0;
+  if (returnCode != FINGERPRINT_OK) {
+    pipe.cancel();
+    notifyClients(String("Export aborted after ") + exported + " of " + count + " templates (Code " + returnCode + ")");
+    return false;
+  }
+  notifyClients(String("Exported ") + exported + " templates in " + String(seconds, 1) + " s (" + String(seconds > 0 ? exported / seconds : 0, 1) + " templates/s)");
+  return true;
+}
+
+
+/* Stores the templates arriving through the pipe (DownChar + Store per slot). While one template is transferred to
+   the sensor the upload handler already parses the next one into the second buffer of the pipe. */
+bool FingerprintManager::importSensorDB(TemplatePipe &pipe) {
+  if (!connected) {
+    pipe.cancel();
+    return false;
+  }
+
+  unsigned long start = millis();
+  uint16_t imported = 0;
+  uint8_t returnCode = FINGERPRINT_OK;
+  while (!pipe.isComplete()) {
+    TemplateRecord *record = pipe.acquireFilled(pdMS_TO_TICKS(templatePipeTimeoutMillis));
+    if (record == nullptr) {
+      returnCode = FINGERPRINT_TIMEOUT; // upload stalled, was aborted or is invalid
+      break;
+    }
+    if (record->id >= finger.capacity) {
+      returnCode = FINGERPRINT_BADLOCATION;
+    } else {
+      returnCode = downloadTemplate(record->id, record->data, record->length);
+    }
+    if (returnCode == FINGERPRINT_OK && fingers.isValidId(record->id)) {
+      int index = fingers.indexOf(record->id);
+      if (index >= 0 && fingers.matchCountAt(index) != 0) {
+        lockFingers();
+        fingers.setMatchCountAt(index, 0);
+        unlockFingers();
+        updateHotRanges();
+      }
+      setFingerName(record->id, record->name, false); // clients reload the whole list afterwards
+    }
+    pipe.release(record);
+    if (returnCode != FINGERPRINT_OK) {
+      pipe.cancel();
+      break;
+    }
+    imported++;
+  }
+  saveFingerList();
+  saveMatchCounts();
+  if (imported > 0)
+    notifyFingerChanged(readerId, FingerChange::reload, 0, "");
+  finger.getTemplateCount();
+  lastTouchState = true; // restore the ring LED on the next scan
+
+  float seconds = (millis() - start) / 1000.0;
+  if (returnCode != FINGERPRINT_OK) {
+    notifyClients(String("Import aborted after ") + imported + " templates (Code " + returnCode + ")" + (pipe.hasStreamError() ? ", the uploaded file is invalid." : ""));
+    return false;
+  }
+  notifyClients(String("Imported ") + imported + " templates in " + String(seconds, 1) + " s (" + String(seconds > 0 ? imported / seconds : 0, 1) + " templates/s)");
+  return true;
+}
+
+
+uint8_t FingerprintManager::readIndexTable(uint8_t *bitmap, uint16_t size) {
+  // every index page covers 256 templates, as many pages as size needs
+  for (uint8_t page=0; page * 32 < size; page++) {
+    uint8_t data[2] = { FINGERPRINT_READINDEXTABLE, page };
+    Adafruit_Fingerprint_Packet packet(FINGERPRINT_COMMANDPACKET, sizeof(data), data);
+    finger.writeStructuredPacket(packet);
+    if (finger.getStructuredPacket(&packet) != FINGERPRINT_OK || packet.type != FINGERPRINT_ACKPACKET)
+      return FINGERPRINT_PACKETRECIEVEERR;
+    if (packet.data[0] != FINGERPRINT_OK)
+      return packet.data[0];
+    memcpy(&bitmap[page * 32], &packet.data[1], min((uint16_t)32, (uint16_t)(size - page * 32)));
+  }
+  return FINGERPRINT_OK;
+}
+
+
+// LoadChar + UpChar of char buffer 1, the sensor sends the template as data packets after its acknowledge
+uint8_t FingerprintManager::uploadTemplate(uint16_t id, uint8_t *data, uint16_t maxLength, uint16_t &length) {
+  uint8_t returnCode = finger.loadModel(id);
+  if (returnCode != FINGERPRINT_OK)
+    return returnCode;
+  returnCode = finger.getModel();
+  if (returnCode != FINGERPRINT_OK)
+    return returnCode;
+
+  length = 0;
+  uint8_t type;
+  do {
+    uint16_t packetLength = 0;
+    returnCode = readDataPacket(type, data + length, maxLength - length, packetLength);
+    if (returnCode != FINGERPRINT_OK) {
+      delay(100);
+      while (trace.available()) // drop the rest of the transfer
+        trace.read();
+      return returnCode;
+    }
+    length += packetLength;
+  } while (type == FINGERPRINT_DATAPACKET);
+
+  return (type == FINGERPRINT_ENDDATAPACKET) ? FINGERPRINT_OK : FINGERPRINT_BADPACKET;
+}
+
+
+// DownChar to char buffer 1 followed by the template as data packets, then Store
+uint8_t FingerprintManager::downloadTemplate(uint16_t id, const uint8_t *data, uint16_t length) {
+  uint8_t command[2] = { FINGERPRINT_DOWNCHAR, 0x01 };
+  Adafruit_Fingerprint_Packet packet(FINGERPRINT_COMMANDPACKET, sizeof(command), command);
+  finger.writeStructuredPacket(packet);
+  if (finger.getStructuredPacket(&packet) != FINGERPRINT_OK || packet.type != FINGERPRINT_ACKPACKET)
+    return FINGERPRINT_PACKETRECIEVEERR;
+  if (packet.data[0] != FINGERPRINT_OK)
+    return packet.data[0];
+
+  uint16_t chunk = finger.packet_len;
+  for (uint16_t pos=0; pos<length; pos+=chunk) {
+    uint16_t packetLength = min(chunk, (uint16_t)(length - pos));
+    writeDataPacket((pos + packetLength >= length) ? FINGERPRINT_ENDDATAPACKET : FINGERPRINT_DATAPACKET, data + pos, packetLength);
+  }
+  return finger.storeModel(id);
+}
+
+
+/* Adafruit_Fingerprint_Packet only holds 64 bytes, template data packets are up to 256 bytes long. So they are
+   written and parsed here directly. */
+void FingerprintManager::writeDataPacket(uint8_t type, const uint8_t *data, uint16_t length) {
+  uint16_t wireLength = length + 2;
+  uint8_t header[9] = {
+    (uint8_t)(FINGERPRINT_STARTCODE >> 8), (uint8_t)(FINGERPRINT_STARTCODE & 0xFF),
+    0xFF, 0xFF, 0xFF, 0xFF,
+    type, (uint8_t)(wireLength >> 8), (uint8_t)(wireLength & 0xFF)
+  };
+  uint16_t sum = type + (wireLength >> 8) + (wireLength & 0xFF);
+  for (uint16_t i=0; i<length; i++)
+    sum += data[i];
+  trace.write(header, sizeof(header));
+  trace.write(data, length);
+  trace.write((uint8_t)(sum >> 8));
+  trace.write((uint8_t)(sum & 0xFF));
+}
+
+uint8_t FingerprintManager::readDataPacket(uint8_t &type, uint8_t *data, uint16_t maxLength, uint16_t &length) {
+  uint8_t header[9];
+  uint16_t idx = 0;
+  uint16_t payloadLength = 0;
+  uint16_t sum = 0;
+  uint16_t receivedSum = 0;
+  unsigned long start = millis();
+
+  while (true) {
+    if (!trace.available()) {
+      if (millis() - start >= DEFAULTTIMEOUT)
+        return FINGERPRINT_TIMEOUT;
+      delay(1);
+      continue;
+    }
+    uint8_t c = trace.read();
+    if (idx < sizeof(header)) {
+      if ((idx == 0 && c != (FINGERPRINT_STARTCODE >> 8)) || (idx == 1 && c != (FINGERPRINT_STARTCODE & 0xFF))) {
+        idx = 0;
+        continue;
+      }
+      header[idx++] = c;
+      if (idx == sizeof(header)) {
+        type = header[6];
+        uint16_t wireLength = ((uint16_t)header[7] << 8) | header[8];
+        if (wireLength < 2 || wireLength - 2 > maxLength)
+          return FINGERPRINT_BADPACKET;
+        payloadLength = wireLength - 2;
+        sum = header[6] + header[7] + header[8];
+      }
+    } else if (idx < sizeof(header) + payloadLength) {
+      data[idx - sizeof(header)] = c;
+      sum += c;
+      idx++;
+    } else if (idx == sizeof(header) + payloadLength) {
+      receivedSum = (uint16_t)c << 8;
+      idx++;
+    } else {
+      receivedSum |= c;
+      length = payloadLength;
+      return (receivedSum == sum) ? FINGERPRINT_OK : FINGERPRINT_PACKETRECIEVEERR;
+    }
+  }
 }
 
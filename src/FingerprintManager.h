@@ -4,74 +4,274 @@
 #include <Adafruit_Fingerprint.h>
 #include <Preferences.h>
 #include "global.h"
-
-#define mySerial Serial1
+#include "ScanMetrics.h"
+#include "TemplatePipe.h"
+#include "FingerRegistry.h"
+#include "FingerListHtml.h"
+#include "UartTrace.h"
+#include "ScanPolicy.h"
+#include "FalseTouchDetector.h"
 
 #define FINGERPRINT_WRITENOTEPAD 0x18 // Write Notepad on sensor
 #define FINGERPRINT_READNOTEPAD 0x19 // Read Notepad from sensor
+#define FINGERPRINT_DOWNCHAR 0x09 // Download a template from the host into a char buffer
+#define FINGERPRINT_READINDEXTABLE 0x1F // Bitmap of the occupied template pages
+#define FINGERPRINT_AUTOIDENTIFY 0x32 // Capture, extract and search in one command (R503 and newer)
+#define FINGERPRINT_AUTOTIMEOUT 0x26 // AutoIdentify: no finger was placed within the sensor-side timeout
 
 
 /*
   By using the touch ring as an additional input to the image sensor the sensitivity is much higher for door bell ring events. Unfortunately
   we cannot differ between touches on the ring by fingers or rain drops, so rain on the ring will cause false alarms.
 */
-const int touchRingPin = 5;     // touch/wakeup pin connected to fingerprint sensor
+const int touchRingPin = 5;     // touch/wakeup pin connected to fingerprint sensor (first reader)
+
+/*
+  Most scans come from a handful of residents. The slots matched most often (the "hot set") are searched first with
+  a narrow start page/page count, the whole library is only searched if none of them matches.
+*/
+const int hotSetSize = 6;             // max. number of slots in the hot set
+const int hotSetMaxGap = 16;          // hot slots closer than this are searched with a single range
+const int matchCountSaveInterval = 20; // persist the match counters every n matches
+
+/*
+  The R503 can capture, extract and search a fingerprint in a single command (AutoIdentify). This saves two UART round
+  trips per scan pass and the sensor starts imaging as soon as the finger is placed. Sensors without this command are
+  scanned with the classic getImage -> image2Tz -> search sequence.
+*/
+enum class ScanEngine { threeStep, autoIdentify };
+const unsigned long autoIdentifyTimeoutMillis = 3000; // host-side wait for the final AutoIdentify reply (includes waiting for the finger)
+const uint16_t autoIdentifyMaxHotPage = 32; // saved round trips are worth about this many searched pages
+const int scanMaxLinkErrors = 2; // communication errors (each can be a timeout) before a scan gives up and returns
+
+/*
+  State a scan pass depends on besides the UART, written into a running UART trace before the first scan pass and
+  again whenever it changed (at the latest every traceStateIntervalMillis, the ring may have dropped the older one).
+  A replay restores it before it feeds the recorded replies to the scan passes. Encoding (big endian): uint32 baud
+  rate, uint16 capacity, uint16 packet length, uint8 security level, uint8 scan engine, uint8 flags (traceFlag*),
+  uint8 failed AutoIdentify commands, uint8 number of hot ranges, hotSetSize x (uint16 start page, uint16 page count)
+*/
+const size_t traceStateLength = 13 + hotSetSize * 4;
+const unsigned long traceStateIntervalMillis = 60000;
+const uint8_t traceFlagIgnoreTouchRing = 0x01; // set by setIgnoreTouchRing() or suppressed by the false touch detection
+const uint8_t traceFlagAutoIdentifySupported = 0x02;
+const uint8_t traceFlagFingerOnSensor = 0x04; // lastTouchState, also part of every scanStart record
 
 enum class ScanResult { noFinger, matchFound, noMatchFound, error };
-enum class EnrollResult { ok, error };
+enum class EnrollResult { ok, error, running, cancelled, timeout };
+
+/*
+  An enrollment runs step by step in the sensor task (continueEnroll()), so commands, the LED ring and cancelEnroll()
+  are still served while the user places and lifts the finger. While waiting, the sensor is polled every
+  enrollPollMillis instead of sending getImage back to back.
+*/
+const uint8_t enrollSamples = 5; // as stated in R503 documentation up to 6 combined image samples possible, but I got an communication error when trying more than 5 samples, so dont go >5
+const uint32_t enrollPollMillis = 50;
+const unsigned long enrollFingerTimeoutMillis = 30000; // per sample, until the finger is placed
+const unsigned long enrollLiftTimeoutMillis = 15000;   // until the finger is lifted after a sample
 
 struct Match {
+  uint8_t readerId = 0;
   ScanResult scanResult = ScanResult::noFinger;
   uint16_t matchId = 0;
-  String matchName = "unknown";
+  char matchName[fingerNameMaxLength + 1] = "unknown";
   uint16_t matchConfidence = 0;
   uint8_t returnCode = 0;
 };
 
+struct PageRange {
+  uint16_t start = 0;
+  uint16_t count = 0;
+};
+
 struct NewFinger {
   EnrollResult enrollResult = EnrollResult::error;
   uint8_t returnCode = 0;
 };
 
+// UART/matching parameters of the sensor that can be changed at runtime (SetSysPara)
+struct SensorLinkSettings {
+  uint32_t baudRate = 57600;  // 9600 * N, N = 1..12
+  uint16_t packetLength = 128; // 32, 64, 128 or 256 bytes per data packet
+  uint8_t securityLevel = 3;   // 1..5
+};
+
+// latency between the touch ring edge (interrupt) and the first getImage command of the following scan
+struct TouchLatencyStats {
+  unsigned long count = 0;
+  unsigned long lastMicros = 0;
+  unsigned long maxMicros = 0;
+  unsigned long long totalMicros = 0;
+};
+
+// average round trip times of the single scan stages in microseconds
+struct LinkTimings {
+  unsigned long getImage = 0;
+  unsigned long image2Tz = 0;
+  unsigned long fingerSearch = 0;
+  unsigned long ledControl = 0;
+};
+
 class FingerprintManager {       
   private:
-    Adafruit_Fingerprint finger = Adafruit_Fingerprint(&mySerial);
+    uint8_t readerId;
+    HardwareSerial &serialPort;
+    int touchPin;
+    int8_t rxPin;
+    int8_t txPin;
+    char namesNamespace[16]; // preferences of this reader: "fingerList"/"fingerStats" for the first one, then with the reader id appended
+    char statsNamespace[16];
+    UartTrace trace; // transport of finger and our own raw commands
+    Adafruit_Fingerprint finger;
     bool lastTouchState = false;
-    String fingerList[201];
-    int fingerCountOnSensor = 0;
+    FingerRegistry fingers; // names and match counters of the enrolled slots
+    bool fingerListDirty = false; // names changed since they were saved to the preferences
+    FingerListHtml fingerListHtml;
+    SemaphoreHandle_t fingersMutex = NULL; // registry changes (sensor task) against API reads (web server)
     bool ignoreTouchRing = false; // set to true when the sensor is usually exposed to rain to avoid false ring events. Can also be set conditional by a rain sensor over MQTT
     bool lastIgnoreTouchRing = false;
+    FalseTouchDetector falseTouches; // suppresses the ring automatically while it rains
+    bool falseTouchDetection = true;
+    bool ringEdgePass = false;       // the scan pass was started by (or, while suppressed, saw) an edge of the ring
+    bool ringEdgePending = false;    // suppressed: an edge waits for a finger up to falseTouchFingerGraceMillis
+    unsigned long ringEdgeMillis = 0;
+    bool scanSawFinger = false;      // a pass of the last scan converted an image or searched it, whatever it ended with
+    uint32_t baudRate = 57600;
+    volatile bool touchEdgeDetected = false; // set by interrupt, the touch signal is only a short pulse and easily missed by polling
+    volatile unsigned long touchEdgeMicros = 0;
+    SemaphoreHandle_t touchSemaphore = NULL;
+    bool touchLatencyPending = false;
+    unsigned long pendingEdgeMicros = 0;
+    TouchLatencyStats touchLatency;
+    ScanMetrics metrics;
+    unsigned long decisionStartMicros = 0; // start of the current touch, 0 = no touch pending
+    PageRange hotRanges[hotSetSize];
+    int hotRangeCount = 0;
+    uint16_t hotSetEnd = 0; // first page behind the highest hot range
+    int matchesSinceSave = 0;
+    uint16_t *matchCountPairs = nullptr; // (id, count) pairs for saveMatchCounts(), kept to not allocate on every save
+    uint16_t matchCountPairsAllocated = 0;
+    ScanEngine scanEngine = ScanEngine::threeStep;
+    bool autoIdentifySupported = false;
+    int autoIdentifyErrors = 0; // consecutive failed AutoIdentify commands
+    uint32_t linkGeneration = 0; // see getLinkGeneration()
+    bool enrolling = false;
+    EnrollState enrollState = EnrollState::waitForFinger;
+    uint16_t enrollId = 0;
+    char enrollName[fingerNameMaxLength + 1] = "";
+    uint8_t enrollSample = 1;
+    unsigned long enrollStepStart = 0;
+    volatile bool enrollCancelRequested = false;
+    bool traceScanOpen = false; // a scanStart record was written, the decision follows at the end of the pass
+    bool traceStatePending = false;
+    uint8_t tracedState[traceStateLength];
+    unsigned long tracedStateMillis = 0;
+    ScanPolicy scanPolicy;
+    ScanLimits scanLimits; // of the scan pass that is running
+    bool scanAfterMatch = false; // last pass found a match, the next one tells the policy if the finger is still there
+    uint16_t lastMatchedId = 0;  // finger of the last pass if it found a match, 0 otherwise
     
+    static void onTouchRingEdge(void *arg);
+    void beginTouchInput();
+    void traceScanStart(TraceTouch touch);
+    void traceDecision(const Match &match);
     void updateTouchState(bool touched);
+    bool isTouchRingIgnored();
+    void classifyTouch(const Match &match);
+    Match scanPasses();
+    Match autoIdentifyScan(bool &anotherScan);
+    uint8_t autoIdentify(uint16_t &id, uint16_t &score);
+    bool probeAutoIdentify();
+    void recordTouchLatency();
+    void startEnrollSample();
+    NewFinger storeEnrolledModel();
+    NewFinger finishEnroll(EnrollResult result, uint8_t returnCode);
+    uint8_t ledControl(uint8_t control, uint8_t speed, uint8_t coloridx);
+    uint8_t searchDatabase();
+    uint8_t searchRange(uint16_t startPage, uint16_t pageCount);
+    uint8_t receiveAck(Adafruit_Fingerprint_Packet &packet, uint16_t timeout = DEFAULTTIMEOUT);
+    uint8_t getImage();
+    uint8_t image2Tz(uint8_t slot = 1);
+    void discardInput();
+    void countMatch(uint16_t id);
+    void updateHotRanges();
+    void loadMatchCounts();
+    void saveMatchCounts();
     bool isRingTouched();
     void loadFingerListFromPrefs();
+    void setFingerName(uint16_t id, const char *name, bool notify = true);
+    void removeFingerName(uint16_t id);
+    void lockFingers();
+    void unlockFingers();
     void disconnect();
+    bool probeBaudRate();
+    uint8_t readIndexTable(uint8_t *bitmap, uint16_t size);
+    uint8_t uploadTemplate(uint16_t id, uint8_t *data, uint16_t maxLength, uint16_t &length);
+    uint8_t downloadTemplate(uint16_t id, const uint8_t *data, uint16_t length);
+    void writeDataPacket(uint8_t type, const uint8_t *data, uint16_t length);
+    uint8_t readDataPacket(uint8_t &type, uint8_t *data, uint16_t maxLength, uint16_t &length);
     uint8_t writeNotepad(uint8_t pageNumber, const char *text, uint8_t length);
     uint8_t readNotepad(uint8_t pageNumber, char *text, uint8_t length);
     
 
 
   public:
+    // one instance per reader; rxPin/txPin < 0 keep the default pins of the UART
+    FingerprintManager(uint8_t readerId = 0, HardwareSerial &serial = Serial1, int touchPin = touchRingPin, int8_t rxPin = -1, int8_t txPin = -1);
+    ~FingerprintManager();
+    uint8_t getReaderId() { return readerId; }
     bool connected;
-    bool connect();
+    bool connect(uint32_t baudRate = 57600);
     Match scanFingerprint();
-    NewFinger enrollFinger(int id, String name);
-    void deleteFinger(int id);
+    bool beginEnroll(int id, const char *name); // false if an enrollment is already running
+    NewFinger continueEnroll();  // one step, waits at most enrollPollMillis. enrollResult is running until it is done
+    void cancelEnroll();         // any task, ends the enrollment on its next step
+    bool isEnrolling();
+    bool deleteFinger(int id);
     void renameFinger(int id, String newName);
+    bool saveFingerList(bool removeOtherKeys = false);
+    const FingerRegistry& getFingers();
     String getFingerListAsHtmlOptionList();
+    void printFingerListJson(Print &out, uint16_t offset, uint16_t limit);
+    bool printFingerJson(Print &out, int id);
+    uint16_t getCapacity();
+    bool isValidFingerId(int id);
     void setIgnoreTouchRing(bool state);
+    void setFalseTouchDetection(bool enabled); // on by default, off also ends a suppression
+    bool isTouchRingSuppressed();              // by the false touch detection (rain), not by setIgnoreTouchRing()
     bool isFingerOnSensor();
+    bool waitForTouch(uint32_t timeoutMillis);
+    void wakeUp();
+    TouchLatencyStats getTouchLatencyStats();
+    const ScanMetrics& getMetrics();
+    ScanEngine getScanEngine();
+    bool setScanEngine(ScanEngine engine);
     void setLedRingError();
     void setLedRingReady();
-    String getPairingCode();
+    void setLedRing(uint8_t control, uint8_t speed, uint8_t coloridx); // FINGERPRINT_LED_* control code and color
+    bool getPairingCode(char *code); // code needs pairingCodeLength + 1 bytes, false (and empty) if the notepad can't be read
     bool setPairingCode(String pairingCode);
+    uint32_t getLinkGeneration(); // changes with every (re)connect and communication error, i.e. whenever the sensor could have been exchanged
+    ScanPolicy& getScanPolicy();  // pass limits and the cooldown after a match
+
+    // UART trace (capture mode of the sensor transport)
+    bool startTrace(size_t size = uartTraceDefaultSize);
+    void stopTrace();
+    UartTrace& getTrace();
+    size_t getTraceState(uint8_t *state); // state needs traceStateLength bytes
+    bool restoreTraceState(const uint8_t *state, size_t length); // replay: takes the state instead of connect()
     
     bool deleteAll();
 
+    // sensor link tuning
+    SensorLinkSettings getLinkSettings();
+    bool applyLinkSettings(SensorLinkSettings settings);
+    LinkTimings measureLinkTimings(int samples = 5);
+    
     
-    // functions for sensor replacement
-    void exportSensorDB();
-    void importSensorDB();
+    // functions for sensor replacement, templates are streamed through the pipe one by one
+    bool exportSensorDB(TemplatePipe &pipe);
+    bool importSensorDB(TemplatePipe &pipe);
 
 };
 
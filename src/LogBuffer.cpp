@@ -0,0 +1,84 @@
+#include "LogBuffer.h"
+#include <new>
+
+bool LogBuffer::begin(uint16_t arenaSize, uint16_t maxMessages) {
+  if (arena != nullptr)
+    return true;
+  if (arenaSize < sizeof(Header) + logMessageMaxLength || maxMessages == 0)
+    return false;
+  arena = new (std::nothrow) uint8_t[arenaSize];
+  offsets = new (std::nothrow) uint16_t[maxMessages];
+  if (arena == nullptr || offsets == nullptr) {
+    delete[] arena;
+    delete[] offsets;
+    arena = nullptr;
+    offsets = nullptr;
+    return false;
+  }
+  this->arenaSize = arenaSize;
+  this->maxMessages = maxMessages;
+  return true;
+}
+
+void LogBuffer::evict(uint16_t start, uint16_t end) {
+  // the oldest message is always the next one behind writePos, so the overlapping ones are dropped in order
+  while (firstSeq <= lastSeq) {
+    uint16_t offset = offsets[firstSeq % maxMessages];
+    if (offset >= end || offset + sizeof(Header) + arena[offset + offsetof(Header, length)] <= start)
+      break;
+    firstSeq++;
+  }
+}
+
+uint32_t LogBuffer::add(const char *message) {
+  if (arena == nullptr)
+    return 0;
+  Header header;
+  header.length = strnlen(message, logMessageMaxLength);
+  header.millis = millis();
+  uint16_t size = sizeof(Header) + header.length;
+  portENTER_CRITICAL(&mux);
+  if (writePos + size > arenaSize) { // no room for it at the end, the messages there are the oldest ones
+    evict(writePos, arenaSize);
+    writePos = 0;
+  }
+  evict(writePos, writePos + size);
+  if (lastSeq - firstSeq + 1 >= maxMessages)
+    firstSeq++;
+  header.seq = ++lastSeq;
+  offsets[header.seq % maxMessages] = writePos;
+  memcpy(arena + writePos, &header, sizeof(Header));
+  memcpy(arena + writePos + sizeof(Header), message, header.length);
+  writePos += size;
+  portEXIT_CRITICAL(&mux);
+  return header.seq;
+}
+
+bool LogBuffer::get(uint32_t seq, LogEntry &entry) {
+  if (arena == nullptr || seq == 0)
+    return false;
+  portENTER_CRITICAL(&mux);
+  bool found = (seq >= firstSeq && seq <= lastSeq);
+  if (found) {
+    Header header;
+    uint16_t offset = offsets[seq % maxMessages];
+    memcpy(&header, arena + offset, sizeof(Header));
+    entry.seq = header.seq;
+    entry.millis = header.millis;
+    memcpy(entry.text, arena + offset + sizeof(Header), header.length);
+    entry.text[header.length] = '\0';
+  }
+  portEXIT_CRITICAL(&mux);
+  return found;
+}
+
+uint32_t LogBuffer::getFirstSeq() {
+  portENTER_CRITICAL(&mux);
+  uint32_t first = (lastSeq != 0) ? firstSeq : 0;
+  portEXIT_CRITICAL(&mux);
+  return first;
+}
+
+uint32_t LogBuffer::getLastSeq() {
+  return lastSeq;
+}
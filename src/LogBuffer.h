@@ -0,0 +1,47 @@
+#ifndef LOGBUFFER_H
+#define LOGBUFFER_H
+
+#include <Arduino.h>
+
+/*
+  Log messages for the web UI, allocated once. The texts are stored with their length one after the other in a ring
+  of fixed size (the arena), so short messages take little room and the number of messages kept depends on their
+  length, up to maxMessages. Every message gets a sequence number (starting at 1) that is used as SSE event id, so a
+  reconnecting browser can be served everything after the last message it has seen. Longer messages are truncated.
+*/
+
+const size_t logMessageMaxLength = 255;
+
+struct LogEntry {
+  uint32_t seq = 0;
+  unsigned long millis = 0;
+  char text[logMessageMaxLength + 1] = "";
+};
+
+class LogBuffer {
+  public:
+    bool begin(uint16_t arenaSize, uint16_t maxMessages);
+    uint32_t add(const char *message);     // returns the sequence number of the message
+    bool get(uint32_t seq, LogEntry &entry); // copy of the entry, false if it was overwritten or does not exist yet
+    uint32_t getFirstSeq();                // oldest message still in the buffer, 0 if empty
+    uint32_t getLastSeq();                 // newest message, 0 if empty
+
+  private:
+    struct Header {                        // in front of each text in the arena, the text is not terminated
+      uint32_t seq;
+      uint32_t millis;
+      uint8_t length;
+    };
+    void evict(uint16_t start, uint16_t end); // drops the oldest messages while they overlap start..end of the arena
+
+    uint8_t *arena = nullptr;
+    uint16_t *offsets = nullptr;           // arena offset of each message kept, by seq % maxMessages
+    uint16_t arenaSize = 0;
+    uint16_t maxMessages = 0;
+    uint16_t writePos = 0;
+    uint32_t firstSeq = 1;
+    uint32_t lastSeq = 0;
+    portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED; // messages are added by the sensor task and the web server
+};
+
+#endif
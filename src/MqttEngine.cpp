@@ -0,0 +1,459 @@
+#include "MqttEngine.h"
+
+// MQTT 3.1.1 control packet types (upper nibble of the fixed header)
+#define MQTT_CONNECT     0x10
+#define MQTT_CONNACK     0x20
+#define MQTT_PUBLISH     0x30
+#define MQTT_PUBACK      0x40
+#define MQTT_SUBSCRIBE   0x82 // with the reserved flags 0010
+#define MQTT_SUBACK      0x90
+#define MQTT_PINGREQ     0xC0
+#define MQTT_PINGRESP    0xD0
+#define MQTT_DISCONNECT  0xE0
+
+static const size_t txHeaderSpace = 5; // packets are built behind the space for the largest fixed header
+
+// uint16 length + string, false if it does not fit
+static bool putString(uint8_t *buffer, size_t &pos, const char *text, size_t length) {
+  if (pos + 2 + length > mqttPacketMaxSize)
+    return false;
+  buffer[pos++] = length >> 8;
+  buffer[pos++] = length & 0xFF;
+  memcpy(&buffer[pos], text, length);
+  pos += length;
+  return true;
+}
+
+MqttEngine::~MqttEngine() {
+  if (mutex != NULL)
+    vSemaphoreDelete(mutex);
+  if (work != NULL)
+    vSemaphoreDelete(work);
+}
+
+bool MqttEngine::begin(Client &client, const char *host, uint16_t port, const char *clientId, const char *username,
+    const char *password, const char *willTopic, const char *willMessage) {
+  if (mutex == NULL) {
+    mutex = xSemaphoreCreateMutex();
+    work = xSemaphoreCreateBinary();
+    if (mutex == NULL || work == NULL)
+      return false;
+  }
+  this->client = &client;
+  this->host = host;
+  this->port = port;
+  this->clientId = clientId;
+  this->username = username;
+  this->password = password;
+  this->willTopic = willTopic;
+  this->willMessage = willMessage;
+  stopRequested = false;
+  backoffMillis = mqttBackoffMinMillis;
+  retryAt = millis();
+  state = MqttState::waiting; // first attempt right away
+  return true;
+}
+
+void MqttEngine::setCallbacks(MqttMessageCallback onMessage, MqttStateCallback onStateChange) {
+  this->onMessage = onMessage;
+  this->onStateChange = onStateChange;
+}
+
+void MqttEngine::setMaxInflight(uint8_t maxInflight) {
+  this->maxInflight = constrain(maxInflight, 1, mqttQueueDepth);
+}
+
+bool MqttEngine::subscribe(const char *topic) {
+  if (subscriptionCount >= mqttMaxSubscriptions)
+    return false;
+  subscriptions[subscriptionCount++] = topic;
+  if (state == MqttState::connected)
+    subscribePending = true; // all of them again, SUBSCRIBE is idempotent
+  return true;
+}
+
+
+bool MqttEngine::publish(const char *topic, const char *payload, uint8_t qos, bool priority) {
+  if (mutex == NULL)
+    return false;
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  // queue full: make room by dropping the oldest waiting message that is not more important (QoS 0 before QoS 1,
+  // priority ones last), otherwise the new one is dropped
+  uint8_t rank = (priority ? 2 : 0) + (qos > 0 ? 1 : 0);
+  Message *slot = nullptr;
+  Message *victim = nullptr;
+  for (Message &message : messages) {
+    if (!message.used) {
+      slot = &message;
+      break;
+    }
+    uint8_t messageRank = (message.priority ? 2 : 0) + message.qos;
+    if (message.inflight || messageRank > rank)
+      continue;
+    uint8_t victimRank = victim ? (victim->priority ? 2 : 0) + victim->qos : 0;
+    if (victim == nullptr || messageRank < victimRank
+        || (messageRank == victimRank && (int32_t)(message.order - victim->order) < 0))
+      victim = &message;
+  }
+  if (slot == nullptr) {
+    stats.dropped++;
+    slot = victim;
+  }
+  if (slot != nullptr) {
+    slot->topic = topic;
+    slot->length = min(strlcpy(slot->payload, payload, sizeof(slot->payload)), mqttPayloadMaxLength);
+    slot->qos = min(qos, (uint8_t)1);
+    slot->priority = priority;
+    slot->used = true;
+    slot->inflight = false;
+    slot->dup = false;
+    slot->order = nextOrder++;
+  }
+  xSemaphoreGive(mutex);
+  xSemaphoreGive(work);
+  return slot != nullptr;
+}
+
+uint8_t MqttEngine::queued() {
+  if (mutex == NULL)
+    return 0;
+  uint8_t count = 0;
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  for (const Message &message : messages)
+    count += message.used;
+  xSemaphoreGive(mutex);
+  return count;
+}
+
+bool MqttEngine::wait(TickType_t ticksToWait) {
+  if (work == NULL)
+    return false;
+  return xSemaphoreTake(work, ticksToWait) == pdTRUE;
+}
+
+void MqttEngine::stop() {
+  stopRequested = true;
+  if (work != NULL)
+    xSemaphoreGive(work);
+}
+
+
+void MqttEngine::loop() {
+  if (client == nullptr)
+    return;
+  if (stopRequested) {
+    if (state == MqttState::connected) {
+      sendQueued(); // e.g. the last log message before a reboot
+      sendPacket(MQTT_DISCONNECT, 0);
+    }
+    if (state != MqttState::stopped)
+      client->stop();
+    state = MqttState::stopped;
+    return;
+  }
+
+  unsigned long now = millis();
+  switch (state) {
+  case MqttState::waiting:
+    if ((long)(now - retryAt) >= 0)
+      connect();
+    break;
+  case MqttState::connecting:
+    if (!client->connected()) {
+      connectionLost(-2);
+      break;
+    }
+    receive();
+    if (state == MqttState::connecting && now - connectStart >= mqttConnackTimeoutMillis)
+      connectionLost(-2);
+    break;
+  case MqttState::connected:
+    if (!client->connected()) {
+      connectionLost(-3);
+      break;
+    }
+    receive();
+    if (state != MqttState::connected)
+      break;
+    sendQueued(); // before the subscriptions, the match is the first thing sent after a reconnect
+    if (subscribePending && state == MqttState::connected) {
+      subscribePending = false;
+      for (uint8_t i=0; i<subscriptionCount; i++)
+        sendSubscribe(subscriptions[i]);
+    }
+    // keep alive: a PINGREQ if nothing was sent for a while, the connection is dead if it is not answered
+    now = millis();
+    if (state == MqttState::connected) {
+      if (pingPending && now - pingSent >= mqttKeepAliveSeconds * 1000ul) {
+        connectionLost(-3);
+      } else if (!pingPending && now - lastSend >= mqttKeepAliveSeconds * 1000ul) {
+        pingPending = true;
+        pingSent = now;
+        sendPacket(MQTT_PINGREQ, 0);
+      }
+    }
+    break;
+  case MqttState::stopped:
+  case MqttState::refused:
+    break;
+  }
+}
+
+void MqttEngine::connect() {
+  stats.connectAttempts++;
+  // resolves the hostname on every attempt, a changed address of the broker is picked up with the next reconnect
+  if (!client->connect(host.c_str(), port)) {
+    scheduleRetry(-1);
+    return;
+  }
+
+  size_t pos = txHeaderSpace;
+  static const uint8_t protocol[] = { 0x00, 0x04, 'M', 'Q', 'T', 'T', 0x04 };
+  memcpy(&tx[pos], protocol, sizeof(protocol));
+  pos += sizeof(protocol);
+  uint8_t flags = 0x02; // clean session
+  if (!willTopic.isEmpty())
+    flags |= 0x04 | 0x08; // will, QoS 1
+  bool credentials = !username.isEmpty() && !password.isEmpty();
+  if (credentials)
+    flags |= 0x80 | 0x40;
+  tx[pos++] = flags;
+  tx[pos++] = mqttKeepAliveSeconds >> 8;
+  tx[pos++] = mqttKeepAliveSeconds & 0xFF;
+  bool fits = putString(tx, pos, clientId.c_str(), clientId.length());
+  if (!willTopic.isEmpty()) {
+    fits = fits && putString(tx, pos, willTopic.c_str(), willTopic.length());
+    fits = fits && putString(tx, pos, willMessage.c_str(), willMessage.length());
+  }
+  if (credentials) {
+    fits = fits && putString(tx, pos, username.c_str(), username.length());
+    fits = fits && putString(tx, pos, password.c_str(), password.length());
+  }
+
+  rxStage = 0;
+  pingPending = false;
+  subscribePending = false;
+  connectStart = millis();
+  state = MqttState::connecting;
+  if (!fits || !sendPacket(MQTT_CONNECT, pos - txHeaderSpace))
+    connectionLost(-1);
+}
+
+void MqttEngine::connectionLost(int code) {
+  // QoS 1 messages without PUBACK are sent again after the reconnect
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  for (Message &message : messages) {
+    if (message.used && message.inflight) {
+      message.inflight = false;
+      message.dup = true;
+    }
+  }
+  xSemaphoreGive(mutex);
+  scheduleRetry(code);
+}
+
+void MqttEngine::scheduleRetry(int code) {
+  client->stop();
+  unsigned long delayMillis = backoffMillis + esp_random() % (backoffMillis / 4 + 1); // jitter, not all clients of a restarted broker at once
+  backoffMillis = min(backoffMillis * 2, mqttBackoffMaxMillis);
+  retryAt = millis() + delayMillis;
+  state = MqttState::waiting;
+  if (onStateChange)
+    onStateChange(MqttState::waiting, code, delayMillis);
+}
+
+
+void MqttEngine::receive() {
+  while (client->available() > 0 && (state == MqttState::connecting || state == MqttState::connected)) {
+    int c = client->read();
+    if (c < 0)
+      break;
+    switch (rxStage) {
+    case 0:
+      rxHeader = c;
+      rxLength = 0;
+      rxShift = 0;
+      rxStage = 1;
+      break;
+    case 1:
+      rxLength |= (uint32_t)(c & 0x7F) << rxShift;
+      rxShift += 7;
+      if (c & 0x80) {
+        if (rxShift > 21) {
+          connectionLost(-3); // malformed remaining length
+          return;
+        }
+      } else if (rxLength == 0) {
+        rxStage = 0;
+        handlePacket();
+      } else {
+        rxPos = 0;
+        rxStage = 2;
+      }
+      break;
+    case 2:
+      if (rxPos < sizeof(rx))
+        rx[rxPos] = c;
+      if (++rxPos == rxLength) {
+        rxStage = 0;
+        if (rxLength <= sizeof(rx))
+          handlePacket(); // larger packets are skipped
+      }
+      break;
+    }
+  }
+}
+
+void MqttEngine::handlePacket() {
+  switch (rxHeader & 0xF0) {
+  case MQTT_CONNACK:
+    if (state != MqttState::connecting || rxLength < 2)
+      break;
+    if (rx[1] == 0) {
+      state = MqttState::connected;
+      stats.connects++;
+      backoffMillis = mqttBackoffMinMillis;
+      lastSend = millis();
+      subscribePending = (subscriptionCount > 0);
+      if (onStateChange)
+        onStateChange(MqttState::connected, 0, 0);
+    } else if (rx[1] == 4 || rx[1] == 5) {
+      client->stop();
+      state = MqttState::refused;
+      if (onStateChange)
+        onStateChange(MqttState::refused, rx[1], 0);
+    } else {
+      connectionLost(rx[1]);
+    }
+    break;
+  case MQTT_PUBLISH: {
+    uint8_t qos = (rxHeader >> 1) & 0x03;
+    if (rxLength < 2)
+      break;
+    size_t topicLength = (rx[0] << 8) | rx[1];
+    size_t pos = 2 + topicLength + (qos > 0 ? 2 : 0);
+    if (pos > rxLength)
+      break;
+    char topic[128];
+    if (onMessage && topicLength < sizeof(topic)) {
+      memcpy(topic, &rx[2], topicLength);
+      topic[topicLength] = 0;
+      onMessage(topic, &rx[pos], rxLength - pos);
+    }
+    if (qos == 1) {
+      tx[txHeaderSpace] = rx[2 + topicLength];
+      tx[txHeaderSpace + 1] = rx[3 + topicLength];
+      sendPacket(MQTT_PUBACK, 2);
+    }
+    break;
+  }
+  case MQTT_PUBACK: {
+    if (rxLength < 2)
+      break;
+    uint16_t packetId = (rx[0] << 8) | rx[1];
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    for (Message &message : messages) {
+      if (message.used && message.inflight && message.packetId == packetId) {
+        message.used = false;
+        stats.acknowledged++;
+        break;
+      }
+    }
+    xSemaphoreGive(mutex);
+    break;
+  }
+  case MQTT_PINGRESP:
+    pingPending = false;
+    break;
+  default:
+    break; // SUBACK, nothing to do
+  }
+}
+
+
+// oldest waiting message, priority ones first
+MqttEngine::Message* MqttEngine::nextToSend() {
+  Message *next = nullptr;
+  for (Message &message : messages) {
+    if (!message.used || message.inflight)
+      continue;
+    if (next == nullptr || (message.priority && !next->priority)
+        || (message.priority == next->priority && (int32_t)(message.order - next->order) < 0))
+      next = &message;
+  }
+  return next;
+}
+
+void MqttEngine::sendQueued() {
+  for (;;) {
+    // the packet is built under the lock, publish() may reuse the slot as soon as it is no longer waiting
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    uint8_t inflight = 0;
+    for (const Message &message : messages)
+      inflight += (message.used && message.inflight);
+    Message *message = nextToSend();
+    if (message == nullptr || (message->qos > 0 && inflight >= maxInflight)) {
+      xSemaphoreGive(mutex);
+      return;
+    }
+    size_t pos = txHeaderSpace;
+    size_t topicLength = strlen(message->topic);
+    putString(tx, pos, message->topic, topicLength);
+    uint8_t header = MQTT_PUBLISH | (message->qos << 1) | (message->dup ? 0x08 : 0);
+    if (message->qos > 0) {
+      if (message->packetId == 0 || !message->dup)
+        message->packetId = takePacketId();
+      tx[pos++] = message->packetId >> 8;
+      tx[pos++] = message->packetId & 0xFF;
+    }
+    size_t length = min((size_t)message->length, mqttPacketMaxSize - pos);
+    memcpy(&tx[pos], message->payload, length);
+    pos += length;
+    if (message->qos > 0)
+      message->inflight = true;
+    else
+      message->used = false;
+    xSemaphoreGive(mutex);
+
+    stats.published++;
+    if (!sendPacket(header, pos - txHeaderSpace)) {
+      connectionLost(-3);
+      return;
+    }
+  }
+}
+
+bool MqttEngine::sendSubscribe(const char *topic) {
+  size_t pos = txHeaderSpace;
+  uint16_t packetId = takePacketId();
+  tx[pos++] = packetId >> 8;
+  tx[pos++] = packetId & 0xFF;
+  if (!putString(tx, pos, topic, strlen(topic)) || pos >= mqttPacketMaxSize)
+    return false;
+  tx[pos++] = 1; // QoS 1
+  return sendPacket(MQTT_SUBSCRIBE, pos - txHeaderSpace);
+}
+
+// writes the fixed header in front of the packet at tx[txHeaderSpace] and sends it
+bool MqttEngine::sendPacket(uint8_t header, size_t length) {
+  uint8_t lengthBytes[4];
+  uint8_t count = 0;
+  size_t remaining = length;
+  do {
+    uint8_t digit = remaining & 0x7F;
+    remaining >>= 7;
+    lengthBytes[count++] = digit | (remaining > 0 ? 0x80 : 0);
+  } while (remaining > 0 && count < 4);
+  size_t start = txHeaderSpace - 1 - count;
+  tx[start] = header;
+  memcpy(&tx[start + 1], lengthBytes, count);
+  size_t total = 1 + count + length;
+  lastSend = millis();
+  return client->write(&tx[start], total) == total;
+}
+
+uint16_t MqttEngine::takePacketId() {
+  if (nextPacketId == 0)
+    nextPacketId = 1; // 0 is not a valid packet id
+  return nextPacketId++;
+}
@@ -0,0 +1,129 @@
+#ifndef MQTTENGINE_H
+#define MQTTENGINE_H
+
+#include <Arduino.h>
+#include <Client.h>
+
+/*
+  MQTT 3.1.1 client that runs in its own task, so neither the scan loop nor the doorbell ever wait for the network.
+  publish() only copies the message into a bounded outbound queue. loop() (MQTT task) does everything that blocks:
+  the broker hostname is resolved again by every connect attempt, failed attempts back off exponentially (with
+  jitter), QoS 1 publishes are pipelined (several in flight, removed on PUBACK, sent again with DUP after a
+  reconnect). Priority messages (the match) are sent before everything else that is waiting.
+*/
+
+const uint8_t mqttQueueDepth = 16;             // outbound messages waiting or in flight
+const uint8_t mqttMaxInflight = 4;             // QoS 1 publishes sent without waiting for their PUBACK
+const uint8_t mqttMaxSubscriptions = 4;
+const size_t mqttPayloadMaxLength = 255;
+const size_t mqttPacketMaxSize = 512;          // largest packet sent or received, bigger incoming ones are skipped
+const uint16_t mqttKeepAliveSeconds = 15;
+const unsigned long mqttConnackTimeoutMillis = 5000;
+const unsigned long mqttBackoffMinMillis = 1000;
+const unsigned long mqttBackoffMaxMillis = 60000;
+const unsigned long mqttPollMillis = 20;       // wait() timeout of the MQTT task, how often the socket is read
+
+enum class MqttState { stopped, waiting, connecting, connected, refused };
+
+struct MqttStats {
+  unsigned long connectAttempts = 0;
+  unsigned long connects = 0;
+  unsigned long published = 0;   // written to the socket, QoS 1 resends included
+  unsigned long acknowledged = 0;
+  unsigned long dropped = 0;     // queue full
+};
+
+typedef void (*MqttMessageCallback)(const char *topic, const uint8_t *payload, unsigned int length);
+// connected, waiting after a failed attempt or a lost connection (code: CONNACK return code, -1 = no TCP connection,
+// -2 = no CONNACK, -3 = connection lost), refused (bad credentials or not authorized, no more attempts)
+typedef void (*MqttStateCallback)(MqttState state, int code, unsigned long retryMillis);
+
+class MqttEngine {
+  public:
+    ~MqttEngine();
+    // strings are copied, the client is only used by loop()
+    bool begin(Client &client, const char *host, uint16_t port, const char *clientId, const char *username,
+      const char *password, const char *willTopic, const char *willMessage);
+    void setCallbacks(MqttMessageCallback onMessage, MqttStateCallback onStateChange);
+    void setMaxInflight(uint8_t maxInflight);
+    bool subscribe(const char *topic); // QoS 1, renewed on every connect, topic must stay valid
+
+    // any task, never blocks; the topic must stay valid until the message is sent. false if it was dropped.
+    bool publish(const char *topic, const char *payload, uint8_t qos = 0, bool priority = false);
+
+    // MQTT task
+    void loop();
+    bool wait(TickType_t ticksToWait);  // sleeps until something was published or the timeout for polling the socket
+    void stop();                        // any task: DISCONNECT on the next loop(), no reconnects after that
+
+    MqttState getState() { return state; }
+    bool connected() { return state == MqttState::connected; }
+    uint8_t queued();
+    MqttStats getStats() { return stats; }
+
+  private:
+    struct Message {
+      const char *topic = nullptr;
+      char payload[mqttPayloadMaxLength + 1];
+      uint16_t length = 0;
+      uint8_t qos = 0;
+      bool priority = false;
+      bool used = false;
+      bool inflight = false;
+      bool dup = false;
+      uint16_t packetId = 0;
+      uint32_t order = 0;
+    };
+
+    Client *client = nullptr;
+    String host;
+    uint16_t port = 1883;
+    String clientId;
+    String username;
+    String password;
+    String willTopic;
+    String willMessage;
+    const char *subscriptions[mqttMaxSubscriptions];
+    uint8_t subscriptionCount = 0;
+    MqttMessageCallback onMessage = nullptr;
+    MqttStateCallback onStateChange = nullptr;
+
+    Message messages[mqttQueueDepth];
+    uint32_t nextOrder = 0;
+    uint8_t maxInflight = mqttMaxInflight;
+    uint16_t nextPacketId = 1;
+    SemaphoreHandle_t mutex = NULL;
+    SemaphoreHandle_t work = NULL;
+    MqttStats stats;
+
+    volatile MqttState state = MqttState::stopped;
+    volatile bool stopRequested = false;
+    unsigned long backoffMillis = mqttBackoffMinMillis;
+    unsigned long retryAt = 0;
+    unsigned long connectStart = 0;
+    unsigned long lastSend = 0;
+    unsigned long pingSent = 0;
+    bool pingPending = false;
+
+    uint8_t tx[mqttPacketMaxSize];
+    uint8_t rx[mqttPacketMaxSize];
+    uint8_t rxStage = 0;        // 0 = fixed header byte, 1 = remaining length, 2 = rest of the packet
+    uint8_t rxHeader = 0;
+    uint8_t rxShift = 0;
+    uint32_t rxLength = 0;      // remaining length of the packet being received
+    uint32_t rxPos = 0;
+    bool subscribePending = false;
+
+    void connect();
+    void connectionLost(int code);
+    void scheduleRetry(int code);
+    void receive();
+    void handlePacket();
+    void sendQueued();
+    bool sendPacket(uint8_t header, size_t length);
+    bool sendSubscribe(const char *topic);
+    uint16_t takePacketId();
+    Message* nextToSend();
+};
+
+#endif
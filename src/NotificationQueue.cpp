@@ -0,0 +1,71 @@
+#include "NotificationQueue.h"
+#include <new>
+
+NotificationQueue::~NotificationQueue() {
+  delete[] cells;
+  if (available != NULL)
+    vSemaphoreDelete(available);
+}
+
+bool NotificationQueue::begin(uint16_t depth) {
+  if (cells != nullptr)
+    return true;
+  uint32_t size = 2;
+  while (size < depth)
+    size *= 2;
+  cells = new (std::nothrow) Cell[size];
+  available = xSemaphoreCreateBinary();
+  if (cells == nullptr || available == NULL)
+    return false;
+  for (uint32_t i=0; i<size; i++)
+    cells[i].seq.store(i, std::memory_order_relaxed);
+  mask = size - 1;
+  return true;
+}
+
+bool NotificationQueue::push(const Notification &notification) {
+  if (cells == nullptr) {
+    dropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  // claim a cell: it is free when its sequence number equals the position, a producer of the previous round that
+  // has not finished yet or a full queue leave it behind
+  uint32_t pos = enqueuePos.load(std::memory_order_relaxed);
+  Cell *cell;
+  for (;;) {
+    cell = &cells[pos & mask];
+    int32_t diff = (int32_t)(cell->seq.load(std::memory_order_acquire) - pos);
+    if (diff == 0) {
+      if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    } else {
+      pos = enqueuePos.load(std::memory_order_relaxed);
+    }
+  }
+  cell->notification = notification;
+  cell->seq.store(pos + 1, std::memory_order_release);
+  pushed.fetch_add(1, std::memory_order_relaxed);
+  xSemaphoreGive(available);
+  return true;
+}
+
+bool NotificationQueue::pop(Notification &notification) {
+  if (cells == nullptr)
+    return false;
+  Cell *cell = &cells[dequeuePos & mask];
+  if ((int32_t)(cell->seq.load(std::memory_order_acquire) - (dequeuePos + 1)) != 0)
+    return false; // empty, or the producer of this cell is still copying
+  notification = cell->notification;
+  cell->seq.store(dequeuePos + mask + 1, std::memory_order_release);
+  dequeuePos++;
+  return true;
+}
+
+bool NotificationQueue::wait(TickType_t ticksToWait) {
+  if (available == NULL)
+    return false;
+  return xSemaphoreTake(available, ticksToWait) == pdTRUE;
+}
@@ -0,0 +1,54 @@
+#ifndef NOTIFICATIONQUEUE_H
+#define NOTIFICATIONQUEUE_H
+
+#include <Arduino.h>
+#include <atomic>
+
+/*
+  Hands notifications (log messages, MQTT publishes, SSE events) from any task to the publisher task, which does the
+  slow part: Serial, the event source and the MQTT client. Bounded and lock-free (the per cell sequence numbers of
+  Dmitry Vyukov's MPMC queue), so a producer never waits: if the publisher falls behind the notification is dropped
+  and counted. Any number of producers, a single consumer.
+*/
+
+const uint8_t notificationTextMaxLength = 63;
+
+enum class NotificationType : uint8_t { log, mqtt, fingerList, fingerChanged, enrollProgress };
+// topics below the MQTT root topic, the full topic strings are built once at boot
+enum class MqttTopic : uint8_t { matchId, matchName, matchConfidence, ring, lastLogMessage, metrics, ignoreTouchRing, ringEvent, enrollProgress, cancelEnrollment, touchRingSuppressed, count };
+
+struct Notification {
+  NotificationType type = NotificationType::log;
+  uint8_t reader = 0;  // mqtt, fingerList, fingerChanged, enrollProgress
+  uint8_t change = 0;  // fingerChanged: FingerChange, enrollProgress: EnrollState
+  uint16_t id = 0;     // fingerChanged, enrollProgress: slot
+  uint32_t seq = 0;    // log: sequence number in the log buffer, the text stays there, enrollProgress: sample
+  MqttTopic topic = MqttTopic::lastLogMessage;   // mqtt
+  char text[notificationTextMaxLength + 1] = "";  // mqtt: payload, fingerChanged: name
+};
+
+class NotificationQueue {
+  public:
+    ~NotificationQueue();
+    bool begin(uint16_t depth);          // depth is rounded up to a power of two
+    bool push(const Notification &notification); // never blocks, false (and counted) if the queue is full
+    bool pop(Notification &notification);        // consumer only, false if empty
+    bool wait(TickType_t ticksToWait);           // consumer only, sleeps until something was pushed
+    uint32_t getDropped() const { return dropped.load(std::memory_order_relaxed); }
+    uint32_t getPushed() const { return pushed.load(std::memory_order_relaxed); }
+
+  private:
+    struct Cell {
+      std::atomic<uint32_t> seq;
+      Notification notification;
+    };
+    Cell *cells = nullptr;
+    uint32_t mask = 0;
+    std::atomic<uint32_t> enqueuePos{0};
+    uint32_t dequeuePos = 0;
+    std::atomic<uint32_t> pushed{0};
+    std::atomic<uint32_t> dropped{0};
+    SemaphoreHandle_t available = NULL; // given by push() to wake up the consumer
+};
+
+#endif
@@ -0,0 +1,132 @@
+#include "ScanMetrics.h"
+
+// same order as enum class ScanResult
+static const char *scanResultNames[scanResultCount] = { "noFinger", "matchFound", "noMatchFound", "error" };
+
+void LatencyHistogram::record(unsigned long durationMicros) {
+  int bucket = 0;
+  while (bucket < latencyBucketCount && durationMicros > latencyBucketBounds[bucket])
+    bucket++;
+  buckets[bucket]++;
+  count++;
+  sumMicros += durationMicros;
+}
+
+static void printHistogram(Print &out, const char *name, const char *labels, const LatencyHistogram &histogram) {
+  uint32_t cumulative = 0;
+  for (int i=0; i<latencyBucketCount; i++) {
+    cumulative += histogram.buckets[i];
+    out.printf("%s_bucket{%s%sle=\"%g\"} %u\n", name, labels, labels[0] ? "," : "", latencyBucketBounds[i] / 1e6, (unsigned)cumulative);
+  }
+  cumulative += histogram.buckets[latencyBucketCount];
+  out.printf("%s_bucket{%s%sle=\"+Inf\"} %u\n", name, labels, labels[0] ? "," : "", (unsigned)cumulative);
+  if (labels[0]) {
+    out.printf("%s_sum{%s} %.6f\n", name, labels, histogram.sumMicros / 1e6);
+    out.printf("%s_count{%s} %u\n", name, labels, (unsigned)histogram.count);
+  } else {
+    out.printf("%s_sum %.6f\n", name, histogram.sumMicros / 1e6);
+    out.printf("%s_count %u\n", name, (unsigned)histogram.count);
+  }
+}
+
+// the histograms of every reader, "labels" comes first in the label set of each sample
+static void printHistograms(Print &out, const char *name, const char *labels, const ScanMetrics *const metrics[], uint8_t readerCount,
+    LatencyHistogram ScanMetrics::*histogram) {
+  for (uint8_t reader = 0; reader < readerCount; reader++) {
+    char readerLabels[64];
+    if (readerCount > 1)
+      snprintf(readerLabels, sizeof(readerLabels), "%s%sreader=\"%u\"", labels, labels[0] ? "," : "", reader);
+    else
+      strlcpy(readerLabels, labels, sizeof(readerLabels));
+    printHistogram(out, name, readerLabels, metrics[reader]->*histogram);
+  }
+}
+
+void printPrometheusMetrics(Print &out, const ScanMetrics &metrics) {
+  const ScanMetrics *readers[] = { &metrics };
+  printPrometheusMetrics(out, readers, 1);
+}
+
+void printPrometheusMetrics(Print &out, const ScanMetrics *const metrics[], uint8_t readerCount) {
+  out.print("# HELP fingerprint_stage_duration_seconds Round trip time of the sensor commands of each scan stage.\n");
+  out.print("# TYPE fingerprint_stage_duration_seconds histogram\n");
+  printHistograms(out, "fingerprint_stage_duration_seconds", "stage=\"getImage\"", metrics, readerCount, &ScanMetrics::getImage);
+  printHistograms(out, "fingerprint_stage_duration_seconds", "stage=\"image2Tz\"", metrics, readerCount, &ScanMetrics::image2Tz);
+  printHistograms(out, "fingerprint_stage_duration_seconds", "stage=\"fingerSearch\"", metrics, readerCount, &ScanMetrics::fingerSearch);
+  printHistograms(out, "fingerprint_stage_duration_seconds", "stage=\"ledControl\"", metrics, readerCount, &ScanMetrics::ledControl);
+  printHistograms(out, "fingerprint_stage_duration_seconds", "stage=\"autoIdentify\"", metrics, readerCount, &ScanMetrics::autoIdentify);
+
+  out.print("# HELP fingerprint_touch_to_image_seconds Time from the touch ring edge to the first getImage.\n");
+  out.print("# TYPE fingerprint_touch_to_image_seconds histogram\n");
+  printHistograms(out, "fingerprint_touch_to_image_seconds", "", metrics, readerCount, &ScanMetrics::touchToImage);
+
+  out.print("# HELP fingerprint_touch_to_decision_seconds Time from touch until match or no match.\n");
+  out.print("# TYPE fingerprint_touch_to_decision_seconds histogram\n");
+  printHistograms(out, "fingerprint_touch_to_decision_seconds", "", metrics, readerCount, &ScanMetrics::touchToDecision);
+
+  char reader[16] = ""; // ,reader="N" if there is more than one
+  out.print("# HELP fingerprint_scan_results_total Results of scanFingerprint().\n");
+  out.print("# TYPE fingerprint_scan_results_total counter\n");
+  for (uint8_t r = 0; r < readerCount; r++) {
+    if (readerCount > 1)
+      snprintf(reader, sizeof(reader), ",reader=\"%u\"", r);
+    for (int i=0; i<scanResultCount; i++)
+      out.printf("fingerprint_scan_results_total{result=\"%s\"%s} %u\n", scanResultNames[i], reader, (unsigned)metrics[r]->scanResults[i]);
+  }
+
+  out.print("# HELP fingerprint_hot_set_searches_total Searches of the most frequently matched slots before the full library.\n");
+  out.print("# TYPE fingerprint_hot_set_searches_total counter\n");
+  for (uint8_t r = 0; r < readerCount; r++) {
+    if (readerCount > 1)
+      snprintf(reader, sizeof(reader), ",reader=\"%u\"", r);
+    out.printf("fingerprint_hot_set_searches_total{result=\"hit\"%s} %u\n", reader, (unsigned)metrics[r]->hotSetHits);
+    out.printf("fingerprint_hot_set_searches_total{result=\"miss\"%s} %u\n", reader, (unsigned)metrics[r]->hotSetMisses);
+  }
+
+  out.print("# HELP fingerprint_touch_ring_edges_total Touch ring edges by what followed: a finger on the sensor or no usable image (rain).\n");
+  out.print("# TYPE fingerprint_touch_ring_edges_total counter\n");
+  for (uint8_t r = 0; r < readerCount; r++) {
+    if (readerCount > 1)
+      snprintf(reader, sizeof(reader), ",reader=\"%u\"", r);
+    out.printf("fingerprint_touch_ring_edges_total{outcome=\"finger\"%s} %u\n", reader, (unsigned)metrics[r]->fingerTouches);
+    out.printf("fingerprint_touch_ring_edges_total{outcome=\"false\"%s} %u\n", reader, (unsigned)metrics[r]->falseTouches);
+  }
+
+  out.print("# HELP fingerprint_touch_ring_suppressed Whether the touch ring is suppressed because of false touches.\n");
+  out.print("# TYPE fingerprint_touch_ring_suppressed gauge\n");
+  for (uint8_t r = 0; r < readerCount; r++) {
+    if (readerCount > 1)
+      snprintf(reader, sizeof(reader), "{reader=\"%u\"}", r);
+    out.printf("fingerprint_touch_ring_suppressed%s %d\n", reader, metrics[r]->ringSuppressed ? 1 : 0);
+  }
+
+  out.print("# HELP fingerprint_touch_ring_suppressions_total Times the touch ring was suppressed because of false touches.\n");
+  out.print("# TYPE fingerprint_touch_ring_suppressions_total counter\n");
+  for (uint8_t r = 0; r < readerCount; r++) {
+    if (readerCount > 1)
+      snprintf(reader, sizeof(reader), "{reader=\"%u\"}", r);
+    out.printf("fingerprint_touch_ring_suppressions_total%s %u\n", reader, (unsigned)metrics[r]->ringSuppressions);
+  }
+
+  out.print("# HELP fingerprint_return_codes_total Last sensor return code of each scan.\n");
+  out.print("# TYPE fingerprint_return_codes_total counter\n");
+  for (uint8_t r = 0; r < readerCount; r++) {
+    if (readerCount > 1)
+      snprintf(reader, sizeof(reader), ",reader=\"%u\"", r);
+    for (int i=0; i<256; i++) {
+      if (metrics[r]->returnCodes[i])
+        out.printf("fingerprint_return_codes_total{code=\"0x%02X\"%s} %u\n", i, reader, (unsigned)metrics[r]->returnCodes[i]);
+    }
+  }
+}
+
+size_t formatMetricsSummary(char *buffer, size_t size, const ScanMetrics &metrics) {
+  int len = snprintf(buffer, size,
+    "{\"matches\":%u,\"noMatches\":%u,\"errors\":%u,\"decisionMs\":%.1f,\"touchToImageMs\":%.1f,\"getImageMs\":%.1f,\"image2TzMs\":%.1f,\"searchMs\":%.1f,\"ledMs\":%.1f,\"autoIdentifyMs\":%.1f,\"falseTouches\":%u,\"ringSuppressed\":%s}",
+    (unsigned)metrics.scanResults[1], (unsigned)metrics.scanResults[2], (unsigned)metrics.scanResults[3],
+    metrics.touchToDecision.meanMicros() / 1000.0, metrics.touchToImage.meanMicros() / 1000.0,
+    metrics.getImage.meanMicros() / 1000.0, metrics.image2Tz.meanMicros() / 1000.0,
+    metrics.fingerSearch.meanMicros() / 1000.0, metrics.ledControl.meanMicros() / 1000.0,
+    metrics.autoIdentify.meanMicros() / 1000.0, (unsigned)metrics.falseTouches, metrics.ringSuppressed ? "true" : "false");
+  return len < 0 ? 0 : (size_t)len;
+}
@@ -0,0 +1,49 @@
+#ifndef SCANMETRICS_H
+#define SCANMETRICS_H
+
+#include <Arduino.h>
+
+/*
+  Fixed bucket latency histograms and outcome counters of the scan path. Recording never allocates, so it can run
+  on every sensor command. Buckets are stored non-cumulative and summed up when rendered.
+*/
+
+const int latencyBucketCount = 12;
+const unsigned long latencyBucketBounds[latencyBucketCount] = { // upper bounds in microseconds
+  1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000, 2000000, 5000000
+};
+
+struct LatencyHistogram {
+  uint32_t buckets[latencyBucketCount + 1] = {0}; // last bucket is +Inf
+  uint32_t count = 0;
+  uint64_t sumMicros = 0;
+
+  void record(unsigned long durationMicros);
+  unsigned long meanMicros() const { return count ? (unsigned long)(sumMicros / count) : 0; }
+};
+
+const int scanResultCount = 4; // number of values in enum class ScanResult
+
+struct ScanMetrics {
+  LatencyHistogram getImage;        // per imaging pass
+  LatencyHistogram image2Tz;
+  LatencyHistogram fingerSearch;
+  LatencyHistogram ledControl;
+  LatencyHistogram autoIdentify;    // capture, extract and search in one sensor command
+  LatencyHistogram touchToImage;    // touch ring edge until first getImage
+  LatencyHistogram touchToDecision; // touch (or first image if touch ring is ignored) until match/no match
+  uint32_t scanResults[scanResultCount] = {0}; // indexed by ScanResult
+  uint32_t returnCodes[256] = {0};             // last sensor return code of each scan
+  uint32_t hotSetHits = 0;                     // matches found by searching the hot set only
+  uint32_t hotSetMisses = 0;                   // hot set searched without match, full search needed
+  uint32_t fingerTouches = 0;                  // touch ring edges followed by a finger on the sensor
+  uint32_t falseTouches = 0;                   // touch ring edges without a usable image (rain)
+  uint32_t ringSuppressions = 0;               // times the ring was suppressed because of false touches
+  bool ringSuppressed = false;
+};
+
+void printPrometheusMetrics(Print &out, const ScanMetrics &metrics);
+void printPrometheusMetrics(Print &out, const ScanMetrics *const metrics[], uint8_t readerCount); // with a reader label if there are several
+size_t formatMetricsSummary(char *buffer, size_t size, const ScanMetrics &metrics);
+
+#endif
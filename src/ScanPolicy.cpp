@@ -0,0 +1,143 @@
+#include "ScanPolicy.h"
+
+void ScanPolicy::setAdaptive(bool adaptive) {
+  portENTER_CRITICAL(&mux);
+  this->adaptive = adaptive;
+  portEXIT_CRITICAL(&mux);
+}
+
+ScanLimits ScanPolicy::beginScan() {
+  portENTER_CRITICAL(&mux);
+  ScanLimits scanLimits; // upper bounds
+  scans++;
+  if (overridePending) {
+    scanLimits = override;
+    overridePending = false;
+  } else if (adaptive && scans % scanPolicyExploreInterval != 0) {
+    scanLimits = currentLimits();
+  }
+  portEXIT_CRITICAL(&mux);
+  return scanLimits;
+}
+
+void ScanPolicy::overrideNextScan(ScanLimits recorded) {
+  portENTER_CRITICAL(&mux);
+  override.imagingPasses = constrain(recorded.imagingPasses, 1, imagingPassesMax);
+  override.searchPasses = constrain(recorded.searchPasses, 1, searchPassesMax);
+  overridePending = true;
+  portEXIT_CRITICAL(&mux);
+}
+
+void ScanPolicy::recordImagingPass(uint8_t pass, bool imageTaken) {
+  portENTER_CRITICAL(&mux);
+  record(imaging, pass, imagingPassesMax, imageTaken);
+  portEXIT_CRITICAL(&mux);
+}
+
+void ScanPolicy::recordSearchPass(uint8_t pass, bool matched) {
+  portENTER_CRITICAL(&mux);
+  record(search, pass, searchPassesMax, matched);
+  portEXIT_CRITICAL(&mux);
+}
+
+void ScanPolicy::recordAfterMatch(bool fingerStillOn) {
+  portENTER_CRITICAL(&mux);
+  if (fingerStillOn) {
+    matchCooldownMillis = min(matchCooldownMillis + matchCooldownExtendMillis, (int)matchCooldownMaxMillis);
+    cooldownsExtended++;
+  } else {
+    matchCooldownMillis = max(matchCooldownMillis - matchCooldownShortenMillis, (int)matchCooldownMinMillis);
+    cooldownsShortened++;
+  }
+  portEXIT_CRITICAL(&mux);
+}
+
+uint16_t ScanPolicy::getMatchCooldownMillis() {
+  portENTER_CRITICAL(&mux);
+  uint16_t cooldown = adaptive ? matchCooldownMillis : matchCooldownMaxMillis;
+  portEXIT_CRITICAL(&mux);
+  return cooldown;
+}
+
+ScanPolicyParameters ScanPolicy::getParameters() {
+  ScanPolicyParameters parameters;
+  portENTER_CRITICAL(&mux);
+  parameters.adaptive = adaptive;
+  if (adaptive) {
+    parameters.limits = currentLimits();
+    parameters.matchCooldownMillis = matchCooldownMillis;
+  }
+  parameters.scans = scans;
+  parameters.cooldownsShortened = cooldownsShortened;
+  parameters.cooldownsExtended = cooldownsExtended;
+  portEXIT_CRITICAL(&mux);
+  return parameters;
+}
+
+void ScanPolicy::printJson(Print &out) {
+  portENTER_CRITICAL(&mux);
+  PassCounts imagingCounts = imaging;
+  PassCounts searchCounts = search;
+  portEXIT_CRITICAL(&mux);
+  ScanPolicyParameters parameters = getParameters();
+
+  out.printf("{\"adaptive\":%s,\"imagingPasses\":%u,\"searchPasses\":%u,\"matchCooldownMillis\":%u,",
+    parameters.adaptive ? "true" : "false", parameters.limits.imagingPasses, parameters.limits.searchPasses, parameters.matchCooldownMillis);
+  out.printf("\"bounds\":{\"imagingPasses\":[%u,%u],\"searchPasses\":[%u,%u],\"matchCooldownMillis\":[%u,%u]},",
+    imagingPassesMin, imagingPassesMax, searchPassesMin, searchPassesMax, matchCooldownMinMillis, matchCooldownMaxMillis);
+  out.printf("\"scans\":%lu,\"cooldownsShortened\":%lu,\"cooldownsExtended\":%lu,",
+    (unsigned long)parameters.scans, (unsigned long)parameters.cooldownsShortened, (unsigned long)parameters.cooldownsExtended);
+  const char *names[] = { "imaging", "search" };
+  const PassCounts *counts[] = { &imagingCounts, &searchCounts };
+  const uint8_t maxPasses[] = { imagingPassesMax, searchPassesMax };
+  for (int i = 0; i < 2; i++) {
+    // per pass: touches that got there and touches that got an image/match in exactly that pass
+    out.printf("\"%s\":{\"reached\":[", names[i]);
+    for (uint8_t pass = 1; pass <= maxPasses[i]; pass++)
+      out.printf(pass > 1 ? ",%u" : "%u", counts[i]->reached[pass]);
+    out.print("],\"succeeded\":[");
+    for (uint8_t pass = 1; pass <= maxPasses[i]; pass++)
+      out.printf(pass > 1 ? ",%u" : "%u", counts[i]->succeeded[pass]);
+    out.print(i == 0 ? "]}," : "]}}");
+  }
+}
+
+
+// caller holds the lock
+void ScanPolicy::record(PassCounts &counts, uint8_t pass, uint8_t maxPass, bool success) {
+  if (pass < 1 || pass > maxPass)
+    return;
+  counts.reached[pass]++;
+  if (success)
+    counts.succeeded[pass]++;
+  if (counts.reached[1] >= scanPolicyWindow) {
+    for (uint8_t i = 1; i <= maxPass; i++) {
+      counts.reached[i] /= 2;
+      counts.succeeded[i] /= 2;
+    }
+  }
+}
+
+// caller holds the lock. Passes behind the current limit are only seen by the exploring scans, a success there is
+// enough to take the pass back
+uint8_t ScanPolicy::limitOf(const PassCounts &counts, uint8_t minPass, uint8_t maxPass, uint8_t current) {
+  uint32_t succeededFrom[imagingPassesMax + 2] = {0}; // touches that succeeded in this pass or a later one
+  for (uint8_t pass = maxPass; pass >= 1; pass--)
+    succeededFrom[pass] = succeededFrom[pass + 1] + counts.succeeded[pass];
+  for (uint8_t pass = minPass + 1; pass <= maxPass; pass++) {
+    if (counts.reached[pass] >= scanPolicyMinSamples) {
+      if (succeededFrom[pass] < scanPolicyMinSuccessRate * counts.reached[pass])
+        return pass - 1;
+    } else if (pass > current && succeededFrom[pass] == 0) {
+      return pass - 1;
+    }
+  }
+  return maxPass;
+}
+
+// caller holds the lock
+ScanLimits ScanPolicy::currentLimits() {
+  limits.imagingPasses = limitOf(imaging, imagingPassesMin, imagingPassesMax, limits.imagingPasses);
+  limits.searchPasses = limitOf(search, searchPassesMin, searchPassesMax, limits.searchPasses);
+  return limits;
+}
@@ -0,0 +1,92 @@
+#ifndef SCANPOLICY_H
+#define SCANPOLICY_H
+
+#include <Arduino.h>
+
+/*
+  Pass limits of a scan and the cooldown after a match, tuned at runtime from the outcomes of the recent touches
+  instead of fixed numbers.
+
+  Imaging passes follow a touch of the ring until the finger is on the sensor, search passes repeat a failed match
+  while the finger stays. For every pass number the policy counts how many touches got there and how many of those
+  still succeeded (got an image, matched) in that pass or a later one. The limit ends the passes in front of the first
+  one where less than scanPolicyMinSuccessRate of the touches still succeed, within the configured bounds. A pass
+  with fewer than scanPolicyMinSamples observations is not cut, so a new reader starts with the upper bounds. Every
+  scanPolicyExploreInterval-th scan runs with the upper bounds to keep observing the passes behind the limit (a
+  success there extends it again), and the counters are halved once scanPolicyWindow touches are counted, older
+  outcomes fade out.
+
+  Search passes keep the fixed limit (searchPassesMin = searchPassesMax): the few residents who match only in a late
+  pass (finger placed off center) are seldom seen behind a cut limit, the counts cannot tell that pass from one that
+  only unknown fingers reach, and cutting it rejected about 1 in 800 of them. Their counts are still reported.
+
+  The cooldown (the match color stays, no scans) is shortened a little whenever the finger was gone when it ended
+  and extended by more when the same finger was still on the sensor. It settles where about one in
+  (1 + extend / shorten) users still rests the finger when the reader looks again. That finger is matched again, it
+  is not published or counted a second time, but the match color stays for another cooldown. That is the price of
+  the earlier scan for the next user.
+*/
+
+const uint8_t imagingPassesMin = 3;          // after a touch of the ring without a finger on the sensor
+const uint8_t imagingPassesMax = 15;
+const uint8_t searchPassesMin = 5;           // until noMatchFound is returned, not cut, see above
+const uint8_t searchPassesMax = 5;
+const uint16_t matchCooldownMinMillis = 1000;
+const uint16_t matchCooldownMaxMillis = 3000;
+const uint16_t matchCooldownShortenMillis = 100;
+const uint16_t matchCooldownExtendMillis = 900;
+const float scanPolicyMinSuccessRate = 0.02f; // keep a pass while at least 1 in 50 touches reaching it succeed
+const uint16_t scanPolicyMinSamples = 50;
+const uint16_t scanPolicyWindow = 1024;
+const uint8_t scanPolicyExploreInterval = 16;
+
+struct ScanLimits {
+  uint8_t imagingPasses = imagingPassesMax;
+  uint8_t searchPasses = searchPassesMax;
+};
+
+struct ScanPolicyParameters {
+  bool adaptive = true;
+  ScanLimits limits;                          // of the scans that don't explore
+  uint16_t matchCooldownMillis = matchCooldownMaxMillis;
+  uint32_t scans = 0;
+  uint32_t cooldownsShortened = 0;            // finger was gone when the cooldown ended
+  uint32_t cooldownsExtended = 0;             // finger still on the sensor
+};
+
+class ScanPolicy {
+  public:
+    void setAdaptive(bool adaptive);          // false: upper bounds and the longest cooldown, like fixed limits
+    ScanLimits beginScan();                   // limits of the scan that starts now
+    void overrideNextScan(ScanLimits recorded); // replay of a trace: the recorded limits instead of our own
+    void recordImagingPass(uint8_t pass, bool imageTaken);
+    void recordSearchPass(uint8_t pass, bool matched);
+    void recordAfterMatch(bool fingerStillOn); // first scan after the cooldown of a match
+    uint16_t getMatchCooldownMillis();
+    ScanPolicyParameters getParameters();
+    void printJson(Print &out);
+
+  private:
+    struct PassCounts {
+      uint16_t reached[imagingPassesMax + 1] = {0};   // index = pass number
+      uint16_t succeeded[imagingPassesMax + 1] = {0};
+    };
+
+    portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED; // sensor task records, the web server reads
+    bool adaptive = true;
+    PassCounts imaging;
+    PassCounts search;
+    ScanLimits limits;                        // adapted whenever they are used
+    uint16_t matchCooldownMillis = matchCooldownMaxMillis;
+    uint32_t scans = 0;
+    uint32_t cooldownsShortened = 0;
+    uint32_t cooldownsExtended = 0;
+    bool overridePending = false;
+    ScanLimits override;
+
+    static void record(PassCounts &counts, uint8_t pass, uint8_t maxPass, bool success);
+    static uint8_t limitOf(const PassCounts &counts, uint8_t minPass, uint8_t maxPass, uint8_t current);
+    ScanLimits currentLimits();
+};
+
+#endif
@@ -12,19 +12,33 @@ bool SettingsManager::loadNetworkSettings() {
     }
 }
 
+// the first reader keeps the keys of single reader versions
+static String pairingKey(const char *key, uint8_t reader) {
+    return reader == 0 ? String(key) : String(key) + reader;
+}
+
 bool SettingsManager::loadAppSettings() {
     Preferences preferences;
+    lock();
     if (preferences.begin("appSettings", true)) {
         appSettings.mqttServer = preferences.getString("mqttServer", String(""));
         appSettings.mqttUsername = preferences.getString("mqttUsername", String(""));
         appSettings.mqttPassword = preferences.getString("mqttPassword", String(""));
         appSettings.mqttRootTopic = preferences.getString("mqttRootTopic", String("fingerprintDoorbell"));
         appSettings.sensorPin = preferences.getString("sensorPin", "00000000");
-        appSettings.sensorPairingCode = preferences.getString("pairingCode", "");
-        appSettings.sensorPairingValid = preferences.getBool("pairingValid", false);
+        for (uint8_t reader = 0; reader < maxReaders; reader++) {
+            pairings[reader] = SensorPairing();
+            preferences.getString(pairingKey("pairingCode", reader).c_str(), pairings[reader].code, sizeof(pairings[reader].code));
+            pairings[reader].valid = preferences.getBool(pairingKey("pairingValid", reader).c_str(), false);
+        }
+        appSettings.sensorBaudRate = preferences.getUInt("sensorBaudRate", 57600);
+        appSettings.sensorPacketLength = preferences.getUShort("sensorPktLen", 128);
+        appSettings.sensorSecurityLevel = preferences.getUChar("sensorSecLevel", 3);
         preferences.end();
+        unlock();
         return true;
     } else {
+        unlock();
         return false;
     }
 }
@@ -44,12 +58,13 @@ void SettingsManager::saveAppSettings() {
     preferences.putString("mqttPassword", appSettings.mqttPassword);
     preferences.putString("mqttRootTopic", appSettings.mqttRootTopic);
     preferences.putString("sensorPin", appSettings.sensorPin);
-    preferences.putString("pairingCode", appSettings.sensorPairingCode);
-    preferences.putBool("pairingValid", appSettings.sensorPairingValid);
+    preferences.putUInt("sensorBaudRate", appSettings.sensorBaudRate);
+    preferences.putUShort("sensorPktLen", appSettings.sensorPacketLength);
+    preferences.putUChar("sensorSecLevel", appSettings.sensorSecurityLevel);
     preferences.end();
 }
 
-NetworkSettings SettingsManager::getNetworkSettings() {
+const NetworkSettings& SettingsManager::getNetworkSettings() const {
     return networkSettings;
 }
 
@@ -59,12 +74,46 @@ void SettingsManager::saveNetworkSettings(NetworkSettings newSettings) {
 }
 
 AppSettings SettingsManager::getAppSettings() {
-    return appSettings;
+    lock();
+    AppSettings settings = appSettings;
+    unlock();
+    return settings;
 }
 
 void SettingsManager::saveAppSettings(AppSettings newSettings) {
+    lock();
     appSettings = newSettings;
     saveAppSettings();
+    unlock();
+}
+
+SensorPairing SettingsManager::getPairing(uint8_t reader) {
+    lock();
+    SensorPairing pairing = pairings[reader];
+    unlock();
+    return pairing;
+}
+
+void SettingsManager::savePairing(uint8_t reader, const char *pairingCode, bool valid) {
+    lock();
+    strlcpy(pairings[reader].code, pairingCode, sizeof(pairings[reader].code));
+    pairings[reader].valid = valid;
+    Preferences preferences;
+    preferences.begin("appSettings", false);
+    preferences.putString(pairingKey("pairingCode", reader).c_str(), pairings[reader].code);
+    preferences.putBool(pairingKey("pairingValid", reader).c_str(), valid);
+    preferences.end();
+    unlock();
+}
+
+void SettingsManager::lock() {
+    if (mutex == NULL)
+        mutex = xSemaphoreCreateMutex(); // first use is loadAppSettings() during setup, before the other tasks run
+    xSemaphoreTake(mutex, portMAX_DELAY);
+}
+
+void SettingsManager::unlock() {
+    xSemaphoreGive(mutex);
 }
 
 bool SettingsManager::deleteAppSettings() {
@@ -95,8 +144,10 @@ String SettingsManager::generateNewPairingCode() {
     /* Put some unique values as input in our new hash */
     hasher.doUpdate( String(esp_random()).c_str() ); // random number
     hasher.doUpdate( String(millis()).c_str() ); // time since boot
+    lock();
     hasher.doUpdate(appSettings.mqttUsername.c_str());
     hasher.doUpdate(appSettings.mqttPassword.c_str());
+    unlock();
 
     /* Compute the final hash */
     byte hash[SHA256_SIZE];
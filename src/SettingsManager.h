@@ -14,27 +14,41 @@ struct AppSettings {
     String mqttPassword = "";
     String mqttRootTopic = "fingerprintDoorbell";
     String sensorPin = "00000000";
-    String sensorPairingCode = "";
-    bool   sensorPairingValid = false;
+    uint32_t sensorBaudRate = 57600;
+    uint16_t sensorPacketLength = 128;
+    uint8_t  sensorSecurityLevel = 3;
+};
+
+// per reader, kept apart from AppSettings: the sensor task checks it in the scan loop (no heap) and saves it while
+// the web server may save the AppSettings it copied before
+struct SensorPairing {
+    char code[pairingCodeLength + 1] = "";
+    bool valid = false;
 };
 
 class SettingsManager {       
   private:
+    SemaphoreHandle_t mutex = NULL; // web server, MQTT task and sensor tasks read and save the app settings
     NetworkSettings networkSettings;
     AppSettings appSettings;
+    SensorPairing pairings[maxReaders];
 
     void saveNetworkSettings();
     void saveAppSettings();
+    void lock();
+    void unlock();
 
   public:
     bool loadNetworkSettings();
     bool loadAppSettings();
 
-    NetworkSettings getNetworkSettings();
+    const NetworkSettings& getNetworkSettings() const; // valid until the next save
     void saveNetworkSettings(NetworkSettings newSettings);
     
-    AppSettings getAppSettings();
-    void saveAppSettings(AppSettings newSettings);
+    AppSettings getAppSettings(); // a copy, the Strings may be replaced by another task meanwhile
+    void saveAppSettings(AppSettings newSettings); // leaves the pairings alone
+    SensorPairing getPairing(uint8_t reader);
+    void savePairing(uint8_t reader, const char *pairingCode, bool valid); // only the keys of this reader, the sensor tasks of other readers may save theirs at the same time
 
     bool deleteAppSettings();
     bool deleteNetworkSettings();
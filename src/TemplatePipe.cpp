@@ -0,0 +1,266 @@
+#include "TemplatePipe.h"
+
+static const uint8_t streamMagic[4] = { 'F', 'P', 'D', 'B' };
+static const uint8_t streamVersion = 1;
+
+bool TemplatePipe::begin(int depth) {
+  portENTER_CRITICAL(&mux);
+  bool busy = running;
+  running = true;
+  portEXIT_CRITICAL(&mux);
+  if (busy)
+    return false;
+
+  if (freeQueue == NULL) {
+    freeQueue = xQueueCreate(templatePipeMaxDepth, sizeof(uint8_t));
+    filledQueue = xQueueCreate(templatePipeMaxDepth, sizeof(uint8_t));
+  }
+  xQueueReset(freeQueue);
+  xQueueReset(filledQueue);
+  depth = constrain(depth, 1, templatePipeMaxDepth);
+  for (uint8_t i=0; i<depth; i++)
+    xQueueSend(freeQueue, &i, 0);
+
+  cancelled = false;
+  finished = false;
+  headerReady = false;
+  streamError = false;
+  recordCount = 0;
+  recordsHandedOut = 0;
+  headerPos = 0;
+  current = nullptr;
+  prefixLength = 0;
+  recordPos = 0;
+  recordsStreamed = 0;
+  recordSideOpen = true;
+  streamSideOpen = true;
+  return true;
+}
+
+void TemplatePipe::closeRecordSide() {
+  portENTER_CRITICAL(&mux);
+  recordSideOpen = false;
+  running = streamSideOpen;
+  portEXIT_CRITICAL(&mux);
+}
+
+void TemplatePipe::closeStreamSide() {
+  portENTER_CRITICAL(&mux);
+  streamSideOpen = false;
+  running = recordSideOpen;
+  portEXIT_CRITICAL(&mux);
+}
+
+void TemplatePipe::cancel() {
+  cancelled = true;
+}
+
+
+TemplateRecord* TemplatePipe::take(QueueHandle_t queue, TickType_t ticksToWait) {
+  // wait in slices to notice a cancel of the other side
+  const TickType_t slice = pdMS_TO_TICKS(50);
+  TickType_t waited = 0;
+  uint8_t index;
+  for (;;) {
+    if (cancelled)
+      return nullptr;
+    TickType_t wait = min(ticksToWait - waited, slice);
+    if (xQueueReceive(queue, &index, wait) == pdTRUE)
+      return &records[index];
+    waited += wait;
+    if (waited >= ticksToWait)
+      return nullptr;
+  }
+}
+
+void TemplatePipe::put(QueueHandle_t queue, TemplateRecord *record) {
+  uint8_t index = record - records;
+  xQueueSend(queue, &index, 0); // never full, there are only as many indices as queue entries
+}
+
+
+void TemplatePipe::setRecordCount(uint16_t count) {
+  memcpy(header, streamMagic, sizeof(streamMagic));
+  header[4] = streamVersion;
+  header[5] = (uint8_t)(count >> 8);
+  header[6] = (uint8_t)(count & 0xFF);
+  recordCount = count;
+  headerReady = true;
+}
+
+TemplateRecord* TemplatePipe::acquireFree(TickType_t ticksToWait) {
+  return take(freeQueue, ticksToWait);
+}
+
+void TemplatePipe::commit(TemplateRecord *record) {
+  put(filledQueue, record);
+}
+
+TemplateRecord* TemplatePipe::acquireFilled(TickType_t ticksToWait) {
+  if (isComplete())
+    return nullptr;
+  TemplateRecord *record = take(filledQueue, ticksToWait);
+  if (record)
+    recordsHandedOut++;
+  return record;
+}
+
+void TemplatePipe::release(TemplateRecord *record) {
+  put(freeQueue, record);
+}
+
+void TemplatePipe::finish() {
+  finished = true;
+}
+
+bool TemplatePipe::isComplete() {
+  return headerReady && (recordsHandedOut >= recordCount);
+}
+
+bool TemplatePipe::isStreamComplete() {
+  return headerReady && (recordsStreamed >= recordCount);
+}
+
+
+void TemplatePipe::preparePrefix(const TemplateRecord *record) {
+  uint8_t nameLength = strnlen(record->name, templateNameMaxLength);
+  prefix[0] = (uint8_t)(record->id >> 8);
+  prefix[1] = (uint8_t)(record->id & 0xFF);
+  prefix[2] = nameLength;
+  memcpy(&prefix[3], record->name, nameLength);
+  prefix[3 + nameLength] = (uint8_t)(record->length >> 8);
+  prefix[4 + nameLength] = (uint8_t)(record->length & 0xFF);
+  prefixLength = 5 + nameLength;
+}
+
+size_t TemplatePipe::readStream(uint8_t *buffer, size_t maxLength) {
+  if (cancelled)
+    return 0;
+  if (!headerReady)
+    return noDataYet;
+
+  size_t count = 0;
+  while (count < maxLength) {
+    if (headerPos < sizeof(header)) {
+      buffer[count++] = header[headerPos++];
+      continue;
+    }
+    if (current == nullptr) {
+      if (recordsStreamed >= recordCount)
+        break;
+      current = take(filledQueue, 0);
+      if (current == nullptr)
+        break;
+      preparePrefix(current);
+      recordPos = 0;
+      checksum = 0;
+    }
+
+    size_t dataEnd = prefixLength + current->length;
+    if (recordPos < prefixLength) {
+      checksum += prefix[recordPos];
+      buffer[count++] = prefix[recordPos++];
+    } else if (recordPos < dataEnd) {
+      size_t chunk = min(dataEnd - recordPos, maxLength - count);
+      const uint8_t *src = &current->data[recordPos - prefixLength];
+      for (size_t i=0; i<chunk; i++)
+        checksum += src[i];
+      memcpy(&buffer[count], src, chunk);
+      count += chunk;
+      recordPos += chunk;
+    } else {
+      buffer[count++] = (recordPos == dataEnd) ? (uint8_t)(checksum >> 8) : (uint8_t)(checksum & 0xFF);
+      recordPos++;
+      if (recordPos == dataEnd + 2) {
+        put(freeQueue, current);
+        current = nullptr;
+        recordsStreamed++;
+      }
+    }
+  }
+
+  if (count > 0)
+    return count;
+  if (recordsStreamed >= recordCount)
+    return 0; // complete
+  if (finished && uxQueueMessagesWaiting(filledQueue) == 0)
+    return 0; // producer gave up, the download ends truncated
+  return noDataYet;
+}
+
+
+size_t TemplatePipe::writeStream(const uint8_t *data, size_t length, TickType_t ticksToWait) {
+  size_t consumed = 0;
+  while (consumed < length) {
+    if (cancelled || streamError)
+      break;
+    if (headerReady && recordsStreamed >= recordCount)
+      return length; // ignore anything behind the last record
+    if (headerPos == sizeof(header) && current == nullptr) {
+      current = take(freeQueue, ticksToWait); // blocks while the sensor task is busy with the previous records
+      if (current == nullptr)
+        break;
+      recordPos = 0;
+      checksum = 0;
+      prefixLength = 3;
+    }
+    if (!parseByte(data[consumed])) {
+      streamError = true;
+      cancelled = true; // don't let the sensor task wait for records that will never come
+      break;
+    }
+    consumed++;
+  }
+  return consumed;
+}
+
+bool TemplatePipe::parseByte(uint8_t c) {
+  if (headerPos < sizeof(header)) {
+    header[headerPos++] = c;
+    if (headerPos == sizeof(header)) {
+      if (memcmp(header, streamMagic, sizeof(streamMagic)) != 0 || header[4] != streamVersion)
+        return false;
+      recordCount = ((uint16_t)header[5] << 8) | header[6];
+      headerReady = true;
+    }
+    return true;
+  }
+
+  if (recordPos < prefixLength) {
+    prefix[recordPos++] = c;
+    checksum += c;
+    if (recordPos == 3) {
+      if (prefix[2] > templateNameMaxLength)
+        return false;
+      prefixLength = 5 + prefix[2]; // name and template length follow
+    } else if (recordPos == prefixLength) {
+      current->id = ((uint16_t)prefix[0] << 8) | prefix[1];
+      memcpy(current->name, &prefix[3], prefix[2]);
+      current->name[prefix[2]] = '\0';
+      current->length = ((uint16_t)prefix[prefixLength - 2] << 8) | prefix[prefixLength - 1];
+      if (current->length == 0 || current->length > templateMaxSize)
+        return false;
+    }
+    return true;
+  }
+
+  size_t dataEnd = prefixLength + current->length;
+  if (recordPos < dataEnd) {
+    current->data[recordPos - prefixLength] = c;
+    checksum += c;
+    recordPos++;
+    return true;
+  }
+  if (recordPos == dataEnd) {
+    receivedChecksum = (uint16_t)c << 8;
+    recordPos++;
+    return true;
+  }
+  receivedChecksum |= c;
+  if (receivedChecksum != checksum)
+    return false;
+  put(filledQueue, current);
+  current = nullptr;
+  recordsStreamed++;
+  return true;
+}
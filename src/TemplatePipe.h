@@ -0,0 +1,89 @@
+#ifndef TEMPLATEPIPE_H
+#define TEMPLATEPIPE_H
+
+#include <Arduino.h>
+
+/*
+  Streams fingerprint templates between the sensor task and a HTTP transfer (export download or import upload) through
+  a small pool of record buffers, so the library is never held in RAM as a whole. While the sensor task transfers one
+  template over the UART the HTTP side already serializes/parses the next one.
+
+  Stream format (all numbers big endian):
+    header: "FPDB", uint8 version, uint16 number of records
+    record: uint16 slot id, uint8 name length, name, uint16 template length, template, uint16 checksum
+  The checksum is the 16 bit sum of all record bytes before it, like the checksum of the sensor packets.
+*/
+
+const uint16_t templateMaxSize = 2048;        // largest template accepted (R503 char files are smaller)
+const uint8_t templateNameMaxLength = 63;
+const int templatePipeMaxDepth = 2;           // record buffers, 2 = transfer and store of consecutive templates overlap
+const unsigned long templatePipeTimeoutMillis = 10000; // give up if the other side makes no progress for this long
+
+struct TemplateRecord {
+  uint16_t id = 0;
+  char name[templateNameMaxLength + 1] = "";
+  uint16_t length = 0;
+  uint8_t data[templateMaxSize];
+};
+
+class TemplatePipe {
+  public:
+    static const size_t noDataYet = (size_t)-1; // readStream(): nothing to send right now, ask again later
+
+    bool begin(int depth = templatePipeMaxDepth); // false if a transfer is already running
+    // each side closes the pipe when it is done (or never started), the pipe is free again once both did
+    void closeRecordSide();
+    void closeStreamSide();
+    void cancel();                  // abort the transfer, blocked calls of the other side return right away
+    bool isCancelled() { return cancelled; }
+    bool isRunning() { return running; }
+
+    // record side (sensor task)
+    void setRecordCount(uint16_t count); // export: number of records that will follow, releases the stream header
+    TemplateRecord* acquireFree(TickType_t ticksToWait);
+    void commit(TemplateRecord *record);
+    TemplateRecord* acquireFilled(TickType_t ticksToWait); // import: nullptr on timeout, cancel or end of stream
+    void release(TemplateRecord *record);
+    void finish();                  // export: no more records will be committed
+    bool isComplete();              // import: all records announced in the header have been handed out
+    bool isStreamComplete();        // all records announced in the header have been serialized/parsed
+    uint16_t getRecordCount() { return recordCount; }
+
+    // byte stream side (HTTP)
+    size_t readStream(uint8_t *buffer, size_t maxLength);                        // export: 0 = end of stream
+    size_t writeStream(const uint8_t *data, size_t length, TickType_t ticksToWait); // import: number of bytes consumed
+    bool hasStreamError() { return streamError; }
+
+  private:
+    TemplateRecord records[templatePipeMaxDepth];
+    QueueHandle_t freeQueue = NULL;     // indices of unused record buffers
+    QueueHandle_t filledQueue = NULL;   // indices of records ready for the consumer
+    portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+    volatile bool running = false;
+    volatile bool cancelled = false;
+    volatile bool finished = false;
+    volatile bool headerReady = false;
+    volatile bool recordSideOpen = false;
+    volatile bool streamSideOpen = false;
+    bool streamError = false;
+    uint16_t recordCount = 0;
+    uint16_t recordsHandedOut = 0;
+
+    // serializer (export) / parser (import) state
+    uint8_t header[7];
+    size_t headerPos = 0;
+    TemplateRecord *current = nullptr;
+    uint8_t prefix[3 + templateNameMaxLength + 2]; // id, name length, name, template length
+    size_t prefixLength = 0;
+    size_t recordPos = 0;         // position inside the serialized record
+    uint16_t checksum = 0;
+    uint16_t receivedChecksum = 0;
+    uint16_t recordsStreamed = 0;
+
+    TemplateRecord* take(QueueHandle_t queue, TickType_t ticksToWait);
+    void put(QueueHandle_t queue, TemplateRecord *record);
+    void preparePrefix(const TemplateRecord *record);
+    bool parseByte(uint8_t c);
+};
+
+#endif
@@ -0,0 +1,215 @@
+#include "UartTrace.h"
+#include <Adafruit_Fingerprint.h>
+#include <new>
+
+UartTrace::UartTrace(HardwareSerial &port, uint8_t readerId) : port(port), readerId(readerId) {
+}
+
+UartTrace::~UartTrace() {
+  delete[] ring;
+}
+
+bool UartTrace::start(size_t size) {
+  size = constrain(size, uartTraceMinSize, uartTraceMaxSize);
+  uint8_t *buffer = (ring != nullptr && size == this->size) ? ring : new (std::nothrow) uint8_t[size];
+  if (buffer == nullptr)
+    return false;
+  uint8_t *old = nullptr;
+  portENTER_CRITICAL(&mux);
+  if (buffer != ring) {
+    old = ring;
+    ring = buffer;
+    this->size = size;
+  }
+  head = tail = used = 0;
+  records = dropped = 0;
+  tx.length = rx.length = 0;
+  active = true;
+  portEXIT_CRITICAL(&mux);
+  delete[] old;
+  return true;
+}
+
+void UartTrace::stop() {
+  portENTER_CRITICAL(&mux);
+  flushPending(tx, TraceRecord::toSensor);
+  flushPending(rx, TraceRecord::fromSensor);
+  active = false;
+  portEXIT_CRITICAL(&mux);
+}
+
+void UartTrace::record(TraceRecord type, const uint8_t *data, uint16_t length) {
+  if (!active)
+    return;
+  portENTER_CRITICAL(&mux);
+  if (active) {
+    // keep the records in time order
+    if (rx.length > 0 && (tx.length == 0 || (int32_t)(rx.at - tx.at) < 0)) {
+      flushPending(rx, TraceRecord::fromSensor);
+      flushPending(tx, TraceRecord::toSensor);
+    } else {
+      flushPending(tx, TraceRecord::toSensor);
+      flushPending(rx, TraceRecord::fromSensor);
+    }
+    append(type, micros(), data, length);
+  }
+  portEXIT_CRITICAL(&mux);
+}
+
+UartTraceInfo UartTrace::getInfo() {
+  UartTraceInfo info;
+  portENTER_CRITICAL(&mux);
+  info.active = active;
+  info.size = size;
+  info.used = used;
+  info.records = records;
+  info.dropped = dropped;
+  portEXIT_CRITICAL(&mux);
+  return info;
+}
+
+size_t UartTrace::getExportLength() {
+  portENTER_CRITICAL(&mux);
+  size_t length = uartTraceHeaderLength + used;
+  portEXIT_CRITICAL(&mux);
+  return length;
+}
+
+size_t UartTrace::exportTo(uint8_t *buffer, size_t maxLength) {
+  portENTER_CRITICAL(&mux);
+  size_t length = uartTraceHeaderLength + used;
+  if (length > maxLength) {
+    portEXIT_CRITICAL(&mux);
+    return 0;
+  }
+  uint8_t header[uartTraceHeaderLength] = {
+    'F', 'D', 'T', 'R', uartTraceVersion, readerId, 0, 0,
+    (uint8_t)(dropped >> 24), (uint8_t)(dropped >> 16), (uint8_t)(dropped >> 8), (uint8_t)dropped,
+    (uint8_t)(used >> 24), (uint8_t)(used >> 16), (uint8_t)(used >> 8), (uint8_t)used
+  };
+  memcpy(buffer, header, sizeof(header));
+  size_t first = min(used, size - tail); // the records can wrap around the end of the ring
+  if (used > 0) {
+    memcpy(buffer + uartTraceHeaderLength, ring + tail, first);
+    memcpy(buffer + uartTraceHeaderLength + first, ring, used - first);
+  }
+  portEXIT_CRITICAL(&mux);
+  return length;
+}
+
+
+size_t UartTrace::write(uint8_t c) {
+  if (active) {
+    portENTER_CRITICAL(&mux);
+    if (active) {
+      flushPending(rx, TraceRecord::fromSensor);
+      collect(tx, TraceRecord::toSensor, c);
+      if (isPacketComplete(tx))
+        flushPending(tx, TraceRecord::toSensor);
+    }
+    portEXIT_CRITICAL(&mux);
+  }
+  return port.write(c);
+}
+
+size_t UartTrace::write(const uint8_t *buffer, size_t size) {
+  if (active) {
+    portENTER_CRITICAL(&mux);
+    if (active) {
+      flushPending(rx, TraceRecord::fromSensor);
+      for (size_t i=0; i<size; i++) {
+        collect(tx, TraceRecord::toSensor, buffer[i]);
+        if (isPacketComplete(tx))
+          flushPending(tx, TraceRecord::toSensor);
+      }
+    }
+    portEXIT_CRITICAL(&mux);
+  }
+  return port.write(buffer, size);
+}
+
+int UartTrace::available() {
+  return port.available();
+}
+
+int UartTrace::read() {
+  int c = port.read();
+  if (c >= 0 && active) {
+    portENTER_CRITICAL(&mux);
+    if (active) {
+      flushPending(tx, TraceRecord::toSensor); // the host is waiting for a reply, even if its packet looked incomplete
+      if (rx.length > 0 && (uint32_t)micros() - rx.lastAt > traceBurstGapMicros)
+        flushPending(rx, TraceRecord::fromSensor);
+      collect(rx, TraceRecord::fromSensor, (uint8_t)c);
+    }
+    portEXIT_CRITICAL(&mux);
+  }
+  return c;
+}
+
+int UartTrace::peek() {
+  return port.peek();
+}
+
+void UartTrace::flush() {
+  port.flush();
+}
+
+
+void UartTrace::collect(Pending &pending, TraceRecord type, uint8_t c) {
+  if (pending.length >= traceMaxRecordLength)
+    flushPending(pending, type);
+  uint32_t now = micros();
+  if (pending.length == 0)
+    pending.at = now;
+  pending.lastAt = now;
+  pending.data[pending.length++] = c;
+}
+
+bool UartTrace::isPacketComplete(const Pending &pending) {
+  if (pending.length < 9 || pending.data[0] != (FINGERPRINT_STARTCODE >> 8) || pending.data[1] != (FINGERPRINT_STARTCODE & 0xFF))
+    return false;
+  return pending.length >= 9 + (((uint16_t)pending.data[7] << 8) | pending.data[8]);
+}
+
+void UartTrace::flushPending(Pending &pending, TraceRecord type) {
+  if (pending.length == 0)
+    return;
+  append(type, pending.at, pending.data, pending.length);
+  pending.length = 0;
+}
+
+// caller holds the lock
+void UartTrace::append(TraceRecord type, uint32_t at, const uint8_t *data, uint16_t length) {
+  size_t total = uartTraceRecordHeaderLength + length;
+  if (ring == nullptr || total > size)
+    return;
+  while (size - used < total) {
+    // drop the oldest record
+    size_t oldest = uartTraceRecordHeaderLength + (((size_t)byteAt(tail + 5) << 8) | byteAt(tail + 6));
+    tail = (tail + oldest) % size;
+    used -= oldest;
+    records--;
+    dropped++;
+  }
+  putByte((uint8_t)type);
+  putByte(at >> 24);
+  putByte(at >> 16);
+  putByte(at >> 8);
+  putByte(at);
+  putByte(length >> 8);
+  putByte(length);
+  for (uint16_t i=0; i<length; i++)
+    putByte(data[i]);
+  records++;
+}
+
+void UartTrace::putByte(uint8_t c) {
+  ring[head] = c;
+  head = (head + 1) % size;
+  used++;
+}
+
+uint8_t UartTrace::byteAt(size_t offset) {
+  return ring[offset % size];
+}
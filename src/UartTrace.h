@@ -0,0 +1,101 @@
+#ifndef UARTTRACE_H
+#define UARTTRACE_H
+
+#include <Arduino.h>
+
+/*
+  Sensor transport with a capture mode: Adafruit_Fingerprint and the raw commands of FingerprintManager talk to the
+  UART through this Stream. While a capture runs, every byte written to and read from the sensor is recorded with a
+  micros() timestamp into a ring of fixed size in RAM (the oldest records are dropped when it is full), together with
+  the markers of the scan loop (touch, decision, state of the manager). Without a capture a call costs one branch.
+
+  Bytes to the sensor are recorded per packet. Bytes from the sensor are recorded per read burst (reads less than
+  traceBurstGapMicros apart), i.e. with the time the firmware actually read them, so a replay can hand them to the
+  firmware at the same moments.
+
+  Download format (all numbers big endian):
+    header: "FDTR", uint8 version, uint8 reader id, uint16 reserved, uint32 dropped records, uint32 length of the records
+    record: uint8 type, uint32 micros, uint16 data length, data
+*/
+
+const uint8_t uartTraceVersion = 2;
+const size_t uartTraceHeaderLength = 16;
+const size_t uartTraceRecordHeaderLength = 7;
+const size_t uartTraceDefaultSize = 16384;
+const size_t uartTraceMinSize = 1024;
+const size_t uartTraceMaxSize = 131072;
+const uint16_t traceMaxRecordLength = 272;  // a data packet of 256 bytes with header and checksum
+const uint32_t traceBurstGapMicros = 100;
+
+enum class TraceRecord : uint8_t {
+  toSensor = 1,     // command or data packet
+  fromSensor = 2,   // bytes read in one burst
+  scanStart = 3,    // a scan pass starts talking to the sensor: uint8 touch (TraceTouch), uint8 finger was on the sensor,
+                    //   uint8 imaging and uint8 search pass limit (ScanPolicy)
+  decision = 4,     // end of that scan pass: uint8 ScanResult, uint8 return code, uint16 matched slot
+  state = 5         // manager state the scan depends on, see FingerprintManager::getTraceState()
+};
+
+enum class TraceTouch : uint8_t { none, level, edge };
+
+struct UartTraceInfo {
+  bool active = false;
+  size_t size = 0;            // bytes of the ring
+  size_t used = 0;
+  unsigned long records = 0;  // in the ring
+  unsigned long dropped = 0;  // overwritten since the capture started
+};
+
+class UartTrace : public Stream {
+  public:
+    UartTrace(HardwareSerial &port, uint8_t readerId = 0);
+    ~UartTrace();
+
+    bool start(size_t size = uartTraceDefaultSize); // clears the ring, false if it can't be allocated
+    void stop();                                    // the recorded data stays until the next start()
+    bool isActive() { return active; }
+    void record(TraceRecord type, const uint8_t *data, uint16_t length);
+    UartTraceInfo getInfo();
+    size_t getExportLength();                       // header and records
+    size_t exportTo(uint8_t *buffer, size_t maxLength); // snapshot in the download format, 0 if it does not fit
+
+    // Stream
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+    using Print::write;
+    int available() override;
+    int read() override;
+    int peek() override;
+    void flush() override;
+
+  private:
+    struct Pending {
+      uint8_t data[traceMaxRecordLength];
+      uint16_t length = 0;
+      uint32_t at = 0;       // first byte
+      uint32_t lastAt = 0;   // latest byte
+    };
+
+    HardwareSerial &port;
+    uint8_t readerId;
+    volatile bool active = false;
+    uint8_t *ring = nullptr;
+    size_t size = 0;
+    size_t head = 0;        // next byte to write
+    size_t tail = 0;        // oldest record
+    size_t used = 0;
+    unsigned long records = 0;
+    unsigned long dropped = 0;
+    Pending tx;
+    Pending rx;
+    portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED; // the sensor task records, the web server starts and downloads
+
+    void collect(Pending &pending, TraceRecord type, uint8_t c);
+    bool isPacketComplete(const Pending &pending);
+    void flushPending(Pending &pending, TraceRecord type);
+    void append(TraceRecord type, uint32_t at, const uint8_t *data, uint16_t length);
+    void putByte(uint8_t c);
+    uint8_t byteAt(size_t offset);
+};
+
+#endif
@@ -3,6 +3,22 @@
 
 #include <WString.h>
 
-extern void notifyClients(String message);
+extern void notifyClients(const char *message);
+inline void notifyClients(const String &message) { notifyClients(message.c_str()); }
+
+// fingerprint readers one controller can drive, the ESP32 has two free UARTs (Serial1, Serial2)
+const uint8_t maxReaders = 2;
+const size_t pairingCodeLength = 32;    // stored in the first notepad page of the sensor and in the settings
+
+// a single slot of the finger list of a reader changed, reload = many slots changed at once (import, delete all)
+enum class FingerChange { added, renamed, deleted, reload };
+extern void notifyFingerChanged(uint8_t reader, FingerChange change, uint16_t id, const char *name);
+
+// steps of an enrollment, the last four end it
+enum class EnrollState { waitForFinger, waitForLift, ok, error, cancelled, timeout };
+extern void notifyEnrollProgress(uint8_t reader, EnrollState state, uint16_t id, uint8_t sample);
+
+// the touch ring of a reader was suppressed because of false touches (rain) or is used again
+extern void notifyTouchRingSuppressed(uint8_t reader, bool suppressed);
 
 #endif
\ No newline at end of file
@@ -7,12 +7,31 @@
 #include <ESPAsyncWebServer.h>
 #include <AsyncElegantOTA.h>
 #include <SPIFFS.h>
-#include <PubSubClient.h>
+#include <StreamString.h>
+#include <atomic>
 #include "FingerprintManager.h"
 #include "SettingsManager.h"
+#include "LogBuffer.h"
+#include "NotificationQueue.h"
+#include "MqttEngine.h"
+#include "FeedbackSequencer.h"
+#include "DoorbellButton.h"
 #include "global.h"
 
-enum class Mode { scan, enroll, maintenance };
+// Commands for the sensor task, the only task that talks to the fingerprint sensor
+enum class SensorCommandType { scan, enroll, deleteFinger, renameFinger, deleteAll, pairing, linkSettings, exportDB, importDB };
+
+struct SensorCommand;
+typedef void (*SensorCommandCallback)(const SensorCommand &command, bool success); // called on the sensor task when the command is done
+
+struct SensorCommand {
+  uint8_t reader = 0;
+  SensorCommandType type = SensorCommandType::scan;
+  int id = 0;
+  char name[64] = "";
+  SensorLinkSettings link;
+  SensorCommandCallback onComplete = nullptr;
+};
 
 const char* VersionInfo = "0.4.1";
 
@@ -20,75 +39,182 @@ const long  gmtOffset_sec = 0; // UTC Time
 const int   daylightOffset_sec = 0; // UTC Time
 
 const int doorbellPin = 14; // doorbell button
-bool doorbellPressed = false;
+DoorbellButton doorbell;     // edges by interrupt, read by loop()
 
 const int buzzerPin = 15; // buzzer when the doorbell button is pressed
 
-const int logMessagesCount = 5;
-String logMessages[logMessagesCount]; // log messages, 0=most recent log message
+FeedbackSequencer buzzer;  // played by loop()
+// buzzer melodies: value = frequency of each tone
+const FeedbackStep bootMelody[] = { {0, 0, 200, 500}, {0, 0, 300, 500}, {0, 0, 400, 500}, {0, 0, 0, 0} };
+const FeedbackStep doorbellMelody[] = { {0, 0, 400, 500}, {0, 0, 500, 500}, {0, 0, 600, 500}, {0, 0, 0, 0} };
+const FeedbackStep buzzerOff[] = { {0, 0, 0, 0} };
+// LED ring after a scan result, the sensor task does not scan until they are played (cooldown). The one after a match
+// is kept per reader (Reader::matchFeedback), its duration comes from the scan policy.
+const FeedbackStep noMatchFeedback[] = { {0, 0, 0, 1000}, {0, 0, 0, 0} }; // let the touch indicator flash after repeated no matches
+
+const uint32_t idleWaitMillis = 20; // max. time the sensor task sleeps waiting for a touch, also the poll interval of loop()
+
+const uint16_t logBufferSize = 16384;   // bytes for the log messages kept for the web UI and /api/log, ~300 typical ones
+const uint16_t logBufferMaxMessages = 512; // messages kept at most, however short they are
+const int logMessagesShown = 5;         // log messages shown on the pages
+const int logReplayMaxMessages = 24;    // max. messages sent to a (re)connecting event client, stays below the SSE queue limit
+LogBuffer logBuffer;
+const uint16_t notificationQueueDepth = 32; // notifications waiting for the publisher task, more are dropped
+NotificationQueue notifications;
+const char *mqttTopicNames[] = { "matchId", "matchName", "matchConfidence", "ring", "lastLogMessage", "metrics", "ignoreTouchRing", "ringEvent", "enrollProgress", "cancelEnrollment", "touchRingSuppressed" }; // same order as MqttTopic
+String mqttTopics[maxReaders][(int)MqttTopic::count]; // per reader: root topic (+ "/reader<n>" from the second reader on) + "/" + name, built once at boot (changing the root topic reboots)
 bool shouldReboot = false;
-unsigned long mqttReconnectPreviousMillis = 0;
+unsigned long metricsPublishPreviousMillis = 0;
+const unsigned long metricsPublishInterval = 300000ul; // publish a scan metrics summary by MQTT every 5 minutes
 
-String enrollId;
-String enrollName;
-Mode currentMode = Mode::scan;
-
-FingerprintManager fingerManager;
 SettingsManager settingsManager;
-bool needMaintenanceMode = false;
+const int sensorCommandQueueLength = 8;
+TemplatePipe templatePipe; // template export/import between sensor task and web server
+AsyncWebServerRequest *importRequest = nullptr; // upload currently feeding the template pipe
+const unsigned long templateUploadWaitMillis = 2000; // max. time the upload handler blocks the web server waiting for a free buffer
+const uint16_t apiFingersPageSize = 50;    // default number of fingers per /api/fingers page
+const uint16_t apiFingersMaxPageSize = 200;
 
 const byte DNS_PORT = 53;
 DNSServer dnsServer;
 AsyncWebServer webServer(80); // AsyncWebServer  on port 80
 AsyncEventSource events("/events"); // event source (Server-Sent events)
 
-WiFiClient espClient;
-PubSubClient mqttClient(espClient);
-long lastMsg = 0;
-char msg[50];
-int value = 0;
-bool mqttConfigValid = true;
-
-
-Match lastMatch;
-
-void addLogMessage(const String& message) {
-  // shift all messages in array by 1, oldest message will die
-  for (int i=logMessagesCount-1; i>0; i--)
-    logMessages[i]=logMessages[i-1];
-  logMessages[0]=message;
-}
+WiFiClient espClient; // connection to the MQTT broker, only used by the MQTT task
+MqttEngine mqtt;
+const char *mqttLastWillMessage = "FingerprintDoorbell disconnected unexpectedly";
+
+
+// Verdict of the last pairing check, kept by the sensor task so a match is published without waiting for a notepad
+// read. A positive verdict is only used while it is fresh and the sensor link had no (re)connect or communication
+// error since, otherwise the match is checked right away as before. Negative verdicts are never cached.
+struct PairingVerdict {
+  bool valid = false;
+  unsigned long checkedAt = 0;
+  uint32_t linkGeneration = 0;
+};
+const unsigned long pairingCheckIntervalMillis = 10000; // background check while the sensor is idle
+const unsigned long pairingVerdictMaxAgeMillis = 30000;
+
+// One fingerprint reader (entrance): its sensor, commands and what its sensor task keeps between scans. Every reader
+// has its own sensor task, so a slow or unplugged reader never delays the scans of the others.
+struct Reader {
+  Reader(uint8_t id, HardwareSerial &serial, int touchPin, int8_t rxPin = -1, int8_t txPin = -1)
+    : id(id), fingerManager(id, serial, touchPin, rxPin, txPin) {}
+
+  uint8_t id;
+  FingerprintManager fingerManager;
+  QueueHandle_t commandQueue = NULL;
+  FeedbackSequencer ledRing;           // played by the sensor task, the only task that talks to the sensor
+  Match lastMatch;
+  PairingVerdict pairingVerdict;
+  bool pairingRecheckPending = false;  // check again once the finger is lifted after a match
+  char logPrefix[12] = "";             // "Reader 1: " in the log if there is more than one
+  FeedbackStep matchFeedback[2] = { {0, 0, 0, matchCooldownMaxMillis}, {0, 0, 0, 0} }; // keep the match color for the cooldown of the scan policy
+};
+
+// The first reader keeps the MQTT topics, finger names and pairing code of single reader setups
+Reader readers[] = {
+  { 0, Serial1, touchRingPin },
+  //{ 1, Serial2, 4, 36, 33 }, // second entrance: touch ring pin, UART2 RX and TX pin
+};
+const uint8_t readerCount = sizeof(readers) / sizeof(readers[0]);
+static_assert(readerCount >= 1 && readerCount <= maxReaders, "one reader per free UART");
 
 String getLogMessagesAsHtml() {
   String html = "";
-  for (int i=logMessagesCount-1; i>=0; i--) {
-    if (logMessages[i]!="")
-      html = html + logMessages[i] + "<br>";
+  LogEntry entry;
+  uint32_t last = logBuffer.getLastSeq();
+  for (uint32_t seq = max(logBuffer.getFirstSeq(), last > logMessagesShown ? last - logMessagesShown + 1 : 1); seq <= last; seq++) {
+    if (logBuffer.get(seq, entry))
+      html = html + entry.text + "<br>";
   }
   return html;
 }
 
-/* wait for maintenance mode or timeout 5s */
-bool waitForMaintenanceMode() {
-  needMaintenanceMode = true;
-  unsigned long startMillis = millis();
-  while (currentMode != Mode::maintenance) {
-    if ((millis() - startMillis) >= 5000ul) {
-      needMaintenanceMode = false;
-      return false;
-    }
-    delay(50);
+// messages after the given sequence number as JSON: {"first":1,"last":9,"messages":[{"id":8,"millis":1234,"text":"..."},...]}
+void printLogMessagesJson(Print &out, uint32_t since) {
+  uint32_t first = logBuffer.getFirstSeq();
+  uint32_t last = logBuffer.getLastSeq();
+  out.printf("{\"first\":%u,\"last\":%u,\"messages\":[", (unsigned)first, (unsigned)last);
+  LogEntry entry;
+  bool separator = false;
+  for (uint32_t seq = max(first, since + 1); seq <= last && seq != 0; seq++) {
+    if (!logBuffer.get(seq, entry))
+      continue;
+    out.printf("%s{\"id\":%u,\"millis\":%lu,\"text\":", separator ? "," : "", (unsigned)entry.seq, entry.millis);
+    printJsonString(out, entry.text);
+    out.print('}');
+    separator = true;
+  }
+  out.print("]}");
+}
+
+/* hand a command over to the sensor task of its reader, never blocks the caller */
+bool queueSensorCommand(const SensorCommand& command) {
+  Reader &reader = readers[command.reader];
+  if (reader.commandQueue == NULL || xQueueSend(reader.commandQueue, &command, 0) != pdTRUE) {
+    notifyClients("Sensor is busy, please try again later.");
+    return false;
   }
-  needMaintenanceMode = false;
+  reader.fingerManager.wakeUp(); // don't wait for the idle timeout of the scan loop
   return true;
 }
 
-// Replaces placeholder in HTML pages
-String processor(const String& var){
+bool queueSensorCommand(uint8_t reader, SensorCommandType type, int id = 0, const String& name = "", SensorCommandCallback onComplete = nullptr) {
+  SensorCommand command;
+  command.reader = reader;
+  command.type = type;
+  command.id = id;
+  name.toCharArray(command.name, sizeof(command.name));
+  command.onComplete = onComplete;
+  return queueSensorCommand(command);
+}
+
+// web server or MQTT task
+void cancelEnrollment(Reader &reader)
+{
+  if (reader.fingerManager.isEnrolling())
+    reader.fingerManager.cancelEnroll(); // the sensor task ends it on its next step
+  else
+    notifyClients("No enrollment is running.");
+}
+
+// reader a page or command is meant for: ?reader=1, the first one if not given
+uint8_t requestedReader(AsyncWebServerRequest *request) {
+  long reader = request->hasArg("reader") ? request->arg("reader").toInt() : 0;
+  return (reader >= 0 && reader < readerCount) ? reader : 0;
+}
+
+String readerUrl(const char *path, uint8_t reader) {
+  return reader == 0 ? String(path) : String(path) + "?reader=" + reader;
+}
+
+// Replaces placeholder in HTML pages, reader = the reader the page manages
+String processor(const String& var, uint8_t reader){
+  FingerprintManager &fingerManager = readers[reader].fingerManager;
   if(var == "LOGMESSAGES"){
     return getLogMessagesAsHtml();
   } else if (var == "FINGERLIST") {
     return fingerManager.getFingerListAsHtmlOptionList();
+  } else if (var == "MAXFINGERID") {
+    return String(fingerManager.getCapacity() - 1);
+  } else if (var == "CAPACITY") {
+    return String(fingerManager.getCapacity());
+  } else if (var == "READER") {
+    return String(reader);
+  } else if (var == "READERSUFFIX") {
+    return reader == 0 ? String() : String(reader);
+  } else if (var == "READERNAV") {
+    // links to the same page for the other readers, nothing with a single reader
+    String nav;
+    for (uint8_t i = 0; readerCount > 1 && i < readerCount; i++)
+      nav += String(i == reader ? "<li class=\"active\">" : "<li>") + "<a href=\"?reader=" + i + "\">Reader " + i + "</a></li>";
+    return nav;
+  } else if (var == "LOGLASTID") {
+    return String(logBuffer.getLastSeq());
+  } else if (var == "LOGMESSAGESSHOWN") {
+    return String(logMessagesShown);
   } else if (var == "HOSTNAME") {
     return settingsManager.getNetworkSettings().hostname;
   } else if (var == "VERSIONINFO") {
@@ -101,78 +227,213 @@ String processor(const String& var){
     return settingsManager.getAppSettings().mqttPassword;
   } else if (var == "MQTT_ROOTTOPIC") {
     return settingsManager.getAppSettings().mqttRootTopic;
+  } else if (var == "SENSOR_BAUDRATE") {
+    return String(settingsManager.getAppSettings().sensorBaudRate);
+  } else if (var == "SENSOR_PACKETLENGTH") {
+    return String(settingsManager.getAppSettings().sensorPacketLength);
+  } else if (var == "SENSOR_SECURITYLEVEL") {
+    return String(settingsManager.getAppSettings().sensorSecurityLevel);
   }
 
   return String();
 }
 
+AwsTemplateProcessor pageProcessor(uint8_t reader) {
+  return [reader](const String &var) { return processor(var, reader); };
+}
+
+
+// The functions below are called from any task (sensor task, web server, loop) and only queue the notification, the
+// publisher task sends it to Serial, the event source clients and MQTT
 
 // send LastMessage to websocket clients
-void notifyClients(String message) {
-  Serial.println(message);
-  addLogMessage(message);
-  events.send(getLogMessagesAsHtml().c_str(),"message",millis(),1000);
-  
-  String mqttRootTopic = settingsManager.getAppSettings().mqttRootTopic;
-  mqttClient.publish((String(mqttRootTopic) + "/lastLogMessage").c_str(), message.c_str());
+void notifyClients(const char *message) {
+  Notification notification;
+  notification.type = NotificationType::log;
+  notification.seq = logBuffer.add(message); // the text stays in the log buffer
+  notifications.push(notification);
+}
+
+void updateClientsFingerlist(uint8_t reader) {
+  Notification notification;
+  notification.type = NotificationType::fingerList;
+  notification.reader = reader;
+  notifications.push(notification);
+}
+
+void notifyFingerChanged(uint8_t reader, FingerChange change, uint16_t id, const char *name) {
+  Notification notification;
+  notification.type = NotificationType::fingerChanged;
+  notification.reader = reader;
+  notification.change = (uint8_t)change;
+  notification.id = id;
+  strlcpy(notification.text, name, sizeof(notification.text));
+  notifications.push(notification);
+}
+
+void notifyEnrollProgress(uint8_t reader, EnrollState state, uint16_t id, uint8_t sample) {
+  Notification notification;
+  notification.type = NotificationType::enrollProgress;
+  notification.reader = reader;
+  notification.change = (uint8_t)state;
+  notification.id = id;
+  notification.seq = sample;
+  notifications.push(notification);
+}
+
+void publishMqtt(uint8_t reader, MqttTopic topic, const char *payload) {
+  Notification notification;
+  notification.type = NotificationType::mqtt;
+  notification.reader = reader;
+  notification.topic = topic;
+  strlcpy(notification.text, payload, sizeof(notification.text));
+  notifications.push(notification);
+}
+
+void publishMqtt(uint8_t reader, MqttTopic topic, long payload) {
+  char text[12];
+  snprintf(text, sizeof(text), "%ld", payload);
+  publishMqtt(reader, topic, text);
+}
+
+// sensor task of the reader, its metrics are not changed meanwhile
+void notifyTouchRingSuppressed(uint8_t reader, bool suppressed) {
+  const ScanMetrics &metrics = readers[reader].fingerManager.getMetrics();
+  char payload[notificationTextMaxLength + 1];
+  snprintf(payload, sizeof(payload), "{\"state\":\"%s\",\"falseTouches\":%u,\"fingerTouches\":%u}", suppressed ? "on" : "off",
+    (unsigned)metrics.falseTouches, (unsigned)metrics.fingerTouches);
+  publishMqtt(reader, MqttTopic::touchRingSuppressed, payload);
 }
 
-void updateClientsFingerlist(String fingerlist) {
-  Serial.println("New fingerlist was sent to clients");
-  events.send(fingerlist.c_str(),"fingerlist",millis(),1000);
+// publisher task only
+void sendNotification(const Notification &notification) {
+  switch (notification.type)
+  {
+  case NotificationType::log: {
+    LogEntry entry;
+    if (!logBuffer.get(notification.seq, entry))
+      return; // already overwritten, the publisher is far behind
+    Serial.println(entry.text);
+    events.send(entry.text,"message",entry.seq,1000); // just the new message, the sequence number is the event id
+    mqtt.publish(mqttTopics[0][(int)MqttTopic::lastLogMessage].c_str(), entry.text);
+    break;
+  }
+  case NotificationType::mqtt: {
+    // the match is QoS 1 and goes out before anything else that is waiting for the broker
+    bool match = notification.topic == MqttTopic::matchId || notification.topic == MqttTopic::matchName || notification.topic == MqttTopic::matchConfidence;
+    mqtt.publish(mqttTopics[notification.reader][(int)notification.topic].c_str(), notification.text, match ? 1 : 0, match);
+    break;
+  }
+  case NotificationType::fingerList: {
+    // "fingerlist" event of the first reader, "fingerlist1" of the second
+    char event[16];
+    snprintf(event, sizeof(event), notification.reader == 0 ? "fingerlist" : "fingerlist%u", notification.reader);
+    Serial.println("New fingerlist was sent to clients");
+    events.send(readers[notification.reader].fingerManager.getFingerListAsHtmlOptionList().c_str(),event,0,1000); // no id, the last event id of the clients stays the last log message
+    break;
+  }
+  case NotificationType::fingerChanged: {
+    // "finger" event with just the changed slot, e.g. {"reader":0,"change":"renamed","id":5,"name":"Bob"}
+    static const char *changeNames[] = { "added", "renamed", "deleted", "reload" }; // same order as enum class FingerChange
+    StreamString json;
+    json.printf("{\"reader\":%u,\"change\":\"%s\"", notification.reader, changeNames[notification.change]);
+    if ((FingerChange)notification.change != FingerChange::reload) {
+      json.printf(",\"id\":%u,\"name\":", notification.id);
+      printJsonString(json, notification.text);
+    }
+    json.print('}');
+    events.send(json.c_str(),"finger",0,1000);
+    break;
+  }
+  case NotificationType::enrollProgress: {
+    // "enroll" event and MQTT message, e.g. {"reader":0,"state":"waitForFinger","id":5,"sample":2,"samples":5}
+    static const char *stateNames[] = { "waitForFinger", "waitForLift", "ok", "error", "cancelled", "timeout" }; // same order as enum class EnrollState
+    char json[112];
+    snprintf(json, sizeof(json), "{\"reader\":%u,\"state\":\"%s\",\"id\":%u,\"sample\":%u,\"samples\":%u}",
+      notification.reader, stateNames[notification.change], notification.id, (unsigned)notification.seq, enrollSamples);
+    events.send(json,"enroll",0,1000);
+    mqtt.publish(mqttTopics[notification.reader][(int)MqttTopic::enrollProgress].c_str(), json);
+    break;
+  }
+  }
 }
 
 
-bool doPairing() {
+bool doPairing(Reader &reader) {
   String newPairingCode = settingsManager.generateNewPairingCode();
+  reader.pairingVerdict.valid = false;
 
-  if (fingerManager.setPairingCode(newPairingCode)) {
-    AppSettings settings = settingsManager.getAppSettings();
-    settings.sensorPairingCode = newPairingCode;
-    settings.sensorPairingValid = true;
-    settingsManager.saveAppSettings(settings);
-    notifyClients("Pairing successful.");
+  if (reader.fingerManager.setPairingCode(newPairingCode)) {
+    settingsManager.savePairing(reader.id, newPairingCode.c_str(), true);
+    notifyClients(String(reader.logPrefix) + "Pairing successful.");
     return true;
   } else {
-    notifyClients("Pairing failed.");
+    notifyClients(String(reader.logPrefix) + "Pairing failed.");
     return false;
   }
 
 }
 
 
-bool checkPairingValid() {
-  AppSettings settings = settingsManager.getAppSettings();
+bool checkPairingValid(Reader &reader) {
+  SensorPairing pairing = settingsManager.getPairing(reader.id); // a copy without heap, the scan loop checks it
 
-   if (!settings.sensorPairingValid) {
-     if (settings.sensorPairingCode.isEmpty()) {
+   if (!pairing.valid) {
+     if (pairing.code[0] == 0) {
        // first boot, do pairing automatically so the user does not have to do this manually
-       return doPairing();
+       return doPairing(reader);
      } else {
       Serial.println("Pairing has been invalidated previously.");   
       return false;
      }
    }
 
-  String actualSensorPairingCode = fingerManager.getPairingCode();
-  //Serial.println("Awaited pairing code: " + settings.sensorPairingCode);
-  //Serial.println("Actual pairing code: " + actualSensorPairingCode);
+  char actualSensorPairingCode[pairingCodeLength + 1];
+  reader.fingerManager.getPairingCode(actualSensorPairingCode);
+  //Serial.println("Awaited pairing code: " + pairingCode);
+  //Serial.println("Actual pairing code: " + String(actualSensorPairingCode));
 
-  if (actualSensorPairingCode.equals(settings.sensorPairingCode))
+  if (strcmp(actualSensorPairingCode, pairing.code) == 0)
     return true;
   else {
-    if (!actualSensorPairingCode.isEmpty()) { 
+    if (actualSensorPairingCode[0] != 0) { 
       // An empty code means there was a communication problem. So we don't have a valid code, but maybe next read will succeed and we get one again.
       // But here we just got an non-empty pairing code that was different to the awaited one. So don't expect that will change in future until repairing was done.
       // -> invalidate pairing for security reasons
-      AppSettings settings = settingsManager.getAppSettings();
-      settings.sensorPairingValid = false;
-      settingsManager.saveAppSettings(settings);
+      settingsManager.savePairing(reader.id, pairing.code, false);
     }
     return false;
   }
 }
 
+// sensor task: reads the pairing code from the sensor and caches the verdict
+bool verifyPairing(Reader &reader) {
+  PairingVerdict &verdict = reader.pairingVerdict;
+  verdict.valid = checkPairingValid(reader);
+  verdict.checkedAt = millis();
+  verdict.linkGeneration = reader.fingerManager.getLinkGeneration();
+  return verdict.valid;
+}
+
+// sensor task: cached verdict if it can be trusted, else the sensor is asked now
+bool isPairingValid(Reader &reader) {
+  const PairingVerdict &verdict = reader.pairingVerdict;
+  if (verdict.valid && millis() - verdict.checkedAt < pairingVerdictMaxAgeMillis
+      && verdict.linkGeneration == reader.fingerManager.getLinkGeneration())
+    return true;
+  return verifyPairing(reader);
+}
+
+// sensor task, between scans while no finger is on the sensor
+void refreshPairingVerdict(Reader &reader) {
+  const PairingVerdict &verdict = reader.pairingVerdict;
+  if (reader.pairingRecheckPending || millis() - verdict.checkedAt >= pairingCheckIntervalMillis
+      || verdict.linkGeneration != reader.fingerManager.getLinkGeneration()) {
+    reader.pairingRecheckPending = false;
+    verifyPairing(reader);
+  }
+}
+
 void startWebserver(){
   
   // Initialize SPIFFS
@@ -185,49 +446,71 @@ void startWebserver(){
   // normal operating mode
   // =======================
   events.onConnect([](AsyncEventSourceClient *client){
+    // replay the log messages the client has missed (a new client gets the ones shown on the page),
+    // set reconnect delay to 1 second
+    uint32_t last = logBuffer.getLastSeq();
+    uint32_t from = last > logMessagesShown ? last - logMessagesShown + 1 : 1;
     if(client->lastId()){
       Serial.printf("Client reconnected! Last message ID it got was: %u\n", client->lastId());
+      if (client->lastId() <= last) // otherwise we have rebooted since and the numbers started again
+        from = client->lastId() + 1;
+    }
+    from = max(from, logBuffer.getFirstSeq());
+    from = max(from, last > logReplayMaxMessages ? last - logReplayMaxMessages + 1 : 1);
+    LogEntry entry;
+    for (uint32_t seq = from; seq <= last; seq++) {
+      if (logBuffer.get(seq, entry))
+        client->send(entry.text,"message",entry.seq,1000);
     }
-    //send event with message "ready", id current millis
-    // and set reconnect delay to 1 second
-    client->send(getLogMessagesAsHtml().c_str(),"message",millis(),1000);
   });
   webServer.addHandler(&events);
 
   
   // Route for root / web page
+  // all pages and commands below are for the reader given by ?reader=n, the first one without it
   webServer.on("/", HTTP_GET, [](AsyncWebServerRequest *request){
-    request->send(SPIFFS, "/index.html", String(), false, processor);
+    request->send(SPIFFS, "/index.html", String(), false, pageProcessor(requestedReader(request)));
   });
 
   webServer.on("/enroll", HTTP_GET, [](AsyncWebServerRequest *request){
+    uint8_t reader = requestedReader(request);
     if(request->hasArg("startEnrollment"))
     {
-      enrollId = request->arg("newFingerprintId");
-      enrollName = request->arg("newFingerprintName");
-      currentMode = Mode::enroll;
+      String enrollId = request->arg("newFingerprintId");
+      int id = enrollId.toInt();
+      if (!readers[reader].fingerManager.isValidFingerId(id))
+        notifyClients("Invalid memory slot id '" + enrollId + "'");
+      else
+        queueSensorCommand(reader, SensorCommandType::enroll, id, request->arg("newFingerprintName"));
     }
-    request->redirect("/");
+    else if(request->hasArg("cancelEnrollment"))
+    {
+      cancelEnrollment(readers[reader]);
+    }
+    request->redirect(readerUrl("/", reader));
   });
 
   webServer.on("/editFingerprints", HTTP_GET, [](AsyncWebServerRequest *request){
+    uint8_t reader = requestedReader(request);
     if(request->hasArg("selectedFingerprint"))
     {
       if(request->hasArg("btnDelete"))
       {
         int id = request->arg("selectedFingerprint").toInt();
-        waitForMaintenanceMode();
-        fingerManager.deleteFinger(id);
-        currentMode = Mode::scan;
+        queueSensorCommand(reader, SensorCommandType::deleteFinger, id, "", [](const SensorCommand &command, bool success) {
+          updateClientsFingerlist(command.reader);
+        });
       }
       else if (request->hasArg("btnRename"))
       {
         int id = request->arg("selectedFingerprint").toInt();
         String newName = request->arg("renameNewName");
-        fingerManager.renameFinger(id, newName);
+        queueSensorCommand(reader, SensorCommandType::renameFinger, id, newName, [](const SensorCommand &command, bool success) {
+          updateClientsFingerlist(command.reader);
+        });
       }
     }
-    request->redirect("/");  
+    request->redirect(readerUrl("/", reader));  
   });
 
   webServer.on("/settings", HTTP_GET, [](AsyncWebServerRequest *request){
@@ -243,7 +526,38 @@ void startWebserver(){
       request->redirect("/");  
       shouldReboot = true;
     } else {
-      request->send(SPIFFS, "/settings.html", String(), false, processor);
+      request->send(SPIFFS, "/settings.html", String(), false, pageProcessor(requestedReader(request)));
+    }
+  });
+
+
+  webServer.on("/sensorLink", HTTP_GET, [](AsyncWebServerRequest *request){
+    if(request->hasArg("btnSaveSensorLink"))
+    {
+      // the link settings are the same for all readers, they are stored once the first reader uses them
+      Serial.println("Apply sensor link settings");
+      SensorCommand command;
+      command.type = SensorCommandType::linkSettings;
+      command.link.baudRate = request->arg("sensor_baudRate").toInt();
+      command.link.packetLength = request->arg("sensor_packetLength").toInt();
+      command.link.securityLevel = request->arg("sensor_securityLevel").toInt();
+      command.onComplete = [](const SensorCommand &command, bool success) {
+        if (success) {
+          AppSettings settings = settingsManager.getAppSettings();
+          settings.sensorBaudRate = command.link.baudRate;
+          settings.sensorPacketLength = command.link.packetLength;
+          settings.sensorSecurityLevel = command.link.securityLevel;
+          settingsManager.saveAppSettings(settings);
+        }
+      };
+      for (uint8_t reader = 0; reader < readerCount; reader++) {
+        command.reader = reader;
+        queueSensorCommand(command);
+        command.onComplete = nullptr;
+      }
+      request->redirect(readerUrl("/settings", requestedReader(request)));  
+    } else {
+      request->send(SPIFFS, "/settings.html", String(), false, pageProcessor(requestedReader(request)));
     }
   });
 
@@ -252,10 +566,11 @@ void startWebserver(){
     if(request->hasArg("btnDoPairing"))
     {
       Serial.println("Do (re)pairing");
-      doPairing();
-      request->redirect("/");  
+      uint8_t reader = requestedReader(request);
+      queueSensorCommand(reader, SensorCommandType::pairing);
+      request->redirect(readerUrl("/", reader));  
     } else {
-      request->send(SPIFFS, "/settings.html", String(), false, processor);
+      request->send(SPIFFS, "/settings.html", String(), false, pageProcessor(requestedReader(request)));
     }
   });
 
@@ -266,16 +581,22 @@ void startWebserver(){
     {
       notifyClients("Factory reset initiated...");
       
-      if (!fingerManager.deleteAll())
-        notifyClients("Finger database could not be deleted.");
-      
-      if (!settingsManager.deleteAppSettings())
-        notifyClients("App settings could not be deleted.");
+      // the fingerprints of every reader, the settings once the last reader is done
+      static std::atomic<uint8_t> readersToReset;
+      readersToReset = readerCount;
+      for (uint8_t reader = 0; reader < readerCount; reader++) {
+        queueSensorCommand(reader, SensorCommandType::deleteAll, 0, "", [](const SensorCommand &command, bool success) {
+          if (--readersToReset != 0)
+            return;
+          if (!settingsManager.deleteAppSettings())
+            notifyClients("App settings could not be deleted.");
+          shouldReboot = true;
+        });
+      }
       
       request->redirect("/");  
-      shouldReboot = true;
     } else {
-      request->send(SPIFFS, "/settings.html", String(), false, processor);
+      request->send(SPIFFS, "/settings.html", String(), false, pageProcessor(requestedReader(request)));
     }
   });
 
@@ -285,16 +606,183 @@ void startWebserver(){
     {
       notifyClients("Deleting all fingerprints...");
       
-      if (!fingerManager.deleteAll())
-        notifyClients("Finger database could not be deleted.");
+      uint8_t reader = requestedReader(request);
+      queueSensorCommand(reader, SensorCommandType::deleteAll, 0, "", [](const SensorCommand &command, bool success) {
+        updateClientsFingerlist(command.reader);
+      });
       
-      request->redirect("/");  
+      request->redirect(readerUrl("/", reader));  
       
     } else {
-      request->send(SPIFFS, "/settings.html", String(), false, processor);
+      request->send(SPIFFS, "/settings.html", String(), false, pageProcessor(requestedReader(request)));
+    }
+  });
+
+
+  // download of all templates (for replacing the sensor), streamed while the sensor task reads them one by one
+  webServer.on("/exportDB", HTTP_GET, [](AsyncWebServerRequest *request){
+    if (!templatePipe.begin()) {
+      request->send(409, "text/plain", "Another template transfer is running.");
+      return;
+    }
+    if (!queueSensorCommand(requestedReader(request), SensorCommandType::exportDB)) {
+      templatePipe.closeRecordSide();
+      templatePipe.closeStreamSide();
+      request->send(503, "text/plain", "Sensor is busy, please try again later.");
+      return;
+    }
+    notifyClients("Exporting fingerprint templates...");
+    request->onDisconnect([](){
+      templatePipe.cancel(); // no effect if the download is complete, otherwise the sensor task stops reading templates
+      templatePipe.closeStreamSide();
+    });
+    AsyncWebServerResponse *response = request->beginChunkedResponse("application/octet-stream", [](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      size_t length = templatePipe.readStream(buffer, maxLen);
+      return (length == TemplatePipe::noDataYet) ? RESPONSE_TRY_AGAIN : length;
+    });
+    response->addHeader("Content-Disposition", "attachment; filename=\"fingerprints.fpdb\"");
+    request->send(response);
+  });
+
+  // upload of an export, the sensor task stores each template as soon as it has been received
+  webServer.on("/importDB", HTTP_POST, [](AsyncWebServerRequest *request){
+    request->redirect(readerUrl("/", requestedReader(request)));
+  }, [](AsyncWebServerRequest *request, String filename, size_t index, uint8_t *data, size_t len, bool final){
+    if (index == 0) {
+      if (!templatePipe.begin()) {
+        notifyClients("Another template transfer is running.");
+        return;
+      }
+      if (!queueSensorCommand(requestedReader(request), SensorCommandType::importDB)) {
+        templatePipe.closeRecordSide();
+        templatePipe.closeStreamSide();
+        return;
+      }
+      notifyClients("Importing fingerprint templates from " + filename + "...");
+      importRequest = request;
+      request->onDisconnect([](){
+        if (!templatePipe.isStreamComplete())
+          templatePipe.cancel();
+        templatePipe.closeStreamSide();
+        importRequest = nullptr;
+      });
+    }
+    if (request != importRequest)
+      return; // upload was rejected
+
+    if (templatePipe.writeStream(data, len, pdMS_TO_TICKS(templateUploadWaitMillis)) != len)
+      templatePipe.cancel(); // invalid file or the sensor task got stuck
+    if (final) {
+      if (!templatePipe.isStreamComplete())
+        templatePipe.cancel(); // file ends in the middle of a record
+      templatePipe.closeStreamSide();
+      importRequest = nullptr;
+    }
+  });
+
+  // UART trace of a reader: /trace?start (optional &size=bytes of the ring), /trace?stop, /trace?status (JSON).
+  // Without arguments a snapshot of the recorded data is downloaded, the capture keeps running.
+  webServer.on("/trace", HTTP_GET, [](AsyncWebServerRequest *request){
+    FingerprintManager &fingerManager = readers[requestedReader(request)].fingerManager;
+    UartTrace &trace = fingerManager.getTrace();
+    if (request->hasArg("start")) {
+      long size = request->hasArg("size") ? request->arg("size").toInt() : uartTraceDefaultSize;
+      if (fingerManager.startTrace(constrain(size, (long)uartTraceMinSize, (long)uartTraceMaxSize)))
+        request->send(200, "text/plain", "UART trace started.");
+      else
+        request->send(507, "text/plain", "Not enough memory for the UART trace.");
+      return;
+    }
+    if (request->hasArg("stop")) {
+      fingerManager.stopTrace();
+      request->send(200, "text/plain", "UART trace stopped.");
+      return;
+    }
+    if (request->hasArg("status")) {
+      UartTraceInfo info = trace.getInfo();
+      AsyncResponseStream *response = request->beginResponseStream("application/json");
+      response->printf("{\"active\":%s,\"size\":%u,\"used\":%u,\"records\":%lu,\"dropped\":%lu}",
+        info.active ? "true" : "false", (unsigned)info.size, (unsigned)info.used, info.records, info.dropped);
+      request->send(response);
+      return;
+    }
+
+    size_t maxLength = uartTraceHeaderLength + trace.getInfo().size; // the ring may grow until it is copied
+    uint8_t *snapshot = (uint8_t*)malloc(maxLength);
+    size_t length = snapshot ? trace.exportTo(snapshot, maxLength) : 0;
+    if (length == 0) {
+      free(snapshot);
+      request->send(507, "text/plain", "Not enough memory for the UART trace download.");
+      return;
+    }
+    request->onDisconnect([snapshot](){
+      free(snapshot);
+    });
+    AsyncWebServerResponse *response = request->beginResponse("application/octet-stream", length, [snapshot, length](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      size_t chunk = min(maxLen, length - index);
+      memcpy(buffer, snapshot + index, chunk);
+      return chunk;
+    });
+    response->addHeader("Content-Disposition", "attachment; filename=\"uart-trace.fdtr\"");
+    request->send(response);
+  });
+
+  // scan latency histograms and counters in Prometheus text format
+  webServer.on("/metrics", HTTP_GET, [](AsyncWebServerRequest *request){
+    AsyncResponseStream *response = request->beginResponseStream("text/plain; version=0.0.4");
+    const ScanMetrics *metrics[readerCount];
+    for (uint8_t reader = 0; reader < readerCount; reader++)
+      metrics[reader] = &readers[reader].fingerManager.getMetrics();
+    printPrometheusMetrics(*response, metrics, readerCount);
+    response->print("# HELP fingerprint_notifications_dropped_total Log messages and MQTT publishes dropped because the publisher task fell behind.\n");
+    response->print("# TYPE fingerprint_notifications_dropped_total counter\n");
+    response->printf("fingerprint_notifications_dropped_total %u\n", (unsigned)notifications.getDropped());
+    MqttStats mqttStats = mqtt.getStats();
+    response->print("# HELP fingerprint_mqtt_connected Whether the MQTT broker is connected.\n");
+    response->print("# TYPE fingerprint_mqtt_connected gauge\n");
+    response->printf("fingerprint_mqtt_connected %d\n", mqtt.connected() ? 1 : 0);
+    response->print("# HELP fingerprint_mqtt_connects_total Successful connects to the MQTT broker (the first one and reconnects).\n");
+    response->print("# TYPE fingerprint_mqtt_connects_total counter\n");
+    response->printf("fingerprint_mqtt_connects_total %lu\n", mqttStats.connects);
+    response->print("# HELP fingerprint_mqtt_dropped_total MQTT messages dropped because the outbound queue was full.\n");
+    response->print("# TYPE fingerprint_mqtt_dropped_total counter\n");
+    response->printf("fingerprint_mqtt_dropped_total %lu\n", mqttStats.dropped);
+    request->send(response);
+  });
+
+  // log messages as JSON, all that are still buffered or the ones after a sequence number: /api/log?since=42
+  webServer.on("/api/log", HTTP_GET, [](AsyncWebServerRequest *request){
+    AsyncResponseStream *response = request->beginResponseStream("application/json");
+    printLogMessagesJson(*response, request->hasArg("since") ? (uint32_t)request->arg("since").toInt() : 0);
+    request->send(response);
+  });
+
+  // finger list as JSON, paged by enrolled fingers: /api/fingers?offset=0&limit=50, a single slot: /api/fingers?id=5
+  webServer.on("/api/fingers", HTTP_GET, [](AsyncWebServerRequest *request){
+    FingerprintManager &fingerManager = readers[requestedReader(request)].fingerManager;
+    if (request->hasArg("id")) {
+      AsyncResponseStream *response = request->beginResponseStream("application/json");
+      if (fingerManager.printFingerJson(*response, request->arg("id").toInt())) {
+        request->send(response);
+      } else {
+        delete response;
+        request->send(404, "application/json", "{\"error\":\"slot is empty\"}");
+      }
+      return;
     }
+    long offset = request->hasArg("offset") ? request->arg("offset").toInt() : 0;
+    long limit = request->hasArg("limit") ? request->arg("limit").toInt() : apiFingersPageSize;
+    AsyncResponseStream *response = request->beginResponseStream("application/json");
+    fingerManager.printFingerListJson(*response, constrain(offset, 0L, 0xFFFFL), constrain(limit, 1L, (long)apiFingersMaxPageSize));
+    request->send(response);
   });
 
+  // pass limits and cooldown the scans currently use, with the outcomes they are tuned from: /api/scanPolicy?reader=0
+  webServer.on("/api/scanPolicy", HTTP_GET, [](AsyncWebServerRequest *request){
+    AsyncResponseStream *response = request->beginResponseStream("application/json");
+    readers[requestedReader(request)].fingerManager.getScanPolicy().printJson(*response);
+    request->send(response);
+  });
 
   webServer.onNotFound([](AsyncWebServerRequest *request){
     request->send(404);
@@ -326,133 +814,302 @@ void startWebserver(){
 }
 
 
-void mqttCallback(char* topic, byte* message, unsigned int length) {
+// MQTT task
+void mqttCallback(const char *topic, const uint8_t *message, unsigned int length) {
   Serial.print("Message arrived on topic: ");
   Serial.print(topic);
   Serial.print(". Message: ");
   String messageTemp;
   
-  for (int i = 0; i < length; i++) {
+  for (unsigned int i = 0; i < length; i++) {
     Serial.print((char)message[i]);
     messageTemp += (char)message[i];
   }
   Serial.println();
 
-  // Check incomming message for interesting topics
-  if (String(topic) == String(settingsManager.getAppSettings().mqttRootTopic) + "/ignoreTouchRing") {
-    if(messageTemp == "on"){
-      fingerManager.setIgnoreTouchRing(true);
+  // Check incomming message for interesting topics, each reader has its own
+  for (Reader &reader : readers) {
+    if (mqttTopics[reader.id][(int)MqttTopic::ignoreTouchRing] == topic) {
+      if(messageTemp == "on"){
+        reader.fingerManager.setIgnoreTouchRing(true);
+      }
+      else if(messageTemp == "off"){
+        reader.fingerManager.setIgnoreTouchRing(false);
+      }
     }
-    else if(messageTemp == "off"){
-      fingerManager.setIgnoreTouchRing(false);
+    if (mqttTopics[reader.id][(int)MqttTopic::cancelEnrollment] == topic) {
+      cancelEnrollment(reader);
     }
   }
 }
 
-void connectMqttClient() {
-  if (!mqttClient.connected() && mqttConfigValid) {
-    Serial.print("(Re)connect to MQTT broker...");
-    // Attempt to connect
-    bool connectResult;
-    
-    // connect with or witout authentication
-    String lastWillTopic = settingsManager.getAppSettings().mqttRootTopic + "/lastLogMessage";
-    String lastWillMessage = "FingerprintDoorbell disconnected unexpectedly";
-    if (settingsManager.getAppSettings().mqttUsername.isEmpty() || settingsManager.getAppSettings().mqttPassword.isEmpty())
-      connectResult = mqttClient.connect(settingsManager.getNetworkSettings().hostname.c_str(),lastWillTopic.c_str(), 1, false, lastWillMessage.c_str());
+// MQTT task
+void mqttStateChanged(MqttState state, int code, unsigned long retryMillis) {
+  char message[160];
+  switch (state) {
+  case MqttState::connected:
+    Serial.println("Connected to MQTT broker");
+    break;
+  case MqttState::waiting:
+    if (code == -3)
+      snprintf(message, sizeof(message), "Connection to MQTT Server lost, reconnect in %lu seconds", (retryMillis + 999) / 1000);
     else
-      connectResult = mqttClient.connect(settingsManager.getNetworkSettings().hostname.c_str(), settingsManager.getAppSettings().mqttUsername.c_str(), settingsManager.getAppSettings().mqttPassword.c_str(), lastWillTopic.c_str(), 1, false, lastWillMessage.c_str());
-
-    if (connectResult) {
-      // success
-      Serial.println("connected");
-      // Subscribe
-      mqttClient.subscribe((settingsManager.getAppSettings().mqttRootTopic + "/ignoreTouchRing").c_str(), 1); // QoS = 1 (at least once)
-    } else {
-      if (mqttClient.state() == 4 || mqttClient.state() == 5) {
-        mqttConfigValid = false;
-        notifyClients("Failed to connect to MQTT Server: bad credentials or not authorized. Will not try again, please check your settings.");
-      } else {
-        notifyClients(String("Failed to connect to MQTT Server, rc=") + mqttClient.state() + ", try again in 30 seconds");
-      }
-    }
+      snprintf(message, sizeof(message), "Failed to connect to MQTT Server '%s', rc=%d, try again in %lu seconds",
+        settingsManager.getAppSettings().mqttServer.c_str(), code, (retryMillis + 999) / 1000);
+    notifyClients(message);
+    break;
+  case MqttState::refused:
+    notifyClients("Failed to connect to MQTT Server: bad credentials or not authorized. Will not try again, please check your settings.");
+    break;
+  default:
+    break;
   }
 }
 
 
-void doScan()
+// loop(): the ring state goes straight to the MQTT queue with priority instead of waiting behind log messages for
+// the publisher task. ringEvent also carries the time from the edge of the button to this publish.
+void publishRing(const DoorbellEvent &event) {
+  unsigned long latencyMicros = micros() - event.edgeMicros;
+  const char *state = event.pressed ? "on" : "off";
+  char payload[64];
+  snprintf(payload, sizeof(payload), "{\"state\":\"%s\",\"latencyMs\":%lu.%lu}", state, latencyMicros / 1000, (latencyMicros / 100) % 10);
+  mqtt.publish(mqttTopics[0][(int)MqttTopic::ring].c_str(), state, 1, true);
+  mqtt.publish(mqttTopics[0][(int)MqttTopic::ringEvent].c_str(), payload, 1, true);
+}
+
+// loop()
+void playBuzzerStep(const FeedbackStep &step, void *arg) {
+  if (step.value != 0)
+    tone(buzzerPin, step.value); // no duration, the sequencer ends it
+  else
+    noTone(buzzerPin);
+}
+
+// sensor task of the reader
+void showLedRingStep(const FeedbackStep &step, void *reader) {
+  if (step.control != 0)
+    ((Reader*)reader)->fingerManager.setLedRing(step.control, step.speed, step.value);
+}
+
+
+void doScan(Reader &reader)
 {
-  Match match = fingerManager.scanFingerprint();
-  String mqttRootTopic = settingsManager.getAppSettings().mqttRootTopic;
+  Match match = reader.fingerManager.scanFingerprint();
+  const Match &lastMatch = reader.lastMatch;
+  char message[logMessageMaxLength + 1]; // formatted on the stack, this runs for every scan
   switch(match.scanResult)
   {
     case ScanResult::noFinger:
       // standard case, occurs every iteration when no finger touchs the sensor
       if (match.scanResult != lastMatch.scanResult) {
         Serial.println("no finger");
-        mqttClient.publish((String(mqttRootTopic) + "/matchId").c_str(), "-1");
-        mqttClient.publish((String(mqttRootTopic) + "/matchName").c_str(), "");
-        mqttClient.publish((String(mqttRootTopic) + "/matchConfidence").c_str(), "-1");
+        publishMqtt(match.readerId, MqttTopic::matchId, "-1");
+        publishMqtt(match.readerId, MqttTopic::matchName, "");
+        publishMqtt(match.readerId, MqttTopic::matchConfidence, "-1");
       }
       break; 
     case ScanResult::matchFound:
-      notifyClients( String("Match Found: ") + match.matchId + " - " + match.matchName  + " with confidence of " + match.matchConfidence );
+      if (match.scanResult != lastMatch.scanResult || match.matchId != lastMatch.matchId) { // not the same finger still resting on the sensor
+        snprintf(message, sizeof(message), "%sMatch Found: %u - %s with confidence of %u", reader.logPrefix, match.matchId, match.matchName, match.matchConfidence);
+        notifyClients(message);
+      }
       if (match.scanResult != lastMatch.scanResult) {
-        if (checkPairingValid()) {
-          mqttClient.publish((String(mqttRootTopic) + "/matchId").c_str(), String(match.matchId).c_str());
-          mqttClient.publish((String(mqttRootTopic) + "/matchName").c_str(), match.matchName.c_str());
-          mqttClient.publish((String(mqttRootTopic) + "/matchConfidence").c_str(), String(match.matchConfidence).c_str());
+        if (isPairingValid(reader)) {
+          reader.pairingRecheckPending = true;
+          publishMqtt(match.readerId, MqttTopic::matchId, match.matchId);
+          publishMqtt(match.readerId, MqttTopic::matchName, match.matchName);
+          publishMqtt(match.readerId, MqttTopic::matchConfidence, match.matchConfidence);
           Serial.println("MQTT message sent: Open the door!");
         } else {
-          notifyClients("Security issue! Match was not sent by MQTT because of invalid sensor pairing! This could potentially be an attack! If the sensor is new or has been replaced by you do a (re)pairing in settings page.");
+          snprintf(message, sizeof(message), "%sSecurity issue! Match was not sent by MQTT because of invalid sensor pairing! This could potentially be an attack! If the sensor is new or has been replaced by you do a (re)pairing in settings page.", reader.logPrefix);
+          notifyClients(message);
         }
       }
-      delay(3000); // wait some time before next scan to let the LED blink
+      reader.matchFeedback[0].durationMillis = reader.fingerManager.getScanPolicy().getMatchCooldownMillis();
+      reader.ledRing.play(reader.matchFeedback);
       break;
     case ScanResult::noMatchFound:
-      notifyClients(String("No Match Found (Code ") + match.returnCode + ")");
+      snprintf(message, sizeof(message), "%sNo Match Found (Code %u)", reader.logPrefix, match.returnCode);
+      notifyClients(message);
       if (match.scanResult != lastMatch.scanResult) {
-        mqttClient.publish((String(mqttRootTopic) + "/matchId").c_str(), "-1");
-        mqttClient.publish((String(mqttRootTopic) + "/matchName").c_str(), "");
-        mqttClient.publish((String(mqttRootTopic) + "/matchConfidence").c_str(), "-1");
+        publishMqtt(match.readerId, MqttTopic::matchId, "-1");
+        publishMqtt(match.readerId, MqttTopic::matchName, "");
+        publishMqtt(match.readerId, MqttTopic::matchConfidence, "-1");
       } else {
-        delay(1000); // wait some time before next scan to let the LED blink
+        reader.ledRing.play(noMatchFeedback);
       }
       break;
     case ScanResult::error:
-      notifyClients(String("ScanResult Error (Code ") + match.returnCode + ")");
+      snprintf(message, sizeof(message), "%sScanResult Error (Code %u)", reader.logPrefix, match.returnCode);
+      notifyClients(message);
       break;
   };
-  lastMatch = match;
+  reader.lastMatch = match;
 
 }
 
-void doEnroll()
+// starts the enrollment, its steps are run by the sensor task instead of scans
+bool doEnroll(Reader &reader, int id, const String& name)
 {
-  int id = enrollId.toInt();
-  if (id < 1 || id > 200) {
-    notifyClients("Invalid memory slot id '" + enrollId + "'");
-    return;
+  if (!reader.fingerManager.beginEnroll(id, name.c_str())) {
+    notifyClients("Another enrollment is still running, please cancel it first.");
+    return false;
   }
+  return true;
+}
 
-  NewFinger finger = fingerManager.enrollFinger(id, enrollName);
-  if (finger.enrollResult == EnrollResult::ok) {
+void enrollFinished(Reader &reader, const NewFinger& finger)
+{
+  switch (finger.enrollResult) {
+  case EnrollResult::ok:
     notifyClients("Enrollment successfull. You can now use your new finger for scanning.");
-    updateClientsFingerlist(fingerManager.getFingerListAsHtmlOptionList());
-  }  else if (finger.enrollResult == EnrollResult::error) {
+    updateClientsFingerlist(reader.id);
+    break;
+  case EnrollResult::cancelled:
+    notifyClients("Enrollment cancelled.");
+    break;
+  case EnrollResult::timeout:
+    notifyClients("Enrollment cancelled, the finger was not placed or lifted in time.");
+    break;
+  default:
     notifyClients(String("Enrollment failed. (Code ") + finger.returnCode + ")");
+    break;
+  }
+}
+
+
+// commands that can run between the steps of an enrollment, all others cancel it
+bool keepsEnrollment(SensorCommandType type)
+{
+  return type == SensorCommandType::enroll || type == SensorCommandType::deleteFinger || type == SensorCommandType::renameFinger;
+}
+
+bool runSensorCommand(Reader &reader, const SensorCommand& command)
+{
+  FingerprintManager &fingerManager = reader.fingerManager;
+  switch (command.type)
+  {
+  case SensorCommandType::scan:
+    doScan(reader);
+    return true;
+  case SensorCommandType::enroll:
+    return doEnroll(reader, command.id, command.name);
+  case SensorCommandType::deleteFinger:
+    return fingerManager.deleteFinger(command.id);
+  case SensorCommandType::renameFinger:
+    fingerManager.renameFinger(command.id, command.name);
+    return true;
+  case SensorCommandType::deleteAll:
+    if (!fingerManager.deleteAll()) {
+      notifyClients("Finger database could not be deleted.");
+      return false;
+    }
+    return true;
+  case SensorCommandType::pairing:
+    return doPairing(reader);
+  case SensorCommandType::linkSettings:
+    return fingerManager.applyLinkSettings(command.link);
+  case SensorCommandType::exportDB: {
+    bool success = fingerManager.exportSensorDB(templatePipe);
+    templatePipe.closeRecordSide();
+    return success;
+  }
+  case SensorCommandType::importDB: {
+    bool success = fingerManager.importSensorDB(templatePipe);
+    templatePipe.closeRecordSide();
+    updateClientsFingerlist(reader.id);
+    return success;
+  }
   }
+  return false;
 }
 
 
+// The sensor task owns the fingerprint sensor of its reader (parameter): it scans continuously and runs queued
+// commands in between
+void sensorTask(void *parameter)
+{
+  Reader &reader = *(Reader*)parameter;
+  FingerprintManager &fingerManager = reader.fingerManager;
+  SensorCommand command;
+  for (;;) {
+    while (xQueueReceive(reader.commandQueue, &command, 0) == pdTRUE) {
+      if (fingerManager.isEnrolling() && !keepsEnrollment(command.type)) {
+        fingerManager.cancelEnroll(); // the command would overwrite the image samples of the sensor
+        enrollFinished(reader, fingerManager.continueEnroll());
+      }
+      bool success = runSensorCommand(reader, command);
+      if (command.onComplete)
+        command.onComplete(command, success);
+    }
+    fingerManager.saveFingerList(); // once for a batch of enroll/rename/delete commands
+
+    uint32_t nextFeedbackMillis = reader.ledRing.update();
+    if (fingerManager.isEnrolling()) {
+      // no scans while enrolling, one step waits at most enrollPollMillis for the finger so commands are still answered
+      NewFinger finger = fingerManager.continueEnroll();
+      if (finger.enrollResult != EnrollResult::running)
+        enrollFinished(reader, finger);
+    } else if (fingerManager.connected && reader.ledRing.playing()) {
+      // cooldown after a scan result: no scans until the LED feedback is played, commands are still answered
+      xQueuePeek(reader.commandQueue, &command, pdMS_TO_TICKS(min(nextFeedbackMillis, idleWaitMillis)));
+    } else if (fingerManager.connected) {
+      fingerManager.waitForTouch(idleWaitMillis); // sleep until the touch ring interrupt (or a new command) wakes us up
+      if (uxQueueMessagesWaiting(reader.commandQueue) == 0)
+        doScan(reader);
+      if (reader.lastMatch.scanResult == ScanResult::noFinger && uxQueueMessagesWaiting(reader.commandQueue) == 0)
+        refreshPairingVerdict(reader);
+    } else {
+      // nothing to scan, but commands still need to be answered
+      if (xQueuePeek(reader.commandQueue, &command, portMAX_DELAY) != pdTRUE)
+        delay(idleWaitMillis);
+    }
+  }
+}
+
+
+
+// The publisher task does everything that may block on the serial port or the browsers, so a slow browser never
+// delays a scan. MQTT messages are only handed to the outbound queue of the MQTT engine.
+void publisherTask(void *parameter)
+{
+  Notification notification;
+  for (;;) {
+    notifications.wait(pdMS_TO_TICKS(idleWaitMillis));
+    while (notifications.pop(notification))
+      sendNotification(notification);
+
+    unsigned long currentMillis = millis();
+    if (mqtt.connected() && (currentMillis - metricsPublishPreviousMillis >= metricsPublishInterval)) {
+      char summary[256];
+      for (Reader &reader : readers) {
+        formatMetricsSummary(summary, sizeof(summary), reader.fingerManager.getMetrics());
+        mqtt.publish(mqttTopics[reader.id][(int)MqttTopic::metrics].c_str(), summary);
+      }
+      metricsPublishPreviousMillis = currentMillis;
+    }
+  }
+}
+
+// The MQTT task owns the connection to the broker: DNS lookup, TCP connect, reconnects with backoff, sending and
+// receiving all block here and nowhere else
+void mqttTask(void *parameter)
+{
+  for (;;) {
+    mqtt.loop();
+    mqtt.wait(pdMS_TO_TICKS(mqttPollMillis));
+  }
+}
+
 
 void reboot()
 {
   notifyClients("System is rebooting now...");
   delay(1000);
     
-  mqttClient.disconnect();
-  espClient.stop();
+  mqtt.stop(); // DISCONNECT by the MQTT task
+  delay(100);
   dnsServer.stop();
   webServer.end();
   ESP.restart();
@@ -500,6 +1157,8 @@ void setup()
   Serial.begin(115200);
   while (!Serial);  // For Yun/Leo/Micro/Zero/...
   delay(100);
+  logBuffer.begin(logBufferSize, logBufferMaxMessages);
+  notifications.begin(notificationQueueDepth); // notifications are queued from now on, sent once the publisher task runs
 
   // Add a handler for network events. This is misnamed "WiFi" because the ESP32 is historically WiFi only,
   // but in our case, this will react to Ethernet events.
@@ -511,51 +1170,81 @@ void setup()
   ETH.begin();
 
   // initialize GPIOs
-  pinMode(doorbellPin, INPUT_PULLUP);
+  doorbell.begin(doorbellPin);
   pinMode(buzzerPin, OUTPUT);
+  buzzer.begin(playBuzzerStep);
   Serial.print("Doorbell button pin: ");
   Serial.println(doorbellPin);
   Serial.print("Buzzer pin: ");
   Serial.println(buzzerPin);
 
   settingsManager.loadAppSettings();
+  AppSettings appSettings = settingsManager.getAppSettings();
+  for (Reader &reader : readers) {
+    String prefix = appSettings.mqttRootTopic;
+    if (reader.id != 0) {
+      prefix += String("/reader") + reader.id;
+      snprintf(reader.logPrefix, sizeof(reader.logPrefix), "Reader %u: ", reader.id);
+    } else if (readerCount > 1) {
+      strcpy(reader.logPrefix, "Reader 0: ");
+    }
+    for (int i = 0; i < (int)MqttTopic::count; i++)
+      mqttTopics[reader.id][i] = prefix + "/" + mqttTopicNames[i];
+  }
 
-  fingerManager.connect();
+  for (Reader &reader : readers) {
+    FingerprintManager &fingerManager = reader.fingerManager;
+    if (fingerManager.connect(appSettings.sensorBaudRate)) {
+      // bring the sensor in line with the stored link settings (e.g. after replacing the sensor)
+      SensorLinkSettings link = fingerManager.getLinkSettings();
+      if (link.baudRate != appSettings.sensorBaudRate || link.packetLength != appSettings.sensorPacketLength || link.securityLevel != appSettings.sensorSecurityLevel) {
+        link.baudRate = appSettings.sensorBaudRate;
+        link.packetLength = appSettings.sensorPacketLength;
+        link.securityLevel = appSettings.sensorSecurityLevel;
+        fingerManager.applyLinkSettings(link);
+      }
+    }
   
-  if (!checkPairingValid())
-    notifyClients("Security issue! Pairing with sensor is invalid. This could potentially be an attack! If the sensor is new or has been replaced by you do a (re)pairing in settings page. MQTT messages regarding matching fingerprints will not been sent until pairing is valid again.");
+    if (!verifyPairing(reader))
+      notifyClients(String(reader.logPrefix) + "Security issue! Pairing with sensor is invalid. This could potentially be an attack! If the sensor is new or has been replaced by you do a (re)pairing in settings page. MQTT messages regarding matching fingerprints will not been sent until pairing is valid again.");
+
+    reader.commandQueue = xQueueCreate(sensorCommandQueueLength, sizeof(SensorCommand));
+    reader.ledRing.begin(showLedRingStep, &reader);
+  }
 
   Serial.println("Started normal operating mode");
-  currentMode = Mode::scan;
 
   startWebserver();
-  if (settingsManager.getAppSettings().mqttServer.isEmpty()) {
-    mqttConfigValid = false;
+  if (appSettings.mqttServer.isEmpty()) {
     notifyClients("Error: No MQTT Broker is configured! Please go to settings and enter your server URL + user credentials.");
   } else {
-    delay(5000);
-    IPAddress mqttServerIp;
-    if (WiFi.hostByName(settingsManager.getAppSettings().mqttServer.c_str(), mqttServerIp))
-    {
-      mqttConfigValid = true;
-      Serial.println("IP used for MQTT server: " + mqttServerIp.toString());
-      mqttClient.setServer(mqttServerIp , 1883);
-      mqttClient.setCallback(mqttCallback);
-      connectMqttClient();
-    }
-    else {
-      mqttConfigValid = false;
-      notifyClients("MQTT Server '" + settingsManager.getAppSettings().mqttServer + "' not found. Please check your settings.");
+    // the MQTT task connects once the network is up, the hostname is looked up again with every (re)connect
+    mqtt.begin(espClient, appSettings.mqttServer.c_str(), 1883, settingsManager.getNetworkSettings().hostname.c_str(),
+      appSettings.mqttUsername.c_str(), appSettings.mqttPassword.c_str(), mqttTopics[0][(int)MqttTopic::lastLogMessage].c_str(), mqttLastWillMessage);
+    mqtt.setCallbacks(mqttCallback, mqttStateChanged);
+    for (Reader &reader : readers) {
+      mqtt.subscribe(mqttTopics[reader.id][(int)MqttTopic::ignoreTouchRing].c_str());
+      mqtt.subscribe(mqttTopics[reader.id][(int)MqttTopic::cancelEnrollment].c_str());
     }
   }
-  if (fingerManager.connected)
-    fingerManager.setLedRingReady();
-  else
-    fingerManager.setLedRingError();
+  for (Reader &reader : readers) {
+    if (reader.fingerManager.connected)
+      reader.fingerManager.setLedRingReady();
+    else
+      reader.fingerManager.setLedRingError();
+  }
   
-  tone(buzzerPin, 200, 500);
-  tone(buzzerPin, 300, 500);
-  tone(buzzerPin, 400, 500);
+  buzzer.play(bootMelody); // played by loop()
+
+  // from now on only the sensor task of a reader talks to its sensor, and only the MQTT task to the MQTT broker
+  for (Reader &reader : readers) {
+    char taskName[16];
+    snprintf(taskName, sizeof(taskName), "sensorTask%u", reader.id);
+    xTaskCreatePinnedToCore(sensorTask, taskName, 8192, &reader, 1, NULL, 1);
+  }
+  xTaskCreatePinnedToCore(publisherTask, "publisherTask", 6144, NULL, 1, NULL, 0);
+  if (!appSettings.mqttServer.isEmpty())
+    xTaskCreatePinnedToCore(mqttTask, "mqttTask", 4096, NULL, 1, NULL, 0);
 }
 
 void loop()
@@ -565,61 +1254,13 @@ void loop()
     reboot();
   }
   
-  // Reconnect handling
-  unsigned long currentMillis = millis();
-
-  // reconnect mqtt if down
-  if (!settingsManager.getAppSettings().mqttServer.isEmpty()) {
-    if (!mqttClient.connected() && (currentMillis - mqttReconnectPreviousMillis >= 30000ul)) {
-      connectMqttClient();
-      mqttReconnectPreviousMillis = currentMillis;
-    }
-    mqttClient.loop();
-
-  }
-
-  // do the actual loop work
-  switch (currentMode)
-  {
-  case Mode::scan:
-    if (fingerManager.connected)
-      doScan();
-    break;
-  
-  case Mode::enroll:
-    doEnroll();
-    currentMode = Mode::scan; // switch back to scan mode after enrollment is done
-    break;
-
-  case Mode::maintenance:
-    // do nothing, give webserver exclusive access to sensor (not thread-safe for concurrent calls)
-    break;
-
-  }
-
-  // enter maintenance mode (no continous scanning) if requested
-  if (needMaintenanceMode)
-    currentMode = Mode::maintenance;
-
-  // read doorbell input and publish by MQTT
-  bool doorbellCurrentlyPressed;
-  doorbellCurrentlyPressed = (digitalRead(doorbellPin) == LOW);
-
-  if (doorbellCurrentlyPressed != doorbellPressed) {
-    String mqttRootTopic = settingsManager.getAppSettings().mqttRootTopic;
-    //Serial.print("doorbell pressed:");
-    //Serial.println(doorbellCurrentlyPressed);
-    if (doorbellCurrentlyPressed) {
-      mqttClient.publish((String(mqttRootTopic) + "/ring").c_str(), "on");
-      tone(buzzerPin, 400, 500);
-      tone(buzzerPin, 500, 500);
-      tone(buzzerPin, 600, 500);   
-    }
-    else {
-      noTone(buzzerPin);
-      mqttClient.publish((String(mqttRootTopic) + "/ring").c_str(), "off");      
-    }
+  // doorbell presses and releases, debounced from the edges the interrupt handler recorded
+  DoorbellEvent event;
+  while (doorbell.read(event)) {
+    publishRing(event);
+    buzzer.play(event.pressed ? doorbellMelody : buzzerOff);
   }
 
-  doorbellPressed = doorbellCurrentlyPressed;
+  // scanning runs in its own task, leave the cpu to it until the button changes or the next tone is due
+  doorbell.wait(pdMS_TO_TICKS(min(buzzer.update(), idleWaitMillis)));
 }
\ No newline at end of file
@@ -0,0 +1,119 @@
+#include <Arduino.h>
+#include "HostRuntime.h"
+#include <deque>
+#include <vector>
+
+struct HostSemaphore {
+  bool available = false;
+};
+
+struct HostQueue {
+  UBaseType_t length;
+  UBaseType_t itemSize;
+  std::deque<std::vector<uint8_t>> items;
+};
+
+TickType_t xTaskGetTickCount() {
+  return (TickType_t)millis();
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary() {
+  return new HostSemaphore();
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex() {
+  HostSemaphore *semaphore = new HostSemaphore();
+  semaphore->available = true; // a mutex starts unlocked (no priority inheritance on the host)
+  return semaphore;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore) {
+  delete semaphore;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticksToWait) {
+  TickType_t waited = 0;
+  while (!semaphore->available) {
+    if (waited >= ticksToWait)
+      return pdFALSE;
+    delay(1);
+    waited++;
+  }
+  semaphore->available = false;
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+  if (semaphore->available)
+    return pdFALSE;
+  semaphore->available = true;
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t semaphore, BaseType_t *higherPriorityTaskWoken) {
+  if (higherPriorityTaskWoken)
+    *higherPriorityTaskWoken = pdTRUE;
+  return xSemaphoreGive(semaphore);
+}
+
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize) {
+  HostQueue *queue = new HostQueue();
+  queue->length = length;
+  queue->itemSize = itemSize;
+  return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue) {
+  delete queue;
+}
+
+// waits like xSemaphoreTake() until the queue state allows the operation
+static bool waitFor(QueueHandle_t queue, bool forSpace, TickType_t ticksToWait) {
+  TickType_t waited = 0;
+  while (forSpace ? queue->items.size() >= queue->length : queue->items.empty()) {
+    if (waited >= ticksToWait)
+      return false;
+    delay(1);
+    waited++;
+  }
+  return true;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticksToWait) {
+  if (!waitFor(queue, true, ticksToWait))
+    return pdFALSE;
+  const uint8_t *bytes = (const uint8_t *)item;
+  queue->items.emplace_back(bytes, bytes + queue->itemSize);
+  return pdTRUE;
+}
+
+BaseType_t xQueueSendFromISR(QueueHandle_t queue, const void *item, BaseType_t *higherPriorityTaskWoken) {
+  if (higherPriorityTaskWoken)
+    *higherPriorityTaskWoken = pdTRUE;
+  return xQueueSend(queue, item, 0);
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticksToWait) {
+  if (!waitFor(queue, false, ticksToWait))
+    return pdFALSE;
+  memcpy(item, queue->items.front().data(), queue->itemSize);
+  queue->items.pop_front();
+  return pdTRUE;
+}
+
+BaseType_t xQueuePeek(QueueHandle_t queue, void *item, TickType_t ticksToWait) {
+  if (!waitFor(queue, false, ticksToWait))
+    return pdFALSE;
+  memcpy(item, queue->items.front().data(), queue->itemSize);
+  return pdTRUE;
+}
+
+BaseType_t xQueueReset(QueueHandle_t queue) {
+  queue->items.clear();
+  return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+  return (UBaseType_t)queue->items.size();
+}
@@ -0,0 +1,378 @@
+#include "HostRuntime.h"
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <random>
+#include <thread>
+
+HardwareSerial Serial(0);
+HardwareSerial Serial1(1);
+HardwareSerial Serial2(2);
+
+namespace {
+
+  struct Pin {
+    uint8_t mode = INPUT;
+    bool driven = false;
+    int level = LOW;
+    int outputLevel = LOW;
+    void (*handler)(void *) = nullptr;
+    void *handlerArg = nullptr;
+    int interruptMode = 0;
+  };
+
+  uint64_t clockMicros = 0;
+  std::multimap<uint64_t, std::function<void()>> events;
+  Pin pins[40];
+  bool consoleOutput = false;
+  std::mt19937 rng(0xF1D0);
+  bool allocationCounting = false;
+  int hardwareDepth = 0;
+  unsigned long allocationCount = 0;
+
+  struct Task {
+    std::function<void()> body;
+    uint64_t wakeAt = 0;
+    uint64_t order = 0;         // tasks waking at the same time run in the order they gave up the core
+    bool finished = false;
+    int hardwareDepth = 0;
+  };
+
+  std::vector<Task> tasks;
+  uint64_t nextTaskOrder = 0;
+  std::mutex batonMutex;
+  std::condition_variable batonPassed;
+  int runningTask = -1;         // -1 = the caller of runTasks()
+  thread_local int currentTask = -1;
+
+  void callPlainHandler(void *arg) {
+    ((void (*)(void))arg)();
+  }
+
+  void runDueEvents(uint64_t until) {
+    while (!events.empty() && events.begin()->first <= until) {
+      auto it = events.begin();
+      if (it->first > clockMicros)
+        clockMicros = it->first;
+      HostRuntime::SimulatedHardware hardware;
+      std::function<void()> event = it->second;
+      events.erase(it);
+      event();
+    }
+  }
+
+  // picks the task that wakes up first, moves the clock to its wake up time and lets it run
+  void passBaton() {
+    int next = -1;
+    for (size_t i = 0; i < tasks.size(); i++) {
+      const Task &t = tasks[i];
+      if (!t.finished && (next < 0 || t.wakeAt < tasks[next].wakeAt || (t.wakeAt == tasks[next].wakeAt && t.order < tasks[next].order)))
+        next = (int)i;
+    }
+    if (next >= 0) {
+      runDueEvents(tasks[next].wakeAt);
+      if (tasks[next].wakeAt > clockMicros)
+        clockMicros = tasks[next].wakeAt;
+    }
+    std::lock_guard<std::mutex> lock(batonMutex);
+    runningTask = next;
+    batonPassed.notify_all();
+  }
+
+  void waitForBaton(int task) {
+    std::unique_lock<std::mutex> lock(batonMutex);
+    batonPassed.wait(lock, [task]() { return runningTask == task; });
+  }
+
+  void runTask(int task) {
+    currentTask = task;
+    waitForBaton(task);
+    hardwareDepth = 0;
+    tasks[task].body();
+    tasks[task].finished = true;
+    passBaton();
+  }
+
+}
+
+namespace HostRuntime {
+
+  uint64_t now() {
+    return clockMicros;
+  }
+
+  void advance(uint64_t micros) {
+    uint64_t until = clockMicros + micros;
+    if (currentTask >= 0) {
+      Task &self = tasks[currentTask];
+      self.wakeAt = until;
+      self.order = nextTaskOrder++;
+      self.hardwareDepth = hardwareDepth;
+      passBaton();
+      waitForBaton(currentTask);
+      hardwareDepth = tasks[currentTask].hardwareDepth;
+      return;
+    }
+    runDueEvents(until);
+    clockMicros = until;
+  }
+
+  void runTasks(const std::vector<std::function<void()>> &bodies) {
+    int callerHardwareDepth = hardwareDepth;
+    tasks.clear();
+    for (const std::function<void()> &body : bodies) {
+      Task task;
+      task.body = body;
+      task.wakeAt = clockMicros;
+      task.order = nextTaskOrder++;
+      tasks.push_back(task);
+    }
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < tasks.size(); i++)
+      threads.emplace_back(runTask, (int)i);
+    passBaton();
+    waitForBaton(-1);
+    for (std::thread &thread : threads)
+      thread.join();
+    tasks.clear();
+    hardwareDepth = callerHardwareDepth;
+  }
+
+  void schedule(uint64_t at, std::function<void()> event) {
+    events.emplace(at, event);
+  }
+
+  void scheduleIn(uint64_t micros, std::function<void()> event) {
+    schedule(clockMicros + micros, event);
+  }
+
+  void clearSchedule() {
+    events.clear();
+  }
+
+  // runs the interrupt handler of the pin if the level change matches its mode
+  static void pinChanged(uint8_t pin, int oldLevel) {
+    const Pin &p = pins[pin];
+    int level = digitalRead(pin);
+    if (p.handler && oldLevel != level) {
+      bool rising = (level == HIGH);
+      if ((p.interruptMode == CHANGE) || (rising && p.interruptMode == RISING) || (!rising && p.interruptMode == FALLING))
+        p.handler(p.handlerArg);
+    }
+  }
+
+  void drivePin(uint8_t pin, int level) {
+    if (pin >= 40)
+      return;
+    int oldLevel = digitalRead(pin);
+    pins[pin].driven = true;
+    pins[pin].level = level;
+    pinChanged(pin, oldLevel);
+  }
+
+  void releasePin(uint8_t pin) {
+    if (pin >= 40)
+      return;
+    int oldLevel = digitalRead(pin);
+    pins[pin].driven = false;
+    pinChanged(pin, oldLevel);
+  }
+
+  void setConsoleOutput(bool enabled) {
+    consoleOutput = enabled;
+  }
+
+  void countAllocations(bool enabled) {
+    allocationCounting = enabled;
+  }
+
+  void resetAllocationCount() {
+    allocationCount = 0;
+  }
+
+  unsigned long getAllocationCount() {
+    return allocationCount;
+  }
+
+  SimulatedHardware::SimulatedHardware() {
+    hardwareDepth++;
+  }
+
+  SimulatedHardware::~SimulatedHardware() {
+    hardwareDepth--;
+  }
+
+}
+
+#ifdef __GLIBC__
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+static inline void countAllocation() {
+  if (allocationCounting && hardwareDepth == 0)
+    allocationCount++;
+}
+
+// operator new of libstdc++ ends up here as well
+extern "C" void *malloc(size_t size) noexcept {
+  countAllocation();
+  return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size) noexcept {
+  countAllocation();
+  return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size) noexcept {
+  countAllocation();
+  return __libc_realloc(ptr, size);
+}
+#endif
+
+
+unsigned long millis() {
+  return (unsigned long)(clockMicros / 1000);
+}
+
+unsigned long micros() {
+  return (unsigned long)clockMicros;
+}
+
+void delay(uint32_t ms) {
+  HostRuntime::advance((uint64_t)ms * 1000);
+}
+
+void delayMicroseconds(uint32_t us) {
+  HostRuntime::advance(us);
+}
+
+void yield() {
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  if (pin < 40)
+    pins[pin].mode = mode;
+}
+
+int digitalRead(uint8_t pin) {
+  if (pin >= 40)
+    return LOW;
+  const Pin &p = pins[pin];
+  if (p.driven)
+    return p.level;
+  if (p.mode == OUTPUT)
+    return p.outputLevel;
+  return (p.mode & PULLUP) ? HIGH : LOW;
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+  if (pin < 40)
+    pins[pin].outputLevel = val;
+}
+
+void attachInterrupt(uint8_t pin, void (*handler)(void), int mode) {
+  attachInterruptArg(pin, callPlainHandler, (void *)handler, mode);
+}
+
+void attachInterruptArg(uint8_t pin, void (*handler)(void *), void *arg, int mode) {
+  if (pin >= 40)
+    return;
+  pins[pin].handler = handler;
+  pins[pin].handlerArg = arg;
+  pins[pin].interruptMode = mode;
+}
+
+void detachInterrupt(uint8_t pin) {
+  if (pin < 40)
+    pins[pin].handler = nullptr;
+}
+
+void interrupts() {
+}
+
+void noInterrupts() {
+}
+
+void tone(uint8_t pin, unsigned int frequency, unsigned long duration) {
+  // the ESP32 core blocks until the tone has been played
+  delay(duration);
+}
+
+void noTone(uint8_t pin) {
+}
+
+uint32_t esp_random() {
+  return rng();
+}
+
+
+size_t Print::printf(const char *format, ...) {
+  char buf[256];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  if (len < 0)
+    return 0;
+  return write((const uint8_t *)buf, (size_t)len < sizeof(buf) ? (size_t)len : sizeof(buf) - 1);
+}
+
+size_t Stream::readBytes(uint8_t *buffer, size_t length) {
+  size_t count = 0;
+  unsigned long startMillis = millis();
+  while (count < length) {
+    int c = read();
+    if (c < 0) {
+      if (millis() - startMillis >= _timeout)
+        break;
+      delay(1);
+      continue;
+    }
+    buffer[count++] = (uint8_t)c;
+  }
+  return count;
+}
+
+
+void HardwareSerial::begin(unsigned long baud, uint32_t config, int8_t rxPin, int8_t txPin) {
+  this->baud = baud;
+  if (device)
+    device->hostBaudChanged(baud);
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+  if (device) {
+    HostRuntime::SimulatedHardware hardware;
+    // like the 128 byte hardware TX FIFO of the ESP32: write() only blocks once the FIFO is full
+    const uint64_t fifoBytes = 128;
+    uint64_t byteMicros = 10000000ull / (baud ? baud : 9600);
+    uint64_t now = HostRuntime::now();
+    if (txBusyUntil > now + fifoBytes * byteMicros)
+      HostRuntime::advance(txBusyUntil - now - fifoBytes * byteMicros);
+    txBusyUntil = std::max(txBusyUntil, HostRuntime::now()) + byteMicros;
+    device->receive(c);
+  } else if (consoleOutput) {
+    fputc(c, stdout);
+  }
+  return 1;
+}
+
+int HardwareSerial::available() {
+  HostRuntime::SimulatedHardware hardware;
+  return device ? device->available() : 0;
+}
+
+int HardwareSerial::read() {
+  HostRuntime::SimulatedHardware hardware;
+  return device ? device->read() : -1;
+}
+
+int HardwareSerial::peek() {
+  HostRuntime::SimulatedHardware hardware;
+  return device ? device->peek() : -1;
+}
@@ -0,0 +1,47 @@
+#ifndef HOSTRUNTIME_H
+#define HOSTRUNTIME_H
+
+#include <Arduino.h>
+#include <functional>
+#include <vector>
+
+/*
+  Control interface of the host runtime behind the Arduino stand-ins: a virtual microsecond clock with an event
+  scheduler, and GPIO pins that can be driven by simulated hardware (e.g. the touch ring output of the sensor).
+  Scheduled events run inside delay(), the same way interrupts and peripherals progress on the device while the
+  firmware waits.
+*/
+namespace HostRuntime {
+
+  uint64_t now();                         // virtual time in microseconds since "boot"
+  void advance(uint64_t micros);          // move the clock forward, running all events that become due
+  void schedule(uint64_t at, std::function<void()> event);
+  void scheduleIn(uint64_t micros, std::function<void()> event);
+  void clearSchedule();
+
+  // Runs the functions like FreeRTOS tasks on a single core and waits until all have returned. Each one gets its own
+  // thread, but only one of them runs at a time: delay() and advance() of a task hand over to the task that wakes up
+  // next on the virtual clock, so the tasks interleave the way the scheduler of the device would interleave them.
+  void runTasks(const std::vector<std::function<void()>> &tasks);
+
+  void drivePin(uint8_t pin, int level);  // simulated hardware drives the pin level
+  void releasePin(uint8_t pin);           // pin floats again, level follows the configured pull resistor
+
+  void setConsoleOutput(bool enabled);    // Serial output of the firmware code (off by default for benchmarks)
+
+  // Heap allocations (malloc/calloc/realloc, new) of the firmware while counting is enabled. Work done on behalf of
+  // the simulated hardware (the device behind a serial port, scheduled events, the flash of Preferences) is not
+  // counted, it marks itself with a SimulatedHardware scope. Only available with glibc, elsewhere the count stays 0.
+  void countAllocations(bool enabled);
+  void resetAllocationCount();
+  unsigned long getAllocationCount();
+
+  class SimulatedHardware {
+    public:
+      SimulatedHardware();
+      ~SimulatedHardware();
+  };
+
+}
+
+#endif
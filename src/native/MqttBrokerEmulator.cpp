@@ -0,0 +1,185 @@
+#include "MqttBrokerEmulator.h"
+#include "HostRuntime.h"
+
+void MqttBrokerEmulator::dropConnection() {
+  open = false;
+  toClient.clear();
+}
+
+void MqttBrokerEmulator::sendToClient(const char *topic, const char *payload) {
+  if (!open)
+    return;
+  std::vector<uint8_t> body;
+  size_t topicLength = strlen(topic);
+  body.push_back(topicLength >> 8);
+  body.push_back(topicLength & 0xFF);
+  body.insert(body.end(), topic, topic + topicLength);
+  body.push_back(nextPacketId >> 8);
+  body.push_back(nextPacketId & 0xFF);
+  nextPacketId++;
+  body.insert(body.end(), payload, payload + strlen(payload));
+  send(0x32, body);
+}
+
+
+int MqttBrokerEmulator::connect(const char *host, uint16_t port) {
+  HostRuntime::SimulatedHardware hardware;
+  connectAttempts.push_back(HostRuntime::now());
+  if (!reachable) {
+    HostRuntime::advance(connectTimeoutMicros);
+    return 0;
+  }
+  HostRuntime::advance(connectMicros);
+  open = true;
+  stage = 0;
+  toClient.clear();
+  return 1;
+}
+
+size_t MqttBrokerEmulator::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+size_t MqttBrokerEmulator::write(const uint8_t *buffer, size_t size) {
+  HostRuntime::SimulatedHardware hardware;
+  if (!open)
+    return 0;
+  for (size_t i = 0; i < size && open; i++) {
+    uint8_t c = buffer[i];
+    switch (stage) {
+    case 0:
+      header = c;
+      length = 0;
+      shift = 0;
+      packet.clear();
+      stage = 1;
+      break;
+    case 1:
+      length |= (uint32_t)(c & 0x7F) << shift;
+      shift += 7;
+      if (!(c & 0x80)) {
+        stage = (length == 0) ? 0 : 2;
+        if (length == 0)
+          handlePacket();
+      }
+      break;
+    case 2:
+      packet.push_back(c);
+      if (packet.size() == length) {
+        stage = 0;
+        handlePacket();
+      }
+      break;
+    }
+  }
+  return size;
+}
+
+int MqttBrokerEmulator::available() {
+  HostRuntime::SimulatedHardware hardware;
+  int count = 0;
+  for (const RxByte &b : toClient) {
+    if (b.at > HostRuntime::now())
+      break;
+    count++;
+  }
+  return count;
+}
+
+int MqttBrokerEmulator::peek() {
+  HostRuntime::SimulatedHardware hardware;
+  if (toClient.empty() || toClient.front().at > HostRuntime::now())
+    return -1;
+  return toClient.front().value;
+}
+
+int MqttBrokerEmulator::read() {
+  int c = peek();
+  if (c >= 0)
+    toClient.pop_front();
+  return c;
+}
+
+uint8_t MqttBrokerEmulator::connected() {
+  // like WiFiClient: still "connected" while received data is waiting
+  return open || !toClient.empty();
+}
+
+void MqttBrokerEmulator::stop() {
+  open = false;
+  toClient.clear();
+}
+
+
+std::string MqttBrokerEmulator::readString(const std::vector<uint8_t> &data, size_t &pos) {
+  if (pos + 2 > data.size())
+    return "";
+  size_t length = (data[pos] << 8) | data[pos + 1];
+  pos += 2;
+  length = std::min(length, data.size() - pos);
+  std::string text((const char *)&data[pos], length);
+  pos += length;
+  return text;
+}
+
+void MqttBrokerEmulator::handlePacket() {
+  size_t pos = 0;
+  switch (header & 0xF0) {
+  case 0x10: { // CONNECT
+    pos = 7; // protocol name and level
+    uint8_t flags = packet[pos++];
+    pos += 2; // keep alive
+    clientId = readString(packet, pos);
+    if (flags & 0x04)
+      willTopic = readString(packet, pos);
+    send(0x20, { 0x00, connackCode });
+    if (connackCode == 0)
+      sessions.push_back(HostRuntime::now());
+    break;
+  }
+  case 0x30: { // PUBLISH
+    Publish publish;
+    publish.qos = (header >> 1) & 0x03;
+    publish.dup = (header & 0x08) != 0;
+    publish.at = HostRuntime::now();
+    publish.topic = readString(packet, pos);
+    uint8_t id[2] = { 0, 0 };
+    if (publish.qos > 0 && pos + 2 <= packet.size()) {
+      id[0] = packet[pos++];
+      id[1] = packet[pos++];
+    }
+    publish.payload.assign(packet.begin() + pos, packet.end());
+    publishes.push_back(publish);
+    if (publish.qos == 1)
+      send(0x40, { id[0], id[1] });
+    break;
+  }
+  case 0x80: { // SUBSCRIBE
+    uint8_t id[2] = { packet[0], packet[1] };
+    pos = 2;
+    subscriptions.push_back(readString(packet, pos));
+    send(0x90, { id[0], id[1], 0x01 });
+    break;
+  }
+  case 0xC0: // PINGREQ
+    if (answerPings)
+      send(0xD0, {});
+    break;
+  case 0xE0: // DISCONNECT
+    open = false;
+    break;
+  }
+}
+
+void MqttBrokerEmulator::send(uint8_t header, const std::vector<uint8_t> &body) {
+  uint64_t at = HostRuntime::now() + roundTripMicros;
+  toClient.push_back({ at, header });
+  size_t remaining = body.size();
+  do {
+    uint8_t digit = remaining & 0x7F;
+    remaining >>= 7;
+    toClient.push_back({ at, (uint8_t)(digit | (remaining > 0 ? 0x80 : 0)) });
+  } while (remaining > 0);
+  for (uint8_t c : body)
+    toClient.push_back({ at, c });
+}
@@ -0,0 +1,74 @@
+#ifndef MQTTBROKEREMULATOR_H
+#define MQTTBROKEREMULATOR_H
+
+#include <Client.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+/*
+  In-process MQTT 3.1.1 broker for the [env:native] build, seen by the firmware as the Client (TCP connection) of
+  MqttEngine. It answers CONNECT, PUBLISH (QoS 0/1), SUBSCRIBE and PINGREQ after a modelled round trip on the virtual
+  clock, records every publish it gets and lets a benchmark inject outages: an unreachable broker (connect() blocks
+  until its timeout and fails), dropped connections and refused logins.
+*/
+class MqttBrokerEmulator : public Client {
+  public:
+    struct Publish {
+      std::string topic;
+      std::string payload;
+      uint8_t qos;
+      bool dup;
+      uint64_t at;            // virtual time it arrived
+    };
+
+    // simulated network and broker
+    bool reachable = true;
+    uint32_t connectMicros = 2000;        // DNS + TCP handshake on the LAN
+    uint32_t connectTimeoutMicros = 3000000; // connect() to an unreachable broker fails after this long
+    uint32_t roundTripMicros = 5000;      // until CONNACK, PUBACK, SUBACK, PINGRESP arrive
+    uint8_t connackCode = 0;              // 0 = accepted, 4/5 = bad credentials / not authorized
+    bool answerPings = true;
+    void dropConnection();                // e.g. restart of the broker, answers not yet sent are lost
+    void sendToClient(const char *topic, const char *payload); // QoS 1 publish to the subscriber
+
+    // what the broker saw
+    std::vector<Publish> publishes;
+    std::vector<std::string> subscriptions;
+    std::vector<uint64_t> connectAttempts; // virtual time of every connect(), to check the backoff
+    std::vector<uint64_t> sessions;        // virtual time of every accepted CONNECT
+    std::string clientId;
+    std::string willTopic;
+
+    // Client
+    int connect(const char *host, uint16_t port) override;
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+    int available() override;
+    int read() override;
+    int peek() override;
+    uint8_t connected() override;
+    void stop() override;
+
+  private:
+    struct RxByte {
+      uint64_t at;  // virtual time the byte is available to the client
+      uint8_t value;
+    };
+    bool open = false;
+    std::deque<RxByte> toClient;
+    uint16_t nextPacketId = 1;
+
+    // parser of the packets from the client
+    uint8_t stage = 0;
+    uint8_t header = 0;
+    uint32_t length = 0;
+    uint8_t shift = 0;
+    std::vector<uint8_t> packet;
+
+    void handlePacket();
+    void send(uint8_t header, const std::vector<uint8_t> &body);
+    static std::string readString(const std::vector<uint8_t> &data, size_t &pos);
+};
+
+#endif
@@ -0,0 +1,186 @@
+#include <Preferences.h>
+#include "HostRuntime.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace {
+
+  struct Entry {
+    PreferenceType type = PT_INVALID;
+    std::vector<uint8_t> data;
+  };
+
+  typedef std::map<std::string, Entry> Namespace;
+  std::map<std::string, Namespace> store;
+
+  // Rough cost of NVS operations on an ESP32 (40 MHz flash): opening a namespace, the hash table lookup of a key,
+  // reading and writing the 32 byte entries of a value. Each call advances the virtual clock, like it blocks on the device.
+  const uint32_t openMicros = 40;
+  const uint32_t lookupMicros = 25;
+  const uint32_t entryReadMicros = 4;
+  const uint32_t entryWriteMicros = 120;
+
+  size_t entriesOf(PreferenceType type, size_t len) {
+    return (type == PT_STR || type == PT_BLOB) ? 1 + (len + 31) / 32 : 1; // strings and blobs: header + data entries
+  }
+
+  void chargeRead(size_t entries) {
+    Preferences::stats.reads++;
+    Preferences::stats.micros += lookupMicros + entries * entryReadMicros;
+    HostRuntime::advance(lookupMicros + entries * entryReadMicros);
+  }
+
+  void chargeWrite(size_t entries) {
+    Preferences::stats.writes++;
+    Preferences::stats.entriesWritten += entries;
+    Preferences::stats.micros += lookupMicros + entries * entryWriteMicros;
+    HostRuntime::advance(lookupMicros + entries * entryWriteMicros);
+  }
+
+}
+
+Preferences::Stats Preferences::stats;
+bool Preferences::failWrites = false;
+
+void Preferences::resetStore() {
+  store.clear();
+  stats = Stats();
+}
+
+bool Preferences::begin(const char *name, bool readOnly, const char *partition_label) {
+  if (started || name == NULL || strlen(name) > 15)
+    return false;
+  this->name = name;
+  this->readOnly = readOnly;
+  if (!readOnly)
+    store[name];
+  else if (store.find(name) == store.end())
+    return false; // the ESP32 implementation cannot open a non-existing namespace read-only
+  started = true;
+  stats.opens++;
+  stats.micros += openMicros;
+  HostRuntime::advance(openMicros);
+  return true;
+}
+
+void Preferences::end() {
+  started = false;
+}
+
+bool Preferences::clear() {
+  if (!started || readOnly)
+    return false;
+  Namespace &ns = store[name.c_str()];
+  chargeWrite(ns.size()); // every entry is marked as erased
+  ns.clear();
+  return true;
+}
+
+bool Preferences::remove(const char *key) {
+  if (!started || readOnly)
+    return false;
+  chargeWrite(1);
+  return store[name.c_str()].erase(key) > 0;
+}
+
+bool Preferences::isKey(const char *key) {
+  return getType(key) != PT_INVALID;
+}
+
+PreferenceType Preferences::getType(const char *key) {
+  if (!started)
+    return PT_INVALID;
+  chargeRead(0);
+  Namespace &ns = store[name.c_str()];
+  auto it = ns.find(key);
+  return it == ns.end() ? PT_INVALID : it->second.type;
+}
+
+size_t Preferences::freeEntries() {
+  return 630; // typical value for the default 20 kB nvs partition
+}
+
+size_t Preferences::putRaw(const char *key, PreferenceType type, const void *value, size_t len) {
+  if (!started || readOnly || key == NULL || strlen(key) > 15 || failWrites)
+    return 0;
+  chargeWrite(entriesOf(type, len));
+  Entry &entry = store[name.c_str()][key];
+  entry.type = type;
+  entry.data.assign((const uint8_t *)value, (const uint8_t *)value + len);
+  return len;
+}
+
+bool Preferences::getRaw(const char *key, PreferenceType type, void *value, size_t len) {
+  if (!started || key == NULL)
+    return false;
+  Namespace &ns = store[name.c_str()];
+  auto it = ns.find(key);
+  chargeRead(it == ns.end() ? 0 : entriesOf(it->second.type, it->second.data.size()));
+  if (it == ns.end() || it->second.type != type || it->second.data.size() != len)
+    return false;
+  memcpy(value, it->second.data.data(), len);
+  return true;
+}
+
+size_t Preferences::putBool(const char *key, bool value) { return putUChar(key, value ? 1 : 0); }
+size_t Preferences::putUChar(const char *key, uint8_t value) { return putRaw(key, PT_U8, &value, sizeof(value)); }
+size_t Preferences::putUShort(const char *key, uint16_t value) { return putRaw(key, PT_U16, &value, sizeof(value)); }
+size_t Preferences::putInt(const char *key, int32_t value) { return putRaw(key, PT_I32, &value, sizeof(value)); }
+size_t Preferences::putUInt(const char *key, uint32_t value) { return putRaw(key, PT_U32, &value, sizeof(value)); }
+size_t Preferences::putString(const char *key, const char *value) { return putRaw(key, PT_STR, value, strlen(value) + 1); }
+size_t Preferences::putString(const char *key, String value) { return putString(key, value.c_str()); }
+size_t Preferences::putBytes(const char *key, const void *value, size_t len) { return putRaw(key, PT_BLOB, value, len); }
+
+bool Preferences::getBool(const char *key, bool defaultValue) { return getUChar(key, defaultValue ? 1 : 0) == 1; }
+uint8_t Preferences::getUChar(const char *key, uint8_t defaultValue) { uint8_t v; return getRaw(key, PT_U8, &v, sizeof(v)) ? v : defaultValue; }
+uint16_t Preferences::getUShort(const char *key, uint16_t defaultValue) { uint16_t v; return getRaw(key, PT_U16, &v, sizeof(v)) ? v : defaultValue; }
+int32_t Preferences::getInt(const char *key, int32_t defaultValue) { int32_t v; return getRaw(key, PT_I32, &v, sizeof(v)) ? v : defaultValue; }
+uint32_t Preferences::getUInt(const char *key, uint32_t defaultValue) { uint32_t v; return getRaw(key, PT_U32, &v, sizeof(v)) ? v : defaultValue; }
+
+size_t Preferences::getString(const char *key, char *value, size_t maxLen) {
+  if (!started || key == NULL)
+    return 0;
+  Namespace &ns = store[name.c_str()];
+  auto it = ns.find(key);
+  chargeRead(it == ns.end() ? 0 : entriesOf(it->second.type, it->second.data.size()));
+  if (it == ns.end() || it->second.type != PT_STR || it->second.data.size() > maxLen)
+    return 0;
+  memcpy(value, it->second.data.data(), it->second.data.size());
+  return it->second.data.size();
+}
+
+String Preferences::getString(const char *key, String defaultValue) {
+  if (!started || key == NULL)
+    return defaultValue;
+  Namespace &ns = store[name.c_str()];
+  auto it = ns.find(key);
+  chargeRead(it == ns.end() ? 0 : entriesOf(it->second.type, it->second.data.size()));
+  if (it == ns.end() || it->second.type != PT_STR)
+    return defaultValue;
+  return String((const char *)it->second.data.data());
+}
+
+size_t Preferences::getBytesLength(const char *key) {
+  if (!started || key == NULL)
+    return 0;
+  Namespace &ns = store[name.c_str()];
+  auto it = ns.find(key);
+  chargeRead(0); // the length is part of the header entry
+  if (it == ns.end() || it->second.type != PT_BLOB)
+    return 0;
+  return it->second.data.size();
+}
+
+size_t Preferences::getBytes(const char *key, void *buf, size_t maxLen) {
+  if (!started || key == NULL)
+    return 0;
+  Namespace &ns = store[name.c_str()];
+  auto it = ns.find(key);
+  chargeRead(it == ns.end() ? 0 : entriesOf(it->second.type, it->second.data.size()));
+  if (it == ns.end() || it->second.type != PT_BLOB || it->second.data.size() > maxLen)
+    return 0;
+  memcpy(buf, it->second.data.data(), it->second.data.size());
+  return it->second.data.size();
+}
@@ -0,0 +1,581 @@
+#include "R503Emulator.h"
+#include "HostRuntime.h"
+
+#define R503_WRITENOTEPAD 0x18
+#define R503_READNOTEPAD 0x19
+#define R503_DOWNCHAR 0x09
+#define R503_READINDEXTABLE 0x1F
+#define R503_AUTOIDENTIFY 0x32
+#define R503_AUTOTIMEOUT 0x26
+
+// step codes in AutoIdentify replies
+#define R503_STEP_CHECK 0x00
+#define R503_STEP_IMAGE 0x01
+#define R503_STEP_EXTRACT 0x02
+#define R503_STEP_SEARCH 0x05
+
+R503Emulator::R503Emulator(uint16_t capacity) : library(capacity, 0), rng(0x503), faultRng(0xFA17) {
+  memset(notepad, 0, sizeof(notepad));
+  memset(faultCounts, 0, sizeof(faultCounts));
+  resetStatistics();
+}
+
+void R503Emulator::resetStatistics() {
+  memset(commandCounts, 0, sizeof(commandCounts));
+  bytesToSensor = 0;
+  bytesToHost = 0;
+}
+
+unsigned long R503Emulator::totalCommands() const {
+  unsigned long total = 0;
+  for (int i = 0; i < 256; i++)
+    total += commandCounts[i];
+  return total;
+}
+
+void R503Emulator::connectTouchRing(uint8_t pin) {
+  touchRingPin = pin;
+  HostRuntime::drivePin(pin, HIGH);
+}
+
+void R503Emulator::placeFinger(int person) {
+  fingerPerson = person;
+  if (touchRingPin != 0xFF) {
+    // the touch output only gives a short low pulse at the beginning of a touch
+    uint8_t pin = touchRingPin;
+    HostRuntime::drivePin(pin, LOW);
+    HostRuntime::scheduleIn(touchPulseMicros, [pin]() { HostRuntime::drivePin(pin, HIGH); });
+  }
+}
+
+void R503Emulator::liftFinger() {
+  fingerPerson = 0;
+}
+
+// a partial image is stored as the negative person, it matches no template
+int R503Emulator::takeImage() {
+  if (partialImageRate > 0.0f && std::uniform_real_distribution<float>(0.0f, 1.0f)(rng) < partialImageRate)
+    return -fingerPerson;
+  return fingerPerson;
+}
+
+void R503Emulator::storeTemplate(uint16_t id, int person) {
+  if (id < library.size())
+    library[id] = person;
+}
+
+int R503Emulator::templateAt(uint16_t id) const {
+  return id < library.size() ? library[id] : 0;
+}
+
+uint16_t R503Emulator::templateCount() const {
+  uint16_t count = 0;
+  for (int person : library)
+    if (person != 0)
+      count++;
+  return count;
+}
+
+
+void R503Emulator::hostBaudChanged(uint32_t baud) {
+  hostBaud = baud;
+  rxPacket.clear();
+  txQueue.clear();
+}
+
+void R503Emulator::receive(uint8_t c) {
+  bytesToSensor++;
+  rxArrival = std::max(rxArrival, HostRuntime::now()) + byteMicros(hostBaud ? hostBaud : sensorBaud);
+  if (isRestarting())
+    return;
+  if (hostBaud != sensorBaud)
+    return; // framing errors, the sensor sees garbage and stays silent
+
+  if (rxPacket.empty() && c != (FINGERPRINT_STARTCODE >> 8))
+    return;
+  rxPacket.push_back(c);
+  if (rxPacket.size() >= 9) {
+    size_t expected = 9 + readU16(&rxPacket[7]);
+    if (rxPacket.size() == expected)
+      handlePacket();
+  }
+}
+
+int R503Emulator::available() {
+  uint64_t now = HostRuntime::now();
+  int count = 0;
+  for (const TxByte &b : txQueue) {
+    if (b.readyAt > now)
+      break;
+    count++;
+  }
+  return count;
+}
+
+int R503Emulator::peek() {
+  if (txQueue.empty() || txQueue.front().readyAt > HostRuntime::now())
+    return -1;
+  return txQueue.front().value;
+}
+
+int R503Emulator::read() {
+  int c = peek();
+  if (c >= 0)
+    txQueue.pop_front();
+  return c;
+}
+
+
+void R503Emulator::handlePacket() {
+  std::vector<uint8_t> packet;
+  packet.swap(rxPacket);
+
+  uint64_t receivedAt = rxArrival;
+  uint16_t length = readU16(&packet[7]);
+  if (packet[1] != (FINGERPRINT_STARTCODE & 0xFF) || length < 3)
+    return;
+
+  uint16_t sum = packet[6] + packet[7] + packet[8];
+  for (size_t i = 9; i < packet.size() - 2; i++)
+    sum += packet[i];
+  if (sum != readU16(&packet[packet.size() - 2])) {
+    reply(receivedAt, timing.other, FINGERPRINT_PACKETRECIEVEERR);
+    return;
+  }
+  if (packet[6] == FINGERPRINT_DATAPACKET || packet[6] == FINGERPRINT_ENDDATAPACKET) {
+    handleDataPacket(packet[6], &packet[9], length - 2);
+    return;
+  }
+  if (packet[6] != FINGERPRINT_COMMANDPACKET)
+    return;
+
+  handleCommand(&packet[9], length - 2, receivedAt);
+}
+
+void R503Emulator::handleCommand(const uint8_t *data, uint16_t length, uint64_t receivedAt) {
+  uint8_t command = data[0];
+  commandCounts[command]++;
+  commandSequence++;
+  if (injectFault(R503Fault::powerCycle, faults.powerCycleRate)) {
+    powerCycle();
+    return;
+  }
+  if (injectFault(R503Fault::noReply, faults.noReplyRate))
+    return;
+
+  switch (command) {
+    case FINGERPRINT_VERIFYPASSWORD: {
+      uint32_t pw = length >= 5 ? ((uint32_t)data[1] << 24) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 8) | data[4] : 0xFFFFFFFF;
+      reply(receivedAt, timing.verifyPassword, pw == password ? FINGERPRINT_OK : FINGERPRINT_PASSFAIL);
+      break;
+    }
+
+    case FINGERPRINT_READSYSPARAM: {
+      uint16_t capacity = (uint16_t)library.size();
+      uint16_t baudFactor = (uint16_t)(sensorBaud / 9600);
+      uint8_t params[16] = {
+        0x00, 0x00,                                   // status register
+        0x00, 0x09,                                   // system identifier code
+        (uint8_t)(capacity >> 8), (uint8_t)capacity,
+        (uint8_t)(securityLevel >> 8), (uint8_t)securityLevel,
+        0xFF, 0xFF, 0xFF, 0xFF,                       // device address
+        (uint8_t)(packetSizeCode >> 8), (uint8_t)packetSizeCode,
+        (uint8_t)(baudFactor >> 8), (uint8_t)baudFactor
+      };
+      reply(receivedAt, timing.other, FINGERPRINT_OK, params, sizeof(params));
+      break;
+    }
+
+    case FINGERPRINT_TEMPLATECOUNT: {
+      uint16_t count = templateCount();
+      uint8_t payload[2] = { (uint8_t)(count >> 8), (uint8_t)count };
+      reply(receivedAt, timing.other, FINGERPRINT_OK, payload, sizeof(payload));
+      break;
+    }
+
+    case FINGERPRINT_GETIMAGE:
+      if (fingerPerson != 0 && injectFault(R503Fault::imageFail, faults.imageFailRate)) {
+        imageBuffer = 0;
+        reply(receivedAt, timing.getImageFinger, FINGERPRINT_IMAGEFAIL);
+      } else if (fingerPerson != 0) {
+        imageBuffer = takeImage();
+        reply(receivedAt, timing.getImageFinger, FINGERPRINT_OK);
+      } else {
+        reply(receivedAt, timing.getImageNoFinger, FINGERPRINT_NOFINGER);
+      }
+      break;
+
+    case FINGERPRINT_IMAGE2TZ: {
+      uint8_t buffer = length >= 2 ? data[1] : 1;
+      if (buffer < 1 || buffer > 6) {
+        reply(receivedAt, timing.other, FINGERPRINT_BADLOCATION);
+      } else if (imageBuffer == 0) {
+        reply(receivedAt, timing.image2TzFailed, FINGERPRINT_INVALIDIMAGE);
+      } else if (std::uniform_real_distribution<float>(0.0f, 1.0f)(rng) < messyImageRate) {
+        reply(receivedAt, timing.image2TzFailed, FINGERPRINT_IMAGEMESS);
+      } else if (injectFault(R503Fault::featureFail, faults.featureFailRate)) {
+        reply(receivedAt, timing.image2TzFailed, FINGERPRINT_FEATUREFAIL);
+      } else {
+        charBuffer[buffer] = imageBuffer;
+        reply(receivedAt, timing.image2Tz, FINGERPRINT_OK);
+      }
+      break;
+    }
+
+    case FINGERPRINT_SEARCH:
+    case FINGERPRINT_HISPEEDSEARCH: {
+      uint8_t buffer = data[1];
+      uint16_t start = readU16(&data[2]);
+      uint16_t count = readU16(&data[4]);
+      uint32_t end = (uint32_t)start + count;
+      if (end > library.size())
+        end = library.size();
+      uint32_t searched = end > start ? end - start : 0;
+      uint32_t latency = timing.searchBase + timing.searchPerTemplate * searched;
+      int person = (buffer >= 1 && buffer <= 6) ? charBuffer[buffer] : 0;
+      for (uint32_t page = start; person != 0 && page < end; page++) {
+        if (library[page] == person) {
+          uint16_t score = (uint16_t)std::uniform_int_distribution<int>(60, 250)(rng);
+          uint8_t payload[4] = { (uint8_t)(page >> 8), (uint8_t)page, (uint8_t)(score >> 8), (uint8_t)score };
+          // the sensor stops at the first hit, so a match costs only the part of the range searched so far
+          reply(receivedAt, timing.searchBase + timing.searchPerTemplate * (page - start + 1), FINGERPRINT_OK, payload, sizeof(payload));
+          return;
+        }
+      }
+      uint8_t payload[4] = { 0, 0, 0, 0 };
+      reply(receivedAt, latency, FINGERPRINT_NOTFOUND, payload, sizeof(payload));
+      break;
+    }
+
+    case FINGERPRINT_REGMODEL: {
+      int person = charBuffer[1];
+      bool matched = person != 0;
+      for (int i = 2; i <= 6; i++)
+        if (charBuffer[i] != 0 && charBuffer[i] != person)
+          matched = false;
+      if (matched) {
+        for (int i = 1; i <= 6; i++)
+          charBuffer[i] = person;
+      }
+      reply(receivedAt, timing.regModel, matched ? FINGERPRINT_OK : FINGERPRINT_ENROLLMISMATCH);
+      break;
+    }
+
+    case FINGERPRINT_STORE: {
+      uint8_t buffer = data[1];
+      uint16_t page = readU16(&data[2]);
+      if (page >= library.size() || buffer < 1 || buffer > 6) {
+        reply(receivedAt, timing.other, FINGERPRINT_BADLOCATION);
+      } else {
+        library[page] = charBuffer[buffer];
+        for (int i = 1; i <= 6; i++)
+          charBuffer[i] = 0;
+        reply(receivedAt, timing.store, FINGERPRINT_OK);
+      }
+      break;
+    }
+
+    case FINGERPRINT_LOAD: {
+      uint8_t buffer = data[1];
+      uint16_t page = readU16(&data[2]);
+      if (page >= library.size() || buffer < 1 || buffer > 6) {
+        reply(receivedAt, timing.other, FINGERPRINT_BADLOCATION);
+      } else if (library[page] == 0) {
+        reply(receivedAt, timing.load, FINGERPRINT_DBREADFAIL);
+      } else {
+        charBuffer[buffer] = library[page];
+        reply(receivedAt, timing.load, FINGERPRINT_OK);
+      }
+      break;
+    }
+
+    case FINGERPRINT_DELETE: {
+      uint16_t page = readU16(&data[1]);
+      uint16_t count = readU16(&data[3]);
+      if ((uint32_t)page + count > library.size()) {
+        reply(receivedAt, timing.other, FINGERPRINT_DELETEFAIL);
+      } else {
+        for (uint16_t i = 0; i < count; i++)
+          library[page + i] = 0;
+        reply(receivedAt, timing.deleteTemplate, FINGERPRINT_OK);
+      }
+      break;
+    }
+
+    case FINGERPRINT_EMPTY:
+      for (int &person : library)
+        person = 0;
+      reply(receivedAt, timing.emptyDatabase, FINGERPRINT_OK);
+      break;
+
+    case FINGERPRINT_WRITE_REG: {
+      uint8_t reg = data[1];
+      uint8_t value = data[2];
+      if (reg == FINGERPRINT_BAUD_REG_ADDR && value >= 1 && value <= 12) {
+        reply(receivedAt, timing.writeReg, FINGERPRINT_OK);
+        sensorBaud = 9600u * value; // new rate is used from the next packet on
+      } else if (reg == FINGERPRINT_SECURITY_REG_ADDR && value >= 1 && value <= 5) {
+        securityLevel = value;
+        reply(receivedAt, timing.writeReg, FINGERPRINT_OK);
+      } else if (reg == FINGERPRINT_PACKET_REG_ADDR && value <= 3) {
+        packetSizeCode = value;
+        reply(receivedAt, timing.writeReg, FINGERPRINT_OK);
+      } else {
+        reply(receivedAt, timing.other, FINGERPRINT_INVALIDREG);
+      }
+      break;
+    }
+
+    case R503_WRITENOTEPAD: {
+      uint8_t page = data[1];
+      if (page > 15 || length < 34) {
+        reply(receivedAt, timing.other, FINGERPRINT_PACKETRECIEVEERR);
+      } else {
+        memcpy(notepad[page], &data[2], 32);
+        reply(receivedAt, timing.writeNotepad, FINGERPRINT_OK);
+      }
+      break;
+    }
+
+    case R503_READNOTEPAD: {
+      uint8_t page = data[1];
+      if (page > 15) {
+        reply(receivedAt, timing.other, FINGERPRINT_PACKETRECIEVEERR);
+      } else {
+        reply(receivedAt, timing.readNotepad, FINGERPRINT_OK, (const uint8_t *)notepad[page], 32);
+      }
+      break;
+    }
+
+    case FINGERPRINT_AURALEDCONFIG:
+      setLed(data[1], data[3]);
+      reply(receivedAt, timing.ledControl, FINGERPRINT_OK);
+      break;
+
+    case FINGERPRINT_LEDON:
+    case FINGERPRINT_LEDOFF:
+      reply(receivedAt, timing.ledControl, FINGERPRINT_OK);
+      break;
+
+    case FINGERPRINT_UPLOAD: {
+      uint8_t buffer = data[1];
+      if (buffer < 1 || buffer > 6 || charBuffer[buffer] == 0) {
+        reply(receivedAt, timing.other, FINGERPRINT_UPLOADFEATUREFAIL);
+        break;
+      }
+      reply(receivedAt, timing.upChar, FINGERPRINT_OK);
+      std::vector<uint8_t> content = encodeTemplate(charBuffer[buffer]);
+      for (size_t pos = 0; pos < content.size(); pos += packetLength()) {
+        uint16_t chunk = (uint16_t)std::min<size_t>(packetLength(), content.size() - pos);
+        bool last = pos + chunk >= content.size();
+        sendPacket(txBusyUntil, last ? FINGERPRINT_ENDDATAPACKET : FINGERPRINT_DATAPACKET, &content[pos], chunk);
+      }
+      break;
+    }
+
+    case R503_DOWNCHAR: {
+      uint8_t buffer = data[1];
+      if (buffer < 1 || buffer > 6) {
+        reply(receivedAt, timing.other, FINGERPRINT_PACKETRESPONSEFAIL);
+        break;
+      }
+      downloading = true;
+      downloadBuffer = buffer;
+      downloadData.clear();
+      reply(receivedAt, timing.downChar, FINGERPRINT_OK);
+      break;
+    }
+
+    case R503_READINDEXTABLE: {
+      uint8_t indexPage = data[1];
+      uint8_t bitmap[32] = {0};
+      for (int bit = 0; bit < 256; bit++) {
+        size_t page = indexPage * 256u + bit;
+        if (page < library.size() && library[page] != 0)
+          bitmap[bit / 8] |= (uint8_t)(1 << (bit % 8));
+      }
+      // pages 0..3 on the R503, larger sensors have a page per 256 slots of their capacity
+      bool validPage = indexTablePages != 0 ? indexPage < indexTablePages : (indexPage <= 3 || indexPage * 256u < library.size());
+      reply(receivedAt, timing.readIndexTable, validPage ? FINGERPRINT_OK : FINGERPRINT_PACKETRESPONSEFAIL, bitmap, sizeof(bitmap));
+      break;
+    }
+
+    case R503_AUTOIDENTIFY: {
+      if (!autoIdentifySupported || length < 6) {
+        reply(receivedAt, timing.other, FINGERPRINT_PACKETRECIEVEERR);
+        break;
+      }
+      uint16_t page = readU16(&data[2]);
+      if (page != 0xFFFF && page >= library.size()) {
+        uint8_t payload[5] = { R503_STEP_CHECK, 0, 0, 0, 0 };
+        reply(receivedAt, timing.other, FINGERPRINT_BADLOCATION, payload, sizeof(payload));
+        break;
+      }
+      unsigned long sequence = commandSequence;
+      HostRuntime::schedule(receivedAt, [this, sequence, receivedAt, page]() {
+        autoIdentifyPoll(sequence, receivedAt + timing.autoIdentifyFingerWait, page);
+      });
+      break;
+    }
+
+    default:
+      reply(receivedAt, timing.other, FINGERPRINT_PACKETRECIEVEERR);
+      break;
+  }
+}
+
+/* AutoIdentify keeps the sensor busy until a finger is placed (checked every 10ms) or the wait time is over, then
+   captures, extracts and searches like GetImage + Img2Tz + Search without the round trips in between. */
+void R503Emulator::autoIdentifyPoll(unsigned long sequence, uint64_t deadline, uint16_t page) {
+  if (sequence != commandSequence)
+    return;
+  uint64_t now = HostRuntime::now();
+
+  if (fingerPerson == 0) {
+    if (now >= deadline) {
+      uint8_t payload[5] = { R503_STEP_IMAGE, 0, 0, 0, 0 };
+      reply(now, 0, R503_AUTOTIMEOUT, payload, sizeof(payload));
+    } else {
+      HostRuntime::schedule(std::min(now + 10000, deadline), [this, sequence, deadline, page]() {
+        autoIdentifyPoll(sequence, deadline, page);
+      });
+    }
+    return;
+  }
+
+  imageBuffer = takeImage();
+  uint32_t latency = timing.getImageFinger;
+  if (std::uniform_real_distribution<float>(0.0f, 1.0f)(rng) < messyImageRate) {
+    uint8_t payload[5] = { R503_STEP_EXTRACT, 0, 0, 0, 0 };
+    reply(now, latency + timing.image2TzFailed, FINGERPRINT_IMAGEMESS, payload, sizeof(payload));
+    return;
+  }
+  charBuffer[1] = imageBuffer;
+  latency += timing.image2Tz;
+
+  uint32_t start = page == 0xFFFF ? 0 : page;
+  uint32_t end = page == 0xFFFF ? library.size() : page + 1;
+  for (uint32_t p = start; p < end; p++) {
+    if (library[p] == imageBuffer) {
+      uint16_t score = (uint16_t)std::uniform_int_distribution<int>(60, 250)(rng);
+      uint8_t payload[5] = { R503_STEP_SEARCH, (uint8_t)(p >> 8), (uint8_t)p, (uint8_t)(score >> 8), (uint8_t)score };
+      reply(now, latency + timing.searchBase + timing.searchPerTemplate * (p - start + 1), FINGERPRINT_OK, payload, sizeof(payload));
+      return;
+    }
+  }
+  uint8_t payload[5] = { R503_STEP_SEARCH, 0, 0, 0, 0 };
+  reply(now, latency + timing.searchBase + timing.searchPerTemplate * (end - start), FINGERPRINT_NOTFOUND, payload, sizeof(payload));
+}
+
+// data packets of a DownChar transfer, the sensor does not acknowledge them
+void R503Emulator::handleDataPacket(uint8_t type, const uint8_t *data, uint16_t length) {
+  if (!downloading)
+    return;
+  downloadData.insert(downloadData.end(), data, data + length);
+  if (type == FINGERPRINT_ENDDATAPACKET) {
+    downloading = false;
+    charBuffer[downloadBuffer] = decodeTemplate(downloadData);
+  }
+}
+
+// Template content: a fixed header, the person id and filler derived from it, so a round trip through
+// UpChar/DownChar restores the same person and corrupted data is noticed
+std::vector<uint8_t> R503Emulator::encodeTemplate(int person) const {
+  std::vector<uint8_t> content(templateSize);
+  content[0] = 0x03;
+  content[1] = 0x01;
+  content[2] = (uint8_t)(person >> 24);
+  content[3] = (uint8_t)(person >> 16);
+  content[4] = (uint8_t)(person >> 8);
+  content[5] = (uint8_t)person;
+  uint32_t x = 2166136261u ^ (uint32_t)person;
+  for (size_t i = 6; i < content.size(); i++) {
+    x = x * 16777619u + 0x9E37u;
+    content[i] = (uint8_t)(x >> 24);
+  }
+  return content;
+}
+
+int R503Emulator::decodeTemplate(const std::vector<uint8_t> &data) const {
+  if (data.size() != templateSize || data[0] != 0x03 || data[1] != 0x01)
+    return 0;
+  int person = (int)(((uint32_t)data[2] << 24) | ((uint32_t)data[3] << 16) | ((uint32_t)data[4] << 8) | data[5]);
+  return encodeTemplate(person) == data ? person : 0;
+}
+
+void R503Emulator::reply(uint64_t receivedAt, uint32_t latency, uint8_t confirmation, const uint8_t *payload, uint16_t payloadLength) {
+  if (injectFault(R503Fault::unknownCode, faults.unknownCodeRate))
+    confirmation = 0x7E; // not defined by the protocol
+  std::vector<uint8_t> content = { confirmation };
+  content.insert(content.end(), payload, payload + payloadLength);
+  sendPacket(receivedAt + latency, FINGERPRINT_ACKPACKET, content.data(), (uint16_t)content.size());
+}
+
+void R503Emulator::sendPacket(uint64_t at, uint8_t type, const uint8_t *payload, uint16_t payloadLength) {
+  uint16_t length = payloadLength + 2;
+  std::vector<uint8_t> packet = {
+    (uint8_t)(FINGERPRINT_STARTCODE >> 8), (uint8_t)(FINGERPRINT_STARTCODE & 0xFF),
+    0xFF, 0xFF, 0xFF, 0xFF,
+    type,
+    (uint8_t)(length >> 8), (uint8_t)length
+  };
+  packet.insert(packet.end(), payload, payload + payloadLength);
+  uint16_t sum = 0;
+  for (size_t i = 6; i < packet.size(); i++)
+    sum += packet[i];
+  packet.push_back((uint8_t)(sum >> 8));
+  packet.push_back((uint8_t)sum);
+  if (injectFault(R503Fault::corruptByte, faults.corruptByteRate))
+    packet[std::uniform_int_distribution<size_t>(0, packet.size() - 1)(faultRng)] ^= (uint8_t)std::uniform_int_distribution<int>(1, 255)(faultRng);
+  if (injectFault(R503Fault::dropByte, faults.dropByteRate))
+    packet.erase(packet.begin() + std::uniform_int_distribution<size_t>(0, packet.size() - 1)(faultRng));
+
+  if (at < txBusyUntil)
+    at = txBusyUntil;
+  uint64_t perByte = byteMicros(hostBaud ? hostBaud : sensorBaud);
+  for (uint8_t b : packet) {
+    at += perByte;
+    txQueue.push_back({ at, b });
+  }
+  txBusyUntil = at;
+  bytesToHost += packet.size();
+}
+
+bool R503Emulator::injectFault(R503Fault fault, float rate) {
+  if (rate <= 0.0f || std::uniform_real_distribution<float>(0.0f, 1.0f)(faultRng) >= rate)
+    return false;
+  faultCounts[(int)fault]++;
+  if (onFault)
+    onFault(fault);
+  return true;
+}
+
+bool R503Emulator::isRestarting() const {
+  return HostRuntime::now() < restartedAt;
+}
+
+/* Brown-out: everything in RAM is lost (image and char buffers, LED state, a running AutoIdentify, replies not sent
+   yet), the library, notepad and system parameters are in flash and survive. After the restart the sensor announces
+   itself with a single 0x55 byte. */
+void R503Emulator::powerCycle() {
+  uint64_t now = HostRuntime::now();
+  for (int &person : charBuffer)
+    person = 0;
+  imageBuffer = 0;
+  downloading = false;
+  rxPacket.clear();
+  while (!txQueue.empty() && txQueue.back().readyAt > now)
+    txQueue.pop_back();
+  txBusyUntil = now;
+  setLed(FINGERPRINT_LED_OFF, FINGERPRINT_LED_BLUE);
+  restartedAt = now + faults.powerCycleMicros;
+  txQueue.push_back({ restartedAt, 0x55 });
+  txBusyUntil = restartedAt;
+}
+
+void R503Emulator::setLed(uint8_t control, uint8_t color) {
+  ledControl = control;
+  ledColor = color;
+  if (onLedChanged)
+    onLedChanged(control, color);
+}
@@ -0,0 +1,159 @@
+#ifndef R503EMULATOR_H
+#define R503EMULATOR_H
+
+#include <Arduino.h>
+#include <Adafruit_Fingerprint.h>
+#include <deque>
+#include <functional>
+#include <random>
+#include <vector>
+
+/*
+  In-process emulation of a Grow R503 fingerprint sensor for the [env:native] build. It is attached to a HardwareSerial
+  stand-in and speaks the same packet protocol as the real sensor (header 0xEF01, address, packet id, length, payload,
+  checksum), so Adafruit_Fingerprint and our own raw commands (e.g. notepad) run unmodified against it.
+
+  Fingers are modelled as "persons": a template stores the id of the person it was taken from, and a search matches
+  if the feature buffer and a stored template belong to the same person. Every command is answered after its modelled
+  processing time plus the UART transfer time at the current baud rate, all on the virtual clock of HostRuntime.
+*/
+
+// Sensor-side processing time per command in microseconds (UART transfer time is added on top)
+struct R503Timing {
+  uint32_t verifyPassword = 5000;
+  uint32_t getImageFinger = 130000;
+  uint32_t getImageNoFinger = 25000;
+  uint32_t image2Tz = 160000;
+  uint32_t image2TzFailed = 60000;
+  uint32_t searchBase = 5000;
+  uint32_t searchPerTemplate = 1000;  // per page of the searched range (200 templates ~ 0.2 s)
+  uint32_t regModel = 40000;
+  uint32_t store = 35000;
+  uint32_t load = 25000;
+  uint32_t deleteTemplate = 25000;
+  uint32_t emptyDatabase = 60000;
+  uint32_t readNotepad = 5000;
+  uint32_t writeNotepad = 30000;
+  uint32_t writeReg = 10000;
+  uint32_t ledControl = 5000;
+  uint32_t readIndexTable = 5000;
+  uint32_t upChar = 5000;             // until the first data packet is sent
+  uint32_t downChar = 5000;
+  uint32_t autoIdentifyFingerWait = 1000000; // AutoIdentify gives up if no finger is placed within this time
+  uint32_t other = 5000;
+};
+
+// Faults a soak test can inject, rates are probabilities per command (per reply for the transmission faults)
+enum class R503Fault { corruptByte, dropByte, noReply, unknownCode, imageFail, featureFail, powerCycle, count };
+
+struct R503Faults {
+  float corruptByteRate = 0.0f;   // one byte of the reply is changed on the wire
+  float dropByteRate = 0.0f;      // one byte of the reply is lost on the wire
+  float noReplyRate = 0.0f;       // the command is lost, the host runs into its timeout
+  float unknownCodeRate = 0.0f;   // the reply carries a confirmation code the host does not know
+  float imageFailRate = 0.0f;     // GetImage with a finger reports FINGERPRINT_IMAGEFAIL
+  float featureFailRate = 0.0f;   // Img2Tz reports FINGERPRINT_FEATUREFAIL
+  float powerCycleRate = 0.0f;    // the supply dips while a command is received: no reply, deaf while it restarts
+  uint32_t powerCycleMicros = 300000; // until the restarted sensor sends its 0x55 handshake byte
+};
+
+class R503Emulator : public SerialDevice {
+  public:
+    explicit R503Emulator(uint16_t capacity = 200);
+
+    R503Timing timing;
+    float messyImageRate = 0.0f;        // probability that Img2Tz reports FINGERPRINT_IMAGEMESS for a real finger
+    float partialImageRate = 0.0f;      // probability that an image of an enrolled finger matches no template (placed off center, dry skin), the next one may
+    uint32_t touchPulseMicros = 20000;  // duration of the low pulse on the touch ring output after a touch
+    bool autoIdentifySupported = true;  // false = behave like older sensors without AutoIdentify (0x32)
+    uint8_t indexTablePages = 0;        // ReadIndexTable pages answered, 0 = enough for the capacity (at least 0..3)
+    uint16_t templateSize = 1536;       // bytes per template in UpChar/DownChar transfers
+
+    // simulated world
+    void connectTouchRing(uint8_t pin);
+    void placeFinger(int person);       // person ids are >= 1
+    void liftFinger();
+    bool isFingerPlaced() const { return fingerPerson != 0; }
+    void storeTemplate(uint16_t id, int person);
+    int templateAt(uint16_t id) const;
+    uint16_t templateCount() const;
+    uint16_t capacity() const { return (uint16_t)library.size(); }
+
+    // called whenever the host changes the aura LED, e.g. to let a simulated user react on the ring color
+    std::function<void(uint8_t control, uint8_t color)> onLedChanged;
+
+    // fault injection, off by default. Uses its own random numbers so the other benchmarks are not affected.
+    R503Faults faults;
+    std::function<void(R503Fault fault)> onFault;
+    unsigned long faultCount(R503Fault fault) const { return faultCounts[(int)fault]; }
+    bool isRestarting() const;
+
+    // statistics
+    unsigned long commandCount(uint8_t command) const { return commandCounts[command]; }
+    unsigned long totalCommands() const;
+    uint64_t uartBytes() const { return bytesToSensor + bytesToHost; }
+    void resetStatistics();
+
+    // SerialDevice
+    void hostBaudChanged(uint32_t baud) override;
+    void receive(uint8_t c) override;
+    int available() override;
+    int peek() override;
+    int read() override;
+
+  private:
+    struct TxByte {
+      uint64_t readyAt;
+      uint8_t value;
+    };
+
+    std::vector<int> library;           // person id per page, 0 = empty
+    int charBuffer[7] = {0};
+    int imageBuffer = 0;
+    int fingerPerson = 0;
+    char notepad[16][32];
+    uint8_t touchRingPin = 0xFF;
+
+    uint32_t password = 0;
+    uint16_t securityLevel = 3;
+    uint16_t packetSizeCode = FINGERPRINT_PACKET_SIZE_128;
+    uint32_t sensorBaud = 57600;
+    uint32_t hostBaud = 0;
+    uint8_t ledControl = FINGERPRINT_LED_OFF;
+    uint8_t ledColor = FINGERPRINT_LED_BLUE;
+
+    std::vector<uint8_t> rxPacket;
+    uint64_t rxArrival = 0;             // virtual time the last received byte has completely arrived
+    bool downloading = false;           // DownChar accepted, data packets follow
+    uint8_t downloadBuffer = 1;
+    std::vector<uint8_t> downloadData;
+    std::deque<TxByte> txQueue;
+    uint64_t txBusyUntil = 0;
+    std::mt19937 rng;
+
+    unsigned long commandCounts[256];
+    uint64_t bytesToSensor = 0;
+    uint64_t bytesToHost = 0;
+    unsigned long commandSequence = 0;
+    std::mt19937 faultRng;
+    unsigned long faultCounts[(int)R503Fault::count];
+    uint64_t restartedAt = 0;           // virtual time a power cycle is over  // invalidates a pending AutoIdentify when the host sends the next command
+
+    uint64_t byteMicros(uint32_t baud) const { return 10000000ull / baud; }
+    void handlePacket();
+    void handleCommand(const uint8_t *data, uint16_t length, uint64_t receivedAt);
+    void reply(uint64_t receivedAt, uint32_t latency, uint8_t confirmation, const uint8_t *payload = nullptr, uint16_t payloadLength = 0);
+    void sendPacket(uint64_t at, uint8_t type, const uint8_t *payload, uint16_t payloadLength);
+    void handleDataPacket(uint8_t type, const uint8_t *data, uint16_t length);
+    int takeImage();                    // what GetImage/AutoIdentify see of the placed finger
+    std::vector<uint8_t> encodeTemplate(int person) const;
+    int decodeTemplate(const std::vector<uint8_t> &data) const;
+    uint16_t packetLength() const { return (uint16_t)(32 << packetSizeCode); }
+    void autoIdentifyPoll(unsigned long sequence, uint64_t deadline, uint16_t page);
+    void setLed(uint8_t control, uint8_t color);
+    uint16_t readU16(const uint8_t *p) const { return (uint16_t)((p[0] << 8) | p[1]); }
+    bool injectFault(R503Fault fault, float rate);
+    void powerCycle();
+};
+
+#endif
@@ -0,0 +1,231 @@
+#include "TracePlayer.h"
+#include "HostRuntime.h"
+#include <fstream>
+#include <iterator>
+
+static uint32_t readU32(const uint8_t *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+bool TracePlayer::load(const std::vector<uint8_t> &file, std::string &error) {
+  records.clear();
+  if (file.size() < uartTraceHeaderLength || memcmp(file.data(), "FDTR", 4) != 0) {
+    error = "not a UART trace";
+    return false;
+  }
+  if (file[4] != uartTraceVersion) {
+    error = "unknown trace version " + std::to_string(file[4]);
+    return false;
+  }
+  readerId = file[5];
+  droppedRecords = readU32(&file[8]);
+  size_t end = uartTraceHeaderLength + readU32(&file[12]);
+  if (end > file.size()) {
+    error = "trace is truncated";
+    return false;
+  }
+
+  size_t pos = uartTraceHeaderLength;
+  uint32_t lastMicros = 0;
+  uint64_t at = 0;
+  while (pos < end) {
+    if (pos + uartTraceRecordHeaderLength > end) {
+      error = "record header at " + std::to_string(pos) + " is truncated";
+      return false;
+    }
+    Record record;
+    record.type = (TraceRecord)file[pos];
+    uint32_t micros = readU32(&file[pos + 1]);
+    size_t length = ((size_t)file[pos + 5] << 8) | file[pos + 6];
+    pos += uartTraceRecordHeaderLength;
+    if (pos + length > end) {
+      error = "record at " + std::to_string(pos) + " is truncated";
+      return false;
+    }
+    // micros() of the device wraps after 71 minutes, the records are in time order
+    at = records.empty() ? micros : at + (uint32_t)(micros - lastMicros);
+    lastMicros = micros;
+    record.at = at;
+    record.data.assign(file.begin() + pos, file.begin() + pos + length);
+    pos += length;
+    records.push_back(record);
+  }
+  return true;
+}
+
+bool TracePlayer::loadFile(const char *path, std::string &error) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    error = std::string("can't open ") + path;
+    return false;
+  }
+  std::vector<uint8_t> file((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  return load(file, error);
+}
+
+
+TraceReplayReport TracePlayer::replay(FingerprintManager &fingerManager, uint8_t touchPin) {
+  TraceReplayReport report;
+  report.records = records.size();
+  report.droppedRecords = droppedRecords;
+  HostRuntime::drivePin(touchPin, HIGH);
+
+  uint8_t state[traceStateLength];
+  bool haveState = false;
+  bool started = false;
+  uint64_t traceStart = 0;
+  uint64_t replayStart = 0;
+  for (size_t i = 0; i < records.size(); i++) {
+    const Record &record = records[i];
+    if (record.type == TraceRecord::toSensor) {
+      report.skippedExchanges++;
+    } else if (record.type == TraceRecord::state) {
+      if (record.data.size() != traceStateLength)
+        continue;
+      if (haveState) {
+        fingerManager.getTraceState(state);
+        state[10] = (state[10] & ~traceFlagFingerOnSensor) | (record.data[10] & traceFlagFingerOnSensor);
+        if (memcmp(state, record.data.data(), traceStateLength) != 0)
+          report.stateMismatches++;
+      }
+      haveState = fingerManager.restoreTraceState(record.data.data(), record.data.size());
+    } else if (record.type == TraceRecord::scanStart) {
+      size_t end = i + 1;
+      while (end < records.size() && records[end].type != TraceRecord::decision && records[end].type != TraceRecord::scanStart)
+        end++;
+      if (!haveState || end >= records.size() || records[end].type != TraceRecord::decision || record.data.size() < 2) {
+        // the ring dropped the state, or the download happened in the middle of the pass
+        report.incompletePasses++;
+        if (end < records.size() && records[end].type == TraceRecord::scanStart)
+          end--;
+        i = end;
+        continue;
+      }
+
+      if (!started) {
+        started = true;
+        traceStart = record.at;
+        replayStart = HostRuntime::now();
+      }
+      uint64_t target = replayStart + (record.at - traceStart);
+      if (HostRuntime::now() < target)
+        HostRuntime::advance(target - HostRuntime::now());
+
+      fingerManager.getTraceState(state);
+      state[10] = record.data[1] ? (state[10] | traceFlagFingerOnSensor) : (state[10] & ~traceFlagFingerOnSensor);
+      fingerManager.restoreTraceState(state, sizeof(state));
+      if (record.data.size() >= 4) {
+        ScanLimits limits;
+        limits.imagingPasses = record.data[2];
+        limits.searchPasses = record.data[3];
+        fingerManager.getScanPolicy().overrideNextScan(limits);
+      }
+      cursor = i + 1;
+      passEnd = end;
+      command.clear();
+      rxQueue.clear();
+      rxPos = 0;
+      diverged = false;
+      divergence.clear();
+
+      TraceReplayPass pass;
+      const Record &decision = records[end];
+      pass.at = record.at - traceStart;
+      pass.recordedResult = (ScanResult)decision.data[0];
+      pass.recordedReturnCode = decision.data[1];
+      pass.recordedMatchId = ((uint16_t)decision.data[2] << 8) | decision.data[3];
+      pass.recordedMicros = decision.at - record.at;
+
+      if ((TraceTouch)record.data[0] != TraceTouch::none)
+        HostRuntime::drivePin(touchPin, LOW);
+      uint64_t passStart = HostRuntime::now();
+      pass.replayed = fingerManager.scanFingerprint();
+      pass.replayedMicros = HostRuntime::now() - passStart;
+      HostRuntime::drivePin(touchPin, HIGH);
+
+      while (cursor < passEnd && records[cursor].type == TraceRecord::fromSensor)
+        cursor++;
+      if (!diverged && cursor < passEnd) {
+        diverged = true;
+        char text[64];
+        snprintf(text, sizeof(text), "recorded command 0x%02X was not sent", records[cursor].data.size() > 9 ? records[cursor].data[9] : 0);
+        divergence = text;
+      }
+      pass.diverged = diverged;
+      if (diverged) {
+        report.divergedPasses++;
+        if (report.firstDivergence.empty())
+          report.firstDivergence = "pass at " + std::to_string(pass.at / 1000) + " ms: " + divergence;
+      }
+      if (pass.replayed.scanResult != pass.recordedResult || pass.replayed.returnCode != pass.recordedReturnCode
+        || (pass.recordedResult == ScanResult::matchFound && pass.replayed.matchId != pass.recordedMatchId))
+        report.decisionMismatches++;
+      uint64_t timingError = pass.replayedMicros > pass.recordedMicros ? pass.replayedMicros - pass.recordedMicros : pass.recordedMicros - pass.replayedMicros;
+      report.maxTimingError = std::max(report.maxTimingError, timingError);
+      report.passes.push_back(pass);
+      i = end;
+    }
+  }
+  passEnd = cursor = 0;
+  return report;
+}
+
+
+void TracePlayer::receive(uint8_t c) {
+  if (command.empty())
+    commandAt = HostRuntime::now();
+  command.push_back(c);
+  if (isCommandComplete()) {
+    commandReceived();
+    command.clear();
+  }
+}
+
+bool TracePlayer::isCommandComplete() const {
+  if (command[0] != (FINGERPRINT_STARTCODE >> 8))
+    return true; // not a packet, compared byte by byte
+  if (command.size() < 9)
+    return false;
+  return command.size() >= 9 + (size_t)((command[7] << 8) | command[8]);
+}
+
+// Answers the command with the bytes recorded after it, at the same offsets
+void TracePlayer::commandReceived() {
+  if (diverged || passEnd == 0)
+    return; // silent like an unplugged sensor, the pass runs into its timeouts
+  while (cursor < passEnd && records[cursor].type == TraceRecord::fromSensor)
+    cursor++;
+  if (cursor >= passEnd || records[cursor].type != TraceRecord::toSensor || records[cursor].data != command) {
+    diverged = true;
+    char text[96];
+    snprintf(text, sizeof(text), "sent command 0x%02X, recorded %s", command.size() > 9 ? command[9] : 0,
+      cursor >= passEnd ? "none" : "another one");
+    divergence = text;
+    return;
+  }
+  const Record &sent = records[cursor++];
+  for (; cursor < passEnd && records[cursor].type == TraceRecord::fromSensor; cursor++) {
+    for (uint8_t c : records[cursor].data)
+      rxQueue.push_back({ commandAt + (records[cursor].at - sent.at), c });
+  }
+}
+
+int TracePlayer::available() {
+  int count = 0;
+  for (size_t i = rxPos; i < rxQueue.size() && rxQueue[i].at <= HostRuntime::now(); i++)
+    count++;
+  return count;
+}
+
+int TracePlayer::peek() {
+  if (rxPos >= rxQueue.size() || rxQueue[rxPos].at > HostRuntime::now())
+    return -1;
+  return rxQueue[rxPos].value;
+}
+
+int TracePlayer::read() {
+  int c = peek();
+  if (c >= 0)
+    rxPos++;
+  return c;
+}
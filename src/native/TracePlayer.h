@@ -0,0 +1,93 @@
+#ifndef TRACEPLAYER_H
+#define TRACEPLAYER_H
+
+#include <Arduino.h>
+#include <string>
+#include <vector>
+#include "../FingerprintManager.h"
+
+/*
+  Replay of a UART trace (downloaded from /trace or recorded on the host) for the [env:native] build. The player sits
+  behind a HardwareSerial stand-in in place of the sensor and replay() runs every recorded scan pass again on a
+  FingerprintManager: at the recorded time (relative to the first pass), with the recorded manager state, pass limits
+  and touch ring input. Each command of the firmware is compared with the recorded one and answered with the recorded bytes,
+  which become readable at the same offset from the command as on the device. The decision and the duration of every
+  pass are compared with the recording, so a slow or wrong scan sequence from the field can be stepped through and
+  timed on the host.
+
+  Exchanges outside of scan passes (LED sequences of the web UI, pairing checks, enrollment) are skipped, they are
+  not run again.
+*/
+
+struct TraceReplayPass {
+  uint64_t at = 0;                 // start relative to the first replayed pass (recording)
+  ScanResult recordedResult = ScanResult::error;
+  uint8_t recordedReturnCode = 0;
+  uint16_t recordedMatchId = 0;
+  uint32_t recordedMicros = 0;     // duration of the pass
+  Match replayed;
+  uint64_t replayedMicros = 0;
+  bool diverged = false;           // the firmware sent other commands than recorded
+};
+
+struct TraceReplayReport {
+  std::vector<TraceReplayPass> passes;
+  unsigned long records = 0;
+  unsigned long droppedRecords = 0; // lost on the device before the download (ring was full)
+  unsigned long skippedExchanges = 0;
+  unsigned long incompletePasses = 0; // start or decision not in the trace
+  unsigned long stateMismatches = 0;  // recorded state differed from the replayed manager before it was restored
+  unsigned long divergedPasses = 0;
+  unsigned long decisionMismatches = 0;
+  uint64_t maxTimingError = 0;        // largest difference of a pass duration
+  std::string firstDivergence;
+};
+
+class TracePlayer : public SerialDevice {
+  public:
+    struct Record {
+      TraceRecord type;
+      uint64_t at;                 // micros of the device, unwrapped
+      std::vector<uint8_t> data;
+    };
+
+    bool load(const std::vector<uint8_t> &file, std::string &error);
+    bool loadFile(const char *path, std::string &error);
+    const std::vector<Record>& getRecords() const { return records; }
+    uint8_t getReaderId() const { return readerId; }
+    unsigned long getDroppedRecords() const { return droppedRecords; }
+
+    // runs all recorded scan passes on the manager, its UART must be attached to this player
+    TraceReplayReport replay(FingerprintManager &fingerManager, uint8_t touchPin);
+
+    // SerialDevice
+    void receive(uint8_t c) override;
+    int available() override;
+    int peek() override;
+    int read() override;
+
+  private:
+    struct RxByte {
+      uint64_t at;                 // virtual time the byte is readable
+      uint8_t value;
+    };
+
+    std::vector<Record> records;
+    uint8_t readerId = 0;
+    unsigned long droppedRecords = 0;
+
+    // the pass being replayed
+    size_t cursor = 0;             // next record to compare a command with
+    size_t passEnd = 0;            // its decision record
+    std::vector<uint8_t> command;
+    uint64_t commandAt = 0;
+    std::vector<RxByte> rxQueue;
+    size_t rxPos = 0;
+    bool diverged = false;
+    std::string divergence;
+
+    void commandReceived();
+    bool isCommandComplete() const;
+};
+
+#endif
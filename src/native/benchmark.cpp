@@ -0,0 +1,1915 @@
+/***************************************************
+  Host benchmark of FingerprintDoorbell ([env:native])
+
+  Runs FingerprintManager against the R503 emulator on a virtual clock and reports time-to-decision statistics
+  for the scan loop and the duration of enrollments. Usage:
+
+    .pio/build/native/program [scan|enroll|link|engine|transfer|registry|boot|notify|alloc|mqtt|feedback|doorbell|readers|soak|trace|policy|rain|all] [cycles] [--verbose] [--metrics]
+    .pio/build/native/program replay <trace file downloaded from /trace>
+ ****************************************************/
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "HostRuntime.h"
+#include "MqttBrokerEmulator.h"
+#include "R503Emulator.h"
+#include "TracePlayer.h"
+#include "../DoorbellButton.h"
+#include "../FeedbackSequencer.h"
+#include "../FingerprintManager.h"
+#include "../LogBuffer.h"
+#include "../MqttEngine.h"
+#include "../NotificationQueue.h"
+
+const int residentCount = 5;         // residents make up most of the scans, they are enrolled in residentSlots
+const int spreadResidentSlots[residentCount] = { 23, 61, 97, 142, 178 };
+const int firstResidentSlots[residentCount] = { 1, 2, 3, 4, 5 }; // residents enrolled first, visitors later
+const int *residentSlots = spreadResidentSlots;
+const int enrolledTemplates = 180;   // all other slots up to this one hold templates of rare visitors
+const int unknownPerson = 9999;      // a finger that is not enrolled at all
+const uint32_t loopOverheadMicros = 1000; // doorbell input etc. per pass of loop()
+
+bool printMetrics = false; // dump the Prometheus text of /metrics after each scan benchmark
+int failures = 0;           // checks that failed, exit code of the program
+
+class StdoutPrint : public Print {
+  public:
+    size_t write(uint8_t c) override { return fputc(c, stdout) == EOF ? 0 : 1; }
+};
+
+class BufferPrint : public Print {
+  public:
+    std::string text;
+    size_t write(uint8_t c) override { text += (char)c; return 1; }
+};
+
+void notifyClients(const char *message) {
+  Serial.println(message);
+}
+
+void notifyFingerChanged(uint8_t reader, FingerChange change, uint16_t id, const char *name) {
+}
+
+void notifyEnrollProgress(uint8_t reader, EnrollState state, uint16_t id, uint8_t sample) {
+}
+
+std::vector<std::pair<uint64_t, bool>> ringSuppressionChanges; // virtual time, suppressed
+
+void notifyTouchRingSuppressed(uint8_t reader, bool suppressed) {
+  ringSuppressionChanges.push_back({ HostRuntime::now(), suppressed });
+}
+
+
+class LatencyStats {
+  public:
+    explicit LatencyStats(const char *name) : name(name) {}
+
+    void add(uint64_t micros) { samples.push_back(micros / 1000.0); }
+
+    size_t count() const { return samples.size(); }
+
+    double mean() const {
+      double sum = 0;
+      for (double s : samples)
+        sum += s;
+      return samples.empty() ? 0 : sum / samples.size();
+    }
+
+    double percentile(double p) {
+      std::sort(samples.begin(), samples.end());
+      return samples.empty() ? 0 : samples[std::min(samples.size() - 1, (size_t)(p * samples.size()))];
+    }
+
+    void print() {
+      if (samples.empty()) {
+        printf("  %-22s n=0\n", name);
+        return;
+      }
+      std::sort(samples.begin(), samples.end());
+      double sum = 0;
+      for (double s : samples)
+        sum += s;
+      printf("  %-22s n=%-6zu min=%7.1f  mean=%7.1f  p50=%7.1f  p95=%7.1f  p99=%7.1f  max=%7.1f ms\n", name, samples.size(),
+        samples.front(), sum / samples.size(), sortedPercentile(0.50), sortedPercentile(0.95), sortedPercentile(0.99), samples.back());
+    }
+
+  private:
+    const char *name;
+    std::vector<double> samples;
+
+    double sortedPercentile(double p) const { return samples[std::min(samples.size() - 1, (size_t)(p * samples.size()))]; }
+};
+
+
+// slots behind the first four index pages (1024 slots), only a large sensor has them
+const uint16_t highSlots[] = { 1024, 2047, 2999 };
+
+// Residents and visitors on the sensor, their names in the per slot layout of older firmware
+static void storeLibrary(R503Emulator &sensor) {
+  Preferences preferences;
+  preferences.begin("fingerList", false);
+  for (int id = 1; id <= enrolledTemplates; id++)
+    sensor.storeTemplate(id, 1000 + id);
+  for (int i = 0; i < residentCount; i++)
+    sensor.storeTemplate(residentSlots[i], i + 1);
+  for (int id = 1; id <= enrolledTemplates; id++)
+    preferences.putString(String(id).c_str(), String("Person ") + sensor.templateAt(id));
+  for (uint16_t id : highSlots) {
+    if (id < sensor.capacity()) {
+      sensor.storeTemplate(id, 2000 + id);
+      preferences.putString(String(id).c_str(), String("Person ") + sensor.templateAt(id));
+    }
+  }
+  preferences.end();
+}
+
+// Fresh "device": empty NVS, sensor with the given templates, FingerprintManager connected to it
+static void setupDevice(R503Emulator &sensor, FingerprintManager &fingerManager, bool withTemplates) {
+  Preferences::resetStore();
+  HostRuntime::clearSchedule();
+  Serial1.attach(&sensor);
+  sensor.connectTouchRing(touchRingPin);
+  if (withTemplates)
+    storeLibrary(sensor);
+
+  fingerManager.connect();
+  fingerManager.setLedRingReady();
+  sensor.resetStatistics();
+}
+
+
+// Pairing verdict cache of main.cpp: checked in the background while no finger is on the sensor, the match only
+// reads the notepad if the verdict is stale or the link had an error since
+const unsigned long pairingCheckIntervalMillis = 10000;
+const unsigned long pairingVerdictMaxAgeMillis = 30000;
+static bool pairingRecheckPending = false;
+static unsigned long pairingCheckedAt = 0;
+static uint32_t pairingLinkGeneration = UINT32_MAX;
+static unsigned long pairingChecks = 0;        // in the background
+static unsigned long pairingChecksOnMatch = 0;  // before a match could be published
+
+static void resetPairingVerdict() {
+  pairingRecheckPending = false;
+  pairingLinkGeneration = UINT32_MAX;
+  pairingChecks = 0;
+  pairingChecksOnMatch = 0;
+}
+
+static void verifyPairing(FingerprintManager &fingerManager) {
+  char pairingCode[pairingCodeLength + 1];
+  fingerManager.getPairingCode(pairingCode);
+  pairingCheckedAt = millis();
+  pairingLinkGeneration = fingerManager.getLinkGeneration();
+}
+
+static void refreshPairingVerdict(FingerprintManager &fingerManager, const Match &lastMatch) {
+  if (lastMatch.scanResult != ScanResult::noFinger)
+    return;
+  if (pairingRecheckPending || millis() - pairingCheckedAt >= pairingCheckIntervalMillis || pairingLinkGeneration != fingerManager.getLinkGeneration()) {
+    pairingRecheckPending = false;
+    verifyPairing(fingerManager);
+    pairingChecks++;
+  }
+}
+
+// Same control flow and waits as doScan() in main.cpp, without the MQTT publishing
+static Match doScan(FingerprintManager &fingerManager, Match &lastMatch) {
+  Match match = fingerManager.scanFingerprint();
+  char message[128];
+  switch(match.scanResult)
+  {
+    case ScanResult::matchFound:
+      snprintf(message, sizeof(message), "Match Found: %u - %s with confidence of %u", match.matchId, match.matchName, match.matchConfidence);
+      notifyClients(message);
+      if (match.scanResult != lastMatch.scanResult) {
+        if (millis() - pairingCheckedAt >= pairingVerdictMaxAgeMillis || pairingLinkGeneration != fingerManager.getLinkGeneration()) {
+          verifyPairing(fingerManager); // isPairingValid() has no fresh verdict
+          pairingChecksOnMatch++;
+        }
+        pairingRecheckPending = true;
+      }
+      break;
+    default:
+      break;
+  }
+  return match;
+}
+
+static void printLinkTimings(FingerprintManager &fingerManager) {
+  SensorLinkSettings link = fingerManager.getLinkSettings();
+  LinkTimings timings = fingerManager.measureLinkTimings(20);
+  printf("link: %u baud, packet length %u, security level %u: round trips getImage %.1f ms, image2Tz %.1f ms, search %.1f ms, LED %.1f ms\n",
+    link.baudRate, link.packetLength, link.securityLevel,
+    timings.getImage / 1000.0, timings.image2Tz / 1000.0, timings.fingerSearch / 1000.0, timings.ledControl / 1000.0);
+}
+
+static const char *scanEngineName(ScanEngine engine) {
+  return engine == ScanEngine::autoIdentify ? "AutoIdentify" : "getImage/image2Tz/search";
+}
+
+static void benchScan(int cycles, const SensorLinkSettings *link = nullptr, ScanEngine engine = ScanEngine::autoIdentify, bool autoIdentifySupported = true) {
+  R503Emulator sensor;
+  FingerprintManager fingerManager;
+  sensor.autoIdentifySupported = autoIdentifySupported;
+  setupDevice(sensor, fingerManager, true);
+  if (!fingerManager.setScanEngine(engine))
+    printf("scan engine %s not supported by the sensor\n", scanEngineName(engine));
+  if (link) {
+    if (!fingerManager.applyLinkSettings(*link))
+      printf("applying the link settings failed\n");
+    printLinkTimings(fingerManager);
+    sensor.resetStatistics();
+  }
+
+  std::mt19937 rng(42);
+  resetPairingVerdict();
+  LatencyStats unlock("time to unlock");
+  LatencyStats reject("time to reject");
+  int wrongDecisions = 0;
+  int missedFingers = 0;
+  Match lastMatch;
+
+  auto wallStart = std::chrono::steady_clock::now();
+  uint64_t virtualStart = HostRuntime::now();
+
+  for (int cycle = 0; cycle < cycles; cycle++) {
+    uint64_t placeAt = HostRuntime::now() + std::uniform_int_distribution<uint32_t>(300000, 3000000)(rng);
+    uint64_t liftAt = placeAt + std::uniform_int_distribution<uint32_t>(800000, 2500000)(rng);
+    int person = std::uniform_int_distribution<int>(0, 9)(rng) < 8 ? std::uniform_int_distribution<int>(1, residentCount)(rng) : unknownPerson;
+    HostRuntime::schedule(placeAt, [&sensor, person]() { sensor.placeFinger(person); });
+    HostRuntime::schedule(liftAt, [&sensor]() { sensor.liftFinger(); });
+
+    bool decided = false;
+    while (HostRuntime::now() < liftAt + 500000 || lastMatch.scanResult != ScanResult::noFinger) {
+      fingerManager.waitForTouch(20);
+      Match match = doScan(fingerManager, lastMatch);
+      uint64_t decisionAt = HostRuntime::now();
+
+      if (!decided && decisionAt >= placeAt && (match.scanResult == ScanResult::matchFound || match.scanResult == ScanResult::noMatchFound)) {
+        decided = true;
+        if (match.scanResult == ScanResult::matchFound && sensor.templateAt(match.matchId) == person)
+          unlock.add(decisionAt - placeAt);
+        else if (match.scanResult == ScanResult::noMatchFound && person == unknownPerson)
+          reject.add(decisionAt - placeAt);
+        else
+          wrongDecisions++;
+      }
+
+      // cooldown of the sensor task while the LED feedback of doScan() plays
+      if (match.scanResult == ScanResult::matchFound)
+        delay(fingerManager.getScanPolicy().getMatchCooldownMillis());
+      else if (match.scanResult == ScanResult::noMatchFound && lastMatch.scanResult == ScanResult::noMatchFound)
+        delay(1000);
+      lastMatch = match;
+      refreshPairingVerdict(fingerManager, lastMatch);
+      HostRuntime::advance(loopOverheadMicros);
+    }
+    if (!decided)
+      missedFingers++;
+  }
+
+  double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+  double virtualSeconds = (HostRuntime::now() - virtualStart) / 1e6;
+
+  // AutoIdentify is skipped while the hot set lies above autoIdentifyMaxHotPage, name the engine most touches used
+  char engineName[96];
+  unsigned long autoIdentifyScans = sensor.commandCount(FINGERPRINT_AUTOIDENTIFY);
+  if (fingerManager.getScanEngine() == ScanEngine::autoIdentify && autoIdentifyScans < (unsigned long)cycles / 2)
+    snprintf(engineName, sizeof(engineName), "getImage/image2Tz/search, AutoIdentify for %lu touches, hot set above page %u",
+      autoIdentifyScans, autoIdentifyMaxHotPage);
+  else
+    strlcpy(engineName, scanEngineName(fingerManager.getScanEngine()), sizeof(engineName));
+  printf("scan (%s): %d cycles, %.0f s simulated in %.2f s\n", engineName, cycles, virtualSeconds, wallSeconds);
+  unlock.print();
+  reject.print();
+  printf("  wrong decisions: %d, fingers without decision: %d\n", wrongDecisions, missedFingers);
+  printf("  pairing checks: %lu in the background, %lu before publishing a match\n", pairingChecks, pairingChecksOnMatch);
+  printf("  hot set searches: %u hits, %u misses\n", (unsigned)fingerManager.getMetrics().hotSetHits, (unsigned)fingerManager.getMetrics().hotSetMisses);
+  TouchLatencyStats touch = fingerManager.getTouchLatencyStats();
+  if (touch.count > 0)
+    printf("  touch to first image: mean %.2f ms, max %.2f ms (%lu touches)\n", touch.totalMicros / 1000.0 / touch.count, touch.maxMicros / 1000.0, touch.count);
+  if (printMetrics) {
+    StdoutPrint out;
+    printPrometheusMetrics(out, fingerManager.getMetrics());
+  }
+  printf("  sensor commands per cycle: %.1f (autoIdentify %.1f, getImage %.1f, image2Tz %.1f, search %.1f, led %.1f), UART bytes per cycle: %.0f\n",
+    (double)sensor.totalCommands() / cycles,
+    (double)sensor.commandCount(FINGERPRINT_AUTOIDENTIFY) / cycles,
+    (double)sensor.commandCount(FINGERPRINT_GETIMAGE) / cycles,
+    (double)sensor.commandCount(FINGERPRINT_IMAGE2TZ) / cycles,
+    (double)sensor.commandCount(FINGERPRINT_SEARCH) / cycles,
+    (double)sensor.commandCount(FINGERPRINT_AURALEDCONFIG) / cycles,
+    (double)sensor.uartBytes() / cycles);
+}
+
+
+// Steps of the enrollment like the sensor task of main.cpp runs them, records the longest single step (how long
+// commands and the LED ring wait at most)
+static NewFinger runEnrollment(FingerprintManager &fingerManager, int id, const String &name, LatencyStats &step, uint64_t &longestStep) {
+  NewFinger newFinger;
+  if (!fingerManager.beginEnroll(id, name.c_str()))
+    return newFinger;
+  do {
+    uint64_t start = HostRuntime::now();
+    newFinger = fingerManager.continueEnroll();
+    uint64_t stepMicros = HostRuntime::now() - start;
+    step.add(stepMicros);
+    longestStep = std::max(longestStep, stepMicros);
+  } while (newFinger.enrollResult == EnrollResult::running);
+  return newFinger;
+}
+
+static void benchEnroll(int cycles) {
+  R503Emulator sensor;
+  FingerprintManager fingerManager;
+  setupDevice(sensor, fingerManager, false);
+
+  // simulated user: puts the finger on when the ring flashes purple, removes it when the ring turns steady purple
+  std::mt19937 rng(7);
+  int person = 0;
+  bool absentUser = false; // never places the finger
+  sensor.onLedChanged = [&](uint8_t control, uint8_t color) {
+    if (color != FINGERPRINT_LED_PURPLE || absentUser)
+      return;
+    if (control == FINGERPRINT_LED_FLASHING)
+      HostRuntime::scheduleIn(std::uniform_int_distribution<uint32_t>(200000, 600000)(rng), [&sensor, &person]() { sensor.placeFinger(person); });
+    else if (control == FINGERPRINT_LED_ON)
+      HostRuntime::scheduleIn(std::uniform_int_distribution<uint32_t>(150000, 400000)(rng), [&sensor]() { sensor.liftFinger(); });
+  };
+
+  LatencyStats duration("enrollment");
+  LatencyStats step("enrollment step");
+  uint64_t longestStep = 0;
+  int failed = 0;
+
+  auto wallStart = std::chrono::steady_clock::now();
+  uint64_t virtualStart = HostRuntime::now();
+
+  for (int cycle = 0; cycle < cycles; cycle++) {
+    int id = 1 + cycle % (sensor.capacity() - 1); // slot ids 1..capacity-1
+    person = 1 + cycle;
+    if (sensor.templateAt(id) != 0)
+      fingerManager.deleteFinger(id);
+
+    uint64_t start = HostRuntime::now();
+    NewFinger newFinger = runEnrollment(fingerManager, id, String("Person ") + person, step, longestStep);
+    if (newFinger.enrollResult == EnrollResult::ok && sensor.templateAt(id) == person)
+      duration.add(HostRuntime::now() - start);
+    else
+      failed++;
+
+    delay(1000); // wait until the simulated user has removed the finger
+  }
+
+  double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+  double virtualSeconds = (HostRuntime::now() - virtualStart) / 1e6;
+  unsigned long commands = sensor.totalCommands();
+  unsigned long getImages = sensor.commandCount(FINGERPRINT_GETIMAGE);
+
+  // cancelled by the web UI or MQTT at a random point, nothing may be stored
+  LatencyStats cancelLatency("cancel to cancelled");
+  int cancelFailures = 0;
+  int cancelId = sensor.capacity() - 1;
+  if (sensor.templateAt(cancelId) != 0)
+    fingerManager.deleteFinger(cancelId); // enrolled by the loop above from capacity - 1 cycles on
+  for (int cycle = 0; cycle < 20; cycle++) {
+    int id = cancelId;
+    uint64_t cancelAt = 0;
+    HostRuntime::scheduleIn(std::uniform_int_distribution<uint32_t>(100000, 4000000)(rng), [&fingerManager, &cancelAt]() {
+      cancelAt = HostRuntime::now();
+      fingerManager.cancelEnroll();
+    });
+    NewFinger newFinger = runEnrollment(fingerManager, id, "Cancelled", step, longestStep);
+    if (newFinger.enrollResult == EnrollResult::cancelled && sensor.templateAt(id) == 0 && !fingerManager.isEnrolling())
+      cancelLatency.add(HostRuntime::now() - cancelAt);
+    else
+      cancelFailures++;
+    delay(1000);
+    sensor.liftFinger();
+  }
+
+  // nobody puts a finger on the sensor: the enrollment ends after the timeout of the first sample
+  absentUser = true;
+  uint64_t timeoutStart = HostRuntime::now();
+  unsigned long getImagesBefore = sensor.commandCount(FINGERPRINT_GETIMAGE);
+  NewFinger abandoned = runEnrollment(fingerManager, sensor.capacity() - 1, "Nobody", step, longestStep);
+  double timeoutSeconds = (HostRuntime::now() - timeoutStart) / 1e6;
+  unsigned long abandonedGetImages = sensor.commandCount(FINGERPRINT_GETIMAGE) - getImagesBefore;
+  bool timeoutOk = abandoned.enrollResult == EnrollResult::timeout && timeoutSeconds >= enrollFingerTimeoutMillis / 1000.0
+    && timeoutSeconds < enrollFingerTimeoutMillis / 1000.0 + 1;
+  absentUser = false;
+
+  printf("enroll: %d cycles, %.0f s simulated in %.2f s\n", cycles, virtualSeconds, wallSeconds);
+  duration.print();
+  step.print();
+  printf("  failed enrollments: %d\n", failed);
+  printf("  sensor commands per enrollment: %.1f (getImage %.1f)\n", (double)commands / cycles, (double)getImages / cycles);
+  cancelLatency.print();
+  printf("  cancelled enrollments: %d of 20 ended cleanly\n", 20 - cancelFailures);
+  printf("  abandoned enrollment: %s after %.1f s, %lu getImage commands\n",
+    timeoutOk ? "timed out" : "NOT timed out", timeoutSeconds, abandonedGetImages);
+  // a step that takes a sample includes getImage and image2Tz on the sensor (~0.3 s), all others at most one poll
+  if (failed != 0 || cancelFailures != 0 || !timeoutOk || longestStep > 500000) {
+    printf("  FAILED: enrollment, cancellation or timeout (longest step %.1f ms)\n", longestStep / 1000.0);
+    failures++;
+  }
+}
+
+
+// Export of the full library through the template pipe into a simulated HTTP download, then import of that file
+// into a new, empty sensor through a simulated upload. Both network sides run as events on the virtual clock.
+// indexTablePages limits the index pages the old sensor answers: the export has to fail instead of leaving slots out.
+static void benchTransfer(int depth, uint32_t baudRate, uint16_t capacity = 200, uint8_t indexTablePages = 0) {
+  const size_t networkChunk = 1436;           // TCP segment
+  const uint64_t networkChunkMicros = 3600;   // ~400 kB/s between browser and ESP32
+
+  R503Emulator oldSensor(capacity);
+  oldSensor.indexTablePages = indexTablePages;
+  oldSensor.timing.searchPerTemplate = oldSensor.timing.searchPerTemplate * 200 / capacity; // large sensors search faster
+  FingerprintManager oldManager;
+  setupDevice(oldSensor, oldManager, true);
+  SensorLinkSettings link;
+  link.baudRate = baudRate;
+  if (!oldManager.applyLinkSettings(link))
+    printf("applying the link settings failed\n");
+
+  TemplatePipe pipe;
+  std::vector<uint8_t> file;
+  bool downloadDone = false;
+  std::function<void()> download = [&]() {
+    uint8_t buffer[networkChunk];
+    size_t length = pipe.readStream(buffer, sizeof(buffer));
+    if (length == 0) {
+      pipe.closeStreamSide();
+      downloadDone = true;
+    } else if (length == TemplatePipe::noDataYet) {
+      HostRuntime::scheduleIn(1000, download);
+    } else {
+      file.insert(file.end(), buffer, buffer + length);
+      HostRuntime::scheduleIn(networkChunkMicros, download);
+    }
+  };
+  pipe.begin(depth);
+  HostRuntime::scheduleIn(0, download);
+  uint64_t exportStart = HostRuntime::now();
+  bool exported = oldManager.exportSensorDB(pipe);
+  pipe.closeRecordSide();
+  while (!downloadDone)
+    delay(1);
+  double exportSeconds = (HostRuntime::now() - exportStart) / 1e6;
+
+  R503Emulator newSensor(capacity);
+  newSensor.timing.searchPerTemplate = oldSensor.timing.searchPerTemplate;
+  FingerprintManager newManager;
+  setupDevice(newSensor, newManager, false);
+  if (!newManager.applyLinkSettings(link))
+    printf("applying the link settings failed\n");
+
+  size_t uploaded = 0;
+  std::function<void()> upload = [&]() {
+    size_t length = std::min(networkChunk, file.size() - uploaded);
+    size_t consumed = pipe.writeStream(&file[uploaded], length, 0); // a full pipe stalls the upload like a full TCP window
+    uploaded += consumed;
+    if (uploaded >= file.size() || pipe.isCancelled()) {
+      if (!pipe.isStreamComplete())
+        pipe.cancel();
+      pipe.closeStreamSide();
+    } else {
+      HostRuntime::scheduleIn(consumed == length ? networkChunkMicros : 1000, upload);
+    }
+  };
+  pipe.begin(depth);
+  HostRuntime::scheduleIn(0, upload);
+  uint64_t importStart = HostRuntime::now();
+  bool imported = newManager.importSensorDB(pipe);
+  pipe.closeRecordSide();
+  double importSeconds = (HostRuntime::now() - importStart) / 1e6;
+
+  FingerprintManager rebootedManager; // names as loaded from the preferences after a reboot
+  rebootedManager.connect();
+  int mismatches = 0;
+  for (uint16_t id = 0; id < oldSensor.capacity(); id++) {
+    const char *name = rebootedManager.getFingers().getName(id);
+    if (newSensor.templateAt(id) != oldSensor.templateAt(id))
+      mismatches++;
+    else if (id > 0 && oldSensor.templateAt(id) != 0 && (name == nullptr || String("Person ") + oldSensor.templateAt(id) != name))
+      mismatches++;
+  }
+
+  uint16_t count = oldSensor.templateCount();
+  printf("transfer: %u templates on %u slots, %u baud, pipe depth %d, file %zu bytes\n", count, capacity, baudRate, depth, file.size());
+  if (indexTablePages != 0) {
+    // the sensor does not report all of its slots
+    printf("  export with %u index pages %s\n", indexTablePages, exported ? "succeeded" : "refused");
+    if (exported) {
+      printf("  FAILED: the export left slots out without an error\n");
+      failures++;
+    }
+    return;
+  }
+  printf("  export %s: %.1f s, %.2f templates/s\n", exported ? "ok" : "FAILED", exportSeconds, count / exportSeconds);
+  printf("  import %s: %.1f s, %.2f templates/s, %d slots differ from the old sensor\n", imported ? "ok" : "FAILED", importSeconds, count / importSeconds, mismatches);
+  if (!exported || !imported || mismatches != 0) {
+    printf("  FAILED: the new sensor does not hold the fingers of the old one\n");
+    failures++;
+  }
+}
+
+
+static void printBoot(const char *name, uint64_t connectMicros, const Preferences::Stats &stats) {
+  printf("  %-32s connect %6.1f ms, preferences %6.1f ms (%lu opens, %lu reads, %lu writes, %lu entries written)\n",
+    name, connectMicros / 1000.0, stats.micros / 1000.0, stats.opens, stats.reads, stats.writes, stats.entriesWritten);
+}
+
+// connect() of a device that still has the per slot names of older firmware (converted on this boot), the following
+// boots with the single blob, and the preferences writes of a batch of renames. A conversion whose blob cannot be
+// written must keep the old names.
+static void benchBoot() {
+  R503Emulator sensor;
+  Preferences::resetStore();
+  HostRuntime::clearSchedule();
+  Serial1.attach(&sensor);
+  sensor.connectTouchRing(touchRingPin);
+  storeLibrary(sensor);
+  printf("boot: %d names in the preferences\n", enrolledTemplates);
+
+  {
+    FingerprintManager failedConversion;
+    Preferences::failWrites = true;
+    failedConversion.connect();
+    Preferences::failWrites = false;
+    FingerprintManager nextBoot;
+    nextBoot.connect();
+    printf("  conversion with failing writes:  %u of %d names kept\n", (unsigned)nextBoot.getFingers().getCount(), enrolledTemplates);
+    if (nextBoot.getFingers().getCount() != enrolledTemplates) {
+      printf("  FAILED: the old names were removed before the blob was written\n");
+      failures++;
+    }
+    Preferences::resetStore();
+    storeLibrary(sensor);
+  }
+
+  for (const char *name : { "per slot keys (converted)", "single blob" }) {
+    FingerprintManager fingerManager;
+    Preferences::stats = Preferences::Stats();
+    uint64_t start = HostRuntime::now();
+    fingerManager.connect();
+    printBoot(name, HostRuntime::now() - start, Preferences::stats);
+  }
+
+  FingerprintManager fingerManager;
+  fingerManager.connect();
+  Preferences::stats = Preferences::Stats();
+  for (int id = 1; id <= 10; id++)
+    fingerManager.renameFinger(id, String("Renamed ") + id);
+  fingerManager.saveFingerList();
+  printf("  10 renames, saved once:          preferences %6.1f ms (%lu writes, %lu entries written)\n",
+    Preferences::stats.micros / 1000.0, Preferences::stats.writes, Preferences::stats.entriesWritten);
+}
+
+
+// Option list as it was built before the HTML was cached: concatenated from scratch on every request
+static String buildOptionList(const FingerRegistry &registry) {
+  String htmlOptions = "";
+  for (uint16_t index = 0; index < registry.getCount(); index++) {
+    String id = String(registry.idAt(index));
+    if (index == 0)
+      htmlOptions += "<option value=\"" + id + "\" selected>" + id + " - " + registry.nameAt(index) + "</option>";
+    else
+      htmlOptions += "<option value=\"" + id + "\">" + id + " - " + registry.nameAt(index) + "</option>";
+  }
+  return htmlOptions;
+}
+
+// Random enroll/rename/delete sequence on the finger registry and its cached option list, checked against a std::map
+// and a full rebuild of the list. Reports the memory used for the names of a typical household on sensors of different
+// capacity and what serving the option list costs.
+static void benchRegistry(int cycles, uint16_t capacity) {
+  FingerRegistry registry;
+  FingerListHtml html;
+  std::map<uint16_t, std::string> reference;
+  std::mt19937 rng(capacity);
+  int mismatches = 0;
+
+  registry.begin(capacity);
+  html.rebuild(registry);
+  for (int cycle = 0; cycle < cycles; cycle++) {
+    uint16_t id = std::uniform_int_distribution<int>(1, capacity - 1)(rng);
+    if (std::uniform_int_distribution<int>(0, 3)(rng) == 0) {
+      int index = registry.indexOf(id);
+      if (registry.remove(id))
+        html.erase(registry, index);
+      reference.erase(id);
+    } else {
+      std::string name = "Person " + std::to_string(cycle) + std::string(std::uniform_int_distribution<int>(0, 20)(rng), 'x');
+      bool added = !registry.contains(id);
+      if (registry.setName(id, name.c_str())) {
+        reference[id] = name;
+        if (added)
+          html.insert(registry, registry.indexOf(id));
+        else
+          html.replace(registry, registry.indexOf(id));
+      }
+    }
+  }
+  if (registry.getCount() != reference.size())
+    mismatches++;
+  uint16_t index = 0;
+  for (auto &entry : reference) {
+    if (index >= registry.getCount() || registry.idAt(index) != entry.first || entry.second != registry.nameAt(index)
+        || !registry.contains(entry.first) || entry.second != registry.getName(entry.first))
+      mismatches++;
+    index++;
+  }
+  if (html.toString() != buildOptionList(registry))
+    mismatches++;
+
+  // JSON pages of the REST API cover every enrolled finger exactly once
+  std::string expected;
+  for (auto &entry : reference)
+    expected += "{\"id\":" + std::to_string(entry.first) + ",";
+  std::string listed;
+  const uint16_t pageSize = 50;
+  for (uint16_t offset = 0; offset < registry.getCount(); offset += pageSize) {
+    BufferPrint page;
+    registry.printJson(page, offset, pageSize);
+    for (size_t pos = page.text.find("{\"id\":"); pos != std::string::npos; pos = page.text.find("{\"id\":", pos + 1))
+      listed += page.text.substr(pos, page.text.find(',', pos) - pos + 1);
+  }
+  if (listed != expected)
+    mismatches++;
+
+  registry.clear();
+  for (int id = 1; id <= enrolledTemplates; id++)
+    registry.setName(id, (String("Person ") + id).c_str());
+  html.rebuild(registry);
+
+  const int renders = 2000;
+  size_t length = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < renders; i++)
+    length += buildOptionList(registry).length();
+  double rebuildMicros = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / renders;
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < renders; i++)
+    length -= html.toString().length();
+  double cachedMicros = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / renders;
+
+  printf("registry: capacity %u, %d random changes, %d mismatches%s; %d fingers use %zu bytes\n",
+    capacity, cycles, mismatches, length != 0 ? " (option list length differs)" : "", enrolledTemplates, registry.getMemoryUsage());
+  printf("  option list (%zu bytes): rebuilt %.1f us, cached %.1f us per request (host)\n", html.length(), rebuildMicros, cachedMicros);
+}
+
+
+// Steady state of the scan loop must not touch the heap: idle passes without a finger and passes that match a finger
+// (including the log message, the pairing check and the periodic save of the match counters) are counted separately.
+static void benchAllocations(int cycles) {
+  R503Emulator sensor;
+  FingerprintManager fingerManager;
+  setupDevice(sensor, fingerManager, true);
+  Match lastMatch;
+
+  // one touch first, later ones reuse what it allocated (hot set, buffer of the match counters)
+  resetPairingVerdict();
+  sensor.placeFinger(1);
+  for (int i = 0; i < matchCountSaveInterval; i++) {
+    lastMatch = doScan(fingerManager, lastMatch);
+    delay(3000);
+  }
+  sensor.liftFinger();
+
+  int matches = 0;
+  HostRuntime::resetAllocationCount();
+  for (int cycle = 0; cycle < cycles; cycle++) {
+    HostRuntime::countAllocations(true);
+    fingerManager.waitForTouch(20);
+    Match match = doScan(fingerManager, lastMatch);
+    lastMatch = match;
+    refreshPairingVerdict(fingerManager, lastMatch); // the first pass checks the pairing after the matches above
+    HostRuntime::countAllocations(false);
+  }
+  unsigned long idleAllocations = HostRuntime::getAllocationCount();
+  sensor.placeFinger(1);
+  for (int cycle = 0; cycle < cycles; cycle++) {
+    HostRuntime::countAllocations(true);
+    fingerManager.waitForTouch(20);
+    Match match = doScan(fingerManager, lastMatch);
+    HostRuntime::countAllocations(false);
+    matches += (match.scanResult == ScanResult::matchFound);
+    lastMatch = match;
+    delay(3000);
+  }
+  unsigned long matchAllocations = HostRuntime::getAllocationCount() - idleAllocations;
+  sensor.liftFinger();
+
+  printf("alloc: %d idle passes: %lu allocations, %d passes with %d matches: %lu allocations\n",
+    cycles, idleAllocations, cycles, matches, matchAllocations);
+  if (idleAllocations != 0 || matchAllocations != 0 || matches != cycles) {
+    printf("  FAILED: the scan loop allocates\n");
+    failures++;
+  }
+}
+
+
+// Notification queue between the producers (sensor task, web server) and the publisher task: a publisher that only
+// keeps up with every third notification, then a burst while it is stalled. Checks that nothing is reordered or lost
+// without being counted and what a push costs the producer.
+static void benchNotify(int cycles) {
+  const uint16_t depth = 32;
+  NotificationQueue queue;
+  queue.begin(depth);
+  Notification notification;
+  uint32_t lastSeq = 0;
+  int popped = 0;
+  int mismatches = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 1; i <= cycles; i++) {
+    notification.seq = i;
+    queue.push(notification);
+    if (i % 3 == 0 && queue.pop(notification)) {
+      if (notification.seq <= lastSeq)
+        mismatches++;
+      lastSeq = notification.seq;
+      popped++;
+    }
+  }
+  double pushNanos = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / cycles;
+  while (queue.pop(notification)) {
+    if (notification.seq <= lastSeq)
+      mismatches++;
+    lastSeq = notification.seq;
+    popped++;
+  }
+  if (popped + queue.getDropped() != (uint32_t)cycles || queue.getPushed() != (uint32_t)popped)
+    mismatches++;
+
+  // stalled publisher: the queue takes exactly its depth, the rest is dropped right away
+  uint32_t droppedBefore = queue.getDropped();
+  for (int i = 0; i < depth + 8; i++)
+    queue.push(notification);
+  if (queue.getDropped() - droppedBefore != 8)
+    mismatches++;
+
+  printf("notify: %d notifications, publisher at 1/3 rate: %d sent, %u dropped, %d mismatches; push %.0f ns (host)\n",
+    cycles, popped, (unsigned)droppedBefore, mismatches, pushNanos);
+
+  // log buffer of the firmware (same size), messages of random length: every message still kept must read back
+  // exactly, typical ones (~40 chars) must fit a few hundred times
+  const uint16_t logSize = 16384, logMaxMessages = 512;
+  LogBuffer log;
+  log.begin(logSize, logMaxMessages);
+  std::mt19937 rng(13);
+  std::map<uint32_t, std::string> texts;
+  LogEntry entry;
+  int logMismatches = 0;
+  for (int i = 0; i < cycles; i++) {
+    size_t length = (i % 10 == 0) ? rng() % 300 : 20 + rng() % 40; // now and then a long one, truncated
+    std::string text(length, 'a' + i % 26);
+    uint32_t seq = log.add(text.c_str());
+    texts[seq] = text.substr(0, logMessageMaxLength);
+    for (uint32_t check = log.getFirstSeq(); check <= seq; check += 7)
+      if (!log.get(check, entry) || entry.seq != check || texts[check] != entry.text)
+        logMismatches++;
+    if (log.get(log.getFirstSeq() - 1, entry))
+      logMismatches++;
+  }
+  uint32_t mixedKept = log.getLastSeq() - log.getFirstSeq() + 1;
+  for (int i = 0; i < 2000; i++)
+    log.add("Match Found: 23 Resident (confidence 120)");
+  uint32_t typicalKept = log.getLastSeq() - log.getFirstSeq() + 1;
+  for (int i = 0; i < 2000; i++)
+    log.add("ok");
+  if (typicalKept < 256 || log.getLastSeq() - log.getFirstSeq() + 1 != logMaxMessages)
+    logMismatches++;
+  printf("log: %u bytes, %u messages of random length kept, %u typical ones, %d mismatches\n",
+    (unsigned)logSize, (unsigned)mixedKept, (unsigned)typicalKept, logMismatches);
+  if (mismatches || logMismatches)
+    failures++;
+}
+
+// MQTT task of the firmware: loop() and a short sleep, producers (scheduled events, like the scan loop and the
+// doorbell) publish in between
+static void runMqttTask(MqttEngine &mqtt, uint64_t until) {
+  while (HostRuntime::now() < until) {
+    mqtt.loop();
+    mqtt.wait(pdMS_TO_TICKS(mqttPollMillis));
+  }
+}
+
+static int mqttMessagesReceived = 0;
+
+static void countMqttMessage(const char *topic, const uint8_t *payload, unsigned int length) {
+  mqttMessagesReceived++;
+}
+
+// QoS 1 throughput against a distant broker (50 ms round trip) with the given number of publishes in flight
+static double benchMqttPipelining(uint8_t maxInflight, int count) {
+  static const char *topic = "fingerprintDoorbell/ring";
+  MqttBrokerEmulator broker;
+  broker.roundTripMicros = 50000;
+  MqttEngine mqtt;
+  mqtt.begin(broker, "broker.local", 1883, "bench", "", "", "", "");
+  mqtt.setMaxInflight(maxInflight);
+  runMqttTask(mqtt, HostRuntime::now() + 200000);
+
+  uint64_t start = HostRuntime::now();
+  int sent = 0;
+  char payload[16];
+  while (mqtt.getStats().acknowledged < (unsigned long)count && HostRuntime::now() - start < 60000000) {
+    while (sent < count && mqtt.queued() < mqttQueueDepth) {
+      snprintf(payload, sizeof(payload), "%d", sent++);
+      mqtt.publish(topic, payload, 1);
+    }
+    mqtt.loop();
+    mqtt.wait(pdMS_TO_TICKS(mqttPollMillis));
+  }
+  double seconds = (HostRuntime::now() - start) / 1e6;
+  mqtt.stop();
+  mqtt.loop();
+  return count / seconds;
+}
+
+// Two minutes of doorbell traffic (a log message every second, a ring and a match every 10 s) while the broker goes
+// away for 45 s and later drops the connection once. Checks that the producers never wait, every QoS 1 message
+// arrives, the match waiting during the outage is the first publish after the reconnect and the reconnect attempts
+// back off.
+static void benchMqtt(int cycles) {
+  double serial = benchMqttPipelining(1, cycles);
+  double pipelined = benchMqttPipelining(mqttMaxInflight, cycles);
+  printf("mqtt: %d QoS 1 publishes, 50 ms round trip: %.1f/s with 1 in flight, %.1f/s with %u in flight\n",
+    cycles, serial, pipelined, (unsigned)mqttMaxInflight);
+
+  static const char *matchTopic = "fingerprintDoorbell/matchId";
+  static const char *ringTopic = "fingerprintDoorbell/ring";
+  static const char *logTopic = "fingerprintDoorbell/lastLogMessage";
+  static const char *ignoreTopic = "fingerprintDoorbell/ignoreTouchRing";
+  MqttBrokerEmulator broker;
+  MqttEngine mqtt;
+  mqtt.begin(broker, "broker.local", 1883, "bench", "user", "secret", logTopic, "disconnected");
+  mqtt.subscribe(ignoreTopic);
+  mqtt.setCallbacks(countMqttMessage, nullptr);
+  mqttMessagesReceived = 0;
+
+  const uint64_t second = 1000000;
+  uint64_t start = HostRuntime::now();
+  uint64_t outageStart = start + 20 * second;
+  uint64_t outageEnd = start + 65 * second;
+  std::vector<std::string> important; // QoS 1 payloads
+  uint64_t publishMicros = 0;         // virtual time the producers spent inside publish()
+  auto publish = [&](const char *topic, const std::string &payload, uint8_t qos, bool priority) {
+    uint64_t before = HostRuntime::now();
+    mqtt.publish(topic, payload.c_str(), qos, priority);
+    publishMicros += HostRuntime::now() - before;
+    if (qos > 0)
+      important.push_back(payload);
+  };
+  for (int i = 0; i < 120; i++) {
+    HostRuntime::schedule(start + i * second + 300000, [&, i]() { publish(logTopic, "log " + std::to_string(i), 0, false); });
+    if (i % 10 == 5) {
+      HostRuntime::schedule(start + i * second, [&, i]() { publish(ringTopic, "ring " + std::to_string(i), 1, false); });
+      HostRuntime::schedule(start + i * second + 600000, [&, i]() { publish(matchTopic, "match " + std::to_string(i), 1, true); });
+    }
+  }
+  HostRuntime::schedule(outageStart, [&]() { broker.dropConnection(); broker.reachable = false; });
+  HostRuntime::schedule(outageEnd, [&]() { broker.reachable = true; });
+  // connection dropped while the match is waiting for its PUBACK
+  HostRuntime::schedule(start + 95 * second + 602000, [&]() { broker.dropConnection(); });
+  HostRuntime::schedule(start + 100 * second, [&]() { broker.sendToClient(ignoreTopic, "on"); });
+  runMqttTask(mqtt, start + 125 * second);
+  MqttStats stats = mqtt.getStats();
+
+  int missing = 0;
+  for (const std::string &payload : important) {
+    bool found = false;
+    for (const MqttBrokerEmulator::Publish &received : broker.publishes)
+      found = found || received.payload == payload;
+    missing += !found;
+  }
+  int duplicates = 0;
+  for (const MqttBrokerEmulator::Publish &received : broker.publishes)
+    duplicates += received.dup;
+  // first publish after the broker came back
+  const MqttBrokerEmulator::Publish *first = nullptr;
+  for (const MqttBrokerEmulator::Publish &received : broker.publishes) {
+    if (received.at >= outageEnd) {
+      first = &received;
+      break;
+    }
+  }
+  std::string attempts;
+  for (size_t i = 1; i < broker.connectAttempts.size(); i++) {
+    if (broker.connectAttempts[i - 1] < outageStart || broker.connectAttempts[i - 1] > outageEnd)
+      continue;
+    char interval[16];
+    snprintf(interval, sizeof(interval), "%s%.1f", attempts.empty() ? "" : " ", (broker.connectAttempts[i] - broker.connectAttempts[i - 1]) / 1e6);
+    attempts += interval;
+  }
+
+  printf("  outage 45 s + dropped connection: %lu attempts, %lu sessions, %zu QoS 1 messages: %d missing, %d resent; "
+    "%lu log messages dropped\n", stats.connectAttempts, stats.connects, important.size(), missing, duplicates, stats.dropped);
+  printf("  attempt intervals during the outage (s): %s; first publish after it: %s \"%s\"; producers waited %llu us\n",
+    attempts.c_str(), first ? first->topic.c_str() : "none", first ? first->payload.c_str() : "",
+    (unsigned long long)publishMicros);
+  bool ok = missing == 0 && publishMicros == 0 && stats.connects == 3 && first != nullptr && first->topic == matchTopic
+    && duplicates > 0 && mqttMessagesReceived == 1 && broker.subscriptions.size() == 3 && broker.willTopic == logTopic;
+  if (!ok) {
+    printf("  FAILED: messages lost or not resent, producers blocked or the match was not sent first\n");
+    failures++;
+  }
+
+  // refused login: no more attempts
+  MqttBrokerEmulator refusingBroker;
+  refusingBroker.connackCode = 5;
+  MqttEngine refused;
+  refused.begin(refusingBroker, "broker.local", 1883, "bench", "user", "wrong", "", "");
+  runMqttTask(refused, HostRuntime::now() + 30 * second);
+  if (refused.getState() != MqttState::refused || refusingBroker.connectAttempts.size() != 1) {
+    printf("  FAILED: refused login was retried\n");
+    failures++;
+  }
+}
+
+// Mirrors of the doorbell part of loop() in main.cpp, before (melody with blocking tone() calls) and with the
+// feedback sequencer. The time of every published ring state is recorded.
+const uint8_t doorbellPin = 14;
+const uint32_t idleWaitMillis = 20;
+const FeedbackStep doorbellMelody[] = { {0, 0, 400, 500}, {0, 0, 500, 500}, {0, 0, 600, 500}, {0, 0, 0, 0} };
+const FeedbackStep buzzerOff[] = { {0, 0, 0, 0} };
+static bool doorbellPressed = false;
+static std::vector<std::pair<uint64_t, bool>> ringPublishes;
+static FeedbackSequencer buzzer;
+static std::vector<std::pair<uint64_t, uint16_t>> buzzerSteps;
+
+static void playBuzzerStep(const FeedbackStep &step, void *arg) {
+  buzzerSteps.push_back({ HostRuntime::now(), step.value });
+}
+
+static void doorbellLoopBlocking() {
+  bool doorbellCurrentlyPressed = (digitalRead(doorbellPin) == LOW);
+  if (doorbellCurrentlyPressed != doorbellPressed) {
+    ringPublishes.push_back({ HostRuntime::now(), doorbellCurrentlyPressed });
+    if (doorbellCurrentlyPressed) {
+      tone(0, 400, 500);
+      tone(0, 500, 500);
+      tone(0, 600, 500);
+    } else {
+      noTone(0);
+    }
+  }
+  doorbellPressed = doorbellCurrentlyPressed;
+  delay(idleWaitMillis);
+}
+
+static void doorbellLoopSequencer() {
+  bool doorbellCurrentlyPressed = (digitalRead(doorbellPin) == LOW);
+  if (doorbellCurrentlyPressed != doorbellPressed) {
+    ringPublishes.push_back({ HostRuntime::now(), doorbellCurrentlyPressed });
+    buzzer.play(doorbellCurrentlyPressed ? doorbellMelody : buzzerOff);
+  }
+  doorbellPressed = doorbellCurrentlyPressed;
+  delay(min(buzzer.update(), idleWaitMillis));
+}
+
+// loop() of main.cpp since the button is read by interrupt
+static DoorbellButton doorbell;
+
+static void doorbellLoopInterrupt() {
+  DoorbellEvent event;
+  while (doorbell.read(event)) {
+    ringPublishes.push_back({ HostRuntime::now(), event.pressed });
+    buzzer.play(event.pressed ? doorbellMelody : buzzerOff);
+  }
+  doorbell.wait(pdMS_TO_TICKS(min(buzzer.update(), idleWaitMillis)));
+}
+
+// contact bounce: the pin toggles a few times within 2 ms before it settles at the level
+static void scheduleButtonEdge(std::mt19937 &random, uint64_t at, bool press, bool bouncy) {
+  int toggles = bouncy ? std::uniform_int_distribution<int>(0, 3)(random) * 2 : 0;
+  for (int i = 0; i <= toggles; i++) {
+    bool level = (i % 2 == 0) ? press : !press;
+    HostRuntime::schedule(at, [level]() {
+      if (level)
+        HostRuntime::drivePin(doorbellPin, LOW);
+      else
+        HostRuntime::releasePin(doorbellPin);
+    });
+    if (i < toggles)
+      at += std::uniform_int_distribution<uint32_t>(100, 600)(random);
+  }
+}
+
+// Random presses of the doorbell button (short double presses included), latency from each press or release to the
+// publish of its ring state. An edge that is never published (pressed and released while loop() was blocked) is
+// missed, a publish without an edge (contact bounce) is spurious. Bouncy presses include short taps of 15-60 ms.
+static void benchDoorbell(const char *name, void (*loopPass)(), int presses, bool bouncy = false) {
+  std::mt19937 random(7);
+  pinMode(doorbellPin, INPUT_PULLUP);
+  doorbellPressed = false;
+  ringPublishes.clear();
+  std::vector<std::pair<uint64_t, bool>> edges;
+  uint64_t at = HostRuntime::now() + 100000;
+  for (int i = 0; i < presses; i++) {
+    at += std::uniform_int_distribution<uint32_t>(200000, 4000000)(random);
+    edges.push_back({ at, true });
+    scheduleButtonEdge(random, at, true, bouncy);
+    bool tap = bouncy && std::uniform_int_distribution<int>(0, 4)(random) == 0;
+    at += tap ? std::uniform_int_distribution<uint32_t>(15000, 60000)(random) : std::uniform_int_distribution<uint32_t>(100000, 2000000)(random);
+    edges.push_back({ at, false });
+    scheduleButtonEdge(random, at, false, bouncy);
+  }
+  if (loopPass == doorbellLoopInterrupt)
+    doorbell.begin(doorbellPin);
+  while (HostRuntime::now() < at + 3000000)
+    loopPass();
+
+  LatencyStats latency(name);
+  int missed = 0;
+  size_t publish = 0;
+  for (size_t i = 0; i < edges.size(); i++) {
+    uint64_t nextEdge = (i + 1 < edges.size()) ? edges[i + 1].first : UINT64_MAX;
+    while (publish < ringPublishes.size() && ringPublishes[publish].first < edges[i].first)
+      publish++;
+    if (publish < ringPublishes.size() && ringPublishes[publish].second == edges[i].second && ringPublishes[publish].first < nextEdge)
+      latency.add(ringPublishes[publish].first - edges[i].first);
+    else
+      missed++;
+  }
+  size_t spurious = ringPublishes.size() - (edges.size() - missed);
+  latency.print();
+  printf("  %-22s %d of %zu presses/releases missed, %zu spurious publishes\n", "", missed, edges.size(), spurious);
+  if (loopPass == doorbellLoopInterrupt && bouncy && (missed != 0 || spurious != 0)) {
+    printf("  FAILED: the interrupt driven button lost or invented presses\n");
+    failures++;
+  }
+}
+
+// Doorbell button latency with the blocking melody and with the feedback sequencer, and the rhythm of a melody played
+// by the sequencer from a loop() that only wakes up every 20 ms
+static void benchFeedback(int cycles) {
+  printf("feedback: %d doorbell presses\n", cycles);
+  benchDoorbell("press to publish (tone)", doorbellLoopBlocking, cycles);
+  buzzer.begin(playBuzzerStep);
+  benchDoorbell("press to publish (seq.)", doorbellLoopSequencer, cycles);
+
+  buzzerSteps.clear();
+  uint64_t start = HostRuntime::now();
+  buzzer.play(doorbellMelody);
+  while (buzzer.playing() || HostRuntime::now() - start < 2000000)
+    delay(min(buzzer.update(), idleWaitMillis));
+  uint64_t maxError = 0;
+  bool ok = buzzerSteps.size() == 4;
+  for (size_t i = 0; ok && i < buzzerSteps.size(); i++) {
+    uint64_t expected = start + i * 500000;
+    uint64_t error = buzzerSteps[i].first > expected ? buzzerSteps[i].first - expected : expected - buzzerSteps[i].first;
+    maxError = std::max(maxError, error);
+    ok = buzzerSteps[i].second == doorbellMelody[i].value;
+  }
+  printf("  melody: %zu steps, max. deviation from the rhythm %.1f ms\n", buzzerSteps.size(), maxError / 1000.0);
+  if (!ok || maxError > 1000) {
+    printf("  FAILED: melody not played as written\n");
+    failures++;
+  }
+}
+
+
+// One reader of a multi reader setup: own sensor, UART and touch pin, scanned by its own sensor task
+struct BenchReader {
+  R503Emulator sensor;
+  HardwareSerial serial;
+  FingerprintManager fingerManager;
+  bool unplugged = false;  // the sensor is disconnected after boot, every command of this reader runs into the timeout
+  int decisions = 0;
+  int wrongDecisions = 0;  // wrong person or the name of another reader
+  BenchReader(uint8_t id, int touchPin) : serial(id + 1), fingerManager(id, serial, touchPin) {}
+};
+
+static int workingReaders = 0; // sensor tasks of the benchmark that still have fingers to scan
+
+// The scan loop of one sensor task: every reader sees the same fingers at the same time (the worst case for the
+// shared core), residents of reader n are persons n * 100 + 1..5 in its slots 1..5, named "Rn Person k"
+static void scanReader(BenchReader &reader, int cycles, LatencyStats &unlock) {
+  if (reader.unplugged) {
+    // keeps scanning (and timing out) as long as the others work
+    while (workingReaders > 0) {
+      reader.fingerManager.waitForTouch(20);
+      reader.fingerManager.scanFingerprint();
+      HostRuntime::advance(loopOverheadMicros);
+    }
+    return;
+  }
+  uint8_t id = reader.fingerManager.getReaderId();
+  char namePrefix[8];
+  snprintf(namePrefix, sizeof(namePrefix), "R%u ", id);
+  std::mt19937 rng(42);
+  Match lastMatch;
+  for (int cycle = 0; cycle < cycles; cycle++) {
+    uint64_t placeAt = HostRuntime::now() + std::uniform_int_distribution<uint32_t>(300000, 3000000)(rng);
+    uint64_t liftAt = placeAt + std::uniform_int_distribution<uint32_t>(800000, 2500000)(rng);
+    int person = id * 100 + std::uniform_int_distribution<int>(1, residentCount)(rng);
+    R503Emulator &sensor = reader.sensor;
+    HostRuntime::schedule(placeAt, [&sensor, person]() { sensor.placeFinger(person); });
+    HostRuntime::schedule(liftAt, [&sensor]() { sensor.liftFinger(); });
+
+    bool decided = false;
+    while (HostRuntime::now() < liftAt + 500000 || lastMatch.scanResult != ScanResult::noFinger) {
+      reader.fingerManager.waitForTouch(20);
+      Match match = reader.fingerManager.scanFingerprint();
+      if (!decided && HostRuntime::now() >= placeAt && match.scanResult == ScanResult::matchFound) {
+        decided = true;
+        reader.decisions++;
+        if (reader.sensor.templateAt(match.matchId) == person && match.readerId == id && strncmp(match.matchName, namePrefix, strlen(namePrefix)) == 0)
+          unlock.add(HostRuntime::now() - placeAt);
+        else
+          reader.wrongDecisions++;
+      }
+      if (match.scanResult == ScanResult::matchFound)
+        delay(reader.fingerManager.getScanPolicy().getMatchCooldownMillis());
+      lastMatch = match;
+      HostRuntime::advance(loopOverheadMicros);
+    }
+  }
+  workingReaders--;
+}
+
+struct ReadersResult {
+  double decisionsPerMinute = 0;
+  double unlockP95 = 0;
+};
+
+static ReadersResult benchReaders(uint8_t readerCount, int cycles, bool unplugSecond = false) {
+  static const int touchPins[] = { touchRingPin, 4, 18, 19, 21, 22, 23, 25 };
+  Preferences::resetStore();
+  HostRuntime::clearSchedule();
+  std::vector<std::unique_ptr<BenchReader>> readers;
+  for (uint8_t id = 0; id < readerCount; id++) {
+    readers.emplace_back(new BenchReader(id, touchPins[id]));
+    BenchReader &reader = *readers.back();
+    reader.serial.attach(&reader.sensor);
+    reader.sensor.connectTouchRing(touchPins[id]);
+    Preferences preferences;
+    preferences.begin(id == 0 ? "fingerList" : (String("fingerList") + id).c_str(), false);
+    for (int k = 1; k <= residentCount; k++) {
+      reader.sensor.storeTemplate(k, id * 100 + k);
+      preferences.putString(String(k).c_str(), String("R") + id + " Person " + k);
+    }
+    preferences.end();
+    reader.fingerManager.connect();
+    reader.fingerManager.setLedRingReady();
+  }
+  if (unplugSecond && readerCount > 1) {
+    readers[1]->unplugged = true;
+    readers[1]->serial.attach(nullptr);
+  }
+
+  LatencyStats unlock("time to unlock");
+  std::vector<std::function<void()>> tasks;
+  workingReaders = 0;
+  for (std::unique_ptr<BenchReader> &reader : readers) {
+    BenchReader *r = reader.get();
+    if (!r->unplugged)
+      workingReaders++;
+    tasks.push_back([r, cycles, &unlock]() { scanReader(*r, cycles, unlock); });
+  }
+  uint64_t virtualStart = HostRuntime::now();
+  auto wallStart = std::chrono::steady_clock::now();
+  HostRuntime::runTasks(tasks);
+  double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+  double virtualSeconds = (HostRuntime::now() - virtualStart) / 1e6;
+
+  ReadersResult result;
+  int decisions = 0;
+  int wrongDecisions = 0;
+  for (std::unique_ptr<BenchReader> &reader : readers) {
+    if (reader->unplugged)
+      continue;
+    decisions += reader->decisions;
+    wrongDecisions += reader->wrongDecisions;
+  }
+  result.decisionsPerMinute = decisions / virtualSeconds * 60;
+  result.unlockP95 = unlock.percentile(0.95);
+  printf("readers: %u%s, %d fingers each, %.0f s simulated in %.2f s: %.1f decisions per minute, %d wrong\n", readerCount,
+    unplugSecond ? " (second one unplugged)" : "", cycles, virtualSeconds, wallSeconds, result.decisionsPerMinute, wrongDecisions);
+  unlock.print();
+  if (wrongDecisions > 0) {
+    printf("  FAILED: matches reported with the wrong person, reader or name\n");
+    failures++;
+  }
+  return result;
+}
+
+// Decisions per minute of 1..8 readers scanned at the same time, and a reader whose sensor is gone next to a working one
+static void benchMultiReader(int cycles) {
+  ReadersResult single;
+  for (uint8_t readerCount : { 1, 2, 4, 8 }) {
+    ReadersResult result = benchReaders(readerCount, cycles);
+    if (readerCount == 1) {
+      single = result;
+      continue;
+    }
+    double scaling = result.decisionsPerMinute / (single.decisionsPerMinute * readerCount);
+    printf("  scaling: %.0f%% of %u single readers, p95 time to unlock %+.1f ms\n", scaling * 100, readerCount, result.unlockP95 - single.unlockP95);
+    if (scaling < 0.9 || result.unlockP95 > single.unlockP95 * 1.1) {
+      printf("  FAILED: the readers slow each other down\n");
+      failures++;
+    }
+  }
+  ReadersResult unplugged = benchReaders(2, cycles, true);
+  if (unplugged.decisionsPerMinute < single.decisionsPerMinute * 0.9 || unplugged.unlockP95 > single.unlockP95 * 1.1) {
+    printf("  FAILED: the unplugged reader stalls the working one\n");
+    failures++;
+  }
+}
+
+
+// Faults of the soak test, per command/reply. Much higher than on a good link, so that every error branch is taken
+// many times in a short run.
+const R503Faults soakFaults = { 0.004f, 0.004f, 0.004f, 0.002f, 0.01f, 0.01f, 0.001f, 300000 };
+const uint64_t soakMaxPassMicros = 5000000;   // longest acceptable pass of the scan loop (AutoIdentify waits up to 3 s)
+const uint64_t soakHangMicros = 60000000;     // virtual time without a finished pass that counts as hang
+const int soakEnrollInterval = 100;          // every n-th touch is an enrollment
+const uint16_t soakEnrollId = 190;
+
+static std::atomic<unsigned long> soakPasses(0); // heartbeat of the scan loop for the watchdogs
+static uint64_t soakPassStart = 0;
+static const char *soakStage = "";
+
+// Task watchdog on the virtual clock: runs as a timer event, so it also fires while the loop waits in delay()
+static void soakWatchdog() {
+  if (HostRuntime::now() - soakPassStart > soakHangMicros) {
+    printf("  FAILED: hang, no pass of the %s finished for %.0f s (at %.1f s)\n", soakStage,
+      (HostRuntime::now() - soakPassStart) / 1e6, HostRuntime::now() / 1e6);
+    fflush(stdout);
+    std::_Exit(1);
+  }
+  HostRuntime::scheduleIn(1000000, soakWatchdog);
+}
+
+static const char *faultName(R503Fault fault) {
+  static const char *const names[] = { "corrupted byte", "dropped byte", "no reply", "unknown code", "image fail", "feature fail", "power cycle" };
+  return names[(int)fault];
+}
+
+// a command was answered properly again: all faults since the last good answer are recovered
+static void recovered(std::vector<uint64_t> &faultTimes, LatencyStats &recovery) {
+  for (uint64_t faultAt : faultTimes)
+    recovery.add(HostRuntime::now() - faultAt);
+  faultTimes.clear();
+}
+
+static void benchSoak(long touches) {
+  R503Emulator sensor;
+  FingerprintManager fingerManager;
+  setupDevice(sensor, fingerManager, true);
+  sensor.faults = soakFaults;
+  sensor.messyImageRate = 0.02f;
+
+  std::mt19937 rng(99);
+  std::vector<uint64_t> unrecovered; // faults that happened since the last good scan
+  sensor.onFault = [&unrecovered](R503Fault fault) { unrecovered.push_back(HostRuntime::now()); };
+  int enrollPerson = 0;
+  sensor.onLedChanged = [&](uint8_t control, uint8_t color) {
+    if (!fingerManager.isEnrolling() || color != FINGERPRINT_LED_PURPLE)
+      return;
+    if (control == FINGERPRINT_LED_FLASHING)
+      HostRuntime::scheduleIn(std::uniform_int_distribution<uint32_t>(200000, 600000)(rng), [&]() {
+        if (fingerManager.isEnrolling()) // not after the enrollment failed in the meantime
+          sensor.placeFinger(enrollPerson);
+      });
+    else if (control == FINGERPRINT_LED_ON)
+      HostRuntime::scheduleIn(std::uniform_int_distribution<uint32_t>(150000, 400000)(rng), [&sensor]() { sensor.liftFinger(); });
+  };
+
+  // wall clock watchdog for loops that spin without ever waiting (the virtual clock would stand still)
+  std::atomic<bool> soakDone(false);
+  std::thread wallWatchdog([&soakDone]() {
+    unsigned long lastPasses = soakPasses;
+    int idleSeconds = 0;
+    while (!soakDone) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      if (++idleSeconds < 100)
+        continue;
+      if (soakPasses == lastPasses && !soakDone) {
+        printf("  FAILED: hang, no pass of the %s finished for 10 s of wall clock time\n", soakStage);
+        fflush(stdout);
+        std::_Exit(1);
+      }
+      lastPasses = soakPasses;
+      idleSeconds = 0;
+    }
+  });
+  soakPassStart = HostRuntime::now();
+  HostRuntime::scheduleIn(1000000, soakWatchdog);
+
+  LatencyStats recovery("fault to good reply");
+  LatencyStats enrollStep("enrollment step");
+  uint64_t longestPass = 0;
+  uint64_t longestEnrollStep = 0;
+  unsigned long scans = 0;
+  int accepted = 0, falseAccepts = 0, falseRejects = 0, noDecision = 0;
+  int enrollments = 0, enrolled = 0;
+  Match lastMatch;
+
+  auto wallStart = std::chrono::steady_clock::now();
+  uint64_t virtualStart = HostRuntime::now();
+
+  for (long touch = 0; touch < touches; touch++) {
+    if (touch % soakEnrollInterval == soakEnrollInterval - 1) {
+      soakStage = "enrollment";
+      enrollments++;
+      enrollPerson = 5000 + touch;
+      if (sensor.templateAt(soakEnrollId) != 0)
+        fingerManager.deleteFinger(soakEnrollId);
+      NewFinger newFinger;
+      if (fingerManager.beginEnroll(soakEnrollId, "Soak")) {
+        do {
+          soakPassStart = HostRuntime::now();
+          unsigned long commandsBefore = sensor.totalCommands();
+          newFinger = fingerManager.continueEnroll();
+          uint64_t stepMicros = HostRuntime::now() - soakPassStart;
+          enrollStep.add(stepMicros);
+          longestEnrollStep = std::max(longestEnrollStep, stepMicros);
+          soakPasses++;
+          if (sensor.totalCommands() != commandsBefore && (newFinger.returnCode == FINGERPRINT_OK || newFinger.returnCode == FINGERPRINT_NOFINGER))
+            recovered(unrecovered, recovery);
+        } while (newFinger.enrollResult == EnrollResult::running);
+      }
+      if (newFinger.enrollResult == EnrollResult::ok && sensor.templateAt(soakEnrollId) == enrollPerson)
+        enrolled++;
+      sensor.liftFinger();
+      continue;
+    }
+
+    soakStage = "scan loop";
+    uint64_t placeAt = HostRuntime::now() + std::uniform_int_distribution<uint32_t>(100000, 1000000)(rng);
+    uint64_t liftAt = placeAt + std::uniform_int_distribution<uint32_t>(600000, 2000000)(rng);
+    int person = std::uniform_int_distribution<int>(0, 9)(rng) < 8 ? std::uniform_int_distribution<int>(1, residentCount)(rng) : unknownPerson;
+    HostRuntime::schedule(placeAt, [&sensor, person]() { sensor.placeFinger(person); });
+    HostRuntime::schedule(liftAt, [&sensor]() { sensor.liftFinger(); });
+
+    bool decided = false;
+    while (HostRuntime::now() < liftAt + 300000 || lastMatch.scanResult != ScanResult::noFinger) {
+      soakPassStart = HostRuntime::now();
+      unsigned long commandsBefore = sensor.totalCommands();
+      fingerManager.waitForTouch(20);
+      Match match = fingerManager.scanFingerprint();
+      longestPass = std::max(longestPass, HostRuntime::now() - soakPassStart);
+      soakPasses++;
+
+      if (sensor.totalCommands() != commandsBefore) {
+        scans++;
+        bool good = match.scanResult == ScanResult::matchFound
+          || (match.scanResult == ScanResult::noMatchFound && match.returnCode == FINGERPRINT_NOTFOUND)
+          || (match.scanResult == ScanResult::noFinger && match.returnCode == FINGERPRINT_NOFINGER);
+        if (good)
+          recovered(unrecovered, recovery);
+      }
+      if (match.scanResult == ScanResult::matchFound) {
+        if (sensor.templateAt(match.matchId) != person)
+          falseAccepts++; // the door would open for the wrong person
+        else if (!decided)
+          accepted++;
+        decided = true;
+      } else if (match.scanResult == ScanResult::noMatchFound && !decided && HostRuntime::now() >= placeAt) {
+        decided = true;
+        if (person != unknownPerson)
+          falseRejects++;
+      }
+
+      if (match.scanResult == ScanResult::matchFound)
+        delay(fingerManager.getScanPolicy().getMatchCooldownMillis());
+      else if (match.scanResult == ScanResult::noMatchFound && lastMatch.scanResult == ScanResult::noMatchFound)
+        delay(1000);
+      lastMatch = match;
+      HostRuntime::advance(loopOverheadMicros);
+    }
+    if (!decided)
+      noDecision++;
+  }
+  soakDone = true;
+  wallWatchdog.join();
+  HostRuntime::clearSchedule();
+
+  double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+  double virtualSeconds = (HostRuntime::now() - virtualStart) / 1e6;
+  printf("soak: %ld touches, %lu scans, %.0f s simulated in %.2f s\n", touches, scans, virtualSeconds, wallSeconds);
+  printf("  faults:");
+  for (int fault = 0; fault < (int)R503Fault::count; fault++)
+    printf("%s %s %lu", fault ? "," : "", faultName((R503Fault)fault), sensor.faultCount((R503Fault)fault));
+  printf("\n");
+  recovery.print();
+  enrollStep.print();
+  printf("  longest pass of the scan loop %.1f ms, longest enrollment step %.1f ms\n", longestPass / 1000.0, longestEnrollStep / 1000.0);
+  printf("  fingers: %d accepted, %d rejected although enrolled, %d without decision, %d accepted as someone else\n",
+    accepted, falseRejects, noDecision, falseAccepts);
+  printf("  enrollments: %d of %d stored\n", enrolled, enrollments);
+  if (falseAccepts > 0) {
+    printf("  FAILED: a corrupted reply was taken as match\n");
+    failures++;
+  }
+  if (longestPass > soakMaxPassMicros || longestEnrollStep > soakMaxPassMicros) {
+    printf("  FAILED: the loop stalled for more than %.0f s\n", soakMaxPassMicros / 1e6);
+    failures++;
+  }
+}
+
+
+// UART trace: a rainy afternoon at the door (drops on the touch ring, wet fingers, a flaky link) is recorded on the
+// emulator and replayed on a second FingerprintManager, which has to reach the same decisions with the same timing
+const R503Faults traceFaults = { 0.002f, 0.002f, 0.002f, 0.001f, 0.01f, 0.01f, 0.0f, 300000 };
+const uint8_t traceReplayTouchPin = 26;
+
+static void printReplay(const TraceReplayReport &report) {
+  uint64_t busyMicros = 0, longestMicros = 0, longestRainMicros = 0;
+  int matches = 0, rejects = 0, ringEvents = 0;
+  for (const TraceReplayPass &pass : report.passes) {
+    busyMicros += pass.replayedMicros;
+    longestMicros = std::max(longestMicros, pass.replayedMicros);
+    if (pass.recordedResult == ScanResult::matchFound)
+      matches++;
+    else if (pass.recordedResult == ScanResult::noMatchFound && (pass.recordedReturnCode == FINGERPRINT_NOFINGER || pass.recordedReturnCode == FINGERPRINT_AUTOTIMEOUT)) {
+      ringEvents++; // touch ring without a finger on the sensor, e.g. rain
+      longestRainMicros = std::max(longestRainMicros, pass.replayedMicros);
+    } else if (pass.recordedResult == ScanResult::noMatchFound)
+      rejects++;
+  }
+  printf("  replay: %zu scan passes (%d matches, %d rejects, %d ring events without finger), %lu exchanges outside of passes skipped\n",
+    report.passes.size(), matches, rejects, ringEvents, report.skippedExchanges);
+  printf("  busy with scan passes %.1f s, longest pass %.0f ms, longest ring event %.0f ms\n", busyMicros / 1e6, longestMicros / 1000.0, longestRainMicros / 1000.0);
+  printf("  %lu decisions differ, %lu passes diverged, %lu incomplete, %lu state corrections, largest timing difference %.3f ms\n",
+    report.decisionMismatches, report.divergedPasses, report.incompletePasses, report.stateMismatches, report.maxTimingError / 1000.0);
+  if (!report.firstDivergence.empty())
+    printf("  first divergence: %s\n", report.firstDivergence.c_str());
+}
+
+static void benchTrace(int touches) {
+  R503Emulator sensor;
+  FingerprintManager fingerManager;
+  setupDevice(sensor, fingerManager, true);
+  sensor.faults = traceFaults;
+  fingerManager.setFalseTouchDetection(false); // every drop is a ring event, see "rain" for the suppressed ring
+  sensor.messyImageRate = 0.1f; // wet fingers
+  fingerManager.startTrace(uartTraceMaxSize);
+
+  std::mt19937 rng(23);
+  bool raining = true;
+  int drops = 0;
+  std::function<void()> drop = [&]() {
+    if (!raining)
+      return;
+    drops++;
+    HostRuntime::drivePin(touchRingPin, LOW);
+    HostRuntime::scheduleIn(sensor.touchPulseMicros, []() { HostRuntime::drivePin(touchRingPin, HIGH); });
+    HostRuntime::scheduleIn(std::uniform_int_distribution<uint32_t>(500000, 6000000)(rng), drop);
+  };
+  HostRuntime::scheduleIn(1000000, drop);
+
+  Match lastMatch;
+  for (int touch = 0; touch < touches; touch++) {
+    uint64_t placeAt = HostRuntime::now() + std::uniform_int_distribution<uint32_t>(1000000, 8000000)(rng);
+    uint64_t liftAt = placeAt + std::uniform_int_distribution<uint32_t>(600000, 2000000)(rng);
+    int person = std::uniform_int_distribution<int>(0, 9)(rng) < 8 ? std::uniform_int_distribution<int>(1, residentCount)(rng) : unknownPerson;
+    HostRuntime::schedule(placeAt, [&sensor, person]() { sensor.placeFinger(person); });
+    HostRuntime::schedule(liftAt, [&sensor]() { sensor.liftFinger(); });
+    while (HostRuntime::now() < liftAt + 300000 || lastMatch.scanResult != ScanResult::noFinger) {
+      fingerManager.waitForTouch(idleWaitMillis);
+      Match match = fingerManager.scanFingerprint();
+      if (match.scanResult == ScanResult::matchFound) {
+        delay(fingerManager.getScanPolicy().getMatchCooldownMillis());
+        fingerManager.setLedRingReady(); // outside of a scan pass, not replayed
+      } else if (match.scanResult == ScanResult::noMatchFound && lastMatch.scanResult == ScanResult::noMatchFound) {
+        delay(1000);
+      }
+      lastMatch = match;
+      HostRuntime::advance(loopOverheadMicros);
+    }
+  }
+  raining = false;
+  fingerManager.stopTrace();
+  HostRuntime::clearSchedule();
+
+  UartTraceInfo info = fingerManager.getTrace().getInfo();
+  std::vector<uint8_t> file(fingerManager.getTrace().getExportLength());
+  file.resize(fingerManager.getTrace().exportTo(file.data(), file.size()));
+  TracePlayer player;
+  std::string error;
+  if (!player.load(file, error)) {
+    printf("  FAILED: the trace can't be read: %s\n", error.c_str());
+    failures++;
+    return;
+  }
+  HardwareSerial replaySerial(2);
+  replaySerial.attach(&player);
+  FingerprintManager replayManager(0, replaySerial, traceReplayTouchPin);
+  TraceReplayReport report = player.replay(replayManager, traceReplayTouchPin);
+
+  printf("trace: %d touches and %d rain drops, %lu records in %.1f KB (%lu dropped), %.0f bytes per scan pass\n", touches, drops,
+    info.records, info.used / 1024.0, info.dropped, report.passes.empty() ? 0.0 : (double)info.used / report.passes.size());
+  printReplay(report);
+  if (report.passes.empty() || report.decisionMismatches > 0 || report.divergedPasses > 0) {
+    printf("  FAILED: the replay did not reproduce the recorded decisions\n");
+    failures++;
+  }
+  if (report.maxTimingError > 1000) {
+    printf("  FAILED: the replay did not reproduce the timing of the scan passes\n");
+    failures++;
+  }
+}
+
+// A rainy day at the door: drops on the touch ring, residents whose image does not always match at the first try
+// (placed off center), unknown fingers and users who rest the finger a while after the match
+struct PolicyResult {
+  double unlockMean = 0;
+  double rejectMean = 0;
+  double ringEventMean = 0;   // scan loop busy with a touch of the ring without a finger
+  int residentTouches = 0;
+  int falseRejects = 0;       // resident got noMatchFound
+  int wrongMatches = 0;
+  int restingMatches = 0;     // finger still on the sensor when the cooldown ended, matched again (not published)
+  int publishedMatches = 0;   // matches the firmware publishes, after a scan without a match
+  int countedMatches = 0;     // match counters saved by the manager (every matchCountSaveInterval matches)
+  ScanPolicyParameters parameters;
+};
+
+static PolicyResult runPolicySession(int touches, ScanEngine engine, bool adaptive) {
+  R503Emulator sensor;
+  FingerprintManager fingerManager;
+  setupDevice(sensor, fingerManager, true);
+  fingerManager.setScanEngine(engine);
+  fingerManager.getScanPolicy().setAdaptive(adaptive);
+  fingerManager.setFalseTouchDetection(false); // only the pass limits, see "rain" for the suppressed ring
+  sensor.partialImageRate = 0.15f;
+
+  std::mt19937 rng(11);
+  std::mt19937 rainRng(12); // own sequence, both runs see the same users
+  bool raining = true;
+  std::function<void()> drop = [&]() {
+    if (!raining)
+      return;
+    if (!sensor.isFingerPlaced()) {
+      HostRuntime::drivePin(touchRingPin, LOW);
+      HostRuntime::scheduleIn(sensor.touchPulseMicros, []() { HostRuntime::drivePin(touchRingPin, HIGH); });
+    }
+    HostRuntime::scheduleIn(std::uniform_int_distribution<uint32_t>(500000, 6000000)(rainRng), drop);
+  };
+  HostRuntime::scheduleIn(1000000, drop);
+
+  PolicyResult result;
+  LatencyStats unlock("time to unlock");
+  LatencyStats reject("time to reject");
+  LatencyStats ringEvent("ring event");
+  Match lastMatch;
+  for (int touch = 0; touch < touches; touch++) {
+    uint64_t placeAt = HostRuntime::now() + std::uniform_int_distribution<uint32_t>(1000000, 8000000)(rng);
+    uint64_t liftAt = placeAt + std::uniform_int_distribution<uint32_t>(800000, 2500000)(rng);
+    int person = std::uniform_int_distribution<int>(0, 9)(rng) < 8 ? std::uniform_int_distribution<int>(1, residentCount)(rng) : unknownPerson;
+    HostRuntime::schedule(placeAt, [&sensor, person]() { sensor.placeFinger(person); });
+    HostRuntime::schedule(liftAt, [&sensor]() { sensor.liftFinger(); });
+    if (person != unknownPerson)
+      result.residentTouches++;
+
+    bool decided = false;
+    while (HostRuntime::now() < liftAt + 300000 || lastMatch.scanResult != ScanResult::noFinger) {
+      fingerManager.waitForTouch(idleWaitMillis);
+      bool fingerPlaced = sensor.isFingerPlaced();
+      uint64_t passStart = HostRuntime::now();
+      Match match = fingerManager.scanFingerprint();
+      uint64_t passEnd = HostRuntime::now();
+      bool fingerResult = match.scanResult == ScanResult::matchFound || match.returnCode == FINGERPRINT_NOTFOUND;
+      if (match.scanResult == ScanResult::noMatchFound && !fingerResult && !fingerPlaced && !sensor.isFingerPlaced())
+        ringEvent.add(passEnd - passStart);
+      if (!decided && passEnd >= placeAt && fingerResult) {
+        decided = true;
+        if (match.scanResult == ScanResult::matchFound && sensor.templateAt(match.matchId) == person)
+          unlock.add(passEnd - placeAt);
+        else if (match.scanResult == ScanResult::matchFound)
+          result.wrongMatches++;
+        else if (person == unknownPerson)
+          reject.add(passEnd - placeAt);
+        else
+          result.falseRejects++;
+      }
+
+      if (match.scanResult == ScanResult::matchFound) {
+        if (lastMatch.scanResult == ScanResult::matchFound && lastMatch.matchId == match.matchId)
+          result.restingMatches++;
+        else if (lastMatch.scanResult != ScanResult::matchFound)
+          result.publishedMatches++;
+        delay(fingerManager.getScanPolicy().getMatchCooldownMillis());
+      } else if (match.scanResult == ScanResult::noMatchFound && lastMatch.scanResult == ScanResult::noMatchFound) {
+        delay(1000);
+      }
+      lastMatch = match;
+      HostRuntime::advance(loopOverheadMicros);
+    }
+  }
+  raining = false;
+  HostRuntime::clearSchedule();
+
+  result.unlockMean = unlock.mean();
+  result.rejectMean = reject.mean();
+  result.ringEventMean = ringEvent.mean();
+  result.parameters = fingerManager.getScanPolicy().getParameters();
+  Preferences stats;
+  stats.begin("fingerStats", true);
+  uint16_t pairs[2 * 16];
+  size_t pairCount = stats.getBytes("slotCounts", pairs, sizeof(pairs)) / (2 * sizeof(uint16_t));
+  stats.end();
+  for (size_t i = 0; i < pairCount; i++)
+    result.countedMatches += pairs[2 * i + 1];
+  printf("  %-8s unlock %6.1f ms, reject %6.1f ms, ring event %6.1f ms (%zu), false rejects %d of %d, resting fingers"
+    " matched again %d, passes %u/%u, cooldown %u ms\n", adaptive ? "adaptive" : "fixed", result.unlockMean, result.rejectMean,
+    result.ringEventMean, ringEvent.count(), result.falseRejects, result.residentTouches, result.restingMatches,
+    result.parameters.limits.imagingPasses, result.parameters.limits.searchPasses, result.parameters.matchCooldownMillis);
+  if (printMetrics) {
+    StdoutPrint out;
+    fingerManager.getScanPolicy().printJson(out);
+    printf("\n");
+  }
+  return result;
+}
+
+// fixed pass limits (upper bounds of the policy, the limits of older firmware) against the adaptive ones. The first
+// pass of AutoIdentify waits for the finger on the sensor side, only its further search passes follow the policy.
+// The search passes keep the fixed limit, with the adaptive cooldown about one in ten resting fingers is matched again,
+// which must neither be published nor counted for the hot set.
+static void benchPolicy(int touches) {
+  residentSlots = firstResidentSlots; // AutoIdentify is only used for low hot slots
+  for (ScanEngine engine : { ScanEngine::threeStep, ScanEngine::autoIdentify }) {
+    printf("policy (%s): %d touches in the rain\n", scanEngineName(engine), touches);
+    PolicyResult fixed = runPolicySession(touches, engine, false);
+    PolicyResult adaptive = runPolicySession(touches, engine, true);
+    if (adaptive.wrongMatches > 0 || fixed.wrongMatches > 0) {
+      printf("  FAILED: a finger matched the wrong template\n");
+      failures++;
+    }
+    printf("  trade-off: the shorter cooldown matched the resting finger again after %d of %d resident touches (fixed: %d),"
+      " the match color stays longer then\n", adaptive.restingMatches, adaptive.residentTouches, fixed.restingMatches);
+    for (const PolicyResult *result : { &fixed, &adaptive }) {
+      if (result->countedMatches > result->publishedMatches || result->countedMatches + matchCountSaveInterval <= result->publishedMatches) {
+        printf("  FAILED: %d matches counted for the hot set, %d published\n", result->countedMatches, result->publishedMatches);
+        failures++;
+      }
+    }
+    if (adaptive.rejectMean > fixed.rejectMean * 1.05 || (engine == ScanEngine::threeStep && adaptive.ringEventMean >= fixed.ringEventMean)) {
+      printf("  FAILED: the adaptive limits did not shorten ring events or made rejections longer\n");
+      failures++;
+    }
+    if (adaptive.unlockMean > fixed.unlockMean * 1.05 || adaptive.falseRejects > fixed.falseRejects) {
+      printf("  FAILED: the adaptive limits made residents wait longer or rejected them\n");
+      failures++;
+    }
+    if (adaptive.restingMatches > adaptive.residentTouches / 8) {
+      printf("  FAILED: the adaptive cooldown matched resting fingers again too often\n");
+      failures++;
+    }
+  }
+  residentSlots = spreadResidentSlots;
+}
+
+// A storm followed by dry weather, with and without the false touch detection: how many ring events and LED flashes
+// the drops cost, whether fingers are still found as fast while the ring is suppressed, and when it is used again.
+// Without storm (stormTouches 0) the ring must never be suppressed, unknown fingers lifted during their passes included
+static int runRainSession(int touches, int stormTouches, bool detection, int missedWithoutDetection = 0) {
+  R503Emulator sensor;
+  FingerprintManager fingerManager;
+  setupDevice(sensor, fingerManager, true);
+  fingerManager.setFalseTouchDetection(detection);
+  ringSuppressionChanges.clear();
+
+  std::mt19937 rng(5);
+  std::mt19937 rainRng(6);
+  bool raining = stormTouches > 0;
+  std::function<void()> drop = [&]() {
+    if (!raining)
+      return;
+    if (!sensor.isFingerPlaced()) {
+      HostRuntime::drivePin(touchRingPin, LOW);
+      HostRuntime::scheduleIn(sensor.touchPulseMicros, []() { HostRuntime::drivePin(touchRingPin, HIGH); });
+    }
+    HostRuntime::scheduleIn(std::uniform_int_distribution<uint32_t>(500000, 6000000)(rainRng), drop);
+  };
+  uint64_t stormStart = HostRuntime::now();
+  HostRuntime::scheduleIn(1000000, drop);
+
+  LatencyStats stormUnlock("time to unlock (storm)");
+  LatencyStats dryUnlock("time to unlock (dry)");
+  int wrongDecisions = 0;
+  int missedFingers = 0;
+  unsigned long ringEvents = 0;
+  uint64_t ringEventMicros = 0;
+  unsigned long stormLedCommands = 0;
+  uint64_t stormEnd = 0;
+  Match lastMatch;
+  for (int touch = 0; touch < touches; touch++) {
+    if (raining && touch == stormTouches) {
+      // the rest is dry
+      raining = false;
+      stormEnd = HostRuntime::now();
+      stormLedCommands = sensor.commandCount(FINGERPRINT_AURALEDCONFIG);
+    }
+    uint64_t placeAt = HostRuntime::now() + std::uniform_int_distribution<uint32_t>(5000000, 30000000)(rng);
+    uint64_t liftAt = placeAt + std::uniform_int_distribution<uint32_t>(800000, 2500000)(rng);
+    int person = std::uniform_int_distribution<int>(0, 9)(rng) < 8 ? std::uniform_int_distribution<int>(1, residentCount)(rng) : unknownPerson;
+    HostRuntime::schedule(placeAt, [&sensor, person]() { sensor.placeFinger(person); });
+    HostRuntime::schedule(liftAt, [&sensor]() { sensor.liftFinger(); });
+
+    bool decided = false;
+    while (HostRuntime::now() < liftAt + 300000 || lastMatch.scanResult != ScanResult::noFinger) {
+      fingerManager.waitForTouch(idleWaitMillis);
+      bool fingerPlaced = sensor.isFingerPlaced();
+      uint64_t passStart = HostRuntime::now();
+      Match match = fingerManager.scanFingerprint();
+      uint64_t passEnd = HostRuntime::now();
+      bool fingerResult = match.scanResult == ScanResult::matchFound || match.returnCode == FINGERPRINT_NOTFOUND;
+      if (match.scanResult == ScanResult::noMatchFound && !fingerResult && !fingerPlaced && !sensor.isFingerPlaced()) {
+        ringEvents++;
+        ringEventMicros += passEnd - passStart;
+      }
+      if (!decided && passEnd >= placeAt && (fingerResult || (match.scanResult == ScanResult::noMatchFound && fingerPlaced))) {
+        decided = true;
+        if (match.scanResult == ScanResult::matchFound && sensor.templateAt(match.matchId) == person)
+          (raining ? stormUnlock : dryUnlock).add(passEnd - placeAt);
+        else if (match.scanResult == ScanResult::matchFound || person != unknownPerson)
+          wrongDecisions++;
+      }
+      if (match.scanResult == ScanResult::matchFound)
+        delay(fingerManager.getScanPolicy().getMatchCooldownMillis());
+      else if (match.scanResult == ScanResult::noMatchFound && lastMatch.scanResult == ScanResult::noMatchFound)
+        delay(1000);
+      lastMatch = match;
+      HostRuntime::advance(loopOverheadMicros);
+    }
+    if (!decided)
+      missedFingers++;
+  }
+  HostRuntime::clearSchedule();
+
+  const ScanMetrics &metrics = fingerManager.getMetrics();
+  printf("  %s, detection %-3s  %lu ring events (%.1f s of scan passes), %lu LED commands in the storm, %u false and %u finger touches\n",
+    stormTouches > 0 ? "storm" : "dry", detection ? "on" : "off", ringEvents, ringEventMicros / 1e6, stormLedCommands, (unsigned)metrics.falseTouches, (unsigned)metrics.fingerTouches);
+  stormUnlock.print();
+  dryUnlock.print();
+  printf("    wrong decisions: %d, fingers without decision: %d\n", wrongDecisions, missedFingers);
+  if (stormTouches > 0)
+    printf("    storm ended at %.0f s\n", (stormEnd - stormStart) / 1e6);
+  uint64_t suppressedAt = 0, releasedAt = 0;
+  bool suppressedWhenDry = false;
+  for (const std::pair<uint64_t, bool> &change : ringSuppressionChanges) {
+    printf("    ring %s at %.0f s%s\n", change.second ? "suppressed" : "used again", (change.first - stormStart) / 1e6,
+      change.first >= stormEnd ? " (dry)" : "");
+    if (change.second && suppressedAt == 0)
+      suppressedAt = change.first;
+    if (!change.second && change.first >= stormEnd && releasedAt == 0)
+      releasedAt = change.first;
+    if (change.second && change.first >= stormEnd)
+      suppressedWhenDry = true;
+  }
+  if (wrongDecisions > 0 || (detection && missedFingers > missedWithoutDetection)) {
+    printf("  FAILED: a finger was decided wrong or not at all while the ring was suppressed\n");
+    failures++;
+  }
+  if (detection && (suppressedWhenDry || (stormTouches == 0 && metrics.falseTouches > 0))) {
+    printf("  FAILED: touches with a finger were taken for rain or the ring was suppressed without rain\n");
+    failures++;
+  }
+  if (detection && stormTouches > 0 && (suppressedAt == 0 || releasedAt == 0 || fingerManager.isTouchRingSuppressed())) {
+    printf("  FAILED: the ring was not suppressed in the storm or not used again when it was dry\n");
+    failures++;
+  }
+  if (detection && stormUnlock.percentile(0.95) > 1000) {
+    printf("  FAILED: fingers waited too long while the ring was suppressed\n");
+    failures++;
+  }
+  return missedFingers;
+}
+
+static void benchRain(int touches) {
+  printf("rain: %d touches, the first half in a storm, then %d touches without rain\n", touches, touches);
+  int missed = runRainSession(touches, touches / 2, false);
+  runRainSession(touches, touches / 2, true, missed);
+  runRainSession(touches, 0, true);
+}
+
+// "replay <file>": a trace downloaded from the device, the decision and duration of every scan pass
+static int replayTraceFile(const char *path) {
+  TracePlayer player;
+  std::string error;
+  if (!player.loadFile(path, error)) {
+    printf("%s: %s\n", path, error.c_str());
+    return 1;
+  }
+  HardwareSerial replaySerial(2);
+  replaySerial.attach(&player);
+  FingerprintManager replayManager(player.getReaderId(), replaySerial, traceReplayTouchPin);
+  TraceReplayReport report = player.replay(replayManager, traceReplayTouchPin);
+  printf("%s: reader %u, %lu records (%lu dropped on the device)\n", path, player.getReaderId(), report.records, report.droppedRecords);
+  static const char *resultNames[] = { "no finger", "match", "no match", "error" };
+  for (const TraceReplayPass &pass : report.passes) {
+    printf("  %10.3f s  %-9s code 0x%02X", pass.at / 1e6, resultNames[(int)pass.recordedResult], pass.recordedReturnCode);
+    if (pass.recordedResult == ScanResult::matchFound)
+      printf(" slot %u", pass.recordedMatchId);
+    printf("  %8.1f ms recorded, %8.1f ms replayed%s%s\n", pass.recordedMicros / 1000.0, pass.replayedMicros / 1000.0,
+      pass.replayed.scanResult != pass.recordedResult || pass.replayed.returnCode != pass.recordedReturnCode ? "  DECISION DIFFERS" : "",
+      pass.diverged ? "  DIVERGED" : "");
+  }
+  printReplay(report);
+  return (report.decisionMismatches > 0 || report.divergedPasses > 0) ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+  String scenario = "all";
+  int cycles = 1000;
+  for (int i = 1; i < argc; i++) {
+    String arg = argv[i];
+    if (arg == "replay" && i + 1 < argc)
+      return replayTraceFile(argv[++i]);
+    else if (arg == "--verbose")
+      HostRuntime::setConsoleOutput(true);
+    else if (arg == "--metrics")
+      printMetrics = true;
+    else if (isdigit((unsigned char)argv[i][0]))
+      cycles = atoi(argv[i]);
+    else
+      scenario = arg;
+  }
+
+  if (scenario == "scan" || scenario == "all") {
+    benchScan(cycles); // residents spread over the library
+    residentSlots = firstResidentSlots; // residents enrolled first, their hot set is searched by AutoIdentify
+    benchScan(cycles);
+    residentSlots = spreadResidentSlots;
+  }
+  if (scenario == "enroll" || scenario == "all")
+    benchEnroll(cycles);
+  if (scenario == "link" || scenario == "all") {
+    // A/B comparison of the default link against the fastest one
+    SensorLinkSettings defaultLink;
+    SensorLinkSettings fastLink;
+    fastLink.baudRate = 115200;
+    benchScan(cycles, &defaultLink);
+    benchScan(cycles, &fastLink);
+  }
+  if (scenario == "engine" || scenario == "all") {
+    // time to match of both scan engines for both library layouts, and a sensor without AutoIdentify that has to fall back
+    for (const int *layout : { spreadResidentSlots, firstResidentSlots }) {
+      residentSlots = layout;
+      printf("residents in slots %d, %d, %d, %d, %d:\n", layout[0], layout[1], layout[2], layout[3], layout[4]);
+      benchScan(cycles, nullptr, ScanEngine::threeStep);
+      benchScan(cycles, nullptr, ScanEngine::autoIdentify);
+    }
+    residentSlots = spreadResidentSlots;
+    benchScan(cycles, nullptr, ScanEngine::autoIdentify, false);
+  }
+  if (scenario == "transfer" || scenario == "all") {
+    // sensor replacement: single buffer (no overlap of network and UART) against the double buffered pipe
+    for (uint32_t baudRate : { 57600u, 115200u }) {
+      benchTransfer(1, baudRate);
+      benchTransfer(templatePipeMaxDepth, baudRate);
+    }
+    // fingers behind slot 1023 of a 3000 slot sensor, and one that only answers the index pages of 1024 slots
+    benchTransfer(templatePipeMaxDepth, 115200, 3000);
+    benchTransfer(templatePipeMaxDepth, 115200, 3000, 4);
+  }
+  if (scenario == "boot" || scenario == "all")
+    benchBoot();
+  if (scenario == "alloc" || scenario == "all")
+    benchAllocations(cycles);
+  if (scenario == "notify" || scenario == "all")
+    benchNotify(cycles * 100);
+  if (scenario == "mqtt" || scenario == "all")
+    benchMqtt(std::min(cycles, 1000));
+  if (scenario == "feedback" || scenario == "all")
+    benchFeedback(std::min(cycles, 1000));
+  if (scenario == "doorbell" || scenario == "all") {
+    // polled button (loop() reads the pin every 20 ms) against the interrupt driven one, with contact bounce and taps
+    printf("doorbell: %d bouncy presses\n", std::min(cycles, 1000));
+    buzzer.begin(playBuzzerStep);
+    benchDoorbell("press to publish (poll)", doorbellLoopSequencer, std::min(cycles, 1000), true);
+    benchDoorbell("press to publish (irq)", doorbellLoopInterrupt, std::min(cycles, 1000), true);
+  }
+  if (scenario == "registry" || scenario == "all") {
+    for (uint16_t capacity : { 200, 1000, 3000 })
+      benchRegistry(cycles * 10, capacity);
+  }
+  if (scenario == "soak" || scenario == "all")
+    benchSoak(scenario == "soak" ? cycles : std::min(cycles, 2000)); // e.g. "soak 1000000" for a long run
+  if (scenario == "readers" || scenario == "all")
+    benchMultiReader(std::min(cycles, 50));
+  if (scenario == "trace" || scenario == "all")
+    benchTrace(std::min(cycles, 100));
+  if (scenario == "rain" || scenario == "all")
+    benchRain(std::min(cycles, 200));
+  if (scenario == "policy" || scenario == "all")
+    benchPolicy(std::min(std::max(cycles, 1000), 5000)); // the search limit needs a few hundred unknown fingers
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,20 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <Arduino.h>
+
+/*
+  Host stand-in for the Arduino Client interface (WiFiClient on the device). Only connecting by hostname is provided,
+  there is no IPAddress on the host.
+*/
+class Client : public Stream {
+  public:
+    virtual int connect(const char *host, uint16_t port) = 0;
+    virtual size_t write(uint8_t c) override = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size) override = 0;
+    virtual uint8_t connected() = 0;
+    virtual void stop() = 0;
+    operator bool() { return connected(); }
+};
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef CRYPTO_H
+#define CRYPTO_H
+
+/*
+  Host stand-in for the SHA256 class of the Crypto library. It only needs to turn the inputs of
+  SettingsManager::generateNewPairingCode() into 32 well-mixed bytes, it is NOT a cryptographic hash.
+*/
+
+#include <Arduino.h>
+
+#define SHA256_SIZE 32
+
+class SHA256 {
+  public:
+    void doUpdate(const char *msg) { doUpdate((const byte *)msg, strlen(msg)); }
+    void doUpdate(const byte *msg, size_t len) {
+      for (size_t i = 0; i < len; i++) {
+        state ^= msg[i];
+        state *= 1099511628211ull;
+      }
+    }
+    void doFinal(byte *digest) {
+      for (int i = 0; i < SHA256_SIZE; i++) {
+        state ^= state >> 29;
+        state *= 1099511628211ull;
+        digest[i] = (byte)(state >> 32);
+      }
+    }
+
+  private:
+    uint64_t state = 14695981039346656037ull;
+};
+
+#endif
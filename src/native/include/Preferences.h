@@ -0,0 +1,63 @@
+#ifndef PREFERENCES_H
+#define PREFERENCES_H
+
+/*
+  Host stand-in for the ESP32 Preferences library. All namespaces live in one process-wide in-memory store that
+  survives Preferences instances (like NVS survives reboots), so a benchmark can "reboot" by constructing a fresh
+  FingerprintManager.
+*/
+
+#include <Arduino.h>
+
+typedef enum {
+    PT_I8, PT_U8, PT_I16, PT_U16, PT_I32, PT_U32, PT_I64, PT_U64, PT_STR, PT_BLOB, PT_INVALID
+} PreferenceType;
+
+class Preferences {
+  public:
+    ~Preferences() { end(); }
+
+    bool begin(const char *name, bool readOnly = false, const char *partition_label = NULL);
+    void end();
+
+    bool clear();
+    bool remove(const char *key);
+    bool isKey(const char *key);
+    PreferenceType getType(const char *key);
+    size_t freeEntries();
+
+    size_t putBool(const char *key, bool value);
+    size_t putUChar(const char *key, uint8_t value);
+    size_t putUShort(const char *key, uint16_t value);
+    size_t putInt(const char *key, int32_t value);
+    size_t putUInt(const char *key, uint32_t value);
+    size_t putString(const char *key, const char *value);
+    size_t putString(const char *key, String value);
+    size_t putBytes(const char *key, const void *value, size_t len);
+
+    bool getBool(const char *key, bool defaultValue = false);
+    uint8_t getUChar(const char *key, uint8_t defaultValue = 0);
+    uint16_t getUShort(const char *key, uint16_t defaultValue = 0);
+    int32_t getInt(const char *key, int32_t defaultValue = 0);
+    uint32_t getUInt(const char *key, uint32_t defaultValue = 0);
+    size_t getString(const char *key, char *value, size_t maxLen);
+    String getString(const char *key, String defaultValue = String());
+    size_t getBytesLength(const char *key);
+    size_t getBytes(const char *key, void *buf, size_t maxLen);
+
+    // host-only: operation counters of the whole store (entriesWritten = 32 byte NVS entries, i.e. flash wear), used by the benchmarks
+    struct Stats { unsigned long reads = 0; unsigned long writes = 0; unsigned long opens = 0; unsigned long entriesWritten = 0; uint64_t micros = 0; };
+    static Stats stats;
+    static void resetStore();
+    static bool failWrites; // host-only: every put fails (flash full), erasing still works
+
+  private:
+    bool started = false;
+    bool readOnly = false;
+    String name;
+
+    size_t putRaw(const char *key, PreferenceType type, const void *value, size_t len);
+    bool getRaw(const char *key, PreferenceType type, void *value, size_t len);
+};
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef WSTRING_H
+#define WSTRING_H
+
+/*
+  Host stand-in for the Arduino String class, backed by std::string. Only the subset used by FingerprintDoorbell
+  is provided; semantics follow the ESP32 Arduino core (e.g. numeric constructors, toInt() returning 0 on garbage).
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+#include <type_traits>
+
+class String {
+  public:
+    String() {}
+    String(const char *cstr) : s(cstr ? cstr : "") {}
+    String(const char *cstr, size_t length) : s(cstr, length) {}
+    String(const std::string &str) : s(str) {}
+    explicit String(char c) : s(1, c) {}
+    explicit String(unsigned char value, unsigned char base = 10) : s(toBase((unsigned long long)value, base)) {}
+    explicit String(int value, unsigned char base = 10) : s(base == 10 ? std::to_string(value) : toBase((unsigned int)value, base)) {}
+    explicit String(unsigned int value, unsigned char base = 10) : s(toBase(value, base)) {}
+    explicit String(long value, unsigned char base = 10) : s(base == 10 ? std::to_string(value) : toBase((unsigned long)value, base)) {}
+    explicit String(unsigned long value, unsigned char base = 10) : s(toBase(value, base)) {}
+    explicit String(long long value, unsigned char base = 10) : s(base == 10 ? std::to_string(value) : toBase((unsigned long long)value, base)) {}
+    explicit String(unsigned long long value, unsigned char base = 10) : s(toBase(value, base)) {}
+    explicit String(double value, unsigned int decimalPlaces = 2) { char buf[32]; snprintf(buf, sizeof(buf), "%.*f", decimalPlaces, value); s = buf; }
+
+    const char *c_str() const { return s.c_str(); }
+    unsigned int length() const { return (unsigned int)s.length(); }
+    bool isEmpty() const { return s.empty(); }
+    bool reserve(unsigned int size) { s.reserve(size); return true; }
+
+    char charAt(unsigned int index) const { return index < s.length() ? s[index] : 0; }
+    char operator[](unsigned int index) const { return charAt(index); }
+    char &operator[](unsigned int index) { return s[index]; }
+
+    bool equals(const String &other) const { return s == other.s; }
+    int compareTo(const String &other) const { return s.compare(other.s); }
+    bool startsWith(const String &prefix) const { return s.compare(0, prefix.s.length(), prefix.s) == 0; }
+    bool endsWith(const String &suffix) const { return s.length() >= suffix.s.length() && s.compare(s.length() - suffix.s.length(), suffix.s.length(), suffix.s) == 0; }
+    int indexOf(char c, unsigned int from = 0) const { size_t pos = s.find(c, from); return pos == std::string::npos ? -1 : (int)pos; }
+    int indexOf(const String &str, unsigned int from = 0) const { size_t pos = s.find(str.s, from); return pos == std::string::npos ? -1 : (int)pos; }
+    String substring(unsigned int from) const { return from < s.length() ? String(s.substr(from)) : String(); }
+    String substring(unsigned int from, unsigned int to) const { return from < to && from < s.length() ? String(s.substr(from, to - from)) : String(); }
+    void toCharArray(char *buf, unsigned int bufsize) const { if (!bufsize) return; size_t n = s.copy(buf, bufsize - 1); buf[n] = 0; }
+    void getBytes(unsigned char *buf, unsigned int bufsize) const { toCharArray((char *)buf, bufsize); }
+    void remove(unsigned int index) { if (index < s.length()) s.erase(index); }
+    void remove(unsigned int index, unsigned int count) { if (index < s.length()) s.erase(index, count); }
+    void trim() { size_t b = s.find_first_not_of(" \t\r\n"); size_t e = s.find_last_not_of(" \t\r\n"); s = (b == std::string::npos) ? std::string() : s.substr(b, e - b + 1); }
+    long toInt() const { return atol(s.c_str()); }
+
+    bool concat(const String &str) { s += str.s; return true; }
+    bool concat(const char *cstr) { if (cstr) s += cstr; return true; }
+    bool concat(const char *cstr, unsigned int length) { if (cstr) s.append(cstr, length); return true; }
+    bool concat(char c) { s += c; return true; }
+    template<typename T, typename std::enable_if<std::is_arithmetic<T>::value && !std::is_same<T, char>::value && !std::is_same<T, bool>::value, int>::type = 0>
+    bool concat(T value) { s += String(value).s; return true; }
+
+    template<typename T> String &operator+=(const T &rhs) { concat(rhs); return *this; }
+
+    bool operator==(const String &rhs) const { return s == rhs.s; }
+    bool operator==(const char *rhs) const { return s == (rhs ? rhs : ""); }
+    bool operator!=(const String &rhs) const { return !(*this == rhs); }
+    bool operator!=(const char *rhs) const { return !(*this == rhs); }
+    bool operator<(const String &rhs) const { return s < rhs.s; }
+
+    const std::string &str() const { return s; }
+
+  private:
+    std::string s;
+
+    static std::string toBase(unsigned long long value, unsigned char base) {
+      if (base < 2 || base > 36) base = 10;
+      char buf[65];
+      int pos = 64;
+      buf[pos] = 0;
+      do {
+        int digit = value % base;
+        buf[--pos] = (char)(digit < 10 ? '0' + digit : 'A' + digit - 10);
+        value /= base;
+      } while (value);
+      return std::string(&buf[pos]);
+    }
+};
+
+inline String operator+(const String &lhs, const String &rhs) { String r(lhs); r.concat(rhs); return r; }
+inline String operator+(const String &lhs, const char *rhs) { String r(lhs); r.concat(rhs); return r; }
+inline String operator+(const char *lhs, const String &rhs) { String r(lhs); r.concat(rhs); return r; }
+inline String operator+(const String &lhs, char rhs) { String r(lhs); r.concat(rhs); return r; }
+template<typename T, typename std::enable_if<std::is_arithmetic<T>::value && !std::is_same<T, char>::value && !std::is_same<T, bool>::value, int>::type = 0>
+inline String operator+(const String &lhs, T rhs) { String r(lhs); r.concat(rhs); return r; }
+
+#endif
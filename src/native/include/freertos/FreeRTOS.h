@@ -0,0 +1,35 @@
+#ifndef FREERTOS_H
+#define FREERTOS_H
+
+/*
+  Host stand-in for the FreeRTOS subset used by FingerprintDoorbell. The host build is single threaded: blocking calls
+  advance the virtual clock (see HostRuntime.h) until they are satisfied or time out, and interrupts run inside these
+  waits just like on the device.
+*/
+
+#include <stdint.h>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+
+#define portYIELD_FROM_ISR(...)
+
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL(mux) ((void)(mux))
+#define portEXIT_CRITICAL(mux) ((void)(mux))
+#define portENTER_CRITICAL_ISR(mux) ((void)(mux))
+#define portEXIT_CRITICAL_ISR(mux) ((void)(mux))
+
+TickType_t xTaskGetTickCount();
+
+#endif